@@ -0,0 +1,377 @@
+/**
+ * Benchmarks many emulator instances running at once, each with its own
+ * minigb_apu context generating audio. The instances are shared between a
+ * number of threads.
+ *
+ * Each instance runs the same ROM from the same starting state, so each must
+ * produce the same audio. This is checked to show that the instances do not
+ * share any APU state.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#define ENABLE_SOUND 1
+#define ENABLE_LCD 0
+
+#include "../sdl2/minigb_apu/minigb_apu.h"
+
+/* Import emulator library. */
+#include "../../peanut_gb.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+enum audio_mode
+{
+	/* Writes are applied immediately, and audio is never rendered. */
+	AUDIO_NONE,
+	/* Audio is rendered with synthesis disabled. */
+	AUDIO_MUTED,
+	/* Audio is synthesised. */
+	AUDIO_ON,
+	AUDIO_MODE_COUNT
+};
+
+struct priv_t
+{
+	/* Pointer to memory holding GB file. Shared by all instances. */
+	const uint8_t *rom;
+	/* Pointer to allocated memory holding save file. */
+	uint8_t *cart_ram;
+
+	struct minigb_apu_ctx apu;
+	/* How audio is handled. */
+	enum audio_mode mode;
+	/* Stereo samples of one frame. */
+	float samples[MINIGB_APU_MAX_FRAME_SAMPLES * 2];
+	/* Hash of all samples generated. */
+	uint64_t audio_hash;
+	/* Hash of NR52 after each frame, which must not depend on whether
+	 * audio is muted. */
+	uint64_t status_hash;
+};
+
+struct instance
+{
+	struct gb_s gb;
+	struct priv_t priv;
+};
+
+struct worker
+{
+	pthread_t thread;
+	struct instance *instances;
+	unsigned count;
+	unsigned long frames;
+	enum audio_mode mode;
+};
+
+/**
+ * Returns a byte from the ROM file at the given address.
+ */
+uint8_t gb_rom_read(struct gb_s *gb, const uint_fast32_t addr)
+{
+	const struct priv_t * const p = gb->direct.priv;
+	return p->rom[addr];
+}
+
+/**
+ * Returns a byte from the cartridge RAM at the given address.
+ */
+uint8_t gb_cart_ram_read(struct gb_s *gb, const uint_fast32_t addr)
+{
+	const struct priv_t * const p = gb->direct.priv;
+	return p->cart_ram[addr];
+}
+
+/**
+ * Writes a given byte to the cartridge RAM at the given address.
+ */
+void gb_cart_ram_write(struct gb_s *gb, const uint_fast32_t addr,
+		const uint8_t val)
+{
+	const struct priv_t * const p = gb->direct.priv;
+	p->cart_ram[addr] = val;
+}
+
+uint8_t audio_read(struct gb_s *gb, const uint16_t addr)
+{
+	struct priv_t * const p = gb->direct.priv;
+	return minigb_apu_audio_read(&p->apu, addr);
+}
+
+void audio_write(struct gb_s *gb, const uint16_t addr, const uint8_t val)
+{
+	struct priv_t * const p = gb->direct.priv;
+	if(p->mode != AUDIO_NONE)
+		minigb_apu_audio_write_at(&p->apu, gb_get_frame_cycles(gb),
+					  addr, val);
+	else
+		minigb_apu_audio_write(&p->apu, addr, val);
+}
+
+/**
+ * Returns a pointer to the allocated space containing the ROM. Must be freed.
+ */
+uint8_t *read_rom_to_ram(const char *file_name)
+{
+	FILE *rom_file = fopen(file_name, "rb");
+	size_t rom_size;
+	uint8_t *rom = NULL;
+
+	if(rom_file == NULL)
+		return NULL;
+
+	fseek(rom_file, 0, SEEK_END);
+	rom_size = ftell(rom_file);
+	rewind(rom_file);
+	rom = malloc(rom_size);
+
+	if(fread(rom, sizeof(uint8_t), rom_size, rom_file) != rom_size)
+	{
+		free(rom);
+		fclose(rom_file);
+		return NULL;
+	}
+
+	fclose(rom_file);
+	return rom;
+}
+
+/**
+ * Ignore all errors.
+ */
+void gb_error(struct gb_s *gb, const enum gb_error_e gb_err, const uint16_t val)
+{
+	(void)gb;
+	(void)gb_err;
+	(void)val;
+}
+
+double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Run each instance of the worker in turn, one frame at a time.
+ */
+void *worker_run(void *arg)
+{
+	struct worker *w = arg;
+
+	for(unsigned i = 0; i < w->count; i++)
+	{
+		w->instances[i].priv.mode = w->mode;
+		minigb_apu_set_synthesis(&w->instances[i].priv.apu,
+					 w->mode == AUDIO_ON);
+	}
+
+	for(unsigned long f = 0; f < w->frames; f++)
+	{
+		for(unsigned i = 0; i < w->count; i++)
+		{
+			struct priv_t *p = &w->instances[i].priv;
+
+			gb_run_frame(&w->instances[i].gb);
+
+			if(w->mode == AUDIO_NONE)
+				continue;
+
+			const size_t len = minigb_apu_end_frame(&p->apu,
+					LCD_VERT_LINES * LCD_LINE_CYCLES,
+					p->samples) * 2 * sizeof(float);
+
+			p->status_hash ^= minigb_apu_audio_read(&p->apu, 0xFF26);
+			p->status_hash *= 0x100000001B3ULL;
+
+			if(w->mode == AUDIO_MUTED)
+				continue;
+
+			/* FNV-1a over the raw samples. */
+			for(size_t b = 0; b < len; b++)
+			{
+				p->audio_hash ^= ((uint8_t *)p->samples)[b];
+				p->audio_hash *= 0x100000001B3ULL;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+int init_instances(struct instance *instances, unsigned count,
+		   const uint8_t *rom)
+{
+	for(unsigned i = 0; i < count; i++)
+	{
+		struct instance *in = &instances[i];
+
+		/* Clear memory so that all instances start identically. */
+		memset(in, 0, sizeof(*in));
+		in->priv.rom = rom;
+		in->priv.audio_hash = 0xCBF29CE484222325ULL;
+		in->priv.status_hash = 0xCBF29CE484222325ULL;
+
+		if(gb_init(&in->gb, &gb_rom_read, &gb_cart_ram_read,
+				&gb_cart_ram_write, &gb_error, &in->priv) !=
+				GB_INIT_NO_ERROR)
+			return -1;
+
+		in->priv.cart_ram = malloc(gb_get_save_size(&in->gb) + 1);
+
+		if(in->priv.cart_ram == NULL)
+			return -1;
+
+		memset(in->priv.cart_ram, 0xFF, gb_get_save_size(&in->gb));
+		minigb_apu_audio_init(&in->priv.apu);
+	}
+
+	return 0;
+}
+
+/**
+ * Run all instances for the given number of frames, and return the time
+ * taken.
+ */
+double run(struct instance *instances, unsigned count, unsigned threads,
+	   unsigned long frames, enum audio_mode mode)
+{
+	struct worker *workers = calloc(threads, sizeof(*workers));
+	unsigned first = 0;
+	double start;
+
+	if(workers == NULL)
+		return -1.0;
+
+	start = now();
+
+	for(unsigned t = 0; t < threads; t++)
+	{
+		struct worker *w = &workers[t];
+
+		/* Spread the remainder over the first workers. */
+		w->count = count / threads + (t < count % threads);
+		w->instances = instances + first;
+		w->frames = frames;
+		w->mode = mode;
+		first += w->count;
+		pthread_create(&w->thread, NULL, worker_run, w);
+	}
+
+	for(unsigned t = 0; t < threads; t++)
+		pthread_join(workers[t].thread, NULL);
+
+	free(workers);
+	return now() - start;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned count = 64;
+	unsigned threads = (unsigned)sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned long frames = 600;
+	struct instance *instances;
+	uint64_t status_hash[AUDIO_MODE_COUNT];
+	uint8_t *rom;
+	int ret = EXIT_FAILURE;
+
+	switch(argc)
+	{
+	case 5:
+		frames = strtoul(argv[4], NULL, 0);
+		/* Fall-through */
+	case 4:
+		threads = strtoul(argv[3], NULL, 0);
+		/* Fall-through */
+	case 3:
+		count = strtoul(argv[2], NULL, 0);
+		/* Fall-through */
+	case 2:
+		break;
+
+	default:
+		fprintf(stderr, "%s ROM [INSTANCES] [THREADS] [FRAMES]\n",
+			argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	if(count == 0 || threads == 0)
+	{
+		fprintf(stderr, "At least one instance and thread required\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if(threads > count)
+		threads = count;
+
+	if((rom = read_rom_to_ram(argv[1])) == NULL)
+	{
+		printf("%d: %s\n", __LINE__, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	if((instances = malloc(count * sizeof(*instances))) == NULL)
+		goto out;
+
+	printf("%u instances on %u threads, %lu frames each\n", count,
+	       threads, frames);
+
+	for(int mode = AUDIO_NONE; mode < AUDIO_MODE_COUNT; mode++)
+	{
+		const char *const name[AUDIO_MODE_COUNT] = {
+			"Without audio:", "Muted audio:", "With audio:"
+		};
+		double duration;
+
+		if(init_instances(instances, count, rom) != 0)
+		{
+			fprintf(stderr, "Unable to initialise instances\n");
+			goto out;
+		}
+
+		duration = run(instances, count, threads, frames, mode);
+
+		printf("%-14s %8.3f s, %10.1f FPS total, %6.2fx real time "
+		       "per instance\n",
+		       name[mode],
+		       duration, count * frames / duration,
+		       frames / duration / VERTICAL_SYNC);
+
+		status_hash[mode] = instances[0].priv.status_hash;
+
+		for(unsigned i = 0; i < count; i++)
+			free(instances[i].priv.cart_ram);
+	}
+
+	if(status_hash[AUDIO_MUTED] != status_hash[AUDIO_ON])
+	{
+		printf("Channel status differs when audio is muted\n");
+		goto out;
+	}
+
+	for(unsigned i = 1; i < count; i++)
+	{
+		if(instances[i].priv.audio_hash != instances[0].priv.audio_hash)
+		{
+			printf("Audio of instance %u differs from instance 0\n",
+			       i);
+			goto out;
+		}
+	}
+
+	printf("Audio of all instances is identical\n");
+	ret = EXIT_SUCCESS;
+
+out:
+	free(instances);
+	free(rom);
+	return ret;
+}
@@ -0,0 +1,147 @@
+/**
+ * Benchmarks the band-limited synthesis used by the blargg APU: adding
+ * transitions to Blip_Buffers with Blip_Synth, and mixing the center, left
+ * and right buffers of a Stereo_Buffer into samples.
+ *
+ * peanut-benchmark-blip-scalar is built from the same source with
+ * BLIP_BUFFER_SIMD set to 0. Both must print the same output hash.
+ *
+ * The buffers are fed pseudo-random square waves, which are loud enough that
+ * the output is sometimes clamped, so no ROM is required.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "../sdl2/blargg_apu/Multi_Buffer.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* Clock cycles in a frame. */
+#define FRAME_CYCLES	70224
+
+/* Transitions added to each buffer in a frame. A square wave at 4 kHz makes
+ * about this many. */
+#define TRANSITIONS	128
+
+/* Same synthesisers as the square and other channels of Gb_Apu. */
+typedef Blip_Synth<blip_good_quality, 210> Square_Synth;
+typedef Blip_Synth<blip_med_quality, 210> Other_Synth;
+
+static uint32_t seed = 1;
+
+static uint32_t rnd(void)
+{
+	seed = seed * 1103515245 + 12345;
+	return seed >> 8;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+	static blip_sample_t samples[4096];
+	static Square_Synth square[3];
+	static Other_Synth other[3];
+	Stereo_Buffer buf;
+	Blip_Buffer *out[3] = { buf.center(), buf.left(), buf.right() };
+	int amp[3] = { 0, 0, 0 };
+	unsigned long frames = 36000;
+	unsigned long transitions = 0, made = 0;
+	double synth_time = 0, mix_time = 0;
+	uint64_t hash = 0xCBF29CE484222325;
+
+	switch(argc)
+	{
+	case 2:
+		frames = strtoul(argv[1], NULL, 0);
+		/* Fall-through */
+	case 1:
+		break;
+
+	default:
+		fprintf(stderr, "%s [FRAMES]\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	if(frames == 0)
+	{
+		fprintf(stderr, "At least one frame required\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Configured as by Basic_Gb_Apu and Gb_Apu. */
+	buf.clock_rate(4194304);
+	buf.bass_freq(461);
+
+	if(buf.set_sample_rate(48000) != NULL)
+	{
+		fprintf(stderr, "Unable to allocate buffers\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for(int i = 0; i < 3; i++)
+	{
+		square[i].volume(0.5);
+		square[i].treble_eq(-20.0);
+		square[i].output(out[i]);
+		other[i].volume(0.5);
+		other[i].treble_eq(-20.0);
+		other[i].output(out[i]);
+	}
+
+	for(unsigned long frame = 0; frame < frames; frame++)
+	{
+		double start = now();
+		long len;
+
+		for(int i = 0; i < 3; i++)
+		{
+			blip_time_t time = rnd() % (FRAME_CYCLES / TRANSITIONS);
+
+			for(int t = 0; t < TRANSITIONS; t++)
+			{
+				const int new_amp = rnd() % 211;
+
+				if(t & 1)
+					other[i].offset(time, new_amp - amp[i]);
+				else
+					square[i].offset(time, new_amp - amp[i]);
+
+				amp[i] = new_amp;
+				time += FRAME_CYCLES / TRANSITIONS;
+			}
+		}
+
+		transitions += 3 * TRANSITIONS;
+		synth_time += now() - start;
+
+		start = now();
+		buf.end_frame(FRAME_CYCLES);
+		len = buf.read_samples(samples, sizeof(samples) /
+				       sizeof(*samples));
+		mix_time += now() - start;
+		made += len / 2;
+
+		for(long i = 0; i < len; i++)
+		{
+			hash ^= (uint16_t)samples[i];
+			hash *= 0x100000001B3;
+		}
+	}
+
+	printf("Transitions %8.3f s, %6.2f ns/transition\n", synth_time,
+	       synth_time * 1e9 / transitions);
+	printf("Mixing      %8.3f s, %6.2f ns/stereo sample\n", mix_time,
+	       mix_time * 1e9 / made);
+	printf("Output hash %016llx\n", (unsigned long long)hash);
+
+	return EXIT_SUCCESS;
+}
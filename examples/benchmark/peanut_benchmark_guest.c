@@ -0,0 +1,627 @@
+/**
+ * Profiles the code of a game, rather than the emulator, to find which of its
+ * routines take the most emulated time.
+ *
+ * A shadow call stack is kept from the call hooks of peanut_gb.h, and is
+ * sampled every given number of emulated clock cycles, so the results of a
+ * ROM are the same on every run and every host. Samples are written as
+ * collapsed stacks, one line per distinct stack followed by its cycles, which
+ * is the input of flamegraph.pl and similar tools. Routines are named by
+ * their bank and address, or by a symbol file written by RGBDS with -n.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#define ENABLE_SOUND 0
+#define ENABLE_LCD 0
+#define ENABLE_STATS 1
+#define ENABLE_OPCODE_HOOKS 1
+#define ENABLE_CALL_HOOKS 1
+
+/* Import emulator library. */
+#include "../../peanut_gb.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Deepest shadow call stack kept. Deeper calls are not recorded. */
+#define MAX_DEPTH	256
+
+/* Marks the end of a stack that has no leaf symbol. */
+#define NO_LEAF		UINT32_MAX
+
+struct frame
+{
+	/* Bank and address of the routine. */
+	uint32_t id;
+	/* Stack pointer on entry, so that frames left by code that does not
+	 * return normally may be discarded. */
+	uint16_t sp;
+};
+
+struct symbol
+{
+	uint32_t id;
+	char *name;
+};
+
+struct stack
+{
+	uint64_t hash;
+	/* Routines from outermost to innermost, then the leaf symbol. */
+	uint32_t *ids;
+	unsigned len;
+	uint64_t cycles;
+};
+
+struct priv_t
+{
+	/* Pointer to allocated memory holding GB file. */
+	uint8_t *rom;
+	/* Pointer to allocated memory holding save file. */
+	uint8_t *cart_ram;
+
+	struct frame frames[MAX_DEPTH];
+	unsigned depth;
+	/* Bank and address of the instruction being executed. */
+	uint32_t pc;
+
+	/* Cycles of the frames run before the current one. */
+	uint64_t cycles_done;
+	uint64_t next_sample;
+	unsigned interval;
+	uint64_t samples;
+
+	/* Symbols sorted by bank and address. */
+	struct symbol *symbols;
+	size_t symbol_count;
+
+	/* Open addressed hash table of the distinct stacks sampled. */
+	struct stack *stacks;
+	size_t stack_cap;
+	size_t stack_count;
+	/* Set when an allocation failed. */
+	int oom;
+};
+
+/**
+ * Returns a byte from the ROM file at the given address.
+ */
+uint8_t gb_rom_read(struct gb_s *gb, const uint_fast32_t addr)
+{
+	const struct priv_t * const p = gb->direct.priv;
+	return p->rom[addr];
+}
+
+/**
+ * Returns a byte from the cartridge RAM at the given address.
+ */
+uint8_t gb_cart_ram_read(struct gb_s *gb, const uint_fast32_t addr)
+{
+	const struct priv_t * const p = gb->direct.priv;
+	return p->cart_ram[addr];
+}
+
+/**
+ * Writes a given byte to the cartridge RAM at the given address.
+ */
+void gb_cart_ram_write(struct gb_s *gb, const uint_fast32_t addr,
+		const uint8_t val)
+{
+	const struct priv_t * const p = gb->direct.priv;
+	p->cart_ram[addr] = val;
+}
+
+/**
+ * Ignore all errors.
+ */
+void gb_error(struct gb_s *gb, const enum gb_error_e gb_err, const uint16_t val)
+{
+	(void)gb;
+	(void)gb_err;
+	(void)val;
+}
+
+/**
+ * Returns the bank and address of code at addr. Code in RAM is given bank 0.
+ * The bank is masked in MBC1 mode 1 as __gb_read() does.
+ */
+static uint32_t code_id(const struct gb_s *gb, const uint16_t addr)
+{
+	if(addr >= ROM_N_ADDR && addr < VRAM_ADDR)
+	{
+		uint32_t bank = gb->selected_rom_bank;
+
+		if(gb->mbc == 1 && gb->cart_mode_select)
+			bank &= 0x1F;
+
+		return bank << 16 | addr;
+	}
+
+	return addr;
+}
+
+/**
+ * Returns the index of the symbol at or before id in the same bank and memory
+ * region, or NO_LEAF if there is none.
+ */
+static uint32_t find_symbol(const struct priv_t *p, const uint32_t id)
+{
+	size_t lo = 0, hi = p->symbol_count;
+	const struct symbol *s;
+
+	/* Find the first symbol after id. */
+	while(lo < hi)
+	{
+		const size_t mid = lo + (hi - lo) / 2;
+
+		if(p->symbols[mid].id <= id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if(lo == 0)
+		return NO_LEAF;
+
+	s = &p->symbols[lo - 1];
+
+	if(s->id >> 16 != id >> 16 ||
+			((s->id & 0xFFFF) >= VRAM_ADDR) != ((id & 0xFFFF) >= VRAM_ADDR))
+		return NO_LEAF;
+
+	return lo - 1;
+}
+
+static uint64_t hash_ids(const uint32_t *ids, const unsigned len)
+{
+	uint64_t h = 0xCBF29CE484222325;
+
+	for(unsigned i = 0; i < len; i++)
+	{
+		h ^= ids[i];
+		h *= 0x100000001B3;
+	}
+
+	return h;
+}
+
+static int grow_stacks(struct priv_t *p)
+{
+	const size_t cap = p->stack_cap ? p->stack_cap * 2 : 1024;
+	struct stack *stacks = calloc(cap, sizeof(*stacks));
+
+	if(stacks == NULL)
+		return -1;
+
+	for(size_t i = 0; i < p->stack_cap; i++)
+	{
+		size_t slot;
+
+		if(p->stacks[i].ids == NULL)
+			continue;
+
+		slot = p->stacks[i].hash & (cap - 1);
+
+		while(stacks[slot].ids != NULL)
+			slot = (slot + 1) & (cap - 1);
+
+		stacks[slot] = p->stacks[i];
+	}
+
+	free(p->stacks);
+	p->stacks = stacks;
+	p->stack_cap = cap;
+	return 0;
+}
+
+/**
+ * Adds cycles to the current stack.
+ */
+static void record(struct priv_t *p, const uint64_t cycles)
+{
+	uint32_t ids[MAX_DEPTH + 1];
+	unsigned len = 0;
+	uint64_t hash;
+	size_t slot;
+
+	for(unsigned i = 0; i < p->depth; i++)
+		ids[len++] = p->frames[i].id;
+
+	/* With symbols, the routine the sample is in may differ from the last
+	 * one called, such as after a jump to another routine. */
+	ids[len++] = p->symbol_count ? find_symbol(p, p->pc) : NO_LEAF;
+	hash = hash_ids(ids, len);
+
+	if(p->stack_count * 2 >= p->stack_cap && grow_stacks(p) != 0)
+	{
+		p->oom = 1;
+		return;
+	}
+
+	slot = hash & (p->stack_cap - 1);
+
+	while(p->stacks[slot].ids != NULL)
+	{
+		struct stack *s = &p->stacks[slot];
+
+		if(s->hash == hash && s->len == len &&
+				memcmp(s->ids, ids, len * sizeof(*ids)) == 0)
+		{
+			s->cycles += cycles;
+			return;
+		}
+
+		slot = (slot + 1) & (p->stack_cap - 1);
+	}
+
+	if((p->stacks[slot].ids = malloc(len * sizeof(*ids))) == NULL)
+	{
+		p->oom = 1;
+		return;
+	}
+
+	memcpy(p->stacks[slot].ids, ids, len * sizeof(*ids));
+	p->stacks[slot].hash = hash;
+	p->stacks[slot].len = len;
+	p->stacks[slot].cycles = cycles;
+	p->stack_count++;
+}
+
+/**
+ * Takes the samples due since the last call, with the stack as it was before
+ * the current instruction.
+ */
+static void advance(struct gb_s *gb)
+{
+	struct priv_t * const p = gb->direct.priv;
+	const uint64_t now = p->cycles_done + gb->stats.cycles;
+	uint64_t n;
+
+	if(now < p->next_sample)
+		return;
+
+	n = (now - p->next_sample) / p->interval + 1;
+	record(p, n * p->interval);
+	p->samples += n;
+	p->next_sample += n * p->interval;
+}
+
+void gb_opcode_hook(struct gb_s *gb, const uint16_t pc, const uint8_t opcode)
+{
+	struct priv_t * const p = gb->direct.priv;
+
+	(void)opcode;
+	advance(gb);
+	p->pc = code_id(gb, pc);
+}
+
+void gb_cb_opcode_hook(struct gb_s *gb, const uint8_t cbop)
+{
+	(void)gb;
+	(void)cbop;
+}
+
+void gb_call_hook(struct gb_s *gb)
+{
+	struct priv_t * const p = gb->direct.priv;
+	const uint16_t sp = gb->cpu_reg.sp;
+
+	advance(gb);
+
+	/* Discard frames that are no longer on the stack. */
+	while(p->depth > 0 && p->frames[p->depth - 1].sp <= sp)
+		p->depth--;
+
+	if(p->depth == MAX_DEPTH)
+		return;
+
+	p->frames[p->depth].id = code_id(gb, gb->cpu_reg.pc);
+	p->frames[p->depth].sp = sp;
+	p->depth++;
+}
+
+void gb_ret_hook(struct gb_s *gb)
+{
+	struct priv_t * const p = gb->direct.priv;
+	const uint16_t sp = gb->cpu_reg.sp;
+
+	advance(gb);
+
+	while(p->depth > 0 && p->frames[p->depth - 1].sp < sp)
+		p->depth--;
+}
+
+static int symbol_cmp(const void *a, const void *b)
+{
+	const struct symbol *sa = a, *sb = b;
+	return (sa->id > sb->id) - (sa->id < sb->id);
+}
+
+/**
+ * Loads a symbol file written by RGBDS, with lines of the form
+ * "BB:AAAA Name". Local labels are skipped, so that samples in them are given
+ * to the routine they are in.
+ */
+static int load_symbols(struct priv_t *p, const char *path)
+{
+	FILE *f = fopen(path, "r");
+	char line[512];
+	size_t cap = 0;
+
+	if(f == NULL)
+		return -1;
+
+	while(fgets(line, sizeof(line), f) != NULL)
+	{
+		unsigned bank, addr;
+		char name[256];
+		struct symbol *s;
+
+		if(line[0] == ';' ||
+				sscanf(line, "%x:%x %255s", &bank, &addr, name) != 3)
+			continue;
+
+		if(strchr(name, '.') != NULL || addr > 0xFFFF)
+			continue;
+
+		if(p->symbol_count == cap)
+		{
+			cap = cap ? cap * 2 : 256;
+			s = realloc(p->symbols, cap * sizeof(*s));
+
+			if(s == NULL)
+			{
+				fclose(f);
+				return -1;
+			}
+
+			p->symbols = s;
+		}
+
+		/* Code in RAM is sampled as bank 0. */
+		if(addr < ROM_N_ADDR || addr >= VRAM_ADDR)
+			bank = 0;
+
+		s = &p->symbols[p->symbol_count];
+
+		if((s->name = malloc(strlen(name) + 1)) == NULL)
+		{
+			fclose(f);
+			return -1;
+		}
+
+		strcpy(s->name, name);
+		s->id = (uint32_t)(bank & 0xFFFF) << 16 | addr;
+		p->symbol_count++;
+	}
+
+	fclose(f);
+	qsort(p->symbols, p->symbol_count, sizeof(*p->symbols), symbol_cmp);
+	return 0;
+}
+
+static void print_name(FILE *f, const struct priv_t *p, const uint32_t id)
+{
+	const uint32_t sym = p->symbol_count ? find_symbol(p, id) : NO_LEAF;
+
+	if(sym != NO_LEAF)
+		fputs(p->symbols[sym].name, f);
+	else
+		fprintf(f, "%02X:%04X", (unsigned)(id >> 16),
+			(unsigned)(id & 0xFFFF));
+}
+
+/**
+ * Writes each stack as a line of names separated by semicolons, followed by
+ * its cycles.
+ */
+static int write_stacks(FILE *f, const struct priv_t *p)
+{
+	for(size_t i = 0; i < p->stack_cap; i++)
+	{
+		const struct stack *s = &p->stacks[i];
+		const char *last = NULL;
+		uint32_t leaf;
+
+		if(s->ids == NULL)
+			continue;
+
+		leaf = s->ids[s->len - 1];
+
+		if(s->len == 1)
+			fputs("[root]", f);
+
+		for(unsigned d = 0; d + 1 < s->len; d++)
+		{
+			const uint32_t sym = p->symbol_count ?
+				find_symbol(p, s->ids[d]) : NO_LEAF;
+
+			if(d > 0)
+				fputc(';', f);
+
+			print_name(f, p, s->ids[d]);
+			last = sym != NO_LEAF ? p->symbols[sym].name : NULL;
+		}
+
+		/* Add the leaf if it is not the routine last called. */
+		if(leaf != NO_LEAF && (last == NULL ||
+				strcmp(last, p->symbols[leaf].name) != 0))
+		{
+			fputc(';', f);
+			fputs(p->symbols[leaf].name, f);
+		}
+
+		fprintf(f, " %llu\n", (unsigned long long)s->cycles);
+	}
+
+	return ferror(f) ? -1 : 0;
+}
+
+/**
+ * Returns a pointer to the allocated space containing the ROM. Must be freed.
+ */
+uint8_t *read_rom_to_ram(const char *file_name)
+{
+	FILE *rom_file = fopen(file_name, "rb");
+	size_t rom_size;
+	uint8_t *rom = NULL;
+
+	if(rom_file == NULL)
+		return NULL;
+
+	fseek(rom_file, 0, SEEK_END);
+	rom_size = ftell(rom_file);
+	rewind(rom_file);
+	rom = malloc(rom_size);
+
+	if(fread(rom, sizeof(uint8_t), rom_size, rom_file) != rom_size)
+	{
+		free(rom);
+		fclose(rom_file);
+		return NULL;
+	}
+
+	fclose(rom_file);
+	return rom;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [-f FRAMES] [-i CYCLES] [-s SYMFILE] [-o FILE] ROM\n"
+		"  -f FRAMES	Number of frames to run. Default 7200.\n"
+		"  -i CYCLES	Emulated clock cycles between samples.\n"
+		"		Default 256.\n"
+		"  -s SYMFILE	Name routines using an RGBDS symbol file.\n"
+		"  -o FILE	Write collapsed stacks to FILE instead of\n"
+		"		standard output.\n",
+		name);
+}
+
+int main(int argc, char **argv)
+{
+	static struct gb_s gb;
+	static struct priv_t priv;
+	const char *sym_path = NULL;
+	const char *out_path = NULL;
+	unsigned long frames = 7200;
+	enum gb_init_error_e gb_ret;
+	int ret = EXIT_FAILURE;
+	FILE *out = stdout;
+	int o;
+
+	priv.interval = 256;
+
+	while((o = getopt(argc, argv, "f:i:s:o:")) != -1)
+	{
+		switch(o)
+		{
+		case 'f':
+			frames = strtoul(optarg, NULL, 0);
+			break;
+
+		case 'i':
+			priv.interval = strtoul(optarg, NULL, 0);
+			break;
+
+		case 's':
+			sym_path = optarg;
+			break;
+
+		case 'o':
+			out_path = optarg;
+			break;
+
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if(optind != argc - 1 || priv.interval == 0)
+	{
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if((priv.rom = read_rom_to_ram(argv[optind])) == NULL)
+	{
+		fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno));
+		goto out;
+	}
+
+	if(sym_path != NULL && load_symbols(&priv, sym_path) != 0)
+	{
+		fprintf(stderr, "%s: %s\n", sym_path, strerror(errno));
+		goto out;
+	}
+
+	/* Memory is not initialised by gb_init(), but the context is static,
+	 * so runs of the same ROM are repeatable. */
+	gb_ret = gb_init(&gb, &gb_rom_read, &gb_cart_ram_read,
+			 &gb_cart_ram_write, &gb_error, &priv);
+
+	if(gb_ret != GB_INIT_NO_ERROR)
+	{
+		fprintf(stderr, "Error: %d\n", gb_ret);
+		goto out;
+	}
+
+	if((priv.cart_ram = malloc(gb_get_save_size(&gb) + 1)) == NULL)
+		goto out;
+
+	memset(priv.cart_ram, 0xFF, gb_get_save_size(&gb));
+	priv.pc = code_id(&gb, gb.cpu_reg.pc);
+	priv.next_sample = priv.interval;
+
+	for(unsigned long i = 0; i < frames && !priv.oom; i++)
+	{
+		gb_run_frame(&gb);
+		priv.cycles_done += gb.stats.cycles;
+	}
+
+	if(priv.oom)
+	{
+		fprintf(stderr, "Unable to allocate memory\n");
+		goto out;
+	}
+
+	if(out_path != NULL && (out = fopen(out_path, "w")) == NULL)
+	{
+		fprintf(stderr, "%s: %s\n", out_path, strerror(errno));
+		goto out;
+	}
+
+	if(write_stacks(out, &priv) != 0)
+	{
+		fprintf(stderr, "Unable to write stacks\n");
+		goto out;
+	}
+
+	fprintf(stderr, "%lu frames, %llu cycles, %llu samples, "
+		"%zu distinct stacks\n", frames,
+		(unsigned long long)priv.cycles_done,
+		(unsigned long long)priv.samples, priv.stack_count);
+	ret = EXIT_SUCCESS;
+
+out:
+	if(out != stdout && out != NULL && fclose(out) != 0)
+		ret = EXIT_FAILURE;
+
+	for(size_t i = 0; i < priv.stack_cap; i++)
+		free(priv.stacks[i].ids);
+
+	for(size_t i = 0; i < priv.symbol_count; i++)
+		free(priv.symbols[i].name);
+
+	free(priv.stacks);
+	free(priv.symbols);
+	free(priv.cart_ram);
+	free(priv.rom);
+	return ret;
+}
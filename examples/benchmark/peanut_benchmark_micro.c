@@ -0,0 +1,649 @@
+/**
+ * Microbenchmarks of parts of the emulator, each reported in nanoseconds per
+ * operation, so that a change in frame rate may be attributed to one of
+ * them:
+ *  - __gb_read() and __gb_write() in each region of the memory map.
+ *  - __gb_step_cpu() running loops of synthetic instruction mixes.
+ *  - __gb_execute_cb() for each group of CB prefixed instructions.
+ *  - __gb_draw_line() drawing fixed scenes of background, window and
+ *    sprites.
+ *  - minigb_apu_audio_callback() with each channel playing on its own.
+ *
+ * The ROM is made in memory, so no ROM file is required. Each benchmark is
+ * run five times, and the fastest is reported.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#define ENABLE_SOUND 1
+#define ENABLE_LCD 1
+
+#include "../sdl2/minigb_apu/minigb_apu.h"
+
+/* Import emulator library. */
+#include "../../peanut_gb.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Times each benchmark is run. The fastest is reported. */
+#define REPEATS		5
+
+/* Size of the ROM made for the benchmarks. Four banks of MBC1. */
+#define ROM_SIZE	0x10000
+
+/* Start of the code of the instruction mixes. */
+#define MIX_ADDR	0x0200
+#define MIX_SPACING	0x0100
+/* Subroutine called by the branch mix. */
+#define SUB_ADDR	0x0190
+/* CB prefixed opcodes 0x00 to 0xFF in order. */
+#define CB_ADDR		0x3000
+
+/* Stereo samples made by each call of the audio callback. */
+#define APU_SAMPLES	1024
+
+struct priv_t
+{
+	uint8_t rom[ROM_SIZE];
+	uint8_t cart_ram[0x2000];
+	/* Receives audio register accesses made through the core. */
+	struct minigb_apu_ctx apu;
+	uint8_t fb[LCD_HEIGHT][LCD_WIDTH];
+};
+
+struct mix
+{
+	const char *name;
+	/* Instructions repeated to fill the loop. */
+	uint8_t body[16];
+	uint8_t len;
+	/* Number of instructions in body. */
+	uint8_t count;
+};
+
+struct region
+{
+	const char *name;
+	uint16_t base;
+	uint16_t len;
+};
+
+struct scene
+{
+	const char *name;
+	uint8_t lcdc;
+};
+
+struct apu_config
+{
+	const char *name;
+	/* Pairs of register and value written after the APU is powered on,
+	 * ending at register 0. Frequencies are written in full, as those
+	 * left at their initial values are high enough to dominate. */
+	uint16_t writes[20][2];
+};
+
+static struct gb_s gb;
+static struct priv_t priv;
+static unsigned long scale = 1;
+
+uint8_t gb_rom_read(struct gb_s *gb, const uint_fast32_t addr)
+{
+	const struct priv_t * const p = gb->direct.priv;
+	return p->rom[addr];
+}
+
+uint8_t gb_cart_ram_read(struct gb_s *gb, const uint_fast32_t addr)
+{
+	const struct priv_t * const p = gb->direct.priv;
+	return p->cart_ram[addr];
+}
+
+void gb_cart_ram_write(struct gb_s *gb, const uint_fast32_t addr,
+		       const uint8_t val)
+{
+	struct priv_t * const p = gb->direct.priv;
+	p->cart_ram[addr] = val;
+}
+
+uint8_t audio_read(struct gb_s *gb, const uint16_t addr)
+{
+	struct priv_t * const p = gb->direct.priv;
+	return minigb_apu_audio_read(&p->apu, addr);
+}
+
+void audio_write(struct gb_s *gb, const uint16_t addr, const uint8_t val)
+{
+	struct priv_t * const p = gb->direct.priv;
+	minigb_apu_audio_write(&p->apu, addr, val);
+}
+
+/**
+ * Ignore all errors.
+ */
+void gb_error(struct gb_s *gb, const enum gb_error_e gb_err, const uint16_t val)
+{
+	(void)gb;
+	(void)gb_err;
+	(void)val;
+}
+
+void lcd_draw_line(struct gb_s *gb, const uint8_t pixels[160],
+		   const uint_least8_t line)
+{
+	struct priv_t * const p = gb->direct.priv;
+	memcpy(p->fb[line], pixels, LCD_WIDTH);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void report(const char *group, const char *name, const double ns)
+{
+	printf("%-12s %-28s %9.2f ns/op\n", group, name, ns);
+}
+
+static uint32_t rnd(void)
+{
+	static uint32_t seed = 1;
+	seed = seed * 1103515245 + 12345;
+	return seed >> 8;
+}
+
+/**
+ * Make a ROM holding the instruction mixes and CB opcodes, with a valid
+ * header, and initialise the emulator with it.
+ */
+static void setup(const struct mix *mixes, const size_t mix_count)
+{
+	uint8_t *rom = priv.rom;
+	uint8_t x = 0;
+
+	memset(rom, 0x00, ROM_SIZE);
+
+	/* Entry point jumps to the first mix, but the benchmarks set the
+	 * program counter themselves. */
+	rom[0x100] = 0x00;
+	rom[0x101] = 0xC3;
+	rom[0x102] = MIX_ADDR & 0xFF;
+	rom[0x103] = MIX_ADDR >> 8;
+	rom[0x147] = 0x03;	/* MBC1 with RAM. */
+	rom[0x148] = 0x01;	/* 64 KiB */
+	rom[0x149] = 0x02;	/* 8 KiB */
+
+	for(unsigned i = 0x134; i <= 0x14C; i++)
+		x = x - rom[i] - 1;
+
+	rom[0x14D] = x;
+	rom[SUB_ADDR] = 0xC9;	/* RET */
+
+	for(size_t m = 0; m < mix_count; m++)
+	{
+		const uint16_t start = MIX_ADDR + m * MIX_SPACING;
+		uint16_t addr = start;
+
+		/* Repeat the body to fill most of the space, then jump back
+		 * to the start. */
+		while(addr + mixes[m].len + 3 <= start + MIX_SPACING)
+		{
+			memcpy(rom + addr, mixes[m].body, mixes[m].len);
+			addr += mixes[m].len;
+		}
+
+		rom[addr++] = 0xC3;	/* JP nn */
+		rom[addr++] = start & 0xFF;
+		rom[addr++] = start >> 8;
+	}
+
+	for(unsigned op = 0; op < 0x100; op++)
+		rom[CB_ADDR + op] = op;
+
+	/* Fill the other banks, so that reads of them are not all zero. */
+	for(unsigned i = 0x4000; i < ROM_SIZE; i++)
+		rom[i] = rnd();
+
+	memset(&gb, 0, sizeof(gb));
+
+	if(gb_init(&gb, &gb_rom_read, &gb_cart_ram_read, &gb_cart_ram_write,
+			&gb_error, &priv) != GB_INIT_NO_ERROR)
+	{
+		fprintf(stderr, "Unable to initialise emulator\n");
+		exit(EXIT_FAILURE);
+	}
+
+	minigb_apu_audio_init(&priv.apu);
+
+	/* Enable cart RAM. */
+	__gb_write(&gb, 0x0000, 0x0A);
+}
+
+/**
+ * Set registers for the instruction mixes, pointing HL, BC and DE at WRAM.
+ */
+static void reset_cpu(const uint16_t pc)
+{
+	gb.cpu_reg.pc = pc;
+	gb.cpu_reg.sp = 0xDFF0;
+	gb.cpu_reg.h = 0xC1;
+	gb.cpu_reg.l = 0x00;
+	gb.cpu_reg.b = 0xC2;
+	gb.cpu_reg.c = 0x00;
+	gb.cpu_reg.d = 0xC3;
+	gb.cpu_reg.e = 0x00;
+	gb.gb_ime = 0;
+	gb.gb_halt = 0;
+	gb.gb_reg.IE = 0;
+}
+
+static void bench_memory(void)
+{
+	static const struct region reads[] = {
+		{ "ROM bank 0",		0x0000, 0x4000 },
+		{ "ROM bank N",		0x4000, 0x4000 },
+		{ "VRAM",		0x8000, 0x2000 },
+		{ "Cart RAM",		0xA000, 0x2000 },
+		{ "WRAM bank 0",	0xC000, 0x1000 },
+		{ "WRAM bank 1",	0xD000, 0x1000 },
+		{ "Echo RAM",		0xE000, 0x1E00 },
+		{ "OAM",		0xFE00, 0x00A0 },
+		{ "Unusable",		0xFEA0, 0x0060 },
+		{ "IO FF00-FF0F",	0xFF00, 0x0010 },
+		{ "Audio FF10-FF3F",	0xFF10, 0x0030 },
+		{ "LCD FF40-FF4B",	0xFF40, 0x000C },
+		{ "HRAM",		0xFF80, 0x007F },
+		{ "IE",			0xFFFF, 0x0001 },
+	};
+	static const struct region writes[] = {
+		{ "MBC registers",	0x0000, 0x8000 },
+		{ "VRAM",		0x8000, 0x2000 },
+		{ "Cart RAM",		0xA000, 0x2000 },
+		{ "WRAM bank 0",	0xC000, 0x1000 },
+		{ "WRAM bank 1",	0xD000, 0x1000 },
+		{ "Echo RAM",		0xE000, 0x1E00 },
+		{ "OAM",		0xFE00, 0x00A0 },
+		{ "IO FF00-FF0F",	0xFF00, 0x0010 },
+		{ "Audio FF10-FF3F",	0xFF10, 0x0030 },
+		{ "LCD FF40-FF4B",	0xFF40, 0x000C },
+		{ "OAM DMA FF46",	0xFF46, 0x0001 },
+		{ "HRAM",		0xFF80, 0x007F },
+	};
+	static uint16_t addrs[4096];
+	const unsigned long ops = 4096 * 256 * scale;
+	volatile uint8_t sink;
+
+	for(size_t r = 0; r < sizeof(reads) / sizeof(*reads); r++)
+	{
+		double best = 0;
+
+		for(unsigned i = 0; i < 4096; i++)
+			addrs[i] = reads[r].base + i % reads[r].len;
+
+		for(unsigned rep = 0; rep < REPEATS; rep++)
+		{
+			const uint64_t start = now_ns();
+			uint8_t acc = 0;
+			double ns;
+
+			for(unsigned long i = 0; i < ops; i++)
+				acc += __gb_read(&gb, addrs[i & 4095]);
+
+			ns = (double)(now_ns() - start) / ops;
+			sink = acc;
+
+			if(rep == 0 || ns < best)
+				best = ns;
+		}
+
+		report("__gb_read", reads[r].name, best);
+	}
+
+	for(size_t r = 0; r < sizeof(writes) / sizeof(*writes); r++)
+	{
+		/* OAM DMA copies 160 bytes, so is run far fewer times. */
+		const unsigned long n = writes[r].base == 0xFF46 ?
+					ops / 64 : ops;
+		double best = 0;
+
+		/* Restore the banks, and enable cart RAM again, after the
+		 * writes to the MBC registers. */
+		__gb_write(&gb, 0x0000, 0x0A);
+		__gb_write(&gb, 0x2000, 0x01);
+		__gb_write(&gb, 0x4000, 0x00);
+		__gb_write(&gb, 0x6000, 0x00);
+
+		for(unsigned i = 0; i < 4096; i++)
+		{
+			/* Spread the addresses over regions larger than the
+			 * table, so that every MBC register is written. */
+			addrs[i] = writes[r].base + (writes[r].len > 4096 ?
+					i * (writes[r].len / 4096) :
+					i % writes[r].len);
+
+			/* OAM DMA is benchmarked on its own. */
+			if(addrs[i] == 0xFF46 && writes[r].len > 1)
+				addrs[i] = 0xFF45;
+		}
+
+		for(unsigned rep = 0; rep < REPEATS; rep++)
+		{
+			const uint64_t start = now_ns();
+			double ns;
+
+			for(unsigned long i = 0; i < n; i++)
+			{
+				/* DMA from WRAM, and keep the LCD on. */
+				const uint8_t val = addrs[i & 4095] == 0xFF46 ?
+						    0xC0 : 0x80 | (i & 0x7F);
+				__gb_write(&gb, addrs[i & 4095], val);
+			}
+
+			ns = (double)(now_ns() - start) / n;
+
+			if(rep == 0 || ns < best)
+				best = ns;
+		}
+
+		report("__gb_write", writes[r].name, best);
+	}
+
+	(void)sink;
+
+	/* Undo writes to registers. */
+	__gb_write(&gb, 0x0000, 0x0A);
+	__gb_write(&gb, 0x2000, 0x01);
+	__gb_write(&gb, 0x6000, 0x00);
+}
+
+static void bench_dispatch(const struct mix *mixes, const size_t mix_count)
+{
+	const unsigned long ops = 1UL << 20;
+
+	for(size_t m = 0; m < mix_count; m++)
+	{
+		const unsigned long n = ops * scale;
+		double best = 0;
+
+		for(unsigned rep = 0; rep < REPEATS; rep++)
+		{
+			uint64_t start;
+			double ns;
+
+			reset_cpu(MIX_ADDR + m * MIX_SPACING);
+			start = now_ns();
+
+			for(unsigned long i = 0; i < n; i++)
+				__gb_step_cpu(&gb);
+
+			ns = (double)(now_ns() - start) / n;
+
+			if(rep == 0 || ns < best)
+				best = ns;
+		}
+
+		report("dispatch", mixes[m].name, best);
+	}
+}
+
+static void bench_cb(void)
+{
+	static const char *const groups[] = {
+		"Rotates and shifts 00-3F", "BIT 40-7F", "RES 80-BF",
+		"SET C0-FF"
+	};
+	const unsigned long rounds = 16384 * scale;
+
+	for(unsigned g = 0; g < 4; g++)
+	{
+		double best = 0;
+
+		for(unsigned rep = 0; rep < REPEATS; rep++)
+		{
+			uint64_t start;
+			double ns;
+
+			reset_cpu(CB_ADDR);
+			start = now_ns();
+
+			/* Each instruction reads its opcode from the program
+			 * counter, so each round runs the 64 of the group. */
+			for(unsigned long r = 0; r < rounds; r++)
+			{
+				gb.cpu_reg.pc = CB_ADDR + g * 64;
+
+				for(unsigned i = 0; i < 64; i++)
+					__gb_execute_cb(&gb);
+			}
+
+			ns = (double)(now_ns() - start) / (rounds * 64);
+
+			if(rep == 0 || ns < best)
+				best = ns;
+		}
+
+		report("execute_cb", groups[g], best);
+	}
+}
+
+/**
+ * Fill VRAM and OAM with fixed tiles, maps and sprites.
+ */
+static void setup_scene(void)
+{
+	for(unsigned i = 0; i < 0x1800; i++)
+		gb.vram[i] = rnd();
+
+	/* Background map at 0x9800 and window map at 0x9C00. */
+	for(unsigned i = 0; i < 0x400; i++)
+	{
+		gb.vram[0x1800 + i] = i;
+		gb.vram[0x1C00 + i] = i * 7;
+	}
+
+	/* Four rows of ten sprites, so that ten are on each line of the rows,
+	 * with a mix of flips, palettes and priorities. */
+	for(unsigned s = 0; s < 40; s++)
+	{
+		gb.oam[s * 4 + 0] = 16 + (s / 10) * 36;
+		gb.oam[s * 4 + 1] = 8 + (s % 10) * 16;
+		gb.oam[s * 4 + 2] = s;
+		gb.oam[s * 4 + 3] = (s & 7) << 4;
+	}
+
+	__gb_write(&gb, 0xFF47, 0xE4);
+	__gb_write(&gb, 0xFF48, 0xD2);
+	__gb_write(&gb, 0xFF49, 0x1B);
+	__gb_write(&gb, 0xFF42, 5);
+	__gb_write(&gb, 0xFF43, 3);
+	__gb_write(&gb, 0xFF4A, 40);
+	__gb_write(&gb, 0xFF4B, 87);
+}
+
+static void bench_draw_line(void)
+{
+	static const struct scene scenes[] = {
+		{ "Background",			0x91 },
+		{ "Background and window",	0xF1 },
+		{ "Background and 40 sprites",	0x93 },
+		{ "All, 8x16 sprites",		0xF7 },
+	};
+	const unsigned long frames = 1024 * scale;
+
+	setup_scene();
+	gb_init_lcd(&gb, &lcd_draw_line);
+
+	for(size_t s = 0; s < sizeof(scenes) / sizeof(*scenes); s++)
+	{
+		double best = 0;
+
+		gb.gb_reg.LCDC = scenes[s].lcdc;
+
+		for(unsigned rep = 0; rep < REPEATS; rep++)
+		{
+			const uint64_t start = now_ns();
+			double ns;
+
+			for(unsigned long f = 0; f < frames; f++)
+			{
+				/* As at the start of VBLANK. */
+				gb.display.WY = gb.gb_reg.WY;
+				gb.display.window_clear = 0;
+
+				for(unsigned line = 0; line < LCD_HEIGHT; line++)
+				{
+					gb.gb_reg.LY = line;
+					__gb_draw_line(&gb);
+				}
+			}
+
+			ns = (double)(now_ns() - start) / (frames * LCD_HEIGHT);
+
+			if(rep == 0 || ns < best)
+				best = ns;
+		}
+
+		report("draw_line", scenes[s].name, best);
+	}
+
+	gb.display.lcd_draw_line = NULL;
+}
+
+static void bench_apu(void)
+{
+	static const struct apu_config configs[] = {
+		{ "All off", { { 0 } } },
+		{ "Square 1", {
+			{ 0xFF10, 0x00 }, { 0xFF11, 0x80 }, { 0xFF12, 0xF0 },
+			{ 0xFF13, 0x00 }, { 0xFF14, 0x87 }, { 0 } } },
+		{ "Square 2", {
+			{ 0xFF16, 0x80 }, { 0xFF17, 0xF0 }, { 0xFF18, 0x00 },
+			{ 0xFF19, 0x87 }, { 0 } } },
+		{ "Wave", {
+			{ 0xFF1A, 0x80 }, { 0xFF1C, 0x20 }, { 0xFF1D, 0x00 },
+			{ 0xFF1E, 0x87 }, { 0 } } },
+		{ "Noise", {
+			{ 0xFF21, 0xF0 }, { 0xFF22, 0x22 }, { 0xFF23, 0x80 },
+			{ 0 } } },
+		{ "All four", {
+			{ 0xFF10, 0x00 }, { 0xFF11, 0x80 }, { 0xFF12, 0xF0 },
+			{ 0xFF13, 0x00 }, { 0xFF14, 0x87 }, { 0xFF16, 0x80 },
+			{ 0xFF17, 0xF0 }, { 0xFF18, 0x00 }, { 0xFF19, 0x87 },
+			{ 0xFF1A, 0x80 }, { 0xFF1C, 0x20 }, { 0xFF1D, 0x00 },
+			{ 0xFF1E, 0x87 }, { 0xFF21, 0xF0 }, { 0xFF22, 0x22 },
+			{ 0xFF23, 0x80 }, { 0 } } },
+	};
+	static float samples[APU_SAMPLES * 2];
+	struct minigb_apu_ctx *ctx = malloc(sizeof(*ctx));
+	const unsigned long calls = 2048 * scale;
+
+	if(ctx == NULL)
+	{
+		fprintf(stderr, "Unable to allocate memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for(size_t c = 0; c < sizeof(configs) / sizeof(*configs); c++)
+	{
+		double best = 0;
+
+		minigb_apu_audio_init(ctx);
+		minigb_apu_audio_write(ctx, 0xFF26, 0x80);
+		minigb_apu_audio_write(ctx, 0xFF24, 0x77);
+		minigb_apu_audio_write(ctx, 0xFF25, 0xFF);
+
+		for(unsigned i = 0; i < 16; i++)
+			minigb_apu_audio_write(ctx, 0xFF30 + i, i * 0x11);
+
+		for(unsigned w = 0; configs[c].writes[w][0] != 0; w++)
+			minigb_apu_audio_write(ctx, configs[c].writes[w][0],
+					       configs[c].writes[w][1]);
+
+		for(unsigned rep = 0; rep < REPEATS; rep++)
+		{
+			const uint64_t start = now_ns();
+			double ns;
+
+			for(unsigned long i = 0; i < calls; i++)
+				minigb_apu_audio_callback(ctx,
+						(uint8_t *)samples,
+						sizeof(samples));
+
+			ns = (double)(now_ns() - start) /
+			     (calls * APU_SAMPLES);
+
+			if(rep == 0 || ns < best)
+				best = ns;
+		}
+
+		report("apu", configs[c].name, best);
+	}
+
+	free(ctx);
+}
+
+int main(int argc, char **argv)
+{
+	static const struct mix mixes[] = {
+		{ "NOP", { 0x00 }, 1, 1 },
+		/* ADD A,B; XOR C; INC D; SUB E; OR H; DEC L; AND A; ADC A,A;
+		 * CP n; ADD A,n */
+		{ "8-bit ALU", {
+			0x80, 0xA9, 0x14, 0x93, 0xB4, 0x2D, 0xA7, 0x8F,
+			0xFE, 0x12, 0xC6, 0x34 }, 12, 10 },
+		/* LD A,B; LD A,(HL); LD (HL),A; LD A,(BC); LD (DE),A;
+		 * LDH A,(n); LDH (n),A; LD A,(nn) */
+		{ "Loads and stores", {
+			0x78, 0x7E, 0x77, 0x0A, 0x12, 0xF0, 0x80, 0xE0,
+			0x81, 0xFA, 0x00, 0xC4 }, 12, 8 },
+		/* INC BC; DEC DE; LD HL,nn; ADD HL,BC; INC SP; DEC SP */
+		{ "16-bit arithmetic", {
+			0x03, 0x1B, 0x21, 0x00, 0xC1, 0x09, 0x33, 0x3B },
+			8, 6 },
+		/* PUSH BC; PUSH DE; POP DE; POP BC; PUSH HL; POP HL */
+		{ "Stack", { 0xC5, 0xD5, 0xD1, 0xC1, 0xE5, 0xE1 }, 6, 6 },
+		/* JR +0; CALL SUB_ADDR; XOR A; JR NZ,+0; JR Z,+0 */
+		{ "Branches", {
+			0x18, 0x00, 0xCD, SUB_ADDR & 0xFF, SUB_ADDR >> 8,
+			0xAF, 0x20, 0x00, 0x28, 0x00 }, 10, 6 },
+		/* RLC B; SWAP A; BIT 7,H; SET 0,A; RES 0,(HL); BIT 0,(HL) */
+		{ "CB prefixed", {
+			0xCB, 0x00, 0xCB, 0x37, 0xCB, 0x7C, 0xCB, 0xC7,
+			0xCB, 0x86, 0xCB, 0x46 }, 12, 6 },
+	};
+	const size_t mix_count = sizeof(mixes) / sizeof(*mixes);
+
+	switch(argc)
+	{
+	case 2:
+		scale = strtoul(argv[1], NULL, 0);
+		/* Fall-through */
+	case 1:
+		break;
+
+	default:
+		fprintf(stderr, "%s [SCALE]\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	if(scale == 0)
+	{
+		fprintf(stderr, "Scale must be at least 1\n");
+		exit(EXIT_FAILURE);
+	}
+
+	setup(mixes, mix_count);
+	bench_memory();
+	bench_dispatch(mixes, mix_count);
+	bench_cb();
+	bench_draw_line();
+	bench_apu();
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,477 @@
+/**
+ * Counts the instructions executed by a ROM, using the opcode hooks of
+ * peanut_gb.h, to find which instructions are worth specialising or fusing.
+ *
+ * Each opcode and CB prefixed opcode is counted, optionally split by the ROM
+ * bank the instruction was read from, along with each pair of consecutive
+ * instructions. The most frequent are printed, and all counts may be written
+ * as CSV.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#define ENABLE_SOUND 0
+#define ENABLE_LCD 0
+#define ENABLE_OPCODE_HOOKS 1
+
+/* Import emulator library. */
+#include "../../peanut_gb.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Instructions are identified by their opcode, or by 0x100 plus the second
+ * byte of CB prefixed instructions. */
+#define OP_IDS		0x200
+#define OP_CB		0x100
+
+/* Entries printed in each summary table. */
+#define SUMMARY_LEN	16
+
+struct priv_t
+{
+	/* Pointer to allocated memory holding GB file. */
+	uint8_t *rom;
+	/* Pointer to allocated memory holding save file. */
+	uint8_t *cart_ram;
+
+	/* ROM banks in the file. When split by bank, counts holds a row for
+	 * each ROM bank, then a row for code run from RAM. */
+	unsigned banks;
+	unsigned rows;
+	uint64_t *counts;
+	/* Counts of each instruction followed by each instruction. */
+	uint64_t *pairs;
+
+	/* Row of the instruction being executed. */
+	unsigned row;
+	/* Previous instruction, or OP_IDS before the first. */
+	unsigned prev;
+};
+
+struct entry
+{
+	unsigned id;
+	uint64_t count;
+};
+
+/**
+ * Returns a byte from the ROM file at the given address.
+ */
+uint8_t gb_rom_read(struct gb_s *gb, const uint_fast32_t addr)
+{
+	const struct priv_t * const p = gb->direct.priv;
+	return p->rom[addr];
+}
+
+/**
+ * Returns a byte from the cartridge RAM at the given address.
+ */
+uint8_t gb_cart_ram_read(struct gb_s *gb, const uint_fast32_t addr)
+{
+	const struct priv_t * const p = gb->direct.priv;
+	return p->cart_ram[addr];
+}
+
+/**
+ * Writes a given byte to the cartridge RAM at the given address.
+ */
+void gb_cart_ram_write(struct gb_s *gb, const uint_fast32_t addr,
+		const uint8_t val)
+{
+	const struct priv_t * const p = gb->direct.priv;
+	p->cart_ram[addr] = val;
+}
+
+/**
+ * Ignore all errors.
+ */
+void gb_error(struct gb_s *gb, const enum gb_error_e gb_err, const uint16_t val)
+{
+	(void)gb;
+	(void)gb_err;
+	(void)val;
+}
+
+static void count(struct priv_t *p, const unsigned id)
+{
+	p->counts[p->row * OP_IDS + id]++;
+
+	if(p->prev != OP_IDS)
+		p->pairs[p->prev * OP_IDS + id]++;
+
+	p->prev = id;
+}
+
+void gb_opcode_hook(struct gb_s *gb, const uint16_t pc, const uint8_t opcode)
+{
+	struct priv_t * const p = gb->direct.priv;
+
+	if(p->rows == 1)
+		p->row = 0;
+	else if(pc < ROM_N_ADDR)
+		p->row = 0;
+	else if(pc < VRAM_ADDR)
+	{
+		/* Masked in MBC1 mode 1 as __gb_read() does. */
+		const uint_fast16_t bank = gb->mbc == 1 && gb->cart_mode_select ?
+			gb->selected_rom_bank & 0x1F : gb->selected_rom_bank;
+
+		p->row = bank < p->banks ? bank : 0;
+	}
+	else
+		p->row = p->banks;
+
+	/* Prefixed instructions are counted once the second byte is read. */
+	if(opcode != 0xCB)
+		count(p, opcode);
+}
+
+void gb_cb_opcode_hook(struct gb_s *gb, const uint8_t cbop)
+{
+	count(gb->direct.priv, OP_CB | cbop);
+}
+
+/**
+ * Returns a pointer to the allocated space containing the ROM. Must be freed.
+ */
+uint8_t *read_rom_to_ram(const char *file_name, size_t *size)
+{
+	FILE *rom_file = fopen(file_name, "rb");
+	size_t rom_size;
+	uint8_t *rom = NULL;
+
+	if(rom_file == NULL)
+		return NULL;
+
+	fseek(rom_file, 0, SEEK_END);
+	rom_size = ftell(rom_file);
+	rewind(rom_file);
+	rom = malloc(rom_size);
+
+	if(fread(rom, sizeof(uint8_t), rom_size, rom_file) != rom_size)
+	{
+		free(rom);
+		fclose(rom_file);
+		return NULL;
+	}
+
+	fclose(rom_file);
+	*size = rom_size;
+	return rom;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Writes the name of an instruction, such as "3E" or "CB 7C".
+ */
+static const char *op_name(const unsigned id, char buf[8])
+{
+	if(id & OP_CB)
+		sprintf(buf, "CB %02X", id & 0xFF);
+	else
+		sprintf(buf, "%02X", id & 0xFF);
+
+	return buf;
+}
+
+/**
+ * Sort entries by count, highest first, and then by instruction.
+ */
+static int entry_cmp(const void *a, const void *b)
+{
+	const struct entry *ea = a, *eb = b;
+
+	if(ea->count != eb->count)
+		return ea->count < eb->count ? 1 : -1;
+
+	return (ea->id > eb->id) - (ea->id < eb->id);
+}
+
+/**
+ * Returns the non-zero counts as entries sorted by count. Must be freed.
+ */
+static struct entry *sort_counts(const uint64_t *counts, const size_t n,
+				 size_t *len)
+{
+	struct entry *e = malloc(n * sizeof(*e));
+
+	if(e == NULL)
+		return NULL;
+
+	*len = 0;
+
+	for(size_t i = 0; i < n; i++)
+	{
+		if(counts[i] == 0)
+			continue;
+
+		e[*len].id = i;
+		e[*len].count = counts[i];
+		(*len)++;
+	}
+
+	qsort(e, *len, sizeof(*e), entry_cmp);
+	return e;
+}
+
+static int write_counts(const char *path, const struct priv_t *p,
+			const uint64_t total)
+{
+	FILE *f = fopen(path, "w");
+	char name[8];
+
+	if(f == NULL)
+		return -1;
+
+	fprintf(f, "bank,opcode,count,percent\n");
+
+	for(unsigned row = 0; row < p->rows; row++)
+	{
+		char bank[12];
+
+		if(p->rows == 1)
+			strcpy(bank, "all");
+		else if(row == p->banks)
+			strcpy(bank, "RAM");
+		else
+			sprintf(bank, "%u", row);
+
+		for(unsigned id = 0; id < OP_IDS; id++)
+		{
+			const uint64_t n = p->counts[row * OP_IDS + id];
+
+			if(n == 0)
+				continue;
+
+			fprintf(f, "%s,%s,%llu,%.6f\n", bank, op_name(id, name),
+				(unsigned long long)n, 100.0 * n / total);
+		}
+	}
+
+	return fclose(f);
+}
+
+static int write_pairs(const char *path, const struct entry *e,
+		       const size_t len, const uint64_t total)
+{
+	FILE *f = fopen(path, "w");
+	char first[8], second[8];
+
+	if(f == NULL)
+		return -1;
+
+	fprintf(f, "first,second,count,percent\n");
+
+	for(size_t i = 0; i < len; i++)
+	{
+		fprintf(f, "%s,%s,%llu,%.6f\n",
+			op_name(e[i].id / OP_IDS, first),
+			op_name(e[i].id % OP_IDS, second),
+			(unsigned long long)e[i].count,
+			100.0 * e[i].count / total);
+	}
+
+	return fclose(f);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [-f FRAMES] [-b] [-o FILE] [-p FILE] [-k PAIRS] ROM\n"
+		"  -f FRAMES	Number of frames to run. Default 7200, two\n"
+		"		minutes of play.\n"
+		"  -b		Count the instructions of each ROM bank, and of\n"
+		"		code run from RAM, separately.\n"
+		"  -o FILE	Write the count of each instruction as CSV.\n"
+		"  -p FILE	Write the most frequent pairs of consecutive\n"
+		"		instructions as CSV.\n"
+		"  -k PAIRS	Number of pairs written with -p. Default 256,\n"
+		"		or 0 for all.\n",
+		name);
+}
+
+int main(int argc, char **argv)
+{
+	static struct gb_s gb;
+	struct priv_t priv = { 0 };
+	const char *counts_path = NULL;
+	const char *pairs_path = NULL;
+	unsigned long frames = 7200;
+	unsigned long pair_limit = 256;
+	int by_bank = 0;
+	uint64_t total_ops[OP_IDS] = { 0 };
+	uint64_t total = 0;
+	struct entry *ops = NULL, *pairs = NULL;
+	size_t ops_len, pairs_len;
+	size_t rom_size;
+	enum gb_init_error_e gb_ret;
+	int ret = EXIT_FAILURE;
+	double start, duration;
+	char name[8], name2[8];
+	int o;
+
+	while((o = getopt(argc, argv, "f:bo:p:k:")) != -1)
+	{
+		switch(o)
+		{
+		case 'f':
+			frames = strtoul(optarg, NULL, 0);
+			break;
+
+		case 'b':
+			by_bank = 1;
+			break;
+
+		case 'o':
+			counts_path = optarg;
+			break;
+
+		case 'p':
+			pairs_path = optarg;
+			break;
+
+		case 'k':
+			pair_limit = strtoul(optarg, NULL, 0);
+			break;
+
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if(optind != argc - 1)
+	{
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if((priv.rom = read_rom_to_ram(argv[optind], &rom_size)) == NULL)
+	{
+		fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno));
+		goto out;
+	}
+
+	priv.banks = (rom_size + ROM_BANK_SIZE - 1) / ROM_BANK_SIZE;
+	priv.rows = by_bank ? priv.banks + 1 : 1;
+	priv.prev = OP_IDS;
+	priv.counts = calloc((size_t)priv.rows * OP_IDS, sizeof(uint64_t));
+	priv.pairs = calloc((size_t)OP_IDS * OP_IDS, sizeof(uint64_t));
+
+	if(priv.counts == NULL || priv.pairs == NULL)
+	{
+		fprintf(stderr, "Unable to allocate memory\n");
+		goto out;
+	}
+
+	/* Memory is not initialised by gb_init(), but the context is static,
+	 * so runs of the same ROM are repeatable. */
+	gb_ret = gb_init(&gb, &gb_rom_read, &gb_cart_ram_read,
+			 &gb_cart_ram_write, &gb_error, &priv);
+
+	if(gb_ret != GB_INIT_NO_ERROR)
+	{
+		fprintf(stderr, "Error: %d\n", gb_ret);
+		goto out;
+	}
+
+	if((priv.cart_ram = malloc(gb_get_save_size(&gb) + 1)) == NULL)
+		goto out;
+
+	memset(priv.cart_ram, 0xFF, gb_get_save_size(&gb));
+
+	start = now();
+
+	for(unsigned long i = 0; i < frames; i++)
+		gb_run_frame(&gb);
+
+	duration = now() - start;
+
+	for(unsigned row = 0; row < priv.rows; row++)
+	{
+		for(unsigned id = 0; id < OP_IDS; id++)
+		{
+			total_ops[id] += priv.counts[row * OP_IDS + id];
+			total += priv.counts[row * OP_IDS + id];
+		}
+	}
+
+	if(total == 0)
+	{
+		fprintf(stderr, "No instructions were executed\n");
+		goto out;
+	}
+
+	ops = sort_counts(total_ops, OP_IDS, &ops_len);
+	pairs = sort_counts(priv.pairs, (size_t)OP_IDS * OP_IDS, &pairs_len);
+
+	if(ops == NULL || pairs == NULL)
+	{
+		fprintf(stderr, "Unable to allocate memory\n");
+		goto out;
+	}
+
+	printf("Ran %lu frames in %.3f s, %llu instructions, "
+	       "%u distinct\n\n", frames, duration,
+	       (unsigned long long)total, (unsigned)ops_len);
+	printf("%-6s %14s %7s   %-6s %-6s %14s %7s\n", "Opcode", "Count", "%",
+	       "First", "Second", "Count", "%");
+
+	for(size_t i = 0; i < SUMMARY_LEN; i++)
+	{
+		if(i < ops_len)
+			printf("%-6s %14llu %7.3f   ", op_name(ops[i].id, name),
+			       (unsigned long long)ops[i].count,
+			       100.0 * ops[i].count / total);
+		else
+			printf("%-6s %14s %7s   ", "", "", "");
+
+		if(i < pairs_len)
+			printf("%-6s %-6s %14llu %7.3f",
+			       op_name(pairs[i].id / OP_IDS, name),
+			       op_name(pairs[i].id % OP_IDS, name2),
+			       (unsigned long long)pairs[i].count,
+			       100.0 * pairs[i].count / total);
+
+		putchar('\n');
+	}
+
+	if(counts_path != NULL && write_counts(counts_path, &priv, total) != 0)
+	{
+		fprintf(stderr, "%s: %s\n", counts_path, strerror(errno));
+		goto out;
+	}
+
+	if(pair_limit != 0 && pair_limit < pairs_len)
+		pairs_len = pair_limit;
+
+	if(pairs_path != NULL &&
+			write_pairs(pairs_path, pairs, pairs_len, total) != 0)
+	{
+		fprintf(stderr, "%s: %s\n", pairs_path, strerror(errno));
+		goto out;
+	}
+
+	ret = EXIT_SUCCESS;
+
+out:
+	free(ops);
+	free(pairs);
+	free(priv.pairs);
+	free(priv.counts);
+	free(priv.cart_ram);
+	free(priv.rom);
+	return ret;
+}
@@ -0,0 +1,274 @@
+/**
+ * Attributes the hardware events of running Blargg's CPU instruction test to
+ * each phase of emulation, using the phase hooks of peanut_gb.h and the
+ * perf_event counters of prof.h.
+ *
+ * The counters are read on entering and leaving every phase, so each phase is
+ * given only the events that occurred while it was the innermost phase. The
+ * cost of reading the counters, measured before the test is run, is taken away
+ * from each phase for each time the counters were read within it. Even so,
+ * reading the counters so often disturbs the caches and branch predictors, so
+ * the results are best compared to each other rather than to those of
+ * peanut-benchmark-prof.
+ */
+
+#define _DEFAULT_SOURCE
+
+#define ENABLE_SOUND 0
+#define ENABLE_LCD 1
+#define ENABLE_PHASE_HOOKS 1
+
+/* Import emulator library. */
+#include "../../peanut_gb.h"
+
+#include <unistd.h>
+
+#define PROF_USER_EVENTS_ONLY
+#define PROF_EVENT_LIST \
+	PROF_EVENT_HW(CPU_CYCLES) \
+	PROF_EVENT_HW(INSTRUCTIONS) \
+	PROF_EVENT_HW(BRANCH_MISSES) \
+	PROF_EVENT_CACHE(L1D, READ, MISS)
+#include "prof.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Number of events in PROF_EVENT_LIST. */
+#define EVENTS		4
+
+/* Index of events made outside of any phase, such as in gb_run_frame(). */
+#define PHASE_OTHER	GB_PHASE_MAX
+
+/* Pairs of calls made to measure the cost of reading the counters. */
+#define CALIBRATION_PAIRS	100000
+
+struct phase_stats
+{
+	enum gb_phase_e stack[16];
+	unsigned depth;
+	uint64_t last[EVENTS];
+
+	/* Events made while each phase was the innermost. */
+	uint64_t events[GB_PHASE_MAX + 1][EVENTS];
+	/* Times each phase was entered. */
+	uint64_t calls[GB_PHASE_MAX + 1];
+	/* Times the counters were read on entering or leaving a phase, while
+	 * each phase was the innermost. */
+	uint64_t reads[GB_PHASE_MAX + 1];
+};
+
+static struct phase_stats stats;
+
+/**
+ * Return byte from blarrg test ROM.
+ */
+uint8_t gb_rom_read(struct gb_s *gb, const uint_fast32_t addr)
+{
+	/* Import blarrg CPU test ROM. */
+#include "../../test/cpu_instrs.h"
+	(void)gb;
+	(void)cpu_instrs_gb_len;
+	return cpu_instrs_gb[addr];
+}
+
+/**
+ * Ignore cart RAM writes, since the test doesn't require it.
+ */
+void gb_cart_ram_write(struct gb_s *gb, const uint_fast32_t addr,
+		const uint8_t val)
+{
+	(void)gb;
+	(void)addr;
+	(void)val;
+	return;
+}
+
+/**
+ * Ignore cart RAM reads, since the test doesn't require it.
+ */
+uint8_t gb_cart_ram_read(struct gb_s *gb, const uint_fast32_t addr)
+{
+	(void)gb;
+	(void)addr;
+	return 0xFF;
+}
+
+/**
+ * Ignore all errors.
+ */
+void gb_error(struct gb_s *gb, const enum gb_error_e gb_err,
+		const uint16_t val)
+{
+	(void)gb;
+	(void)gb_err;
+	(void)val;
+	return;
+}
+
+/**
+ * Keep the line, so that drawing it is not optimised away.
+ */
+void lcd_draw_line(struct gb_s *gb, const uint8_t pixels[160],
+		   const uint_least8_t line)
+{
+	static uint8_t fb[LCD_HEIGHT][LCD_WIDTH];
+	(void)gb;
+	memcpy(fb[line], pixels, LCD_WIDTH);
+}
+
+/**
+ * Give the events since the counters were last read to the innermost phase.
+ */
+static void account(void)
+{
+	const unsigned top = stats.depth ?
+			     stats.stack[stats.depth - 1] : PHASE_OTHER;
+
+	PROF_READ_COUNTERS_(prof_event_buf_);
+
+	for(unsigned e = 0; e < EVENTS; e++)
+	{
+		stats.events[top][e] += PROF_COUNTERS[e] - stats.last[e];
+		stats.last[e] = PROF_COUNTERS[e];
+	}
+
+	stats.reads[top]++;
+}
+
+void gb_phase_begin(struct gb_s *gb, const enum gb_phase_e phase)
+{
+	(void)gb;
+	account();
+	stats.calls[phase]++;
+	stats.stack[stats.depth++] = phase;
+	stats.reads[phase]++;
+}
+
+void gb_phase_end(struct gb_s *gb, const enum gb_phase_e phase)
+{
+	(void)gb;
+	(void)phase;
+	account();
+	stats.depth--;
+	stats.reads[stats.depth ?
+		    stats.stack[stats.depth - 1] : PHASE_OTHER]++;
+}
+
+static void reset_stats(void)
+{
+	memset(&stats, 0, sizeof(stats));
+	PROF_START();
+}
+
+int main(int argc, char **argv)
+{
+	static const char *const phase_names[GB_PHASE_MAX + 1] = {
+		"Dispatch", "Memory", "Timers", "LCD", "Draw line",
+		"Frontend", "Other"
+	};
+	const unsigned short pc_end = 0x06F1; /* Test ends when PC is this value. */
+	unsigned long frames = 600;
+	unsigned long frame = 0;
+	double cost[EVENTS];
+	uint64_t total[EVENTS] = { 0 };
+	struct gb_s gb;
+	int ret;
+
+	switch(argc)
+	{
+	case 2:
+		frames = strtoul(argv[1], NULL, 0);
+		/* Fall-through */
+	case 1:
+		break;
+
+	default:
+		fprintf(stderr, "%s [FRAMES]\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	/* Each pair of calls reads the counters twice, each read being counted
+	 * within two phases. */
+	reset_stats();
+
+	for(unsigned i = 0; i < CALIBRATION_PAIRS; i++)
+	{
+		gb_phase_begin(NULL, GB_PHASE_DISPATCH);
+		gb_phase_end(NULL, GB_PHASE_DISPATCH);
+	}
+
+	for(unsigned e = 0; e < EVENTS; e++)
+	{
+		cost[e] = (double)(stats.events[GB_PHASE_DISPATCH][e] +
+				   stats.events[PHASE_OTHER][e]) /
+			  (stats.reads[GB_PHASE_DISPATCH] +
+			   stats.reads[PHASE_OTHER]);
+	}
+
+	ret = gb_init(&gb, &gb_rom_read, &gb_cart_ram_read,
+			&gb_cart_ram_write, &gb_error, NULL);
+
+	if(ret != GB_INIT_NO_ERROR)
+	{
+		printf("Error: %d\n", ret);
+		exit(EXIT_FAILURE);
+	}
+
+	gb_init_lcd(&gb, &lcd_draw_line);
+	reset_stats();
+
+	/* Step CPU until test is complete, or for the given number of frames. */
+	while(gb.cpu_reg.pc != pc_end && (frames == 0 || frame < frames))
+	{
+		gb_run_frame(&gb);
+		frame++;
+	}
+
+	account();
+	PROF_STOP();
+
+	for(unsigned p = 0; p <= PHASE_OTHER; p++)
+	{
+		for(unsigned e = 0; e < EVENTS; e++)
+		{
+			const double c = cost[e] * stats.reads[p];
+
+			if(stats.events[p][e] > c)
+				stats.events[p][e] -= c;
+			else
+				stats.events[p][e] = 0;
+
+			total[e] += stats.events[p][e];
+		}
+	}
+
+	printf("%lu frames\n\n", frame);
+	printf("%-10s %11s %14s %6s %14s %5s %12s %12s\n",
+	       "Phase", "Calls", "Cycles", "%", "Instructions", "IPC",
+	       "Br. misses", "L1D misses");
+
+	for(unsigned p = 0; p <= PHASE_OTHER; p++)
+	{
+		const uint64_t *ev = stats.events[p];
+
+		printf("%-10s %11llu %14llu %6.2f %14llu %5.2f %12llu %12llu\n",
+		       phase_names[p], (unsigned long long)stats.calls[p],
+		       (unsigned long long)ev[0],
+		       total[0] ? 100.0 * ev[0] / total[0] : 0.0,
+		       (unsigned long long)ev[1],
+		       ev[0] ? (double)ev[1] / ev[0] : 0.0,
+		       (unsigned long long)ev[2], (unsigned long long)ev[3]);
+	}
+
+	printf("%-10s %11s %14llu %6.2f %14llu %5.2f %12llu %12llu\n",
+	       "Total", "", (unsigned long long)total[0], 100.0,
+	       (unsigned long long)total[1],
+	       total[0] ? (double)total[1] / total[0] : 0.0,
+	       (unsigned long long)total[2], (unsigned long long)total[3]);
+	printf("\nCost of reading counters: %.0f cycles, %.0f instructions\n",
+	       2 * cost[0], 2 * cost[1]);
+
+	return 0;
+}
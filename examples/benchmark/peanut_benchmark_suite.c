@@ -0,0 +1,725 @@
+/**
+ * Benchmarks a matrix of ROMs and runtime configurations, and reports the
+ * median, 5th and 95th percentile frame rate of a number of runs, and the
+ * distribution of the time taken by each frame. Each run starts from a
+ * freshly initialised emulator, and warm-up runs are made before the
+ * measured runs of each case.
+ *
+ * Results may be written as CSV or as JSON, which also holds the frame time
+ * histogram of each case. A CSV file from an earlier run may be given as a
+ * baseline, in which case the change in median frame rate of each case is
+ * printed, and the benchmark fails if any case is slower by more than a
+ * threshold.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#define ENABLE_SOUND 1
+#define ENABLE_LCD 1
+
+#include "../sdl2/minigb_apu/minigb_apu.h"
+
+/* Import emulator library. */
+#include "../../peanut_gb.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Runtime options of a configuration. */
+#define CONFIG_LCD		(1 << 0)
+#define CONFIG_INTERLACE	(1 << 1)
+#define CONFIG_FRAME_SKIP	(1 << 2)
+#define CONFIG_SOUND		(1 << 3)
+
+/* Frame time histogram buckets per doubling of the frame time. */
+#define HIST_SUB_BITS		2
+#define HIST_SUB		(1 << HIST_SUB_BITS)
+/* Frame times below 2^HIST_MIN_LOG2 ns go in the first bucket, and times
+ * of 2^HIST_MAX_LOG2 ns or more in the last. */
+#define HIST_MIN_LOG2		10
+#define HIST_MAX_LOG2		30
+#define HIST_BUCKETS		((HIST_MAX_LOG2 - HIST_MIN_LOG2) * HIST_SUB + 2)
+
+struct config
+{
+	const char *name;
+	unsigned flags;
+};
+
+static const struct config configs[] = {
+	{ "lcd",	CONFIG_LCD },
+	{ "nolcd",	0 },
+	{ "interlace",	CONFIG_LCD | CONFIG_INTERLACE },
+	{ "frameskip",	CONFIG_LCD | CONFIG_FRAME_SKIP },
+	{ "sound",	CONFIG_LCD | CONFIG_SOUND },
+};
+
+#define CONFIG_COUNT	(sizeof(configs) / sizeof(*configs))
+
+struct priv_t
+{
+	/* Pointer to memory holding GB file. */
+	const uint8_t *rom;
+	/* Pointer to allocated memory holding save file. */
+	uint8_t *cart_ram;
+
+	/* Allocated when the configuration has sound. */
+	struct minigb_apu_ctx *apu;
+	float samples[MINIGB_APU_MAX_FRAME_SAMPLES * 2];
+
+	/* Frame buffer */
+	uint16_t fb[LCD_HEIGHT][LCD_WIDTH];
+};
+
+/* Results of one ROM in one configuration. */
+struct result
+{
+	const char *rom;
+	const struct config *config;
+
+	double fps_median, fps_p5, fps_p95;
+	/* Frame times in microseconds. */
+	double frame_p50, frame_p95, frame_p99, frame_max;
+	unsigned long hist[HIST_BUCKETS];
+};
+
+struct options
+{
+	unsigned long frames;
+	unsigned runs;
+	unsigned warmup;
+	/* Bit set of the configurations to run. */
+	unsigned long configs;
+	const char *csv;
+	const char *json;
+	const char *baseline;
+	/* Largest slowdown of the median frame rate in percent that is not
+	 * reported as a regression. */
+	double threshold;
+};
+
+/**
+ * Returns a byte from the ROM file at the given address.
+ */
+uint8_t gb_rom_read(struct gb_s *gb, const uint_fast32_t addr)
+{
+	const struct priv_t * const p = gb->direct.priv;
+	return p->rom[addr];
+}
+
+/**
+ * Returns a byte from the cartridge RAM at the given address.
+ */
+uint8_t gb_cart_ram_read(struct gb_s *gb, const uint_fast32_t addr)
+{
+	const struct priv_t * const p = gb->direct.priv;
+	return p->cart_ram[addr];
+}
+
+/**
+ * Writes a given byte to the cartridge RAM at the given address.
+ */
+void gb_cart_ram_write(struct gb_s *gb, const uint_fast32_t addr,
+		const uint8_t val)
+{
+	const struct priv_t * const p = gb->direct.priv;
+	p->cart_ram[addr] = val;
+}
+
+/**
+ * Audio registers read as open bus in configurations without sound.
+ */
+uint8_t audio_read(struct gb_s *gb, const uint16_t addr)
+{
+	struct priv_t * const p = gb->direct.priv;
+
+	if(p->apu == NULL)
+		return 0xFF;
+
+	return minigb_apu_audio_read(p->apu, addr);
+}
+
+void audio_write(struct gb_s *gb, const uint16_t addr, const uint8_t val)
+{
+	struct priv_t * const p = gb->direct.priv;
+
+	if(p->apu != NULL)
+		minigb_apu_audio_write_at(p->apu, gb_get_frame_cycles(gb),
+					  addr, val);
+}
+
+/**
+ * Draws scanline into framebuffer.
+ */
+void lcd_draw_line(struct gb_s *gb, const uint8_t pixels[160],
+		const uint_least8_t line)
+{
+	struct priv_t *priv = gb->direct.priv;
+	const uint16_t palette[] = { 0x7FFF, 0x5294, 0x294A, 0x0000 };
+
+	for (unsigned int x = 0; x < LCD_WIDTH; x++)
+		priv->fb[line][x] = palette[pixels[x] & 3];
+}
+
+/**
+ * Returns a pointer to the allocated space containing the ROM. Must be freed.
+ */
+uint8_t *read_rom_to_ram(const char *file_name)
+{
+	FILE *rom_file = fopen(file_name, "rb");
+	size_t rom_size;
+	uint8_t *rom = NULL;
+
+	if(rom_file == NULL)
+		return NULL;
+
+	fseek(rom_file, 0, SEEK_END);
+	rom_size = ftell(rom_file);
+	rewind(rom_file);
+	rom = malloc(rom_size);
+
+	if(fread(rom, sizeof(uint8_t), rom_size, rom_file) != rom_size)
+	{
+		free(rom);
+		fclose(rom_file);
+		return NULL;
+	}
+
+	fclose(rom_file);
+	return rom;
+}
+
+/**
+ * Ignore all errors.
+ */
+void gb_error(struct gb_s *gb, const enum gb_error_e gb_err, const uint16_t val)
+{
+	(void)gb;
+	(void)gb_err;
+	(void)val;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static unsigned hist_bucket(const uint64_t ns)
+{
+	unsigned log2;
+
+	if(ns < (1ULL << HIST_MIN_LOG2))
+		return 0;
+
+	log2 = 63 - __builtin_clzll(ns);
+
+	if(log2 >= HIST_MAX_LOG2)
+		return HIST_BUCKETS - 1;
+
+	return (log2 - HIST_MIN_LOG2) * HIST_SUB + 1 +
+	       ((ns >> (log2 - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/**
+ * Returns the lowest frame time in microseconds that falls in a bucket.
+ */
+static double hist_lower_us(const unsigned bucket)
+{
+	const unsigned b = bucket - 1;
+
+	if(bucket == 0)
+		return 0.0;
+
+	return (double)((HIST_SUB + b % HIST_SUB) <<
+			(HIST_MIN_LOG2 + b / HIST_SUB - HIST_SUB_BITS)) / 1000.0;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	const double x = *(const double *)a;
+	const double y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+/**
+ * Returns the p-th quantile of sorted values, interpolating between the two
+ * closest values.
+ */
+static double quantile(const double *sorted, const size_t len, const double p)
+{
+	const double pos = p * (len - 1);
+	const size_t i = (size_t)pos;
+
+	if(i + 1 >= len)
+		return sorted[len - 1];
+
+	return sorted[i] + (sorted[i + 1] - sorted[i]) * (pos - i);
+}
+
+/**
+ * Runs a ROM for a number of frames in a configuration. The time of each
+ * frame in microseconds is stored in frame_us if not NULL.
+ *
+ * \return	frames per second.
+ */
+static double run(const uint8_t *rom, const struct config *config,
+		  const unsigned long frames, double *frame_us,
+		  unsigned long *hist)
+{
+	static struct priv_t priv;
+	struct gb_s gb;
+	uint64_t start, total;
+
+	memset(&gb, 0, sizeof(gb));
+	memset(&priv, 0, sizeof(priv));
+	priv.rom = rom;
+
+	if(gb_init(&gb, &gb_rom_read, &gb_cart_ram_read, &gb_cart_ram_write,
+			&gb_error, &priv) != GB_INIT_NO_ERROR)
+	{
+		fprintf(stderr, "Unable to initialise emulator\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Cart RAM is allocated even if the ROM does not need it, since
+	 * malloc(0) may return NULL. */
+	priv.cart_ram = calloc(1, gb_get_save_size(&gb) + 1);
+
+	if(priv.cart_ram == NULL)
+		goto err;
+
+	if(config->flags & CONFIG_SOUND)
+	{
+		priv.apu = malloc(sizeof(*priv.apu));
+
+		if(priv.apu == NULL)
+			goto err;
+
+		minigb_apu_audio_init(priv.apu);
+	}
+
+	if(config->flags & CONFIG_LCD)
+		gb_init_lcd(&gb, &lcd_draw_line);
+
+	gb.direct.interlace = !!(config->flags & CONFIG_INTERLACE);
+	gb.direct.frame_skip = !!(config->flags & CONFIG_FRAME_SKIP);
+
+	start = now_ns();
+
+	for(unsigned long f = 0; f < frames; f++)
+	{
+		const uint64_t frame_start = now_ns();
+		uint64_t frame_end;
+
+		gb_run_frame(&gb);
+
+		if(priv.apu != NULL)
+			minigb_apu_end_frame_blip(priv.apu,
+					LCD_VERT_LINES * LCD_LINE_CYCLES,
+					priv.samples);
+
+		frame_end = now_ns();
+
+		if(frame_us != NULL)
+			frame_us[f] = (frame_end - frame_start) / 1000.0;
+
+		if(hist != NULL)
+			hist[hist_bucket(frame_end - frame_start)]++;
+	}
+
+	total = now_ns() - start;
+
+	free(priv.apu);
+	free(priv.cart_ram);
+	return frames / (total / 1e9);
+
+err:
+	fprintf(stderr, "Unable to allocate memory\n");
+	exit(EXIT_FAILURE);
+}
+
+/**
+ * Benchmark one ROM in one configuration.
+ */
+static void bench(const struct options *opt, const uint8_t *rom,
+		  struct result *res, double *fps, double *frame_us)
+{
+	memset(res->hist, 0, sizeof(res->hist));
+
+	for(unsigned w = 0; w < opt->warmup; w++)
+		run(rom, res->config, opt->frames, NULL, NULL);
+
+	for(unsigned r = 0; r < opt->runs; r++)
+		fps[r] = run(rom, res->config, opt->frames,
+			     frame_us + r * opt->frames, res->hist);
+
+	qsort(fps, opt->runs, sizeof(*fps), cmp_double);
+	res->fps_median = quantile(fps, opt->runs, 0.50);
+	res->fps_p5 = quantile(fps, opt->runs, 0.05);
+	res->fps_p95 = quantile(fps, opt->runs, 0.95);
+
+	qsort(frame_us, opt->runs * opt->frames, sizeof(*frame_us),
+	      cmp_double);
+	res->frame_p50 = quantile(frame_us, opt->runs * opt->frames, 0.50);
+	res->frame_p95 = quantile(frame_us, opt->runs * opt->frames, 0.95);
+	res->frame_p99 = quantile(frame_us, opt->runs * opt->frames, 0.99);
+	res->frame_max = frame_us[opt->runs * opt->frames - 1];
+}
+
+static const char *base_name(const char *path)
+{
+	const char *slash = strrchr(path, '/');
+	return slash == NULL ? path : slash + 1;
+}
+
+static int write_csv(const char *file, const struct options *opt,
+		     const struct result *res, const size_t count)
+{
+	FILE *f = fopen(file, "w");
+
+	if(f == NULL)
+		return -1;
+
+	fprintf(f, "rom,config,frames,runs,fps_median,fps_p5,fps_p95,"
+		"frame_us_p50,frame_us_p95,frame_us_p99,frame_us_max\n");
+
+	for(size_t i = 0; i < count; i++)
+	{
+		fprintf(f, "%s,%s,%lu,%u,%.1f,%.1f,%.1f,%.2f,%.2f,%.2f,%.2f\n",
+			base_name(res[i].rom), res[i].config->name,
+			opt->frames, opt->runs, res[i].fps_median,
+			res[i].fps_p5, res[i].fps_p95, res[i].frame_p50,
+			res[i].frame_p95, res[i].frame_p99, res[i].frame_max);
+	}
+
+	return fclose(f);
+}
+
+/**
+ * Writes str to f as a JSON string, escaping quotes, backslashes and control
+ * characters.
+ */
+static void write_json_string(FILE *f, const char *str)
+{
+	fputc('"', f);
+
+	for(; *str != '\0'; str++)
+	{
+		const unsigned char c = *str;
+
+		if(c == '"' || c == '\\')
+			fprintf(f, "\\%c", c);
+		else if(c < 0x20)
+			fprintf(f, "\\u%04x", c);
+		else
+			fputc(c, f);
+	}
+
+	fputc('"', f);
+}
+
+static int write_json(const char *file, const struct options *opt,
+		      const struct result *res, const size_t count)
+{
+	FILE *f = fopen(file, "w");
+
+	if(f == NULL)
+		return -1;
+
+	fprintf(f, "{\n  \"frames\": %lu,\n  \"runs\": %u,\n"
+		"  \"warmup\": %u,\n  \"results\": [\n",
+		opt->frames, opt->runs, opt->warmup);
+
+	for(size_t i = 0; i < count; i++)
+	{
+		const char *sep = "";
+
+		fputs("    {\n      \"rom\": ", f);
+		write_json_string(f, base_name(res[i].rom));
+		fprintf(f, ",\n"
+			"      \"config\": \"%s\",\n"
+			"      \"fps\": { \"median\": %.1f, \"p5\": %.1f, "
+			"\"p95\": %.1f },\n"
+			"      \"frame_us\": { \"p50\": %.2f, \"p95\": %.2f, "
+			"\"p99\": %.2f, \"max\": %.2f },\n"
+			"      \"histogram\": [",
+			res[i].config->name,
+			res[i].fps_median, res[i].fps_p5, res[i].fps_p95,
+			res[i].frame_p50, res[i].frame_p95, res[i].frame_p99,
+			res[i].frame_max);
+
+		/* Only buckets holding frames are written, each with the
+		 * lowest frame time in microseconds that it holds. */
+		for(unsigned b = 0; b < HIST_BUCKETS; b++)
+		{
+			if(res[i].hist[b] == 0)
+				continue;
+
+			fprintf(f, "%s\n        { \"us\": %.3f, \"frames\": %lu }",
+				sep, hist_lower_us(b), res[i].hist[b]);
+			sep = ",";
+		}
+
+		fprintf(f, "\n      ]\n    }%s\n", i + 1 < count ? "," : "");
+	}
+
+	fprintf(f, "  ]\n}\n");
+	return fclose(f);
+}
+
+/**
+ * Compare results to a CSV file written by an earlier run.
+ *
+ * \return	number of cases slower than the threshold.
+ */
+static unsigned compare(const char *file, const struct options *opt,
+			const struct result *res, const size_t count)
+{
+	FILE *f = fopen(file, "r");
+	char line[512];
+	unsigned regressions = 0;
+
+	if(f == NULL)
+	{
+		fprintf(stderr, "%s: %s\n", file, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	printf("\n%-20s %-10s %10s %10s %8s\n", "ROM", "Config", "Baseline",
+	       "Median", "Change");
+
+	/* Skip the header. */
+	if(fgets(line, sizeof(line), f) == NULL)
+		goto out;
+
+	while(fgets(line, sizeof(line), f) != NULL)
+	{
+		char rom[256], config[32];
+		double median;
+		double change;
+
+		if(sscanf(line, "%255[^,],%31[^,],%*u,%*u,%lf", rom, config,
+				&median) != 3)
+			continue;
+
+		for(size_t i = 0; i < count; i++)
+		{
+			if(strcmp(base_name(res[i].rom), rom) != 0 ||
+					strcmp(res[i].config->name, config) != 0)
+				continue;
+
+			change = (res[i].fps_median - median) / median * 100.0;
+			printf("%-20s %-10s %10.1f %10.1f %+7.1f%%%s\n", rom,
+			       config, median, res[i].fps_median, change,
+			       change < -opt->threshold ? " REGRESSION" : "");
+
+			if(change < -opt->threshold)
+				regressions++;
+		}
+	}
+
+out:
+	fclose(f);
+	return regressions;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [-f FRAMES] [-r RUNS] [-w WARMUP] [-c CONFIGS] "
+		"[-o CSV] [-j JSON]\n"
+		"	[-b BASELINE] [-t PERCENT] ROM...\n"
+		"  -f FRAMES	Frames in each run. Default 10000.\n"
+		"  -r RUNS	Measured runs of each case. Default 9.\n"
+		"  -w WARMUP	Runs made before measuring. Default 1.\n"
+		"  -c CONFIGS	Comma separated configurations to run. Default\n"
+		"		all of:",
+		name);
+
+	for(size_t c = 0; c < CONFIG_COUNT; c++)
+		fprintf(stderr, " %s", configs[c].name);
+
+	fprintf(stderr, "\n"
+		"  -o CSV	Write results to CSV file.\n"
+		"  -j JSON	Write results and frame time histograms to JSON\n"
+		"		file.\n"
+		"  -b BASELINE	Compare to CSV file of an earlier run. Fails if\n"
+		"		any case is slower than the threshold.\n"
+		"  -t PERCENT	Threshold of slowdown in median frame rate.\n"
+		"		Default 5.\n");
+}
+
+static int parse_configs(const char *list, unsigned long *set)
+{
+	const char *p = list;
+
+	*set = 0;
+
+	while(*p != '\0')
+	{
+		const size_t len = strcspn(p, ",");
+		size_t c;
+
+		for(c = 0; c < CONFIG_COUNT; c++)
+		{
+			if(strlen(configs[c].name) == len &&
+					strncmp(configs[c].name, p, len) == 0)
+				break;
+		}
+
+		if(c == CONFIG_COUNT)
+		{
+			fprintf(stderr, "Unknown configuration: %.*s\n",
+				(int)len, p);
+			return -1;
+		}
+
+		*set |= 1UL << c;
+		p += len;
+
+		if(*p == ',')
+			p++;
+	}
+
+	return *set == 0 ? -1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct options opt = {
+		.frames = 10000,
+		.runs = 9,
+		.warmup = 1,
+		.configs = (1UL << CONFIG_COUNT) - 1,
+		.threshold = 5.0
+	};
+	struct result *res;
+	size_t count = 0;
+	double *fps, *frame_us;
+	int status = EXIT_SUCCESS;
+	int o;
+
+	while((o = getopt(argc, argv, "f:r:w:c:o:j:b:t:")) != -1)
+	{
+		switch(o)
+		{
+		case 'f':
+			opt.frames = strtoul(optarg, NULL, 0);
+			break;
+
+		case 'r':
+			opt.runs = strtoul(optarg, NULL, 0);
+			break;
+
+		case 'w':
+			opt.warmup = strtoul(optarg, NULL, 0);
+			break;
+
+		case 'c':
+			if(parse_configs(optarg, &opt.configs) != 0)
+				return EXIT_FAILURE;
+
+			break;
+
+		case 'o':
+			opt.csv = optarg;
+			break;
+
+		case 'j':
+			opt.json = optarg;
+			break;
+
+		case 'b':
+			opt.baseline = optarg;
+			break;
+
+		case 't':
+			opt.threshold = strtod(optarg, NULL);
+			break;
+
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if(optind == argc || opt.frames == 0 || opt.runs == 0)
+	{
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	res = calloc((argc - optind) * CONFIG_COUNT, sizeof(*res));
+	fps = malloc(opt.runs * sizeof(*fps));
+	frame_us = malloc(opt.runs * opt.frames * sizeof(*frame_us));
+
+	if(res == NULL || fps == NULL || frame_us == NULL)
+	{
+		fprintf(stderr, "Unable to allocate memory\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("%-20s %-10s %10s %10s %10s %9s %9s %9s\n", "ROM", "Config",
+	       "Median FPS", "P5 FPS", "P95 FPS", "P50 us", "P99 us",
+	       "Max us");
+
+	for(int r = optind; r < argc; r++)
+	{
+		uint8_t *rom = read_rom_to_ram(argv[r]);
+
+		if(rom == NULL)
+		{
+			fprintf(stderr, "%s: %s\n", argv[r], strerror(errno));
+			return EXIT_FAILURE;
+		}
+
+		for(size_t c = 0; c < CONFIG_COUNT; c++)
+		{
+			struct result *cur = &res[count];
+
+			if(!(opt.configs & (1UL << c)))
+				continue;
+
+			cur->rom = argv[r];
+			cur->config = &configs[c];
+			bench(&opt, rom, cur, fps, frame_us);
+			count++;
+
+			printf("%-20s %-10s %10.1f %10.1f %10.1f %9.2f %9.2f "
+			       "%9.2f\n", base_name(cur->rom),
+			       cur->config->name, cur->fps_median, cur->fps_p5,
+			       cur->fps_p95, cur->frame_p50, cur->frame_p99,
+			       cur->frame_max);
+			fflush(stdout);
+		}
+
+		free(rom);
+	}
+
+	if(opt.csv != NULL && write_csv(opt.csv, &opt, res, count) != 0)
+	{
+		fprintf(stderr, "%s: %s\n", opt.csv, strerror(errno));
+		status = EXIT_FAILURE;
+	}
+
+	if(opt.json != NULL && write_json(opt.json, &opt, res, count) != 0)
+	{
+		fprintf(stderr, "%s: %s\n", opt.json, strerror(errno));
+		status = EXIT_FAILURE;
+	}
+
+	if(opt.baseline != NULL && compare(opt.baseline, &opt, res, count))
+		status = EXIT_FAILURE;
+
+	free(frame_us);
+	free(fps);
+	free(res);
+	return status;
+}
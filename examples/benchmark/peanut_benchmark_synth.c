@@ -0,0 +1,404 @@
+/**
+ * Benchmarks the floating point, fixed-point and band-limited synthesis
+ * paths of minigb_apu, and measures the aliasing of each. Also benchmarks
+ * resampling to several output rates. Checks that the fixed-point path is
+ * close to the floating point path, and that resampling neither loses nor
+ * gains samples.
+ *
+ * The APU is driven directly by a pseudo-random sequence of register writes
+ * that triggers every channel with random frequencies, envelopes, lengths,
+ * sweeps and panning, so no ROM is required.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "../sdl2/minigb_apu/minigb_apu.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* Clock cycles in a frame. */
+#define FRAME_CYCLES	70224
+
+/* The paths round the timing of their counters differently, so the phase of
+ * each channel slowly drifts apart between them. The APU is reset after this
+ * many frames, and the paths compared over each short sequence. */
+#define CASE_FRAMES	5
+
+/* Lowest signal to noise ratio of the fixed-point path that is accepted. */
+#define MIN_SNR_DB	25.0
+
+struct script
+{
+	uint32_t seed;
+};
+
+static uint32_t rnd(struct script *s)
+{
+	s->seed = s->seed * 1103515245 + 12345;
+	return s->seed >> 8;
+}
+
+/**
+ * Queue the register writes of one frame to ctx.
+ */
+static void script_frame(struct script *s, struct minigb_apu_ctx *ctx)
+{
+	/* Base address of the registers of each channel. */
+	static const uint16_t base[4] = { 0xFF10, 0xFF15, 0xFF1A, 0xFF1F };
+	unsigned writes = rnd(s) % 4;
+	uint32_t cycle = 0;
+
+	for(unsigned w = 0; w < writes; w++)
+	{
+		const unsigned ch = rnd(s) % 4;
+		const uint16_t freq = rnd(s) % 2048;
+
+		cycle += rnd(s) % (FRAME_CYCLES / 4);
+
+		switch(rnd(s) % 8)
+		{
+		case 0:
+			/* Master volume and panning. */
+			minigb_apu_audio_write_at(ctx, cycle, 0xFF24,
+						  rnd(s) & 0x77);
+			minigb_apu_audio_write_at(ctx, cycle, 0xFF25,
+						  rnd(s) & 0xFF);
+			break;
+
+		case 1:
+			/* Wave pattern. */
+			minigb_apu_audio_write_at(ctx, cycle,
+						  0xFF30 + rnd(s) % 16,
+						  rnd(s) & 0xFF);
+			break;
+
+		default:
+			/* Trigger a channel. */
+			if(ch == 0)
+				minigb_apu_audio_write_at(ctx, cycle, 0xFF10,
+							  rnd(s) & 0x7F);
+
+			if(ch == 2)
+			{
+				minigb_apu_audio_write_at(ctx, cycle, 0xFF1A,
+							  0x80);
+				minigb_apu_audio_write_at(ctx, cycle, 0xFF1C,
+							  rnd(s) & 0x60);
+			}
+			else
+				minigb_apu_audio_write_at(ctx, cycle,
+							  base[ch] + 2,
+							  rnd(s) | 0x10);
+
+			minigb_apu_audio_write_at(ctx, cycle, base[ch] + 1,
+						  rnd(s) & 0xFF);
+			minigb_apu_audio_write_at(ctx, cycle, base[ch] + 3,
+					ch == 3 ? (rnd(s) & 0xDF) : freq & 0xFF);
+			minigb_apu_audio_write_at(ctx, cycle, base[ch] + 4,
+					0x80 | (rnd(s) & 0x40) | (freq >> 8));
+			break;
+		}
+	}
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Compare the output of both paths over the given number of frames.
+ *
+ * \return	signal to noise ratio of the fixed-point path in dB.
+ */
+static double accuracy(unsigned long frames, double *max_err)
+{
+	static struct minigb_apu_ctx fctx, xctx;
+	static float fsamples[MINIGB_APU_MAX_FRAME_SAMPLES * 2];
+	static int16_t xsamples[MINIGB_APU_MAX_FRAME_SAMPLES * 2];
+	struct script fs = { 1 }, xs = { 1 };
+	double signal = 0.0, noise = 0.0;
+
+	*max_err = 0.0;
+
+	for(unsigned long f = 0; f < frames; f++)
+	{
+		unsigned len;
+
+		if(f % CASE_FRAMES == 0)
+		{
+			minigb_apu_audio_init(&fctx);
+			minigb_apu_audio_init(&xctx);
+		}
+
+		script_frame(&fs, &fctx);
+		script_frame(&xs, &xctx);
+		len = minigb_apu_end_frame(&fctx, FRAME_CYCLES, fsamples);
+
+		if(minigb_apu_end_frame_s16(&xctx, FRAME_CYCLES, xsamples) !=
+				len)
+			return 0.0;
+
+		for(unsigned i = 0; i < len * 2; i++)
+		{
+			const double err = xsamples[i] / 32768.0 - fsamples[i];
+
+			signal += (double)fsamples[i] * fsamples[i];
+			noise += err * err;
+
+			if(fabs(err) > *max_err)
+				*max_err = fabs(err);
+		}
+	}
+
+	return 10.0 * log10(signal / noise);
+}
+
+enum path
+{
+	PATH_FLOAT,
+	PATH_FIXED,
+	PATH_BLIP,
+	PATH_COUNT
+};
+
+/**
+ * Render one frame with the given path.
+ *
+ * \return	number of stereo samples made.
+ */
+static unsigned render_frame(struct minigb_apu_ctx *ctx, enum path path,
+			     float *fsamples, int16_t *xsamples)
+{
+	switch(path)
+	{
+	case PATH_FIXED:
+		return minigb_apu_end_frame_s16(ctx, FRAME_CYCLES, xsamples);
+
+	case PATH_BLIP:
+		return minigb_apu_end_frame_blip(ctx, FRAME_CYCLES, fsamples);
+
+	default:
+		return minigb_apu_end_frame(ctx, FRAME_CYCLES, fsamples);
+	}
+}
+
+/**
+ * Render the given number of frames with one of the paths.
+ *
+ * \return	time taken in seconds.
+ */
+static double bench(unsigned long frames, enum path path)
+{
+	static struct minigb_apu_ctx ctx;
+	static float fsamples[MINIGB_APU_MAX_FRAME_SAMPLES * 2];
+	static int16_t xsamples[MINIGB_APU_MAX_FRAME_SAMPLES * 2];
+	struct script s = { 1 };
+	double start;
+
+	minigb_apu_audio_init(&ctx);
+	start = now();
+
+	for(unsigned long f = 0; f < frames; f++)
+	{
+		script_frame(&s, &ctx);
+		render_frame(&ctx, path, fsamples, xsamples);
+	}
+
+	return now() - start;
+}
+
+/**
+ * Render the given number of frames with the band-limited path, and resample
+ * them to the given rate. Stores the number of stereo samples made in made.
+ *
+ * \return	time taken in seconds.
+ */
+static double bench_rate(unsigned long frames, unsigned rate,
+			 unsigned long *made)
+{
+	static struct minigb_apu_ctx ctx;
+	static struct minigb_apu_resampler r;
+	static float samples[MINIGB_APU_MAX_FRAME_SAMPLES * 2];
+	/* Enough for resampling to 192 kHz. */
+	static float out[(MINIGB_APU_MAX_FRAME_SAMPLES * 4 + 1) * 2];
+	struct script s = { 1 };
+	double start;
+
+	minigb_apu_audio_init(&ctx);
+	minigb_apu_resampler_init(&r, AUDIO_SAMPLE_RATE, rate);
+	*made = 0;
+	start = now();
+
+	for(unsigned long f = 0; f < frames; f++)
+	{
+		unsigned len;
+
+		script_frame(&s, &ctx);
+		len = minigb_apu_end_frame_blip(&ctx, FRAME_CYCLES, samples);
+		*made += minigb_apu_resample(&r, samples, len, out);
+	}
+
+	return now() - start;
+}
+
+/**
+ * Play a 1024 Hz square wave with the given path, and return the power of
+ * the left output at frequencies that are not harmonics of the note, relative
+ * to the power at the harmonics, in dB. Harmonics above the Nyquist frequency
+ * alias to these frequencies.
+ */
+static double aliasing(enum path path)
+{
+	/* 0.1 seconds, for a resolution of 10 Hz. */
+	enum { N = 4800 };
+	const double pi = 3.14159265358979323846;
+	static struct minigb_apu_ctx ctx;
+	static float fsamples[MINIGB_APU_MAX_FRAME_SAMPLES * 2];
+	static int16_t xsamples[MINIGB_APU_MAX_FRAME_SAMPLES * 2];
+	static double in[N], twiddle[N];
+	double harmonic = 0.0, other = 0.0;
+	unsigned n = 0;
+
+	minigb_apu_audio_init(&ctx);
+
+	/* Channel 2 at full volume with 50% duty, and a frequency register
+	 * of 1920. */
+	minigb_apu_audio_write_at(&ctx, 0, 0xFF16, 0x80);
+	minigb_apu_audio_write_at(&ctx, 0, 0xFF17, 0xF0);
+	minigb_apu_audio_write_at(&ctx, 0, 0xFF18, 0x80);
+	minigb_apu_audio_write_at(&ctx, 0, 0xFF19, 0x87);
+
+	/* Let the high-pass filter settle before analysing the output. */
+	for(unsigned f = 0; f < 30; f++)
+		render_frame(&ctx, path, fsamples, xsamples);
+
+	while(n < N)
+	{
+		const unsigned len = render_frame(&ctx, path, fsamples,
+						  xsamples);
+
+		for(unsigned i = 0; i < len && n < N; i++, n++)
+		{
+			/* Blackman-Harris window, so that the leakage of the
+			 * harmonics is below the aliasing being measured. */
+			const double a = 2.0 * pi * n / N;
+			const double window = 0.35875 - 0.48829 * cos(a) +
+				0.14128 * cos(2.0 * a) - 0.01168 * cos(3.0 * a);
+
+			in[n] = window * (path == PATH_FIXED ?
+					xsamples[i * 2] / 32768.0 :
+					fsamples[i * 2]);
+		}
+	}
+
+	for(unsigned i = 0; i < N; i++)
+		twiddle[i] = 2.0 * pi * i / N;
+
+	/* Skip frequencies below 100 Hz, which the high-pass filter
+	 * affects. */
+	for(unsigned k = 10; k < N / 2; k++)
+	{
+		const double hz = k * AUDIO_SAMPLE_RATE / N;
+		const double nearest = 1024.0 * floor(hz / 1024.0 + 0.5);
+		double re = 0.0, im = 0.0;
+
+		for(unsigned i = 0; i < N; i++)
+		{
+			const double a = twiddle[(unsigned long)k * i % N];
+			re += in[i] * cos(a);
+			im -= in[i] * sin(a);
+		}
+
+		/* The window spreads each harmonic over a few bins. */
+		if(fabs(hz - nearest) <= 50.0)
+			harmonic += re * re + im * im;
+		else
+			other += re * re + im * im;
+	}
+
+	return 10.0 * log10(other / harmonic);
+}
+
+int main(int argc, char **argv)
+{
+	/* Output rates that the cost of resampling is measured at. */
+	static const unsigned rates[] = { 32000, 44100, 48000, 96000 };
+	unsigned long frames = 36000;
+	const char *const name[PATH_COUNT] = {
+		"Floating point", "Fixed-point", "Band-limited"
+	};
+	double snr, max_err;
+
+	switch(argc)
+	{
+	case 2:
+		frames = strtoul(argv[1], NULL, 0);
+		/* Fall-through */
+	case 1:
+		break;
+
+	default:
+		fprintf(stderr, "%s [FRAMES]\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	if(frames == 0)
+	{
+		fprintf(stderr, "At least one frame required\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for(int path = 0; path < PATH_COUNT; path++)
+	{
+		const double duration = bench(frames, path);
+		const double samples = frames * AUDIO_SAMPLE_RATE /
+				       VERTICAL_SYNC;
+
+		printf("%-15s %8.3f s, %12.0f samples/s, %8.1fx real time, "
+		       "aliasing %6.1f dB\n",
+		       name[path], duration, samples / duration,
+		       samples / duration / AUDIO_SAMPLE_RATE,
+		       aliasing(path));
+	}
+
+	for(unsigned i = 0; i < sizeof(rates) / sizeof(*rates); i++)
+	{
+		unsigned long made;
+		const double duration = bench_rate(frames, rates[i], &made);
+		/* The fraction of a sample left over by each frame must be
+		 * carried to the next, so that none are lost or gained. */
+		const double expected = frames * FRAME_CYCLES * rates[i] /
+			DMG_CLOCK_FREQ;
+
+		printf("Resampled to %6u Hz %8.3f s, %12.0f samples/s, "
+		       "%8.1fx real time\n",
+		       rates[i], duration, made / duration,
+		       frames / VERTICAL_SYNC / duration);
+
+		if(fabs(made - expected) > 1.0)
+		{
+			fprintf(stderr, "Made %lu samples at %u Hz, but "
+				"expected %.0f\n", made, rates[i], expected);
+			return EXIT_FAILURE;
+		}
+	}
+
+	snr = accuracy(frames, &max_err);
+	printf("Fixed-point SNR %.1f dB, maximum error %.4f\n", snr, max_err);
+
+	if(snr < MIN_SNR_DB)
+	{
+		fprintf(stderr, "Fixed-point path differs from floating point "
+			"path by more than %.0f dB\n", MIN_SNR_DB);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,527 @@
+/**
+ * Writes small ROMs that each stress one costly part of the emulator, to be
+ * used as reproducible inputs to the other benchmarks without needing any
+ * commercial ROM.
+ *
+ * The ROMs are assembled here from machine code, and have valid header and
+ * global checksums so that gb_init() accepts them. Each runs the same loop
+ * forever, so any number of frames may be benchmarked.
+ */
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Locations in bank 0 of the common code and data. */
+#define VBLANK_VECTOR	0x0040
+#define STAT_VECTOR	0x0048
+#define TIMER_VECTOR	0x0050
+#define SERIAL_VECTOR	0x0058
+#define ENTRY_ADDR	0x0100
+#define TITLE_ADDR	0x0134
+#define INIT_ADDR	0x0150
+#define COPY_ADDR	0x0800
+#define DMA_ADDR	0x0810
+#define HANDLER_ADDR	0x0900
+#define TILE_ADDR	0x1000
+#define MAP_ADDR	0x1100
+#define OAM_ADDR	0x1500
+
+#define TILE_BYTES	0x100
+#define MAP_BYTES	0x400
+#define OAM_BYTES	0xA0
+#define DMA_BYTES	8
+#define HRAM_DMA	0xFF80
+
+/* Registers, as offsets from 0xFF00 for LDH. */
+#define REG_SB		0x01
+#define REG_SC		0x02
+#define REG_TIMA	0x05
+#define REG_TMA		0x06
+#define REG_TAC		0x07
+#define REG_LCDC	0x40
+#define REG_STAT	0x41
+#define REG_SCY		0x42
+#define REG_SCX		0x43
+#define REG_LY		0x44
+#define REG_BGP		0x47
+#define REG_OBP0	0x48
+#define REG_OBP1	0x49
+#define REG_WY		0x4A
+#define REG_WX		0x4B
+#define REG_IE		0xFF
+
+/* Opcodes used more than once. */
+#define OP_JR_NZ	0x20
+#define OP_JR_Z		0x28
+#define OP_JR		0x18
+#define OP_HALT		0x76
+#define OP_RETI		0xD9
+#define OP_EI		0xFB
+#define OP_PUSH_AF	0xF5
+#define OP_POP_AF	0xF1
+
+struct rom
+{
+	uint8_t *data;
+	size_t size;
+	/* Offset in data of the next byte emitted. */
+	size_t at;
+};
+
+struct scenario
+{
+	const char *name;
+	const char *description;
+	/* Cartridge type and ROM size bytes of the header. */
+	uint8_t cart_type;
+	uint8_t rom_size;
+	/* Emits the code run after the common initialisation. */
+	void (*emit)(struct rom *r);
+};
+
+/**
+ * Emit count bytes, given as int arguments.
+ */
+static void emit(struct rom *r, unsigned count, ...)
+{
+	va_list ap;
+
+	va_start(ap, count);
+
+	while(count--)
+		r->data[r->at++] = (uint8_t)va_arg(ap, int);
+
+	va_end(ap);
+}
+
+/**
+ * Write val to the register at 0xFF00 + reg with LD A, val and LDH (reg), A.
+ */
+static void emit_ldh(struct rom *r, uint8_t reg, uint8_t val)
+{
+	emit(r, 4, 0x3E, val, 0xE0, reg);
+}
+
+/**
+ * Emit a relative jump to target, which must be within 128 bytes.
+ */
+static void emit_jr(struct rom *r, uint8_t op, size_t target)
+{
+	const long disp = (long)target - (long)(r->at + 2);
+
+	if(disp < -128 || disp > 127)
+	{
+		fprintf(stderr, "Jump out of range at %04zX\n", r->at);
+		abort();
+	}
+
+	emit(r, 2, op, (int)(disp & 0xFF));
+}
+
+/**
+ * Copy BC bytes from DE to HL with the routine at COPY_ADDR.
+ */
+static void emit_copy(struct rom *r, uint16_t dst, uint16_t src,
+		      uint16_t len)
+{
+	emit(r, 3, 0x21, dst & 0xFF, dst >> 8);		/* LD HL, dst */
+	emit(r, 3, 0x11, src & 0xFF, src >> 8);		/* LD DE, src */
+	emit(r, 3, 0x01, len & 0xFF, len >> 8);		/* LD BC, len */
+	emit(r, 3, 0xCD, COPY_ADDR & 0xFF, COPY_ADDR >> 8); /* CALL copy */
+}
+
+/**
+ * Point an interrupt vector to a handler at addr.
+ */
+static void emit_vector(struct rom *r, size_t vector, uint16_t addr)
+{
+	r->at = vector;
+	emit(r, 3, 0xC3, addr & 0xFF, addr >> 8);	/* JP addr */
+}
+
+/**
+ * Emit the code and data shared by all scenarios: the entry point, a copy
+ * routine, and initialisation that loads tiles, both tile maps and the
+ * palettes with the LCD off. Code following INIT_ADDR is emitted by the
+ * scenario.
+ */
+static void emit_common(struct rom *r)
+{
+	uint32_t seed = 0x2F6B1D3A;
+	size_t loop;
+
+	/* Interrupts return at once unless a scenario handles them. */
+	for(size_t v = VBLANK_VECTOR; v <= SERIAL_VECTOR; v += 8)
+		r->data[v] = OP_RETI;
+
+	r->at = ENTRY_ADDR;
+	emit(r, 4, 0x00, 0xC3, INIT_ADDR & 0xFF, INIT_ADDR >> 8);
+
+	/* Copy routine. */
+	r->at = COPY_ADDR;
+	loop = r->at;
+	emit(r, 6, 0x1A, 0x22, 0x13, 0x0B, 0x78, 0xB1);	/* LD A, (DE) ... */
+	emit_jr(r, OP_JR_NZ, loop);
+	emit(r, 1, 0xC9);				/* RET */
+
+	/* OAM DMA routine, copied to HRAM. */
+	r->at = DMA_ADDR;
+	emit(r, 4, 0xE0, 0x46, 0x3E, 0x28);	/* LDH (DMA), A; LD A, 40 */
+	emit(r, 4, 0x3D, OP_JR_NZ, 0xFD, 0xC9);	/* DEC A; JR NZ; RET */
+
+	/* Tiles of pseudo-random pixels, and maps using all 16 of them. */
+	for(unsigned i = 0; i < TILE_BYTES; i++)
+	{
+		seed = seed * 1103515245 + 12345;
+		r->data[TILE_ADDR + i] = seed >> 16;
+	}
+
+	for(unsigned i = 0; i < MAP_BYTES; i++)
+		r->data[MAP_ADDR + i] = ((i & 31) + (i >> 5) * 3) & 15;
+
+	r->at = INIT_ADDR;
+	emit(r, 1, 0xF3);				/* DI */
+	emit(r, 3, 0x31, 0xFE, 0xFF);			/* LD SP, FFFE */
+	emit_ldh(r, REG_LCDC, 0x00);
+	emit_copy(r, 0x8000, TILE_ADDR, TILE_BYTES);
+	emit_copy(r, 0x9800, MAP_ADDR, MAP_BYTES);
+	emit_copy(r, 0x9C00, MAP_ADDR, MAP_BYTES);
+	emit_ldh(r, REG_BGP, 0xE4);
+	emit_ldh(r, REG_OBP0, 0xE4);
+	emit_ldh(r, REG_OBP1, 0x1B);
+}
+
+/**
+ * Wait for interrupts forever.
+ */
+static void emit_halt_loop(struct rom *r)
+{
+	const size_t loop = r->at;
+
+	emit(r, 1, OP_HALT);
+	emit_jr(r, OP_JR, loop);
+}
+
+/**
+ * 40 8x16 sprites, ten on each of four bands of lines, copied to OAM by DMA
+ * and moved every frame.
+ */
+static void emit_sprites(struct rom *r)
+{
+	size_t loop;
+
+	for(unsigned i = 0; i < OAM_BYTES / 4; i++)
+	{
+		uint8_t *o = &r->data[OAM_ADDR + i * 4];
+
+		o[0] = 16 + (i / 10) * 36;	/* Y */
+		o[1] = 8 + (i % 10) * 16;	/* X */
+		o[2] = (i * 2) & 15;		/* Tile */
+		o[3] = (i & 1) << 4 | (i & 2) << 4; /* Palette and X flip. */
+	}
+
+	emit_copy(r, 0xC000, OAM_ADDR, OAM_BYTES);
+	emit_copy(r, HRAM_DMA, DMA_ADDR, DMA_BYTES);
+	emit_ldh(r, REG_LCDC, 0x97);
+	emit_ldh(r, REG_IE, 0x01);
+	emit(r, 1, OP_EI);
+	emit_halt_loop(r);
+
+	/* Start DMA, then move each sprite right by one pixel. */
+	emit_vector(r, VBLANK_VECTOR, HANDLER_ADDR);
+	r->at = HANDLER_ADDR;
+	emit(r, 3, OP_PUSH_AF, 0xE5, 0xC5);		/* PUSH AF, HL, BC */
+	emit(r, 2, 0x3E, 0xC0);				/* LD A, C0 */
+	emit(r, 3, 0xCD, HRAM_DMA & 0xFF, HRAM_DMA >> 8); /* CALL DMA */
+	emit(r, 3, 0x21, 0x01, 0xC0);			/* LD HL, C001 */
+	emit(r, 2, 0x06, OAM_BYTES / 4);		/* LD B, 40 */
+	loop = r->at;
+	emit(r, 5, 0x34, 0x7D, 0xC6, 0x04, 0x6F);	/* INC (HL); L += 4 */
+	emit(r, 1, 0x05);				/* DEC B */
+	emit_jr(r, OP_JR_NZ, loop);
+	emit(r, 4, 0xC1, 0xE1, OP_POP_AF, OP_RETI);
+}
+
+/**
+ * Window over part of every line, with SCX and WX changed by the STAT
+ * interrupt in the HBLANK of each line, and SCY changed every frame.
+ */
+static void emit_window(struct rom *r)
+{
+	emit_ldh(r, REG_WY, 0);
+	emit_ldh(r, REG_WX, 87);
+	emit_ldh(r, REG_STAT, 0x08);
+	emit_ldh(r, REG_LCDC, 0xF1);
+	emit_ldh(r, REG_IE, 0x03);
+	emit(r, 1, OP_EI);
+	emit_halt_loop(r);
+
+	emit_vector(r, STAT_VECTOR, HANDLER_ADDR);
+	r->at = HANDLER_ADDR;
+	emit(r, 1, OP_PUSH_AF);
+	emit(r, 4, 0xF0, REG_LY, 0xE0, REG_SCX);	/* SCX = LY */
+	emit(r, 4, 0xE6, 0x3F, 0xC6, 0x07);		/* A = (A & 3F) + 7 */
+	emit(r, 2, 0xE0, REG_WX);			/* WX = A */
+	emit(r, 2, OP_POP_AF, OP_RETI);
+
+	emit_vector(r, VBLANK_VECTOR, HANDLER_ADDR + 0x20);
+	r->at = HANDLER_ADDR + 0x20;
+	emit(r, 1, OP_PUSH_AF);
+	emit(r, 5, 0xF0, REG_SCY, 0x3C, 0xE0, REG_SCY); /* SCY++ */
+	emit(r, 2, OP_POP_AF, OP_RETI);
+}
+
+/**
+ * Switch to each ROM bank in turn, calling a routine in each, with the
+ * register layout of MBC1 or MBC5.
+ */
+static void emit_banks(struct rom *r, unsigned banks, int mbc5)
+{
+	size_t loop;
+
+	for(unsigned b = 1; b < banks; b++)
+	{
+		uint8_t *code = &r->data[b * 0x4000];
+
+		code[0] = 0x3E;		/* LD A, b */
+		code[1] = b;
+		code[2] = 0xC9;		/* RET */
+	}
+
+	emit_ldh(r, REG_LCDC, 0x91);
+	emit(r, 2, 0x06, 0x01);				/* LD B, 1 */
+	loop = r->at;
+	emit(r, 4, 0x78, 0xEA, 0x00, 0x20);		/* LD (2000), B */
+
+	if(mbc5)
+		emit(r, 4, 0xAF, 0xEA, 0x00, 0x30);	/* LD (3000), 0 */
+
+	emit(r, 3, 0xCD, 0x00, 0x40);			/* CALL 4000 */
+	emit(r, 4, 0x04, 0x78, 0xFE, banks);		/* INC B; CP banks */
+	emit_jr(r, OP_JR_NZ, loop);
+	emit(r, 2, 0x06, 0x01);				/* LD B, 1 */
+	emit_jr(r, OP_JR, loop);
+}
+
+static void emit_mbc1(struct rom *r)
+{
+	emit_banks(r, 32, 0);
+}
+
+static void emit_mbc5(struct rom *r)
+{
+	emit_banks(r, 64, 1);
+}
+
+/**
+ * Sleep in HALT until each VBLANK interrupt.
+ */
+static void emit_halt(struct rom *r)
+{
+	emit_ldh(r, REG_LCDC, 0x91);
+	emit_ldh(r, REG_IE, 0x01);
+	emit(r, 1, OP_EI);
+	emit_halt_loop(r);
+}
+
+/**
+ * Poll LY for the start and end of VBLANK, with interrupts disabled.
+ */
+static void emit_poll(struct rom *r)
+{
+	size_t wait_start, wait_end;
+
+	emit_ldh(r, REG_LCDC, 0x91);
+	wait_start = r->at;
+	emit(r, 4, 0xF0, REG_LY, 0xFE, 144);		/* LDH A, (LY); CP */
+	emit_jr(r, OP_JR_NZ, wait_start);
+	wait_end = r->at;
+	emit(r, 4, 0xF0, REG_LY, 0xFE, 144);
+	emit_jr(r, OP_JR_Z, wait_end);
+	emit_jr(r, OP_JR, wait_start);
+}
+
+/**
+ * A timer interrupt every 128 clock cycles, and serial transfers started
+ * again by each serial interrupt.
+ */
+static void emit_timer(struct rom *r)
+{
+	emit_ldh(r, REG_LCDC, 0x91);
+	emit_ldh(r, REG_TMA, 0xF8);
+	emit_ldh(r, REG_TIMA, 0xF8);
+	emit_ldh(r, REG_TAC, 0x05);
+	emit_ldh(r, REG_SB, 0x55);
+	emit_ldh(r, REG_SC, 0x81);
+	emit_ldh(r, REG_IE, 0x0C);
+	emit(r, 1, OP_EI);
+	emit_halt_loop(r);
+
+	/* Count timer interrupts in HRAM. */
+	emit_vector(r, TIMER_VECTOR, HANDLER_ADDR);
+	r->at = HANDLER_ADDR;
+	emit(r, 1, OP_PUSH_AF);
+	emit(r, 5, 0xF0, 0x80, 0x3C, 0xE0, 0x80);	/* (FF80)++ */
+	emit(r, 2, OP_POP_AF, OP_RETI);
+
+	/* Send the next byte. */
+	emit_vector(r, SERIAL_VECTOR, HANDLER_ADDR + 0x20);
+	r->at = HANDLER_ADDR + 0x20;
+	emit(r, 1, OP_PUSH_AF);
+	emit(r, 5, 0xF0, REG_SB, 0x3C, 0xE0, REG_SB);	/* SB++ */
+	emit_ldh(r, REG_SC, 0x81);
+	emit(r, 2, OP_POP_AF, OP_RETI);
+}
+
+static const struct scenario scenarios[] = {
+	{ "sprites", "40 8x16 sprites moved by OAM DMA every frame",
+	  0x00, 0x00, emit_sprites },
+	{ "window", "Window, with SCX and WX changed on every line",
+	  0x00, 0x00, emit_window },
+	{ "mbc1", "MBC1 ROM bank switch and call into the bank",
+	  0x01, 0x04, emit_mbc1 },
+	{ "mbc5", "MBC5 ROM bank switch and call into the bank",
+	  0x19, 0x05, emit_mbc5 },
+	{ "halt", "HALT until each VBLANK interrupt",
+	  0x00, 0x00, emit_halt },
+	{ "poll", "Busy poll of LY for VBLANK",
+	  0x00, 0x00, emit_poll },
+	{ "timer", "Timer interrupt every 128 cycles, with serial transfers",
+	  0x00, 0x00, emit_timer },
+};
+
+#define SCENARIO_COUNT	(sizeof(scenarios) / sizeof(*scenarios))
+
+/**
+ * Write the title and checksums of the header.
+ */
+static void finish_header(struct rom *r, const char *name)
+{
+	char title[16];
+	uint16_t global = 0;
+	uint8_t x = 0;
+
+	snprintf(title, sizeof(title), "STRESS %s", name);
+
+	for(size_t i = 0; title[i] != '\0'; i++)
+	{
+		const char c = title[i];
+		r->data[TITLE_ADDR + i] = c >= 'a' && c <= 'z' ? c - 32 : c;
+	}
+
+	for(size_t i = 0x134; i <= 0x14C; i++)
+		x = x - r->data[i] - 1;
+
+	r->data[0x14D] = x;
+
+	for(size_t i = 0; i < r->size; i++)
+	{
+		if(i != 0x14E && i != 0x14F)
+			global += r->data[i];
+	}
+
+	r->data[0x14E] = global >> 8;
+	r->data[0x14F] = global & 0xFF;
+}
+
+/**
+ * Assemble the ROM of a scenario and write it to DIR/stress-NAME.gb.
+ */
+static int write_rom(const struct scenario *s, const char *dir)
+{
+	struct rom r;
+	char path[4096];
+	FILE *f;
+	int ret = -1;
+
+	r.size = (size_t)0x8000 << s->rom_size;
+	r.at = 0;
+
+	if((r.data = calloc(r.size, 1)) == NULL)
+		return -1;
+
+	r.data[0x147] = s->cart_type;
+	r.data[0x148] = s->rom_size;
+	emit_common(&r);
+	s->emit(&r);
+	finish_header(&r, s->name);
+
+	snprintf(path, sizeof(path), "%s/stress-%s.gb", dir, s->name);
+
+	if((f = fopen(path, "wb")) == NULL)
+	{
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		goto out;
+	}
+
+	if(fwrite(r.data, 1, r.size, f) != r.size || fclose(f) != 0)
+	{
+		fprintf(stderr, "%s: write failed\n", path);
+		goto out;
+	}
+
+	printf("%s\n", path);
+	ret = 0;
+
+out:
+	free(r.data);
+	return ret;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s DIR [SCENARIO...]\n"
+		"Writes DIR/stress-SCENARIO.gb for each scenario, or for all "
+		"of them:\n", name);
+
+	for(size_t i = 0; i < SCENARIO_COUNT; i++)
+		fprintf(stderr, "  %-8s %s\n", scenarios[i].name,
+			scenarios[i].description);
+}
+
+int main(int argc, char **argv)
+{
+	if(argc < 2)
+	{
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if(argc == 2)
+	{
+		for(size_t i = 0; i < SCENARIO_COUNT; i++)
+		{
+			if(write_rom(&scenarios[i], argv[1]) != 0)
+				return EXIT_FAILURE;
+		}
+
+		return EXIT_SUCCESS;
+	}
+
+	for(int a = 2; a < argc; a++)
+	{
+		size_t i;
+
+		for(i = 0; i < SCENARIO_COUNT; i++)
+		{
+			if(strcmp(argv[a], scenarios[i].name) == 0)
+				break;
+		}
+
+		if(i == SCENARIO_COUNT)
+		{
+			fprintf(stderr, "Unknown scenario: %s\n", argv[a]);
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+
+		if(write_rom(&scenarios[i], argv[1]) != 0)
+			return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,587 @@
+/**
+ * MIT License
+ * Copyright (c) 2018 Mahyar Koshkouei
+ *
+ * Renders the tracks of a Game Boy Sound System (GBS) file to WAV files,
+ * without any video output and as fast as possible.
+ *
+ * A GBS file holds the music code and data of a game, and the addresses of
+ * its init and play routines. It is mapped into a ROM made on the fly, with
+ * a small driver that calls the init routine with the track number, and then
+ * calls the play routine from the VBLANK or timer interrupt as the GBS file
+ * requests. The ROM uses MBC5 with cart RAM, so that the music code may
+ * switch ROM banks and use RAM at 0xA000.
+ *
+ * Each track is rendered by its own emulator and minigb_apu context, and the
+ * tracks are shared between a number of threads.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#define ENABLE_SOUND 1
+#define ENABLE_LCD 0
+
+#include "../sdl2/minigb_apu/minigb_apu.h"
+
+#include "../../peanut_gb.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Size of the GBS header, after which the data to load follows. */
+#define GBS_HEADER_SIZE		0x70
+
+/* Location of the driver in the ROM. The GBS data must be loaded after it. */
+#define DRIVER_ADDR		0x0150
+#define DRIVER_END		0x0200
+
+/* Location of the operand of the instruction loading the track number into
+ * A, which is replaced for each track. */
+#define DRIVER_TRACK_ADDR	(DRIVER_ADDR + 13)
+
+/* Size of cart RAM, mapped at 0xA000. */
+#define GBS_CART_RAM_SIZE	0x2000
+
+/* Output of each track is written in chunks of this many frames. */
+#define WAV_CHUNK_FRAMES	60
+
+struct gbs
+{
+	/* ROM made from the GBS file. Shared by all tracks. */
+	uint8_t *rom;
+	size_t rom_len;
+
+	unsigned songs;
+	unsigned first_song;
+	char title[33];
+	char author[33];
+};
+
+struct priv_t
+{
+	const struct gbs *gbs;
+	/* Track number passed to the init routine, starting from zero. */
+	uint8_t track;
+	uint8_t cart_ram[GBS_CART_RAM_SIZE];
+	struct minigb_apu_ctx apu;
+	/* Set if the music code caused an emulation error. */
+	unsigned failed;
+};
+
+struct job
+{
+	const struct gbs *gbs;
+	const char *prefix;
+	unsigned long frames;
+	/* Next track to render. Shared by all threads. */
+	unsigned next;
+	/* Set if any track failed. */
+	unsigned failed;
+};
+
+uint8_t gb_rom_read(struct gb_s *gb, const uint_fast32_t addr)
+{
+	const struct priv_t * const p = gb->direct.priv;
+
+	if(addr == DRIVER_TRACK_ADDR)
+		return p->track;
+
+	return p->gbs->rom[addr];
+}
+
+uint8_t gb_cart_ram_read(struct gb_s *gb, const uint_fast32_t addr)
+{
+	const struct priv_t * const p = gb->direct.priv;
+	return p->cart_ram[addr];
+}
+
+void gb_cart_ram_write(struct gb_s *gb, const uint_fast32_t addr,
+		       const uint8_t val)
+{
+	struct priv_t * const p = gb->direct.priv;
+	p->cart_ram[addr] = val;
+}
+
+/**
+ * Stop rendering the track. Music code that crashes usually does so by
+ * running off into data.
+ */
+void gb_error(struct gb_s *gb, const enum gb_error_e gb_err, const uint16_t val)
+{
+	struct priv_t * const p = gb->direct.priv;
+
+	if(!p->failed)
+		fprintf(stderr, "Track %u: error %d at %04X\n", p->track + 1,
+			gb_err, val);
+
+	p->failed = 1;
+}
+
+uint8_t audio_read(struct gb_s *gb, const uint16_t addr)
+{
+	struct priv_t * const p = gb->direct.priv;
+	return minigb_apu_audio_read(&p->apu, addr);
+}
+
+void audio_write(struct gb_s *gb, const uint16_t addr, const uint8_t val)
+{
+	struct priv_t * const p = gb->direct.priv;
+	minigb_apu_audio_write_at(&p->apu, gb_get_frame_cycles(gb), addr, val);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint16_t read_le16(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static void write_le16(uint8_t *p, const uint16_t val)
+{
+	p[0] = val & 0xFF;
+	p[1] = val >> 8;
+}
+
+static void write_le32(uint8_t *p, const uint32_t val)
+{
+	write_le16(p, val & 0xFFFF);
+	write_le16(p + 2, val >> 16);
+}
+
+/**
+ * Make a ROM that runs the music code of a GBS file.
+ *
+ * \return	0 on success, or -1 if the GBS file is invalid.
+ */
+static int gbs_load(struct gbs *gbs, const uint8_t *file, size_t len)
+{
+	uint16_t load, init, play, sp;
+	uint8_t tma, tac;
+	size_t data_len;
+	uint8_t *rom;
+	unsigned rom_size_code = 0;
+
+	if(len < GBS_HEADER_SIZE || memcmp(file, "GBS", 3) != 0 ||
+			file[0x03] != 1 || file[0x04] == 0)
+		return -1;
+
+	gbs->songs = file[0x04];
+	gbs->first_song = file[0x05];
+	load = read_le16(file + 0x06);
+	init = read_le16(file + 0x08);
+	play = read_le16(file + 0x0A);
+	sp = read_le16(file + 0x0C);
+	tma = file[0x0E];
+	tac = file[0x0F];
+	memcpy(gbs->title, file + 0x10, 32);
+	gbs->title[32] = '\0';
+	memcpy(gbs->author, file + 0x30, 32);
+	gbs->author[32] = '\0';
+
+	data_len = len - GBS_HEADER_SIZE;
+
+	/* The data must be loaded after the driver and within the ROM. */
+	if(load < DRIVER_END || load >= 0x8000)
+		return -1;
+
+	/* Size of the ROM must be a power of two of at least 32 KiB, and MBC5
+	 * supports at most 8 MiB. */
+	while(((size_t)0x8000 << rom_size_code) < load + data_len)
+	{
+		if(++rom_size_code > 8)
+			return -1;
+	}
+
+	gbs->rom_len = (size_t)0x8000 << rom_size_code;
+
+	if((rom = malloc(gbs->rom_len)) == NULL)
+		return -1;
+
+	/* RST 0xFF, which is the opcode 0xFF, is run from unused space. */
+	memset(rom, 0xFF, gbs->rom_len);
+	memcpy(rom + load, file + GBS_HEADER_SIZE, data_len);
+
+	/* RST instructions jump to the same offset from the load address. */
+	for(unsigned rst = 0x00; rst <= 0x38; rst += 0x08)
+	{
+		rom[rst] = 0xC3;	/* JP nn */
+		write_le16(rom + rst + 1, load + rst);
+	}
+
+	/* Interrupt vectors. The play routine is called from VBLANK or the
+	 * timer, and the others return straight away. */
+	for(unsigned irq = 0x40; irq <= 0x60; irq += 0x08)
+	{
+		if(irq == 0x40 || irq == 0x50)
+		{
+			rom[irq] = 0xCD;	/* CALL nn */
+			write_le16(rom + irq + 1, play);
+			rom[irq + 3] = 0xD9;	/* RETI */
+		}
+		else
+			rom[irq] = 0xD9;	/* RETI */
+	}
+
+	/* Entry point. */
+	rom[0x100] = 0x00;	/* NOP */
+	rom[0x101] = 0xC3;	/* JP nn */
+	write_le16(rom + 0x102, DRIVER_ADDR);
+
+	/* Cartridge header. The Nintendo logo is not checked. */
+	memset(rom + 0x134, 0, 0x150 - 0x134);
+	memcpy(rom + 0x134, "PEANUT-GBS", 10);
+	rom[0x147] = 0x1A;	/* MBC5 with RAM. */
+	rom[0x148] = rom_size_code;
+	rom[0x149] = 0x02;	/* 8 KiB of cart RAM. */
+
+	{
+		uint8_t x = 0;
+
+		for(unsigned i = 0x134; i <= 0x14C; i++)
+			x = x - rom[i] - 1;
+
+		rom[0x14D] = x;
+	}
+
+	/* Driver. */
+	{
+		const uint8_t driver[] = {
+			0xF3,			/* DI */
+			0x31, sp & 0xFF, sp >> 8,	/* LD SP, sp */
+			0x3E, tma,		/* LD A, tma */
+			0xE0, 0x06,		/* LDH (TMA), A */
+			0x3E, tac & 0x07,	/* LD A, tac */
+			0xE0, 0x07,		/* LDH (TAC), A */
+			0x3E, 0x00,		/* LD A, track */
+			0xCD, init & 0xFF, init >> 8,	/* CALL init */
+			/* Enable the timer interrupt if bit 2 of TAC is set,
+			 * or the VBLANK interrupt otherwise. */
+			0x3E, (tac & 0x04) ? 0x04 : 0x01, /* LD A, IE */
+			0xE0, 0xFF,		/* LDH (IE), A */
+			0xAF,			/* XOR A */
+			0xE0, 0x0F,		/* LDH (IF), A */
+			0xFB,			/* EI */
+			0x76,			/* HALT */
+			0x18, 0xFD		/* JR -3 */
+		};
+
+		memcpy(rom + DRIVER_ADDR, driver, sizeof(driver));
+	}
+
+	gbs->rom = rom;
+	return 0;
+}
+
+/**
+ * Write the header of a WAV file holding the given number of stereo 16-bit
+ * samples.
+ */
+static int wav_write_header(FILE *f, const uint32_t samples)
+{
+	const uint32_t rate = (uint32_t)AUDIO_SAMPLE_RATE;
+	const uint32_t data_len = samples * 4;
+	uint8_t h[44];
+
+	memcpy(h, "RIFF", 4);
+	write_le32(h + 4, 36 + data_len);
+	memcpy(h + 8, "WAVEfmt ", 8);
+	write_le32(h + 16, 16);
+	write_le16(h + 20, 1);		/* PCM */
+	write_le16(h + 22, 2);		/* Channels */
+	write_le32(h + 24, rate);
+	write_le32(h + 28, rate * 4);	/* Bytes per second */
+	write_le16(h + 32, 4);		/* Bytes per sample */
+	write_le16(h + 34, 16);		/* Bits per sample */
+	memcpy(h + 36, "data", 4);
+	write_le32(h + 40, data_len);
+
+	return fwrite(h, sizeof(h), 1, f) == 1 ? 0 : -1;
+}
+
+/**
+ * Render a track to a WAV file.
+ *
+ * \return	0 on success, or -1 on error.
+ */
+static int render_track(const struct job *job, struct priv_t *p,
+			unsigned track)
+{
+	static const unsigned max = MINIGB_APU_MAX_FRAME_SAMPLES;
+	struct gb_s gb;
+	float samples[MINIGB_APU_MAX_FRAME_SAMPLES * 2];
+	int16_t *out;
+	char name[FILENAME_MAX];
+	uint32_t total = 0;
+	unsigned len = 0;
+	int ret = -1;
+	FILE *f;
+	double start;
+
+	snprintf(name, sizeof(name), "%s-%02u.wav", job->prefix, track + 1);
+
+	out = malloc(WAV_CHUNK_FRAMES * max * 2 * sizeof(*out));
+
+	if(out == NULL || (f = fopen(name, "wb")) == NULL)
+	{
+		fprintf(stderr, "%s: %s\n", name, strerror(errno));
+		free(out);
+		return -1;
+	}
+
+	memset(p, 0, sizeof(*p));
+	p->gbs = job->gbs;
+	p->track = track;
+	minigb_apu_audio_init(&p->apu);
+
+	/* Memory is not initialised by gb_init(). Clear it so that each
+	 * render of a track is the same. */
+	memset(&gb, 0, sizeof(gb));
+
+	if(gb_init(&gb, &gb_rom_read, &gb_cart_ram_read, &gb_cart_ram_write,
+			&gb_error, p) != GB_INIT_NO_ERROR)
+		goto out;
+
+	/* The header is written again once the length is known. */
+	if(wav_write_header(f, 0) != 0)
+		goto out;
+
+	start = now();
+
+	for(unsigned long frame = 0; frame < job->frames && !p->failed;
+			frame++)
+	{
+		unsigned n;
+
+		gb_run_frame(&gb);
+		n = minigb_apu_end_frame_blip(&p->apu,
+				LCD_VERT_LINES * LCD_LINE_CYCLES, samples);
+
+		/* WAV files are always little endian. */
+		for(unsigned i = 0; i < n * 2; i++)
+		{
+			const float s = samples[i] * 32767.0f;
+			const int16_t v = s > 32767.0f ? 32767 :
+					  s < -32768.0f ? -32768 : (int16_t)s;
+			write_le16((uint8_t *)&out[len * 2 + i], (uint16_t)v);
+		}
+
+		len += n;
+
+		if(len > (WAV_CHUNK_FRAMES - 1) * max ||
+				frame + 1 == job->frames)
+		{
+			if(fwrite(out, len * 4, 1, f) != 1)
+				goto out;
+
+			total += len;
+			len = 0;
+		}
+	}
+
+	if(fseek(f, 0, SEEK_SET) != 0 || wav_write_header(f, total) != 0)
+		goto out;
+
+	printf("Track %u: %s, %.1f s in %.3f s\n", track + 1, name,
+	       total / AUDIO_SAMPLE_RATE, now() - start);
+	ret = p->failed ? -1 : 0;
+
+out:
+	if(ret != 0 && !p->failed)
+		fprintf(stderr, "%s: unable to render\n", name);
+
+	fclose(f);
+	free(out);
+	return ret;
+}
+
+/**
+ * Render tracks until none are left.
+ */
+static void *worker_run(void *arg)
+{
+	struct job *job = arg;
+	/* The APU context is too large for the stack of a thread. */
+	struct priv_t *p = malloc(sizeof(*p));
+
+	if(p == NULL)
+	{
+		__atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	for(;;)
+	{
+		const unsigned track = __atomic_fetch_add(&job->next, 1,
+							  __ATOMIC_RELAXED);
+
+		if(track >= job->gbs->songs)
+			break;
+
+		if(render_track(job, p, track) != 0)
+			__atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+	}
+
+	free(p);
+	return NULL;
+}
+
+/**
+ * Returns a pointer to the allocated space containing the file, and stores
+ * its size in len. Must be freed.
+ */
+static uint8_t *read_file(const char *file_name, size_t *len)
+{
+	FILE *f = fopen(file_name, "rb");
+	uint8_t *buf = NULL;
+	long size;
+
+	if(f == NULL)
+		return NULL;
+
+	if(fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) < 0)
+		goto out;
+
+	rewind(f);
+
+	if((buf = malloc(size)) == NULL)
+		goto out;
+
+	if(fread(buf, size, 1, f) != 1)
+	{
+		free(buf);
+		buf = NULL;
+		goto out;
+	}
+
+	*len = size;
+
+out:
+	fclose(f);
+	return buf;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [-s SECONDS] [-t THREADS] [-o PREFIX] [-n TRACK] "
+		"GBS\n"
+		"  -s SECONDS	Length of each track. Default 180.\n"
+		"  -t THREADS	Number of tracks rendered at once. Default is\n"
+		"		the number of processors.\n"
+		"  -o PREFIX	Tracks are written to PREFIX-NN.wav. Default\n"
+		"		\"track\".\n"
+		"  -n TRACK	Render only track number TRACK, from 1.\n",
+		name);
+}
+
+int main(int argc, char **argv)
+{
+	struct gbs gbs = { 0 };
+	struct job job = { 0 };
+	unsigned threads = (unsigned)sysconf(_SC_NPROCESSORS_ONLN);
+	double seconds = 180.0;
+	unsigned only = 0;
+	pthread_t *workers = NULL;
+	uint8_t *file;
+	size_t len = 0;
+	double start;
+	int opt;
+
+	job.prefix = "track";
+
+	while((opt = getopt(argc, argv, "s:t:o:n:")) != -1)
+	{
+		switch(opt)
+		{
+		case 's':
+			seconds = strtod(optarg, NULL);
+			break;
+
+		case 't':
+			threads = strtoul(optarg, NULL, 0);
+			break;
+
+		case 'o':
+			job.prefix = optarg;
+			break;
+
+		case 'n':
+			only = strtoul(optarg, NULL, 0);
+			break;
+
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if(optind != argc - 1 || threads == 0 || seconds <= 0.0)
+	{
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if((file = read_file(argv[optind], &len)) == NULL)
+	{
+		fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	if(gbs_load(&gbs, file, len) != 0)
+	{
+		fprintf(stderr, "%s: not a supported GBS file\n",
+			argv[optind]);
+		free(file);
+		return EXIT_FAILURE;
+	}
+
+	free(file);
+	printf("%s by %s, %u tracks\n", gbs.title, gbs.author, gbs.songs);
+
+	job.gbs = &gbs;
+	job.frames = (unsigned long)(seconds * VERTICAL_SYNC + 0.5);
+
+	if(only != 0)
+	{
+		if(only > gbs.songs)
+		{
+			fprintf(stderr, "Track %u does not exist\n", only);
+			goto out;
+		}
+
+		/* Start from the track, and stop after it. */
+		job.next = only - 1;
+		gbs.songs = only;
+	}
+
+	if(threads > gbs.songs - job.next)
+		threads = gbs.songs - job.next;
+
+	if((workers = calloc(threads, sizeof(*workers))) == NULL)
+		goto out;
+
+	start = now();
+
+	for(unsigned t = 0; t < threads; t++)
+		pthread_create(&workers[t], NULL, worker_run, &job);
+
+	for(unsigned t = 0; t < threads; t++)
+		pthread_join(workers[t], NULL);
+
+	printf("Rendered in %.3f s\n", now() - start);
+
+out:
+	free(workers);
+	free(gbs.rom);
+	return job.failed || workers == NULL ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,209 @@
+/**
+ * MIT License
+ * Copyright (c) 2018 Mahyar Koshkouei
+ *
+ * Hands a running session over to another process. See migrate.h for
+ * details.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "migrate.h"
+
+#define MIGRATE_MAGIC	0x3247494Du	/* "MIG2" */
+
+/* Acknowledgements sent by the receiver. */
+#define MIGRATE_RESUMED		1
+#define MIGRATE_REJECTED	0
+
+static int send_all(const int fd, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	while(len > 0)
+	{
+		const ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+
+		if(n < 0)
+		{
+			if(errno == EINTR)
+				continue;
+
+			return -1;
+		}
+
+		p += n;
+		len -= (size_t)n;
+	}
+
+	return 0;
+}
+
+static int recv_all(const int fd, void *buf, size_t len)
+{
+	uint8_t *p = buf;
+
+	while(len > 0)
+	{
+		const ssize_t n = recv(fd, p, len, 0);
+
+		if(n < 0)
+		{
+			if(errno == EINTR)
+				continue;
+
+			return -1;
+		}
+
+		if(n == 0)
+		{
+			errno = ECONNRESET;
+			return -1;
+		}
+
+		p += n;
+		len -= (size_t)n;
+	}
+
+	return 0;
+}
+
+static int socket_address(const char *path, struct sockaddr_un *addr)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+
+	if(strlen(path) >= sizeof(addr->sun_path))
+	{
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	strcpy(addr->sun_path, path);
+	return 0;
+}
+
+int migrate_listen(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if(socket_address(path, &addr) != 0)
+		return -1;
+
+	if((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return -1;
+
+	unlink(path);
+
+	if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+			listen(fd, 1) != 0)
+	{
+		const int err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+
+	return fd;
+}
+
+int migrate_accept(int listen_fd, struct migrate_header *hdr,
+		   void *state, void *ram)
+{
+	struct migrate_header recv_hdr;
+	int fd;
+
+	while((fd = accept(listen_fd, NULL, NULL)) < 0)
+	{
+		if(errno != EINTR)
+			return -1;
+	}
+
+	if(recv_all(fd, &recv_hdr, sizeof(recv_hdr)) != 0)
+		goto err;
+
+	if(recv_hdr.magic != MIGRATE_MAGIC ||
+			recv_hdr.state_len != hdr->state_len ||
+			recv_hdr.ram_len != hdr->ram_len ||
+			recv_hdr.rom_hash != hdr->rom_hash)
+	{
+		const uint8_t ack = MIGRATE_REJECTED;
+		send_all(fd, &ack, sizeof(ack));
+		errno = EINVAL;
+		goto err;
+	}
+
+	if(recv_all(fd, state, recv_hdr.state_len) != 0 ||
+			recv_all(fd, ram, recv_hdr.ram_len) != 0)
+		goto err;
+
+	*hdr = recv_hdr;
+	return fd;
+
+err:
+	{
+		const int err = errno;
+		close(fd);
+		errno = err;
+	}
+
+	return -1;
+}
+
+int migrate_resumed(int fd)
+{
+	const uint8_t ack = MIGRATE_RESUMED;
+	int ret = send_all(fd, &ack, sizeof(ack));
+
+	close(fd);
+	return ret;
+}
+
+int migrate_send(const char *path, const struct migrate_header *hdr,
+		 const void *state, const void *ram)
+{
+	struct migrate_header send_hdr = *hdr;
+	struct sockaddr_un addr;
+	uint8_t ack;
+	int fd;
+
+	if(socket_address(path, &addr) != 0)
+		return -1;
+
+	if((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return -1;
+
+	send_hdr.magic = MIGRATE_MAGIC;
+
+	if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+			send_all(fd, &send_hdr, sizeof(send_hdr)) != 0 ||
+			send_all(fd, state, hdr->state_len) != 0 ||
+			send_all(fd, ram, hdr->ram_len) != 0 ||
+			recv_all(fd, &ack, sizeof(ack)) != 0)
+		goto err;
+
+	if(ack != MIGRATE_RESUMED)
+	{
+		errno = EINVAL;
+		goto err;
+	}
+
+	close(fd);
+	return 0;
+
+err:
+	{
+		const int err = errno;
+		close(fd);
+		errno = err;
+	}
+
+	return -1;
+}
@@ -0,0 +1,71 @@
+/**
+ * MIT License
+ * Copyright (c) 2018 Mahyar Koshkouei
+ *
+ * Hands a running session over to another process through a Unix domain
+ * socket.
+ *
+ * The receiving process loads the ROM and listens on a socket before the
+ * session is moved, so that only the emulator state, cart RAM and input state
+ * are sent. The sending process pauses after a frame, sends the session, and
+ * waits until the receiver has restored the session and is about to run the
+ * next frame. The time between pausing and that acknowledgement is the time
+ * for which the player sees the game stop.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct migrate_header
+{
+	uint32_t magic;
+	uint32_t state_len;
+	uint32_t ram_len;
+	/* Joypad state held by the front-end when the session was paused. */
+	uint8_t joypad;
+	uint8_t reserved[3];
+	/* Hash of the ROM, so that a session is only resumed with the same
+	 * ROM. */
+	uint64_t rom_hash;
+	/* Number of frames run in the session. */
+	uint64_t frames;
+};
+
+/**
+ * Listen for a session on the socket at path, replacing any existing socket
+ * file.
+ *
+ * \return	listening socket, or -1 on error with errno set.
+ */
+int migrate_listen(const char *path);
+
+/**
+ * Wait for a session to be sent to a listening socket, and read it. The
+ * session is rejected if the lengths or ROM hash do not match those in hdr.
+ * On success, the session must be acknowledged with migrate_resumed() once it
+ * has been restored.
+ *
+ * \param hdr	expected lengths and ROM hash. Filled with the received
+ *		header on success.
+ * \return	connection to the sender, or -1 on error with errno set.
+ */
+int migrate_accept(int listen_fd, struct migrate_header *hdr,
+		   void *state, void *ram);
+
+/**
+ * Tell the sender that the session was restored, and close the connection.
+ */
+int migrate_resumed(int fd);
+
+/**
+ * Send a session to the process listening on path, and wait until it has been
+ * resumed there.
+ *
+ * \return	0 if the session was resumed by the receiver, or -1 on error
+ *		with errno set. The session should continue to run in this
+ *		process on error.
+ */
+int migrate_send(const char *path, const struct migrate_header *hdr,
+		 const void *state, const void *ram);
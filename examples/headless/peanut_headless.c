@@ -0,0 +1,587 @@
+/**
+ * MIT License
+ * Copyright (c) 2018 Mahyar Koshkouei
+ *
+ * Runs a ROM without any video or audio output. Save states may be loaded
+ * before and saved after running a number of frames, using the same state
+ * store as the SDL2 example. A running session may also be handed over to
+ * another instance of this program. This is useful for running many
+ * instances of the emulator, or for checking that the emulator is
+ * deterministic.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#define ENABLE_SOUND 0
+#define ENABLE_LCD 0
+#define ENABLE_STATE_HASH 1
+#define ENABLE_STATS 1
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../../peanut_gb.h"
+#include "../sdl2/state_store/state_store.h"
+#include "migrate.h"
+
+struct priv_t
+{
+	/* Pointer to allocated memory holding GB file. */
+	uint8_t *rom;
+	/* Size of the GB file in bytes. */
+	size_t rom_size;
+	/* Pointer to allocated memory holding save file. */
+	uint8_t *cart_ram;
+	/* Set when the game polled the joypad. */
+	unsigned warm_start_polled;
+};
+
+/* Maximum number of frames to wait for the game to poll the joypad before
+ * giving up on taking a warm start snapshot. */
+#define WARM_START_MAX_FRAMES	(60 * 60)
+
+/**
+ * Returns a byte from the ROM file at the given address.
+ */
+uint8_t gb_rom_read(struct gb_s *gb, const uint_fast32_t addr)
+{
+	const struct priv_t * const p = gb->direct.priv;
+	return p->rom[addr];
+}
+
+/**
+ * Returns a byte from the cartridge RAM at the given address.
+ */
+uint8_t gb_cart_ram_read(struct gb_s *gb, const uint_fast32_t addr)
+{
+	const struct priv_t * const p = gb->direct.priv;
+	return p->cart_ram[addr];
+}
+
+/**
+ * Writes a given byte to the cartridge RAM at the given address.
+ */
+void gb_cart_ram_write(struct gb_s *gb, const uint_fast32_t addr,
+		const uint8_t val)
+{
+	const struct priv_t * const p = gb->direct.priv;
+	p->cart_ram[addr] = val;
+}
+
+/**
+ * Returns a pointer to the allocated space containing the ROM. Must be freed.
+ */
+uint8_t *read_rom_to_ram(const char *file_name, size_t *size)
+{
+	FILE *rom_file = fopen(file_name, "rb");
+	size_t rom_size;
+	uint8_t *rom = NULL;
+
+	if(rom_file == NULL)
+		return NULL;
+
+	fseek(rom_file, 0, SEEK_END);
+	rom_size = ftell(rom_file);
+	rewind(rom_file);
+	rom = malloc(rom_size);
+
+	if(fread(rom, sizeof(uint8_t), rom_size, rom_file) != rom_size)
+	{
+		free(rom);
+		fclose(rom_file);
+		return NULL;
+	}
+
+	fclose(rom_file);
+	*size = rom_size;
+	return rom;
+}
+
+/**
+ * Print the error and abort.
+ */
+void gb_error(struct gb_s *gb, const enum gb_error_e gb_err, const uint16_t val)
+{
+	const char* gb_err_str[4] = {
+		"UNKNOWN",
+		"INVALID OPCODE",
+		"INVALID READ",
+		"INVALID WRITE"
+	};
+	fprintf(stderr, "Error %d occurred: %s at %04X\n. Abort.\n",
+			gb_err,
+			gb_err >= GB_INVALID_MAX ?
+				gb_err_str[0] : gb_err_str[gb_err],
+			val);
+
+	/* Unused parameters. */
+	(void)gb;
+
+	abort();
+}
+
+/**
+ * Returns a monotonic time in seconds.
+ */
+double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Replace the emulator context with a loaded one. Callbacks and values set
+ * directly by the front-end are kept.
+ */
+void restore_state(struct gb_s *gb, struct gb_s *loaded)
+{
+	loaded->gb_rom_read = gb->gb_rom_read;
+	loaded->gb_cart_ram_read = gb->gb_cart_ram_read;
+	loaded->gb_cart_ram_write = gb->gb_cart_ram_write;
+	loaded->gb_error = gb->gb_error;
+	loaded->gb_serial_tx = gb->gb_serial_tx;
+	loaded->gb_serial_rx = gb->gb_serial_rx;
+	loaded->gb_joypad_poll = gb->gb_joypad_poll;
+	loaded->display.lcd_draw_line = gb->display.lcd_draw_line;
+	loaded->direct = gb->direct;
+	/* Cached hashes do not match the loaded memory. */
+	loaded->hash.valid = 0;
+	*gb = *loaded;
+}
+
+/**
+ * Load the emulator context and cart RAM from the state store.
+ */
+int load_state(struct gb_s *gb, struct state_store *st, const char *key)
+{
+	struct priv_t *priv = gb->direct.priv;
+	struct gb_s loaded;
+
+	if(state_store_get(st, key, &loaded, sizeof(loaded),
+			   priv->cart_ram, gb_get_save_size(gb)) != 0)
+		return -1;
+
+	restore_state(gb, &loaded);
+	return 0;
+}
+
+/**
+ * Returns a hash of the whole ROM.
+ */
+uint64_t rom_hash(struct gb_s *gb)
+{
+	const struct priv_t *priv = gb->direct.priv;
+	return state_store_hash(priv->rom, priv->rom_size);
+}
+
+/**
+ * Wait for a session to be handed over from another process, and resume it.
+ */
+int receive_session(struct gb_s *gb, const char *path,
+		    unsigned long long *session_frames)
+{
+	struct priv_t *priv = gb->direct.priv;
+	struct migrate_header hdr = { 0 };
+	struct gb_s loaded;
+	double start;
+	int listen_fd, fd;
+
+	if((listen_fd = migrate_listen(path)) < 0)
+		return -1;
+
+	printf("Waiting for session on %s\n", path);
+	hdr.state_len = sizeof(loaded);
+	hdr.ram_len = gb_get_save_size(gb);
+	hdr.rom_hash = rom_hash(gb);
+	fd = migrate_accept(listen_fd, &hdr, &loaded, priv->cart_ram);
+	close(listen_fd);
+	unlink(path);
+
+	if(fd < 0)
+		return -1;
+
+	start = now();
+	restore_state(gb, &loaded);
+	gb->direct.joypad = hdr.joypad;
+	*session_frames = hdr.frames;
+
+	if(migrate_resumed(fd) != 0)
+		return -1;
+
+	printf("Resumed session at frame %llu in %.3f ms\n", *session_frames,
+	       (now() - start) * 1e3);
+	return 0;
+}
+
+/**
+ * Hand the session over to the process listening on path. The pause seen by
+ * the player is measured from the end of the last frame run here until the
+ * other process is ready to run the next frame.
+ */
+int send_session(struct gb_s *gb, const char *path,
+		 const unsigned long long session_frames)
+{
+	const struct priv_t *priv = gb->direct.priv;
+	struct migrate_header hdr = { 0 };
+	const double start = now();
+	double pause;
+
+	hdr.state_len = sizeof(*gb);
+	hdr.ram_len = gb_get_save_size(gb);
+	hdr.joypad = gb->direct.joypad;
+	hdr.rom_hash = rom_hash(gb);
+	hdr.frames = session_frames;
+
+	if(migrate_send(path, &hdr, gb, priv->cart_ram) != 0)
+		return -1;
+
+	pause = (now() - start) * 1e3;
+	printf("Handed over session at frame %llu to %s. Paused for %.3f ms "
+	       "(frame time %.3f ms)\n", session_frames, path, pause,
+	       1000.0 / VERTICAL_SYNC);
+	return 0;
+}
+
+/**
+ * Called when the game first polls the joypad while a warm start snapshot is
+ * pending.
+ */
+void warm_start_poll(struct gb_s *gb)
+{
+	struct priv_t *priv = gb->direct.priv;
+	priv->warm_start_polled = 1;
+}
+
+/**
+ * Restore the warm start snapshot of the ROM, or run the ROM until the
+ * snapshot should be taken and store it. The snapshot is taken after a given
+ * number of frames, or if trigger is "poll", at the end of the frame in which
+ * the game first polled the joypad.
+ */
+int warm_start(struct gb_s *gb, struct state_store *st, const char *trigger)
+{
+	struct priv_t *priv = gb->direct.priv;
+	char key[STATE_STORE_KEY_MAX + 1];
+	unsigned long frames = 0;
+	unsigned long max_frames;
+	double start = now();
+
+	/* The snapshot depends on the ROM, the contents of cart RAM when the
+	 * game started, and when the snapshot was taken. */
+	snprintf(key, sizeof(key), "warm-%016llX-%016llX-%016llX-%s",
+		 (unsigned long long)state_store_hash(priv->rom + 0x0134,
+						      0x014E - 0x0134),
+		 (unsigned long long)rom_hash(gb),
+		 (unsigned long long)state_store_hash(priv->cart_ram,
+						      gb_get_save_size(gb)),
+		 trigger);
+
+	if(load_state(gb, st, key) == 0)
+	{
+		printf("Warm started from %s in %.3f ms\n", key,
+		       (now() - start) * 1e3);
+		return 0;
+	}
+
+	if(errno != ENOENT)
+		return -1;
+
+	if(strcmp(trigger, "poll") == 0)
+	{
+		max_frames = WARM_START_MAX_FRAMES;
+		priv->warm_start_polled = 0;
+		gb_init_joypad(gb, &warm_start_poll);
+	}
+	else if((max_frames = strtoul(trigger, NULL, 0)) == 0)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	while(frames < max_frames && !priv->warm_start_polled)
+	{
+		gb_run_frame(gb);
+		frames++;
+	}
+
+	if(gb->gb_joypad_poll != NULL)
+	{
+		gb_init_joypad(gb, NULL);
+
+		/* Give up if the game never polled the joypad. */
+		if(!priv->warm_start_polled)
+		{
+			printf("Joypad not polled after %lu frames; no warm "
+			       "start snapshot taken\n", frames);
+			return 0;
+		}
+	}
+
+	if(state_store_put(st, key, gb, sizeof(*gb), priv->cart_ram,
+			   gb_get_save_size(gb)) < 0)
+		return -1;
+
+	printf("Stored warm start %s after %lu frames in %.3f s\n", key,
+	       frames, now() - start);
+	return 0;
+}
+
+/**
+ * Writes the statistics of a frame as a line of CSV.
+ */
+static void write_stats(FILE *f, const unsigned long long frame,
+			const struct gb_stats_s *st)
+{
+	fprintf(f, "%llu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu\n", frame,
+		(unsigned long)st->instructions, (unsigned long)st->cycles,
+		(unsigned long)st->halt_cycles,
+		(unsigned long)st->lines_drawn,
+		(unsigned long)st->lines_skipped,
+		(unsigned long)st->rom_reads,
+		(unsigned long)st->cart_ram_reads,
+		(unsigned long)st->cart_ram_writes,
+		(unsigned long)st->apu_writes,
+		(unsigned long)st->bank_switches);
+}
+
+void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [-n FRAMES] [-d DIR] [-W TRIGGER] [-l KEY] [-s KEY] "
+		"[-R SOCKET] [-M SOCKET] [-H] [-S FILE] ROM\n"
+		"  -n FRAMES	Number of frames to run. Default 3600.\n"
+		"  -d DIR	Save state store directory. Default \"states\".\n"
+		"  -W TRIGGER	Restore a snapshot of the ROM taken after TRIGGER\n"
+		"		frames, or when the joypad is first polled if\n"
+		"		TRIGGER is \"poll\". The snapshot is taken and\n"
+		"		stored if it does not exist.\n"
+		"  -l KEY	Load save state KEY before running.\n"
+		"  -s KEY	Save state to KEY after running.\n"
+		"  -R SOCKET	Wait for a session to be handed over on the\n"
+		"		Unix socket SOCKET before running.\n"
+		"  -M SOCKET	Hand the session over to the process waiting\n"
+		"		on SOCKET after running.\n"
+		"  -H		Print hash of emulator state after running.\n"
+		"  -S FILE	Write the statistics of each frame to FILE as\n"
+		"		CSV.\n",
+		name);
+}
+
+int main(int argc, char **argv)
+{
+	struct gb_s gb;
+	struct priv_t priv = { NULL, 0, NULL, 0 };
+	struct state_store *st = NULL;
+	const char *store_dir = "states";
+	const char *load_key = NULL;
+	const char *save_key = NULL;
+	const char *warm_trigger = NULL;
+	const char *receive_path = NULL;
+	const char *send_path = NULL;
+	const char *stats_path = NULL;
+	FILE *stats_file = NULL;
+	unsigned long frames = 3600;
+	/* Frames run since the start of the session, including frames run by
+	 * other processes before the session was handed over. */
+	unsigned long long session_frames = 0;
+	int print_hash = 0;
+	enum gb_init_error_e gb_ret;
+	int ret = EXIT_FAILURE;
+	double start;
+	int opt;
+
+	while((opt = getopt(argc, argv, "n:d:W:l:s:R:M:HS:")) != -1)
+	{
+		switch(opt)
+		{
+		case 'n':
+			frames = strtoul(optarg, NULL, 0);
+			break;
+
+		case 'd':
+			store_dir = optarg;
+			break;
+
+		case 'W':
+			warm_trigger = optarg;
+			break;
+
+		case 'l':
+			load_key = optarg;
+			break;
+
+		case 's':
+			save_key = optarg;
+			break;
+
+		case 'R':
+			receive_path = optarg;
+			break;
+
+		case 'M':
+			send_path = optarg;
+			break;
+
+		case 'H':
+			print_hash = 1;
+			break;
+
+		case 'S':
+			stats_path = optarg;
+			break;
+
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if(optind != argc - 1)
+	{
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if((priv.rom = read_rom_to_ram(argv[optind],
+					  &priv.rom_size)) == NULL)
+	{
+		fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno));
+		goto out;
+	}
+
+	/* Memory is not initialised by gb_init(). Clear it so that runs of the
+	 * same ROM are repeatable. */
+	memset(&gb, 0, sizeof(gb));
+	gb_ret = gb_init(&gb, &gb_rom_read, &gb_cart_ram_read,
+			 &gb_cart_ram_write, &gb_error, &priv);
+
+	if(gb_ret != GB_INIT_NO_ERROR)
+	{
+		fprintf(stderr, "Error: %d\n", gb_ret);
+		goto out;
+	}
+
+	if((priv.cart_ram = malloc(gb_get_save_size(&gb) + 1)) == NULL)
+		goto out;
+
+	memset(priv.cart_ram, 0xFF, gb_get_save_size(&gb));
+
+	if(load_key != NULL || save_key != NULL || warm_trigger != NULL)
+	{
+		if((st = state_store_open(store_dir)) == NULL)
+		{
+			fprintf(stderr, "%s: %s\n", store_dir, strerror(errno));
+			goto out;
+		}
+	}
+
+	if(warm_trigger != NULL && warm_start(&gb, st, warm_trigger) != 0)
+	{
+		fprintf(stderr, "Unable to warm start: %s\n", strerror(errno));
+		goto out;
+	}
+
+	if(load_key != NULL)
+	{
+		start = now();
+
+		if(load_state(&gb, st, load_key) != 0)
+		{
+			fprintf(stderr, "Unable to load state %s: %s\n",
+				load_key, strerror(errno));
+			goto out;
+		}
+
+		printf("Loaded state %s in %.3f ms\n", load_key,
+		       (now() - start) * 1e3);
+	}
+
+	if(receive_path != NULL &&
+			receive_session(&gb, receive_path, &session_frames) != 0)
+	{
+		fprintf(stderr, "Unable to receive session: %s\n",
+			strerror(errno));
+		goto out;
+	}
+
+	if(stats_path != NULL)
+	{
+		if((stats_file = fopen(stats_path, "w")) == NULL)
+		{
+			fprintf(stderr, "%s: %s\n", stats_path, strerror(errno));
+			goto out;
+		}
+
+		fputs("frame,instructions,cycles,halt_cycles,lines_drawn,"
+		      "lines_skipped,rom_reads,cart_ram_reads,cart_ram_writes,"
+		      "apu_writes,bank_switches\n", stats_file);
+	}
+
+	start = now();
+
+	for(unsigned long i = 0; i < frames; i++)
+	{
+		gb_run_frame(&gb);
+
+		if(stats_file != NULL)
+			write_stats(stats_file, session_frames + i, &gb.stats);
+	}
+
+	session_frames += frames;
+
+	{
+		const double duration = now() - start;
+		printf("Ran %lu frames in %.3f s (%.1f FPS)\n", frames,
+		       duration, frames / duration);
+	}
+
+	if(save_key != NULL)
+	{
+		long written;
+
+		start = now();
+		written = state_store_put(st, save_key, &gb, sizeof(gb),
+					  priv.cart_ram, gb_get_save_size(&gb));
+
+		if(written < 0)
+		{
+			fprintf(stderr, "Unable to save state %s: %s\n",
+				save_key, strerror(errno));
+			goto out;
+		}
+
+		printf("Saved state %s in %.3f ms (%ld new bytes)\n", save_key,
+		       (now() - start) * 1e3, written);
+	}
+
+	if(print_hash)
+		printf("State hash: %016llX\n",
+		       (unsigned long long)gb_state_hash(&gb));
+
+	if(send_path != NULL && send_session(&gb, send_path,
+					     session_frames) != 0)
+	{
+		fprintf(stderr, "Unable to hand over session: %s\n",
+			strerror(errno));
+		goto out;
+	}
+
+	ret = EXIT_SUCCESS;
+
+out:
+	if(stats_file != NULL && fclose(stats_file) != 0)
+	{
+		fprintf(stderr, "%s: %s\n", stats_path, strerror(errno));
+		ret = EXIT_FAILURE;
+	}
+
+	state_store_close(st);
+	free(priv.cart_ram);
+	free(priv.rom);
+	return ret;
+}
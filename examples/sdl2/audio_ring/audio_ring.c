@@ -0,0 +1,114 @@
+/**
+ * MIT License
+ * Copyright (c) 2018 Mahyar Koshkouei
+ *
+ * Lock-free ring of audio samples. See audio_ring.h for details.
+ */
+
+#include <string.h>
+
+#include "audio_ring.h"
+
+#define RING_MASK	(AUDIO_RING_SIZE - 1)
+
+void audio_ring_init(struct audio_ring *r, unsigned target)
+{
+	memset(r, 0, sizeof(*r));
+
+	if(target > AUDIO_RING_SIZE / 2)
+		target = AUDIO_RING_SIZE / 2;
+
+	r->target = target;
+	r->min_occupancy = UINT32_MAX;
+}
+
+unsigned audio_ring_occupancy(const struct audio_ring *r)
+{
+	return __atomic_load_n(&r->written, __ATOMIC_ACQUIRE) -
+	       __atomic_load_n(&r->read, __ATOMIC_ACQUIRE);
+}
+
+unsigned audio_ring_write(struct audio_ring *r, const float *samples,
+			  unsigned len)
+{
+	const uint32_t read = __atomic_load_n(&r->read, __ATOMIC_ACQUIRE);
+	uint32_t written = r->written;
+	double error, step;
+
+	/* Make more samples when the ring is emptier than the target, and
+	 * fewer when it is fuller. */
+	error = ((double)r->target - (double)(written - read)) / r->target;
+
+	if(error > 1.0)
+		error = 1.0;
+	else if(error < -1.0)
+		error = -1.0;
+
+	step = 1.0 / (1.0 + AUDIO_RING_MAX_RATIO_DELTA * error);
+
+	/* Linear interpolation between the last input sample and the current
+	 * one, which delays the output by one input sample. */
+	for(unsigned i = 0; i < len; i++)
+	{
+		const float l = samples[i * 2];
+		const float rt = samples[i * 2 + 1];
+
+		while(r->pos < 1.0)
+		{
+			const float f = (float)r->pos;
+
+			r->pos += step;
+
+			if(written - read == AUDIO_RING_SIZE)
+			{
+				r->overruns++;
+				continue;
+			}
+
+			r->buf[(written & RING_MASK) * 2] =
+				r->last[0] + (l - r->last[0]) * f;
+			r->buf[(written & RING_MASK) * 2 + 1] =
+				r->last[1] + (rt - r->last[1]) * f;
+			written++;
+		}
+
+		r->pos -= 1.0;
+		r->last[0] = l;
+		r->last[1] = rt;
+	}
+
+	len = written - r->written;
+	__atomic_store_n(&r->written, written, __ATOMIC_RELEASE);
+	return len;
+}
+
+void audio_ring_callback(void *userdata, uint8_t *data, int len)
+{
+	struct audio_ring *r = userdata;
+	float *out = (float *)data;
+	const uint32_t written = __atomic_load_n(&r->written, __ATOMIC_ACQUIRE);
+	uint32_t read = r->read;
+	unsigned want = (unsigned)len / (2 * sizeof(float));
+	const unsigned avail = written - read;
+
+	/* Counters are read by other threads to report on the ring. */
+	if(avail < r->min_occupancy)
+		__atomic_store_n(&r->min_occupancy, avail, __ATOMIC_RELAXED);
+
+	if(avail < want)
+	{
+		/* Play what is left, followed by silence. */
+		memset(out + avail * 2, 0, (want - avail) * 2 * sizeof(float));
+		want = avail;
+		__atomic_store_n(&r->underruns, r->underruns + 1,
+				 __ATOMIC_RELAXED);
+	}
+
+	for(unsigned i = 0; i < want; i++, read++)
+	{
+		out[i * 2] = r->buf[(read & RING_MASK) * 2];
+		out[i * 2 + 1] = r->buf[(read & RING_MASK) * 2 + 1];
+	}
+
+	__atomic_store_n(&r->read, read, __ATOMIC_RELEASE);
+}
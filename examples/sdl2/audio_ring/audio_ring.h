@@ -0,0 +1,71 @@
+/**
+ * MIT License
+ * Copyright (c) 2018 Mahyar Koshkouei
+ *
+ * Lock-free ring of stereo 32-bit floating point samples, passing audio from
+ * the thread running the emulator to the audio callback. There must be a
+ * single thread writing and a single thread reading.
+ *
+ * The writer resamples its input by a ratio that is adjusted slightly
+ * depending on the occupancy of the ring, so that the latency settles at the
+ * target even though the clocks of the emulator and the audio device differ.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/* Capacity of the ring in stereo samples. Must be a power of two. */
+#define AUDIO_RING_SIZE		8192
+
+/* Largest change in the resampling ratio made to correct the occupancy of
+ * the ring. Half a percent is not audible as a change in pitch. */
+#define AUDIO_RING_MAX_RATIO_DELTA	0.005
+
+struct audio_ring
+{
+	/* Stereo samples written and read since initialisation. Each is only
+	 * changed by one side, and wraps around. */
+	uint32_t written;
+	float buf[AUDIO_RING_SIZE * 2];
+	uint32_t read;
+
+	/* Number of times the reader found fewer samples than it needed, and
+	 * the lowest occupancy seen by the reader. Changed by the reader. */
+	uint32_t underruns;
+	uint32_t min_occupancy;
+
+	/* Number of stereo samples dropped by the writer because the ring was
+	 * full. Changed by the writer. */
+	uint32_t overruns;
+
+	/* Private to the writer. */
+	uint32_t target;
+	double pos;
+	float last[2];
+};
+
+/**
+ * Initialise an empty ring that aims to hold target stereo samples.
+ */
+void audio_ring_init(struct audio_ring *r, unsigned target);
+
+/**
+ * Resample and write len stereo interleaved samples to the ring. Samples that
+ * do not fit are dropped.
+ *
+ * \return	number of stereo samples written to the ring.
+ */
+unsigned audio_ring_write(struct audio_ring *r, const float *samples,
+			  unsigned len);
+
+/**
+ * Fill "len" bytes of "data" with stereo samples from ring "userdata", and
+ * silence if the ring runs out. Has the signature of an SDL2 audio callback.
+ */
+void audio_ring_callback(void *userdata, uint8_t *data, int len);
+
+/**
+ * Returns the number of stereo samples waiting in the ring.
+ */
+unsigned audio_ring_occupancy(const struct audio_ring *r);
@@ -53,6 +53,23 @@ void Basic_Gb_Apu::end_frame()
 	buf.end_frame( frame_length, stereo );
 }
 
+void Basic_Gb_Apu::write_register( gb_time_t t, gb_addr_t addr, int data )
+{
+	apu.write_register( t, addr, data );
+}
+
+int Basic_Gb_Apu::read_register( gb_time_t t, gb_addr_t addr )
+{
+	return apu.read_register( t, addr );
+}
+
+void Basic_Gb_Apu::end_frame( gb_time_t length )
+{
+	time = 0;
+	bool stereo = apu.end_frame( length );
+	buf.end_frame( length, stereo );
+}
+
 long Basic_Gb_Apu::samples_avail() const
 {
 	return buf.samples_avail();
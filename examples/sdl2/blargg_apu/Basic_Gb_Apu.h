@@ -24,6 +24,15 @@ public:
 	// End a 1/60 sound frame and add samples to buffer
 	void end_frame();
 	
+	// Same as above, but made at the given clock time since the start of
+	// the frame. Times must not go backwards within a frame.
+	void write_register( gb_time_t, gb_addr_t, int data );
+	int read_register( gb_time_t, gb_addr_t );
+	
+	// End a sound frame of the given number of clocks and add samples to
+	// buffer
+	void end_frame( gb_time_t );
+	
 	// Samples are generated in stereo, left first. Sample counts are always
 	// a multiple of 2.
 	
@@ -9,7 +9,22 @@
 
 #include "blargg_common.h"
 
+// Use SSE2 or NEON to mix Stereo_Buffer, when available. The output is the
+// same as that of the scalar code.
+#ifndef BLIP_BUFFER_SIMD
+	#define BLIP_BUFFER_SIMD 1
+#endif
+
+#if BLIP_BUFFER_SIMD && defined (__SSE2__)
+	#include <emmintrin.h>
+	#define BLIP_SSE2 1
+#elif BLIP_BUFFER_SIMD && defined (__ARM_NEON)
+	#include <arm_neon.h>
+	#define BLIP_NEON 1
+#endif
+
 class Blip_Reader;
+class Stereo_Buffer;
 
 // Source time unit.
 typedef long blip_time_t;
@@ -128,6 +143,7 @@ private:
 		enum { accum_fract = 15 }; // less than 16 to give extra sample range
 		
 		friend class Blip_Reader;
+		friend class Stereo_Buffer;
 };
 
 // Low-pass equalization parameters (see notes.txt)
@@ -157,6 +157,9 @@ long Stereo_Buffer::read_samples( blip_sample_t* out, long count )
 
 void Stereo_Buffer::mix_stereo( blip_sample_t* out, long count )
 {
+#if BLIP_SSE2 || BLIP_NEON
+	mix_stereo_simd( out, count );
+#else
 	Blip_Reader left; 
 	Blip_Reader right; 
 	Blip_Reader center;
@@ -188,8 +191,202 @@ void Stereo_Buffer::mix_stereo( blip_sample_t* out, long count )
 	center.end( bufs [0] );
 	right.end( bufs [2] );
 	left.end( bufs [1] );
+#endif
 }
 
+#if BLIP_SSE2 || BLIP_NEON
+
+// Samples mixed at once by mix_stereo_simd()
+enum { simd_block = 32 };
+
+// Same as mix_stereo(), but runs the three integrators in 32-bit lanes of a
+// vector. They are serial, so the lanes are the buffers rather than
+// consecutive samples. While every accumulator stays within the range of a
+// 16-bit sample, shifted left by accum_fract, none of them can overflow in
+// the next step, the result is the same as with long accumulators, and
+// clamping is the same as saturation. A block in which any accumulator leaves
+// that range is mixed again by scalar code.
+void Stereo_Buffer::mix_stereo_simd( blip_sample_t* out, long count )
+{
+	enum { fract = Blip_Buffer::accum_fract };
+	enum { offset = Blip_Buffer::sample_offset_ };
+	const Blip_Buffer::buf_t_* in [buf_count];
+	long accum [buf_count];
+	int bass = bufs [0].bass_shift;
+	
+	for ( int i = 0; i < buf_count; i++ )
+	{
+		in [i] = bufs [i].buffer_;
+		accum [i] = bufs [i].reader_accum;
+	}
+	
+	while ( count > 0 )
+	{
+		long n = (count < simd_block) ? count : long (simd_block);
+		bool mixed = (n == simd_block);
+		
+		for ( int i = 0; mixed && i < buf_count; i++ )
+			mixed = (unsigned long) ((accum [i] >> fract) + 0x8000) < 0x10000;
+		
+		if ( mixed )
+		{
+		#if BLIP_SSE2
+			const __m128i zero = _mm_setzero_si128();
+			const __m128i off = _mm_set1_epi32( offset );
+			const __m128i shift = _mm_cvtsi32_si128( bass );
+			const __m128i bias = _mm_set1_epi32( 0x8000 );
+			// Lanes are center, left, right and unused
+			__m128i acc = _mm_set_epi32( 0, (int) accum [2], (int) accum [1],
+					(int) accum [0] );
+			// Bits above the low 16 are set if a sample left its range
+			__m128i range = zero;
+			
+			for ( int k = 0; k < simd_block; k += 4 )
+			{
+				__m128i c = _mm_loadl_epi64( (const __m128i*) (in [0] + k) );
+				__m128i l = _mm_loadl_epi64( (const __m128i*) (in [1] + k) );
+				__m128i r = _mm_loadl_epi64( (const __m128i*) (in [2] + k) );
+				c = _mm_slli_epi32( _mm_sub_epi32( _mm_unpacklo_epi16( c, zero ), off ), fract );
+				l = _mm_slli_epi32( _mm_sub_epi32( _mm_unpacklo_epi16( l, zero ), off ), fract );
+				r = _mm_slli_epi32( _mm_sub_epi32( _mm_unpacklo_epi16( r, zero ), off ), fract );
+				
+				// Transpose to the deltas of each buffer for each sample
+				__m128i cl0 = _mm_unpacklo_epi32( c, l );
+				__m128i cl1 = _mm_unpackhi_epi32( c, l );
+				__m128i r0 = _mm_unpacklo_epi32( r, zero );
+				__m128i r1 = _mm_unpackhi_epi32( r, zero );
+				__m128i x [4];
+				x [0] = _mm_unpacklo_epi64( cl0, r0 );
+				x [1] = _mm_unpackhi_epi64( cl0, r0 );
+				x [2] = _mm_unpacklo_epi64( cl1, r1 );
+				x [3] = _mm_unpackhi_epi64( cl1, r1 );
+				
+				__m128i lr [4];
+				for ( int j = 0; j < 4; j++ )
+				{
+					__m128i s = _mm_srai_epi32( acc, fract );
+					range = _mm_or_si128( range, _mm_add_epi32( s, bias ) );
+					acc = _mm_sub_epi32( acc, _mm_sra_epi32( acc, shift ) );
+					acc = _mm_add_epi32( acc, x [j] );
+					
+					// Left and right plus center in the low lanes
+					lr [j] = _mm_add_epi32( _mm_shuffle_epi32( s, _MM_SHUFFLE( 3, 3, 2, 1 ) ),
+							_mm_shuffle_epi32( s, _MM_SHUFFLE( 0, 0, 0, 0 ) ) );
+				}
+				
+				_mm_storeu_si128( (__m128i*) (out + k * 2), _mm_packs_epi32(
+						_mm_unpacklo_epi64( lr [0], lr [1] ),
+						_mm_unpacklo_epi64( lr [2], lr [3] ) ) );
+			}
+			
+			range = _mm_or_si128( range, _mm_add_epi32( _mm_srai_epi32( acc, fract ), bias ) );
+			mixed = _mm_movemask_epi8( _mm_cmpeq_epi32( _mm_srli_epi32( range, 16 ), zero ) ) == 0xFFFF;
+			
+			if ( mixed )
+			{
+				accum [0] = _mm_cvtsi128_si32( acc );
+				accum [1] = _mm_cvtsi128_si32( _mm_shuffle_epi32( acc, _MM_SHUFFLE( 1, 1, 1, 1 ) ) );
+				accum [2] = _mm_cvtsi128_si32( _mm_shuffle_epi32( acc, _MM_SHUFFLE( 2, 2, 2, 2 ) ) );
+			}
+		#else
+			const int32x4_t zero = vdupq_n_s32( 0 );
+			const int32x4_t off = vdupq_n_s32( offset );
+			const int32x4_t shift = vdupq_n_s32( -bass );
+			const int32x4_t bias = vdupq_n_s32( 0x8000 );
+			// Lanes are center, left, right and unused
+			int32_t lanes [4] = { (int32_t) accum [0], (int32_t) accum [1],
+					(int32_t) accum [2], 0 };
+			int32x4_t acc = vld1q_s32( lanes );
+			// Bits above the low 16 are set if a sample left its range
+			int32x4_t range = zero;
+			
+			for ( int k = 0; k < simd_block; k += 4 )
+			{
+				int32x4_t c = vreinterpretq_s32_u32( vmovl_u16( vld1_u16( in [0] + k ) ) );
+				int32x4_t l = vreinterpretq_s32_u32( vmovl_u16( vld1_u16( in [1] + k ) ) );
+				int32x4_t r = vreinterpretq_s32_u32( vmovl_u16( vld1_u16( in [2] + k ) ) );
+				c = vshlq_n_s32( vsubq_s32( c, off ), fract );
+				l = vshlq_n_s32( vsubq_s32( l, off ), fract );
+				r = vshlq_n_s32( vsubq_s32( r, off ), fract );
+				
+				// Transpose to the deltas of each buffer for each sample
+				int32x4x2_t cl = vtrnq_s32( c, l );
+				int32x4x2_t rz = vtrnq_s32( r, zero );
+				int32x4_t x [4];
+				x [0] = vcombine_s32( vget_low_s32( cl.val [0] ), vget_low_s32( rz.val [0] ) );
+				x [1] = vcombine_s32( vget_low_s32( cl.val [1] ), vget_low_s32( rz.val [1] ) );
+				x [2] = vcombine_s32( vget_high_s32( cl.val [0] ), vget_high_s32( rz.val [0] ) );
+				x [3] = vcombine_s32( vget_high_s32( cl.val [1] ), vget_high_s32( rz.val [1] ) );
+				
+				int32x2_t lr [4];
+				for ( int j = 0; j < 4; j++ )
+				{
+					int32x4_t s = vshrq_n_s32( acc, fract );
+					range = vorrq_s32( range, vaddq_s32( s, bias ) );
+					acc = vsubq_s32( acc, vshlq_s32( acc, shift ) );
+					acc = vaddq_s32( acc, x [j] );
+					
+					// Left and right plus center
+					lr [j] = vadd_s32( vget_low_s32( vextq_s32( s, s, 1 ) ),
+							vdup_lane_s32( vget_low_s32( s ), 0 ) );
+				}
+				
+				vst1q_s16( out + k * 2, vcombine_s16(
+						vqmovn_s32( vcombine_s32( lr [0], lr [1] ) ),
+						vqmovn_s32( vcombine_s32( lr [2], lr [3] ) ) ) );
+			}
+			
+			range = vorrq_s32( range, vaddq_s32( vshrq_n_s32( acc, fract ), bias ) );
+			vst1q_s32( lanes, range );
+			mixed = ((lanes [0] | lanes [1] | lanes [2] | lanes [3]) >> 16) == 0;
+			
+			if ( mixed )
+			{
+				vst1q_s32( lanes, acc );
+				accum [0] = lanes [0];
+				accum [1] = lanes [1];
+				accum [2] = lanes [2];
+			}
+		#endif
+		}
+		
+		if ( !mixed )
+		{
+			for ( long k = 0; k < n; k++ )
+			{
+				int s [buf_count];
+				for ( int i = 0; i < buf_count; i++ )
+				{
+					s [i] = accum [i] >> fract;
+					accum [i] -= accum [i] >> bass;
+					accum [i] += (long (in [i] [k]) - offset) << fract;
+				}
+				
+				long l = s [0] + s [1];
+				long r = s [0] + s [2];
+				out [k * 2] = (blip_sample_t) l;
+				out [k * 2 + 1] = (blip_sample_t) r;
+				
+				if ( (BOOST::int16_t) l != l )
+					out [k * 2] = 0x7FFF - (l >> 24);
+				
+				if ( (BOOST::int16_t) r != r )
+					out [k * 2 + 1] = 0x7FFF - (r >> 24);
+			}
+		}
+		
+		for ( int i = 0; i < buf_count; i++ )
+			in [i] += n;
+		out += n * 2;
+		count -= n;
+	}
+	
+	for ( int i = 0; i < buf_count; i++ )
+		bufs [i].reader_accum = accum [i];
+}
+
+#endif
+
 void Stereo_Buffer::mix_mono( blip_sample_t* out, long count )
 {
 	Blip_Reader in;
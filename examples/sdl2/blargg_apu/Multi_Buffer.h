@@ -117,6 +117,9 @@ private:
 	
 	void mix_stereo( blip_sample_t*, long );
 	void mix_mono( blip_sample_t*, long );
+#if BLIP_SSE2 || BLIP_NEON
+	void mix_stereo_simd( blip_sample_t*, long );
+#endif
 };
 
 // Silent_Buffer generates no samples, useful where no sound is wanted
@@ -1,5 +1,3 @@
-#include <SDL2/SDL.h>
-
 #include "Basic_Gb_Apu.h"
 #include "audio.h"
 #include <stdio.h>
@@ -9,60 +7,62 @@
 
 static Basic_Gb_Apu apu;
 
-void fill_audio( void *userdata, uint8_t *stream, int len );
-
-void audio_init(SDL_AudioDeviceID *dev)
-{
-	const long default_sample_rate = 48000;
-	SDL_AudioSpec want, have;
-
-	debugprintf("audio was initialised\n");
-	apu.set_sample_rate( default_sample_rate );
+// Clock cycles in a video frame.
+static const uint32_t frame_cycles = 70224;
 
-	want.freq = default_sample_rate;
-	want.format = AUDIO_S16SYS;
-	want.channels = 2;
-	want.samples = 1024;
-	want.callback = fill_audio;
-	want.userdata = NULL;
+// Cycle of the video frame at which the current sound frame started, and
+// the time of the last access within the sound frame.
+static uint32_t frame_start;
+static gb_time_t last_time;
 
-	debugprintf("Audio driver: %s\n", SDL_GetAudioDeviceName(0, 0));
+// Convert a cycle of the video frame to a time within the sound frame. The
+// sound frame ends a few cycles after the video frame, so cycles before its
+// start belong after the video frame wrapped around.
+static gb_time_t frame_time( uint32_t cycle )
+{
+    gb_time_t t = cycle >= frame_start ? cycle - frame_start :
+                  cycle + frame_cycles - frame_start;
 
-	if((*dev = SDL_OpenAudioDevice(NULL, 0, &want, &have, 0)) == 0)
-	{
-		printf("SDL could not open audio device: %s\n", SDL_GetError());
-		exit(EXIT_FAILURE);
-	}
+    // Accesses must not go back in time
+    if ( t < last_time )
+        t = last_time;
 
-	SDL_PauseAudioDevice(*dev, 0);
+    last_time = t;
+    return t;
 }
 
-void fill_audio( void *userdata, uint8_t *stream, int len )
+void audio_init(long sample_rate)
 {
-    debugprintf( "fill_audio( %p, %p, %d );\n", userdata, stream, len );
-    memset( stream, 0, len );
-    apu.read_samples( (blip_sample_t *)stream, len/2 );
+	debugprintf("audio was initialised\n");
+	apu.set_sample_rate( sample_rate );
 }
 
 void audio_cleanup(void)
 {
     debugprintf("audio was cleaned up");
-    SDL_CloseAudio();
 }
 
-uint8_t audio_read( uint16_t address )
+uint8_t blargg_audio_read( uint32_t cycle, uint16_t address )
 {
-    return apu.read_register( address );
+    return apu.read_register( frame_time( cycle ), address );
 }
 
-void audio_write( uint16_t address, uint8_t data )
+void blargg_audio_write( uint32_t cycle, uint16_t address, uint8_t data )
 {
-    apu.write_register(address, data);
+    apu.write_register( frame_time( cycle ), address, data );
 }
 
-void audio_frame(void)
+void audio_frame( uint32_t cycle )
 {
-    apu.end_frame();
+    // The frame always wraps around once.
+    gb_time_t length = cycle + frame_cycles - frame_start;
+
+    if ( length < last_time )
+        length = last_time;
+
+    apu.end_frame( length );
+    frame_start = cycle;
+    last_time = 0;
 }
 
 int audio_length(void)
@@ -70,6 +70,34 @@ int audio_length(void)
     return apu.samples_avail();
 }
 
+unsigned audio_read_samples(float *samples, unsigned len)
+{
+    blip_sample_t buf[1024];
+    unsigned total = 0;
+
+    /* Samples are converted in chunks, since the audio ring holds
+     * floating point samples. */
+    while (total < len)
+    {
+        long want = (long)(len - total) * 2;
+        long got;
+
+        if (want > 1024)
+            want = 1024;
+
+        got = apu.read_samples( buf, want );
+        if (got == 0)
+            break;
+
+        for (long i = 0; i < got; i++)
+            samples[total * 2 + i] = buf[i] / 32768.0f;
+
+        total += got / 2;
+    }
+
+    return total;
+}
+
 void audio_sample_rate_set(unsigned int sample_rate)
 {
 	apu.set_sample_rate( sample_rate );
@@ -6,12 +6,17 @@
 extern "C" {
 #endif
 
-void audio_init(SDL_AudioDeviceID *dev);
-uint8_t audio_read( uint16_t address );
-void audio_write( uint16_t address, uint8_t data );
+void audio_init(long sample_rate);
+/* Accesses and the end of each frame are timed by the cycle of the video
+ * frame they happen at, as returned by gb_get_frame_cycles(). */
+uint8_t blargg_audio_read( uint32_t cycle, uint16_t address );
+void blargg_audio_write( uint32_t cycle, uint16_t address, uint8_t data );
 void audio_cleanup(void);
-void audio_frame(void);
+void audio_frame( uint32_t cycle );
 int audio_length(void);
+/* Read at most len stereo samples, converted to floating point. Returns the
+ * number of stereo samples read. */
+unsigned audio_read_samples(float *samples, unsigned len);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,158 @@
+/**
+ * MIT License
+ * Copyright (c) 2018 Mahyar Koshkouei
+ *
+ * Chrome trace event recorder. See chrome_trace.h for details.
+ */
+
+#include <stdlib.h>
+
+#include "chrome_trace.h"
+
+/* Phase of events that name a track, which are written as metadata. */
+#define PH_TRACK_NAME	'M'
+
+int chrome_trace_init(struct chrome_trace *t, size_t cap)
+{
+	t->len = 0;
+	t->fixed = 0;
+	t->dropped = 0;
+	t->cap = cap ? cap : 1;
+	t->events = malloc(t->cap * sizeof(*t->events));
+
+	return t->events == NULL ? -1 : 0;
+}
+
+int chrome_trace_init_fixed(struct chrome_trace *t, size_t cap)
+{
+	const int ret = chrome_trace_init(t, cap);
+
+	t->fixed = 1;
+	return ret;
+}
+
+void chrome_trace_free(struct chrome_trace *t)
+{
+	free(t->events);
+	t->events = NULL;
+	t->len = 0;
+	t->cap = 0;
+}
+
+void chrome_trace_add(struct chrome_trace *t, uint64_t ns, char ph,
+		      uint32_t tid, const char *name,
+		      const char *arg0_name, uint32_t arg0,
+		      const char *arg1_name, uint32_t arg1)
+{
+	struct chrome_trace_event *e;
+
+	if(t->len == t->cap)
+	{
+		if(t->fixed)
+		{
+			t->dropped++;
+			return;
+		}
+
+		/* Doubling keeps the cost of copying to a constant per
+		 * event. */
+		e = realloc(t->events, t->cap * 2 * sizeof(*e));
+
+		if(e == NULL)
+		{
+			t->dropped++;
+			return;
+		}
+
+		t->events = e;
+		t->cap *= 2;
+	}
+
+	e = &t->events[t->len++];
+	e->ns = ns;
+	e->ph = ph;
+	e->tid = tid;
+	e->name = name;
+	e->arg_names[0] = arg0_name;
+	e->args[0] = arg0;
+	e->arg_names[1] = arg1_name;
+	e->args[1] = arg1;
+}
+
+void chrome_trace_name_track(struct chrome_trace *t, uint32_t tid,
+			     const char *name)
+{
+	chrome_trace_add(t, 0, PH_TRACK_NAME, tid, name, NULL, 0, NULL, 0);
+}
+
+int chrome_trace_write(FILE *f, const struct chrome_trace *const *traces,
+		       size_t count)
+{
+	uint64_t base = UINT64_MAX;
+	const char *sep = "";
+
+	for(size_t i = 0; i < count; i++)
+	{
+		for(size_t j = 0; j < traces[i]->len; j++)
+		{
+			const struct chrome_trace_event *e =
+				&traces[i]->events[j];
+
+			if(e->ph != PH_TRACK_NAME && e->ns < base)
+				base = e->ns;
+		}
+	}
+
+	fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n", f);
+
+	for(size_t i = 0; i < count; i++)
+	{
+		for(size_t j = 0; j < traces[i]->len; j++)
+		{
+			const struct chrome_trace_event *e =
+				&traces[i]->events[j];
+
+			if(e->ph == PH_TRACK_NAME)
+			{
+				fprintf(f, "%s{\"name\":\"thread_name\","
+					"\"ph\":\"M\",\"pid\":1,\"tid\":%lu,"
+					"\"args\":{\"name\":\"%s\"}}",
+					sep, (unsigned long)e->tid, e->name);
+				sep = ",\n";
+				continue;
+			}
+
+			/* Timestamps are in microseconds. */
+			fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"%c\","
+				"\"ts\":%llu.%03u,\"pid\":1,\"tid\":%lu",
+				sep, e->name, e->ph,
+				(unsigned long long)((e->ns - base) / 1000),
+				(unsigned)((e->ns - base) % 1000),
+				(unsigned long)e->tid);
+
+			/* Instant events are drawn across their track. */
+			if(e->ph == 'i')
+				fputs(",\"s\":\"t\"", f);
+
+			if(e->arg_names[0] != NULL)
+			{
+				fprintf(f, ",\"args\":{\"%s\":%lu",
+					e->arg_names[0],
+					(unsigned long)e->args[0]);
+
+				if(e->arg_names[1] != NULL)
+					fprintf(f, ",\"%s\":%lu",
+						e->arg_names[1],
+						(unsigned long)e->args[1]);
+
+				fputc('}', f);
+			}
+
+			fputc('}', f);
+			sep = ",\n";
+		}
+	}
+
+	fputs("\n]}\n", f);
+	return ferror(f) ? -1 : 0;
+}
@@ -0,0 +1,89 @@
+/**
+ * MIT License
+ * Copyright (c) 2018 Mahyar Koshkouei
+ *
+ * Records timed events in memory, and writes them as Chrome trace JSON, which
+ * may be opened in ui.perfetto.dev or chrome://tracing. Recording an event
+ * only stores it in a buffer, which grows as needed, so that tracing does not
+ * make a system call for each event.
+ *
+ * A buffer must only be written by one thread. Threads that record events
+ * each use their own buffer, and the buffers are written to one file once
+ * recording has stopped.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+struct chrome_trace_event
+{
+	/* Host time in nanoseconds. */
+	uint64_t ns;
+	/* Name of the event, and of its arguments. Must be string literals or
+	 * otherwise outlive the buffer. Argument names may be NULL. */
+	const char *name;
+	const char *arg_names[2];
+	uint32_t args[2];
+	/* Track the event is shown on. */
+	uint32_t tid;
+	/* Chrome trace phase: 'B' for begin, 'E' for end, 'i' for instant. */
+	char ph;
+};
+
+struct chrome_trace
+{
+	struct chrome_trace_event *events;
+	size_t len;
+	size_t cap;
+	/* Set if the buffer must not be grown. */
+	int fixed;
+	/* Events lost because the buffer was full and could not be grown. */
+	uint64_t dropped;
+};
+
+/**
+ * Initialise an empty buffer, allocating space for cap events.
+ *
+ * \return	0 on success, or -1 if the allocation failed.
+ */
+int chrome_trace_init(struct chrome_trace *t, size_t cap);
+
+/**
+ * Same as chrome_trace_init(), but the buffer is never grown. Events added
+ * once it is full are dropped, so that recording never allocates memory. This
+ * is for threads that must not block, such as an audio callback.
+ *
+ * \return	0 on success, or -1 if the allocation failed.
+ */
+int chrome_trace_init_fixed(struct chrome_trace *t, size_t cap);
+
+/**
+ * Free the events of the buffer.
+ */
+void chrome_trace_free(struct chrome_trace *t);
+
+/**
+ * Add an event to the buffer. Unused arguments are given a NULL name.
+ */
+void chrome_trace_add(struct chrome_trace *t, uint64_t ns, char ph,
+		      uint32_t tid, const char *name,
+		      const char *arg0_name, uint32_t arg0,
+		      const char *arg1_name, uint32_t arg1);
+
+/**
+ * Name a track, so that it is labelled in the trace viewer.
+ */
+void chrome_trace_name_track(struct chrome_trace *t, uint32_t tid,
+			     const char *name);
+
+/**
+ * Write the events of count buffers to f as a Chrome trace JSON object. Times
+ * are written relative to the earliest event.
+ *
+ * \return	0 on success, or -1 if writing failed.
+ */
+int chrome_trace_write(FILE *f, const struct chrome_trace *const *traces,
+		       size_t count);
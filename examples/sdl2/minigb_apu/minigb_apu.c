@@ -13,83 +13,25 @@
 
 #include "minigb_apu.h"
 
-#define ENABLE_HIPASS 1
-
-#define AUDIO_NSAMPLES ((unsigned)(AUDIO_SAMPLE_RATE / VERTICAL_SYNC) * 2)
+#if MINIGB_APU_SIMD && defined(__SSE2__)
+#	include <emmintrin.h>
+#	define MIX_SSE2
+#elif MINIGB_APU_SIMD && defined(__ARM_NEON)
+#	include <arm_neon.h>
+#	define MIX_NEON
+#endif
 
-#define AUDIO_MEM_SIZE (0xFF3F - 0xFF10 + 1)
 #define AUDIO_ADDR_COMPENSATION 0xFF10
 
+/* Clock cycles between length, sweep and envelope steps of the band-limited
+ * path, for a length, sweep rate or envelope step of one. */
+#define BLIP_LEN_CYCLES		16384
+#define BLIP_SWEEP_CYCLES	32768
+#define BLIP_ENV_CYCLES		65536
+
 #define MAX(a, b) ({ a > b ? a : b; })
 #define MIN(a, b) ({ a <= b ? a : b; })
 
-/**
- * Memory holding audio registers between 0xFF10 and 0xFF3F inclusive.
- */
-static uint8_t audio_mem[AUDIO_MEM_SIZE];
-
-struct chan_len_ctr {
-	unsigned load : 6;
-	unsigned enabled : 1;
-	float counter;
-	float inc;
-};
-
-struct chan_vol_env {
-	unsigned step : 3;
-	unsigned up : 1;
-	float counter;
-	float inc;
-};
-
-struct chan_freq_sweep {
-	uint_fast16_t freq;
-	unsigned rate : 3;
-	unsigned up : 1;
-	unsigned shift : 3;
-	float counter;
-	float inc;
-};
-
-static struct chan {
-	unsigned enabled : 1;
-	unsigned powered : 1;
-	unsigned on_left : 1;
-	unsigned on_right : 1;
-	unsigned muted : 1;
-
-	unsigned volume : 4;
-	unsigned volume_init : 4;
-
-	uint16_t freq;
-	float    freq_counter;
-	float    freq_inc;
-
-	int val;
-
-	struct chan_len_ctr    len;
-	struct chan_vol_env    env;
-	struct chan_freq_sweep sweep;
-
-	// square
-	uint8_t duty;
-	uint8_t duty_counter;
-
-	// noise
-	uint16_t lfsr_reg;
-	bool     lfsr_wide;
-	int      lfsr_div;
-
-	// wave
-	uint8_t sample;
-
-#if ENABLE_HIPASS
-	float capacitor;
-#endif
-} chans[4];
-
-static float vol_l, vol_r;
-
 static float hipass(struct chan *c, float sample)
 {
 #if ENABLE_HIPASS
@@ -101,20 +43,99 @@ static float hipass(struct chan *c, float sample)
 #endif
 }
 
-static void set_note_freq(struct chan *c, const uint_fast16_t freq)
+/**
+ * Set the steps per sample of a channel that steps every clocks clock cycles.
+ */
+static void set_note_freq(struct chan *c, const uint_fast32_t clocks)
+{
+	c->freq_inc = (float)(DMG_CLOCK_FREQ / AUDIO_SAMPLE_RATE) / clocks;
+}
+
+static void chan_enable(struct minigb_apu_ctx *ctx, const uint_fast8_t i,
+			const bool enable)
 {
-	c->freq_inc = freq / AUDIO_SAMPLE_RATE;
+	ctx->chans[i].enabled = enable;
+
+	uint8_t val =
+		(ctx->audio_mem[0xFF26 - AUDIO_ADDR_COMPENSATION] & 0x80) |
+		(ctx->chans[3].enabled << 3) | (ctx->chans[2].enabled << 2) |
+		(ctx->chans[1].enabled << 1) | (ctx->chans[0].enabled << 0);
+
+	ctx->audio_mem[0xFF26 - AUDIO_ADDR_COMPENSATION] = val;
 }
 
-static void chan_enable(const uint_fast8_t i, const bool enable)
+/**
+ * Returns true if channel c makes no sound until its registers are next
+ * written, so that it need not be rendered. Its frequency timer is still
+ * advanced by chan_skip(), and its length, envelope and sweep still run, as
+ * they affect the phase of the channel and the status bits of NR52.
+ */
+static bool chan_silent(const struct minigb_apu_ctx *ctx, const struct chan *c)
 {
-	chans[i].enabled = enable;
+	if (ctx->synthesis_off || c->muted || !(c->on_left || c->on_right))
+		return true;
 
-	uint8_t val = (audio_mem[0xFF26 - AUDIO_ADDR_COMPENSATION] & 0x80) |
-		      (chans[3].enabled << 3) | (chans[2].enabled << 2) |
-		      (chans[1].enabled << 1) | (chans[0].enabled << 0);
+	if (c == ctx->chans + 2)
+		return c->volume == 0;
 
-	audio_mem[0xFF26 - AUDIO_ADDR_COMPENSATION] = val;
+	/* A volume of zero stays at zero unless the envelope is rising. */
+	return c->volume == 0 && !(c->env.up && c->env.step);
+}
+
+/**
+ * Advance channel i by the given number of steps of its frequency timer
+ * without rendering it, so that a channel that was silent resumes with the
+ * same phase as if it had been rendered.
+ */
+static void chan_skip(struct chan *c, const unsigned i, uint_fast32_t steps)
+{
+	if (steps == 0)
+		return;
+
+	switch (i) {
+	case 2:
+		c->val = (c->val + steps) & 31;
+		break;
+
+	case 3: {
+		/* The LFSR repeats every 127 or 32767 steps, and after 16 steps
+		 * the register holds only earlier outputs, so whole periods
+		 * may be skipped. */
+		const uint_fast32_t period = c->lfsr_wide ? 32767 : 127;
+		const unsigned tap = c->lfsr_wide ? 13 : 5;
+
+		if (steps > 16 + period)
+			steps = 16 + (steps - 16) % period;
+
+		while (steps--) {
+			c->lfsr_reg = (c->lfsr_reg << 1) | (c->val == 1);
+			c->val = !(((c->lfsr_reg >> (tap + 1)) & 1) ^
+				   ((c->lfsr_reg >> tap) & 1)) ? 1 : -1;
+		}
+		break;
+	}
+
+	default:
+		c->duty_counter = (c->duty_counter + steps) & 7;
+		c->val = (c->duty & (1 << c->duty_counter)) ? 1 : -1;
+		break;
+	}
+}
+
+/**
+ * Step the volume envelope. Used by both the floating point and fixed-point
+ * paths.
+ */
+static void env_step(struct chan *c)
+{
+	if (c->env.step) {
+		c->volume += c->env.up ? 1 : -1;
+		if (c->volume == 0 || c->volume == 15) {
+			c->env.inc = 0;
+			c->fixed.env_inc = 0;
+		}
+		c->volume = MAX(0, MIN(15, c->volume));
+	}
 }
 
 static void update_env(struct chan *c)
@@ -122,28 +143,36 @@ static void update_env(struct chan *c)
 	c->env.counter += c->env.inc;
 
 	while (c->env.counter > 1.0f) {
-		if (c->env.step) {
-			c->volume += c->env.up ? 1 : -1;
-			if (c->volume == 0 || c->volume == 15) {
-				c->env.inc = 0;
-			}
-			c->volume = MAX(0, MIN(15, c->volume));
-		}
+		env_step(c);
 		c->env.counter -= 1.0f;
 	}
 }
 
-static void update_len(struct chan *c)
+static void update_len(struct minigb_apu_ctx *ctx, struct chan *c)
 {
 	if (c->len.enabled) {
 		c->len.counter += c->len.inc;
 		if (c->len.counter > 1.0f) {
-			chan_enable(c - chans, 0);
+			chan_enable(ctx, c - ctx->chans, 0);
 			c->len.counter = 0.0f;
 		}
 	}
 }
 
+/**
+ * Run the frequency timer for one sample without rendering the channel.
+ *
+ * \return	number of steps of the timer, as update_freq() would count them.
+ */
+static uint_fast32_t skip_freq(struct chan *c)
+{
+	const float total = c->freq_counter + c->freq_inc;
+	const uint_fast32_t steps = (uint_fast32_t)total;
+
+	c->freq_counter = total - steps;
+	return steps;
+}
+
 static bool update_freq(struct chan *c, float *pos)
 {
 	float inc = c->freq_inc - *pos;
@@ -159,48 +188,65 @@ static bool update_freq(struct chan *c, float *pos)
 	}
 }
 
+/**
+ * Step the frequency sweep. Used by both the floating point and fixed-point
+ * paths.
+ *
+ * \return	true if the frequency of the channel changed.
+ */
+static bool sweep_step(struct chan *c)
+{
+	if (c->sweep.shift) {
+		uint16_t inc = (c->sweep.freq >> c->sweep.shift);
+		if (!c->sweep.up)
+			inc *= -1;
+
+		c->freq += inc;
+		if (c->freq > 2047) {
+			c->enabled = 0;
+		} else {
+			return true;
+		}
+	} else if (c->sweep.rate) {
+		c->enabled = 0;
+	}
+
+	return false;
+}
+
 static void update_sweep(struct chan *c)
 {
 	c->sweep.counter += c->sweep.inc;
 
 	while (c->sweep.counter > 1.0f) {
-		if (c->sweep.shift) {
-			uint16_t inc = (c->sweep.freq >> c->sweep.shift);
-			if (!c->sweep.up)
-				inc *= -1;
-
-			c->freq += inc;
-			if (c->freq > 2047) {
-				c->enabled = 0;
-			} else {
-				set_note_freq(c,
-					4194304 / ((2048 - c->freq)<< 5));
-				c->freq_inc *= 8.0f;
-			}
-		} else if (c->sweep.rate) {
-			c->enabled = 0;
-		}
+		if (sweep_step(c))
+			set_note_freq(c, (2048 - c->freq) << 2);
 		c->sweep.counter -= 1.0f;
 	}
 }
 
-static void update_square(float *restrict samples, const bool ch2)
+static void update_square(struct minigb_apu_ctx *ctx, float *restrict samples,
+			  const bool ch2, const unsigned start, const unsigned end)
 {
-	struct chan *c = chans + ch2;
+	struct chan *c = ctx->chans + ch2;
 	if (!c->powered)
 		return;
 
-	set_note_freq(c, 4194304.0f / ((2048 - c->freq) << 5));
-	c->freq_inc *= 8.0f;
+	set_note_freq(c, (2048 - c->freq) << 2);
 
-	for (uint_fast16_t i = 0; i < AUDIO_NSAMPLES; i += 2) {
-		update_len(c);
+	for (uint_fast16_t i = start * 2; i < end * 2; i += 2) {
+		update_len(ctx, c);
 
 		if (c->enabled) {
 			update_env(c);
 			if (!ch2)
 				update_sweep(c);
 
+			if (chan_silent(ctx, c)) {
+				chan_skip(c, ch2, skip_freq(c));
+				continue;
+			}
+
 			float pos      = 0.0f;
 			float prev_pos = 0.0f;
 			float sample   = 0.0f;
@@ -218,20 +264,19 @@ static void update_square(float *restrict samples, const bool ch2)
 				  (float)c->val;
 			sample = hipass(c, sample * (c->volume / 15.0f));
 
-			if (!c->muted) {
-				samples[i + 0] +=
-					sample * 0.25f * c->on_left * vol_l;
-				samples[i + 1] +=
-					sample * 0.25f * c->on_right * vol_r;
-			}
+			samples[i + 0] += sample * 0.25f * c->on_left *
+					  ctx->vol_l;
+			samples[i + 1] += sample * 0.25f * c->on_right *
+					  ctx->vol_r;
 		}
 	}
 }
 
-static uint8_t wave_sample(const unsigned int pos, const unsigned int volume)
+static uint8_t wave_sample(const struct minigb_apu_ctx *ctx,
+			   const unsigned int pos, const unsigned int volume)
 {
 	uint8_t sample =
-		audio_mem[(0xFF30 + pos / 2) - AUDIO_ADDR_COMPENSATION];
+		ctx->audio_mem[(0xFF30 + pos / 2) - AUDIO_ADDR_COMPENSATION];
 	if (pos & 1) {
 		sample &= 0xF;
 	} else {
@@ -240,32 +285,32 @@ static uint8_t wave_sample(const unsigned int pos, const unsigned int volume)
 	return volume ? (sample >> (volume - 1)) : 0;
 }
 
-static void update_wave(float *restrict samples)
+static void update_wave(struct minigb_apu_ctx *ctx, float *restrict samples,
+			const unsigned start, const unsigned end)
 {
-	struct chan *c = chans + 2;
+	struct chan *c = ctx->chans + 2;
 	if (!c->powered)
 		return;
 
-	uint_fast16_t freq = 4194304.0f / ((2048 - c->freq) << 5);
-	set_note_freq(c, freq);
-
-	c->freq_inc *= 16.0f;
+	set_note_freq(c, (2048 - c->freq) << 1);
 
-	for (uint_fast16_t i = 0; i < AUDIO_NSAMPLES; i += 2) {
-		update_len(c);
+	for (uint_fast16_t i = start * 2; i < end * 2; i += 2) {
+		update_len(ctx, c);
 
-		if (c->enabled) {
+		if (c->enabled && chan_silent(ctx, c))
+			chan_skip(c, 2, skip_freq(c));
+		else if (c->enabled) {
 			float pos      = 0.0f;
 			float prev_pos = 0.0f;
 			float sample   = 0.0f;
 
-			c->sample = wave_sample(c->val, c->volume);
+			c->sample = wave_sample(ctx, c->val, c->volume);
 
 			while (update_freq(c, &pos)) {
 				c->val = (c->val + 1) & 31;
 				sample += ((pos - prev_pos) / c->freq_inc) *
 					  (float)c->sample;
-				c->sample = wave_sample(c->val, c->volume);
+				c->sample = wave_sample(ctx, c->val, c->volume);
 				prev_pos  = pos;
 			}
 			sample += ((pos - prev_pos) / c->freq_inc) *
@@ -276,37 +321,40 @@ static void update_wave(float *restrict samples)
 							1.5f }[c->volume - 1];
 				sample     = hipass(c, (sample - diff) / 7.5f);
 
-				if (!c->muted) {
-					samples[i + 0] += sample * 0.25f *
-							  c->on_left * vol_l;
-					samples[i + 1] += sample * 0.25f *
-							  c->on_right * vol_r;
-				}
+				samples[i + 0] += sample * 0.25f *
+						  c->on_left * ctx->vol_l;
+				samples[i + 1] += sample * 0.25f *
+						  c->on_right * ctx->vol_r;
 			}
 		}
 	}
 }
 
-static void update_noise(float *restrict samples)
+static void update_noise(struct minigb_apu_ctx *ctx, float *restrict samples,
+			 const unsigned start, const unsigned end)
 {
-	struct chan *c = chans + 3;
+	struct chan *c = ctx->chans + 3;
 	if (!c->powered)
 		return;
 
-	uint_fast16_t freq = 4194304 / ((uint_fast8_t[]){
+	set_note_freq(c, (uint_fast32_t)(uint_fast8_t[]){
 			8, 16, 32, 48, 64, 80, 96, 112
 		}[c->lfsr_div] << c->freq);
-	set_note_freq(c, freq);
 
 	if (c->freq >= 14)
 		c->enabled = 0;
 
-	for (uint_fast16_t i = 0; i < AUDIO_NSAMPLES; i += 2) {
-		update_len(c);
+	for (uint_fast16_t i = start * 2; i < end * 2; i += 2) {
+		update_len(ctx, c);
 
 		if (c->enabled) {
 			update_env(c);
 
+			if (chan_silent(ctx, c)) {
+				chan_skip(c, 3, skip_freq(c));
+				continue;
+			}
+
 			float pos      = 0.0f;
 			float prev_pos = 0.0f;
 			float sample   = 0.0f;
@@ -333,45 +381,462 @@ static void update_noise(float *restrict samples)
 			sample += ((pos - prev_pos) / c->freq_inc) * c->val;
 			sample = hipass(c, sample * (c->volume / 15.0f));
 
-			if (!c->muted) {
-				samples[i + 0] +=
-					sample * 0.25f * c->on_left * vol_l;
-				samples[i + 1] +=
-					sample * 0.25f * c->on_right * vol_r;
-			}
+			samples[i + 0] += sample * 0.25f * c->on_left *
+					  ctx->vol_l;
+			samples[i + 1] += sample * 0.25f * c->on_right *
+					  ctx->vol_r;
+		}
+	}
+}
+
+/*
+ * Fixed-point path.
+ *
+ * Frequency timers count the time until the next step of the channel in
+ * units of 1/65536 of an output sample. Each output sample is the average of
+ * the channel over that time, which is found by adding the value of the
+ * channel multiplied by the length of time it is held. This needs no
+ * division, as the length of a sample is a power of two.
+ *
+ * Channels are rendered to 16-bit buffers scaled so that 1 << 14 is the full
+ * volume of a channel, leaving space for the high-pass filter to overshoot.
+ * The buffers are then mixed with the stereo volume of each channel.
+ */
+
+/* Value of a counter of the fixed-point path when it fires. */
+#define FIXED_ONE	(UINT32_C(1) << 31)
+
+/* Length of one output sample in the frequency timers. */
+#define FIXED_SAMPLE	(UINT32_C(1) << 16)
+
+/* Maximum channel volume multiplied by the volume of each channel, in units
+ * of 1/65536. */
+static const uint16_t fixed_volume[16] = {
+	0, 4369, 8738, 13107, 17476, 21845, 26214, 30583,
+	34952, 39321, 43690, 48059, 52428, 56797, 61166, 65535
+};
+
+/**
+ * Returns the increment of a counter that fires num / den times a second,
+ * rounded to the nearest value.
+ */
+static uint32_t fixed_inc(const uint32_t num, const uint32_t den)
+{
+	const uint_fast64_t d = (uint_fast64_t)den *
+				(uint32_t)AUDIO_SAMPLE_RATE;
+	return (((uint_fast64_t)num << 31) + d / 2) / d;
+}
+
+/**
+ * Set the time between steps of a channel that steps every clocks clock
+ * cycles.
+ */
+static void set_fixed_period(struct chan *c, const uint_fast32_t clocks)
+{
+	const uint_fast64_t t = (uint_fast64_t)AUDIO_SAMPLE_RATE *
+				FIXED_SAMPLE * clocks;
+	const uint32_t period = t / (uint_fast64_t)DMG_CLOCK_FREQ;
+
+	if (clocks == c->fixed.clocks)
+		return;
+
+	/* Keep the phase of the channel, as the floating point path does.
+	 * The counter is only zero before the channel is first rendered. */
+	if (c->fixed.freq_counter == 0)
+		c->fixed.freq_counter = period;
+	else
+		c->fixed.freq_counter = (uint_fast64_t)c->fixed.freq_counter *
+					period / c->fixed.period;
+
+	c->fixed.clocks = clocks;
+	c->fixed.period = period;
+	c->fixed.period_rem = t % (uint_fast64_t)DMG_CLOCK_FREQ;
+	c->fixed.period_err = 0;
+}
+
+/**
+ * Returns the time until the step after the next. The remainder of the
+ * period is carried between steps, so that the frequency is exact.
+ */
+static uint32_t next_fixed_period(struct chan *c)
+{
+	c->fixed.period_err += c->fixed.period_rem;
+
+	if (c->fixed.period_err >= (uint32_t)DMG_CLOCK_FREQ) {
+		c->fixed.period_err -= (uint32_t)DMG_CLOCK_FREQ;
+		return c->fixed.period + 1;
+	}
+
+	return c->fixed.period;
+}
+
+/**
+ * Run the frequency timer for one sample without rendering the channel.
+ *
+ * \return	number of steps of the timer.
+ */
+static uint_fast32_t skip_fixed(struct chan *c)
+{
+	uint32_t left = FIXED_SAMPLE;
+	uint_fast32_t steps = 0;
+
+	while (c->fixed.freq_counter <= left) {
+		left -= c->fixed.freq_counter;
+		c->fixed.freq_counter = next_fixed_period(c);
+		steps++;
+	}
+	c->fixed.freq_counter -= left;
+
+	return steps;
+}
+
+static int16_t hipass_fixed(struct chan *c, const int32_t sample)
+{
+#if ENABLE_HIPASS
+	/* 32637 / 32768 is the 0.996 used by hipass(). */
+	const int32_t out = sample - c->fixed.capacitor;
+	c->fixed.capacitor = sample - ((out * 32637) >> 15);
+#else
+	const int32_t out = sample;
+#endif
+	return out > INT16_MAX ? INT16_MAX : out < INT16_MIN ? INT16_MIN : out;
+}
+
+static void update_env_fixed(struct chan *c)
+{
+	c->fixed.env_counter += c->fixed.env_inc;
+
+	while (c->fixed.env_counter > FIXED_ONE) {
+		env_step(c);
+		c->fixed.env_counter -= FIXED_ONE;
+	}
+}
+
+static void update_len_fixed(struct minigb_apu_ctx *ctx, struct chan *c)
+{
+	if (c->len.enabled) {
+		c->fixed.len_counter += c->fixed.len_inc;
+		if (c->fixed.len_counter > FIXED_ONE) {
+			chan_enable(ctx, c - ctx->chans, 0);
+			c->fixed.len_counter = 0;
+		}
+	}
+}
+
+static void update_sweep_fixed(struct chan *c)
+{
+	c->fixed.sweep_counter += c->fixed.sweep_inc;
+
+	while (c->fixed.sweep_counter > FIXED_ONE) {
+		if (sweep_step(c))
+			set_fixed_period(c, (2048 - c->freq) << 2);
+		c->fixed.sweep_counter -= FIXED_ONE;
+	}
+}
+
+static void update_square_fixed(struct minigb_apu_ctx *ctx,
+				int16_t *restrict out, const bool ch2,
+				const unsigned len)
+{
+	struct chan *c = ctx->chans + ch2;
+	if (!c->powered) {
+		memset(out, 0, len * sizeof(*out));
+		return;
+	}
+
+	/* The sweep may leave the frequency above 2047, but then the channel
+	 * is disabled. */
+	set_fixed_period(c, (2048 - (c->freq & 0x7FF)) << 2);
+
+	for (unsigned i = 0; i < len; i++) {
+		uint32_t left = FIXED_SAMPLE;
+		int32_t sum = 0;
+
+		update_len_fixed(ctx, c);
+
+		if (!c->enabled) {
+			out[i] = 0;
+			continue;
+		}
+
+		update_env_fixed(c);
+		if (!ch2)
+			update_sweep_fixed(c);
+
+		if (chan_silent(ctx, c)) {
+			chan_skip(c, ch2, skip_fixed(c));
+			out[i] = 0;
+			continue;
+		}
+
+		while (c->fixed.freq_counter <= left) {
+			sum += c->val * (int32_t)c->fixed.freq_counter;
+			left -= c->fixed.freq_counter;
+			c->fixed.freq_counter = next_fixed_period(c);
+			c->duty_counter = (c->duty_counter + 1) & 7;
+			c->val = (c->duty & (1 << c->duty_counter)) ? 1 : -1;
+		}
+		sum += c->val * (int32_t)left;
+		c->fixed.freq_counter -= left;
+
+		out[i] = hipass_fixed(c,
+			((sum >> 2) * fixed_volume[c->volume]) >> 16);
+	}
+}
+
+static void update_wave_fixed(struct minigb_apu_ctx *ctx,
+			      int16_t *restrict out, const unsigned len)
+{
+	/* Middle of the wave at each volume, in units of 1/65536. */
+	static const int32_t offset[3] = { 491520, 245760, 98304 };
+	struct chan *c = ctx->chans + 2;
+	if (!c->powered) {
+		memset(out, 0, len * sizeof(*out));
+		return;
+	}
+
+	set_fixed_period(c, (2048 - c->freq) << 1);
+
+	for (unsigned i = 0; i < len; i++) {
+		uint32_t left = FIXED_SAMPLE;
+		int32_t sum = 0;
+
+		update_len_fixed(ctx, c);
+
+		if (!c->enabled) {
+			out[i] = 0;
+			continue;
+		}
+
+		if (chan_silent(ctx, c)) {
+			chan_skip(c, 2, skip_fixed(c));
+			out[i] = 0;
+			continue;
+		}
+
+		c->sample = wave_sample(ctx, c->val, c->volume);
+
+		while (c->fixed.freq_counter <= left) {
+			sum += c->sample * (int32_t)c->fixed.freq_counter;
+			left -= c->fixed.freq_counter;
+			c->fixed.freq_counter = next_fixed_period(c);
+			c->val = (c->val + 1) & 31;
+			c->sample = wave_sample(ctx, c->val, c->volume);
+		}
+		sum += c->sample * (int32_t)left;
+		c->fixed.freq_counter -= left;
+
+		if (c->volume == 0) {
+			out[i] = 0;
+			continue;
+		}
+
+		/* 2185 / 65536 is 1 / 30, which scales 7.5 to 1 << 14 from
+		 * units of 1/65536. */
+		out[i] = hipass_fixed(c,
+			((sum - offset[c->volume - 1]) * 2185) >> 16);
+	}
+}
+
+static void update_noise_fixed(struct minigb_apu_ctx *ctx,
+			       int16_t *restrict out, const unsigned len)
+{
+	struct chan *c = ctx->chans + 3;
+	if (!c->powered) {
+		memset(out, 0, len * sizeof(*out));
+		return;
+	}
+
+	set_fixed_period(c, (uint_fast32_t)(uint_fast8_t[]){
+			8, 16, 32, 48, 64, 80, 96, 112
+		}[c->lfsr_div] << c->freq);
+
+	if (c->freq >= 14)
+		c->enabled = 0;
+
+	for (unsigned i = 0; i < len; i++) {
+		uint32_t left = FIXED_SAMPLE;
+		int32_t sum = 0;
+
+		update_len_fixed(ctx, c);
+
+		if (!c->enabled) {
+			out[i] = 0;
+			continue;
+		}
+
+		update_env_fixed(c);
+
+		if (chan_silent(ctx, c)) {
+			chan_skip(c, 3, skip_fixed(c));
+			out[i] = 0;
+			continue;
+		}
+
+		while (c->fixed.freq_counter <= left) {
+			const unsigned tap = c->lfsr_wide ? 13 : 5;
+
+			c->lfsr_reg = (c->lfsr_reg << 1) | (c->val == 1);
+			c->val = !(((c->lfsr_reg >> (tap + 1)) & 1) ^
+				   ((c->lfsr_reg >> tap) & 1)) ? 1 : -1;
+
+			/* As in update_noise(), the new value is held for the
+			 * time before the step. */
+			sum += c->val * (int32_t)c->fixed.freq_counter;
+			left -= c->fixed.freq_counter;
+			c->fixed.freq_counter = next_fixed_period(c);
+		}
+		sum += c->val * (int32_t)left;
+		c->fixed.freq_counter -= left;
+
+		out[i] = hipass_fixed(c,
+			((sum >> 2) * fixed_volume[c->volume]) >> 16);
+	}
+}
+
+/**
+ * Mix four channel buffers of len samples into stereo samples. Each output is
+ * the sum of each channel multiplied by its gain, divided by 1 << 14.
+ */
+static void mix_fixed(int16_t *restrict out,
+		      int16_t (*restrict buf)[MINIGB_APU_MAX_FRAME_SAMPLES],
+		      const int16_t *gl, const int16_t *gr, const unsigned len)
+{
+	unsigned i = 0;
+
+	/* On x86, compilers vectorise the scalar loop below, and SSE2
+	 * intrinsics were no faster, so only NEON has its own loop. */
+#if defined(MIX_NEON)
+	for (; i + 8 <= len; i += 8) {
+		const int16x8_t c0 = vld1q_s16(&buf[0][i]);
+		const int16x8_t c1 = vld1q_s16(&buf[1][i]);
+		const int16x8_t c2 = vld1q_s16(&buf[2][i]);
+		const int16x8_t c3 = vld1q_s16(&buf[3][i]);
+		int32x4_t l_lo, l_hi, r_lo, r_hi;
+		int16x8x2_t lr;
+
+		l_lo = vmull_n_s16(vget_low_s16(c0), gl[0]);
+		l_lo = vmlal_n_s16(l_lo, vget_low_s16(c1), gl[1]);
+		l_lo = vmlal_n_s16(l_lo, vget_low_s16(c2), gl[2]);
+		l_lo = vmlal_n_s16(l_lo, vget_low_s16(c3), gl[3]);
+		l_hi = vmull_n_s16(vget_high_s16(c0), gl[0]);
+		l_hi = vmlal_n_s16(l_hi, vget_high_s16(c1), gl[1]);
+		l_hi = vmlal_n_s16(l_hi, vget_high_s16(c2), gl[2]);
+		l_hi = vmlal_n_s16(l_hi, vget_high_s16(c3), gl[3]);
+		r_lo = vmull_n_s16(vget_low_s16(c0), gr[0]);
+		r_lo = vmlal_n_s16(r_lo, vget_low_s16(c1), gr[1]);
+		r_lo = vmlal_n_s16(r_lo, vget_low_s16(c2), gr[2]);
+		r_lo = vmlal_n_s16(r_lo, vget_low_s16(c3), gr[3]);
+		r_hi = vmull_n_s16(vget_high_s16(c0), gr[0]);
+		r_hi = vmlal_n_s16(r_hi, vget_high_s16(c1), gr[1]);
+		r_hi = vmlal_n_s16(r_hi, vget_high_s16(c2), gr[2]);
+		r_hi = vmlal_n_s16(r_hi, vget_high_s16(c3), gr[3]);
+
+		lr.val[0] = vcombine_s16(vqshrn_n_s32(l_lo, 14),
+					 vqshrn_n_s32(l_hi, 14));
+		lr.val[1] = vcombine_s16(vqshrn_n_s32(r_lo, 14),
+					 vqshrn_n_s32(r_hi, 14));
+		vst2q_s16(&out[i * 2], lr);
+	}
+#endif
+
+	for (; i < len; i++) {
+		int32_t l = 0, r = 0;
+
+		for (unsigned ch = 0; ch < 4; ch++) {
+			l += buf[ch][i] * gl[ch];
+			r += buf[ch][i] * gr[ch];
 		}
+
+		l >>= 14;
+		r >>= 14;
+		out[i * 2 + 0] = l > INT16_MAX ? INT16_MAX :
+				 l < INT16_MIN ? INT16_MIN : l;
+		out[i * 2 + 1] = r > INT16_MAX ? INT16_MAX :
+				 r < INT16_MIN ? INT16_MIN : r;
 	}
 }
 
+/**
+ * Render stereo samples between start and end of a buffer of signed 16-bit
+ * samples, replacing the samples in the buffer.
+ */
+static void render_fixed(struct minigb_apu_ctx *ctx, void *restrict samples,
+			 const unsigned start, const unsigned end)
+{
+	const uint8_t vol = ctx->audio_mem[0xFF24 - AUDIO_ADDR_COMPENSATION];
+	int16_t buf[4][MINIGB_APU_MAX_FRAME_SAMPLES];
+	int16_t gl[4], gr[4];
+
+	update_square_fixed(ctx, buf[0], 0, end - start);
+	update_square_fixed(ctx, buf[1], 1, end - start);
+	update_wave_fixed(ctx, buf[2], end - start);
+	update_noise_fixed(ctx, buf[3], end - start);
+
+	if (ctx->synthesis_off) {
+		memset((int16_t *)samples + start * 2, 0,
+		       (end - start) * 2 * sizeof(int16_t));
+		return;
+	}
+
+	/* 1170 / 32768 is 0.25 / 7, the scale of each channel multiplied by
+	 * the scale of the master volume in update_square(). */
+	for (unsigned ch = 0; ch < 4; ch++) {
+		const struct chan *c = ctx->chans + ch;
+
+		gl[ch] = c->muted ? 0 : c->on_left * ((vol >> 4) & 0x07) * 1170;
+		gr[ch] = c->muted ? 0 : c->on_right * (vol & 0x07) * 1170;
+	}
+
+	mix_fixed((int16_t *)samples + start * 2, buf, gl, gr, end - start);
+}
+
+/**
+ * Render stereo samples between start and end of a buffer of floating point
+ * samples, adding each channel to the samples already in the buffer.
+ */
+static void render(struct minigb_apu_ctx *ctx, void *restrict out,
+		   const unsigned start, const unsigned end)
+{
+	float *samples = out;
+
+	update_square(ctx, samples, 0, start, end);
+	update_square(ctx, samples, 1, start, end);
+	update_wave(ctx, samples, start, end);
+	update_noise(ctx, samples, start, end);
+}
+
 /**
  * SDL2 style audio callback function.
  */
-void audio_callback(void *userdata, uint8_t *restrict stream, int len)
+void minigb_apu_audio_callback(void *userdata, uint8_t *restrict stream,
+			       int len)
 {
+	struct minigb_apu_ctx *ctx = userdata;
 	float *samples = (float *)stream;
 
-	/* Appease unused variable warning. */
-	(void)userdata;
-
 	memset(stream, 0, len);
-
-	update_square(samples, 0);
-	update_square(samples, 1);
-	update_wave(samples);
-	update_noise(samples);
+	render(ctx, samples, 0, len / (2 * sizeof(float)));
 }
 
-static void chan_trigger(uint_fast8_t i)
+static void chan_trigger(struct minigb_apu_ctx *ctx, uint_fast8_t i)
 {
-	struct chan *c = chans + i;
+	struct chan *c = ctx->chans + i;
 
-	chan_enable(i, 1);
+	chan_enable(ctx, i, 1);
 	c->volume = c->volume_init;
 
+	/* Reload the frequency timer, so that the phase of the channel after a
+	 * trigger does not depend on rounding in earlier frames. */
+	c->freq_counter = 0.0f;
+	c->fixed.freq_counter = 0;
+	c->fixed.clocks = 0;
+	c->blip.timer = 0;
+
 	// volume envelope
 	{
-		uint8_t val =
-			audio_mem[(0xFF12 + (i * 5)) - AUDIO_ADDR_COMPENSATION];
+		uint8_t val = ctx->audio_mem[(0xFF12 + (i * 5)) -
+					     AUDIO_ADDR_COMPENSATION];
 
 		c->env.step = val & 0x07;
 		c->env.up   = val & 0x08 ? 1 : 0;
@@ -379,11 +844,15 @@ static void chan_trigger(uint_fast8_t i)
 						   AUDIO_SAMPLE_RATE :
 					   8.0f / AUDIO_SAMPLE_RATE;
 		c->env.counter = 0.0f;
+		c->blip.env_timer = BLIP_ENV_CYCLES * c->env.step;
+		c->fixed.env_inc = c->env.step ? fixed_inc(64, c->env.step) :
+						 fixed_inc(8, 1);
+		c->fixed.env_counter = 0;
 	}
 
 	// freq sweep
 	if (i == 0) {
-		uint8_t val = audio_mem[0xFF10 - AUDIO_ADDR_COMPENSATION];
+		uint8_t val = ctx->audio_mem[0xFF10 - AUDIO_ADDR_COMPENSATION];
 
 		c->sweep.freq  = c->freq;
 		c->sweep.rate  = (val >> 4) & 0x07;
@@ -394,6 +863,12 @@ static void chan_trigger(uint_fast8_t i)
 					       AUDIO_SAMPLE_RATE :
 				       0;
 		c->sweep.counter = nexttowardf(1.0f, 1.1f);
+		c->fixed.sweep_inc = c->sweep.rate ?
+					fixed_inc(128, c->sweep.rate) : 0;
+		/* Just above one, so that the first sample applies the sweep
+		 * even if it is not repeated. */
+		c->fixed.sweep_counter = FIXED_ONE + 1;
+		c->blip.sweep_timer = 0;
 	}
 
 	int len_max = 64;
@@ -409,6 +884,9 @@ static void chan_trigger(uint_fast8_t i)
 	c->len.inc =
 		(256.0f / (float)(len_max - c->len.load)) / AUDIO_SAMPLE_RATE;
 	c->len.counter = 0.0f;
+	c->fixed.len_inc = fixed_inc(256, len_max - c->len.load);
+	c->fixed.len_counter = 0;
+	c->blip.len_timer = BLIP_LEN_CYCLES * (len_max - c->len.load);
 }
 
 /**
@@ -417,123 +895,695 @@ static void chan_trigger(uint_fast8_t i)
  *				This is not checked in this function.
  * \return		Byte at address.
  */
-uint8_t audio_read(const uint16_t addr)
+uint8_t minigb_apu_audio_read(struct minigb_apu_ctx *ctx,
+			      const uint16_t addr)
 {
 	static uint8_t ortab[] = { 0x80, 0x3f, 0x00, 0xff, 0xbf, 0xff,
 				   0x3f, 0x00, 0xff, 0xbf, 0x7f, 0xff,
 				   0x9f, 0xff, 0xbf, 0xff, 0xff, 0x00,
 				   0x00, 0xbf, 0x00, 0x00, 0x70 };
 
+	const uint8_t val = ctx->cpu_mem[addr - AUDIO_ADDR_COMPENSATION];
+
 	if (addr > 0xFF26)
-		return audio_mem[addr - AUDIO_ADDR_COMPENSATION];
-	
-	return audio_mem[addr - AUDIO_ADDR_COMPENSATION] | ortab[addr - 0xFF10];
+		return val;
+
+	/* Channel status is only known to the synthesis state. With queued
+	 * writes, it is updated as each frame is rendered, so triggers and
+	 * length expiry during the current frame are not yet seen. */
+	if (addr == 0xFF26)
+		return (val & 0x80) | ortab[addr - 0xFF10] |
+		       (ctx->audio_mem[0xFF26 - AUDIO_ADDR_COMPENSATION] & 0x0F);
+
+	return val | ortab[addr - 0xFF10];
 }
 
 /**
- * Write audio register.
- * \param addr	Address of audio register. Must be 0xFF10 <= addr <= 0xFF3F.
- *				This is not checked in this function.
- * \param val	Byte to write at address.
+ * Apply a write to an audio register to the state used for synthesis.
  */
-void audio_write(const uint16_t addr, const uint8_t val)
+static void apply_write(struct minigb_apu_ctx *ctx, const uint16_t addr,
+			const uint8_t val)
 {
 	/* Find sound channel corresponding to register address. */
 	uint_fast8_t i = (addr - 0xFF10) / 5;
-	audio_mem[addr - AUDIO_ADDR_COMPENSATION] = val;
+	struct chan *c = ctx->chans;
+	ctx->audio_mem[addr - AUDIO_ADDR_COMPENSATION] = val;
 
 	switch (addr) {
 	case 0xFF12:
 	case 0xFF17:
 	case 0xFF21: {
-		chans[i].volume_init = val >> 4;
-		chans[i].powered     = (val >> 3) != 0;
+		c[i].volume_init = val >> 4;
+		c[i].powered     = (val >> 3) != 0;
 
 		// "zombie mode" stuff, needed for Prehistorik Man and probably
 		// others
-		if (chans[i].powered && chans[i].enabled) {
-			if ((chans[i].env.step == 0 && chans[i].env.inc != 0)) {
+		if (c[i].powered && c[i].enabled) {
+			if ((c[i].env.step == 0 && c[i].env.inc != 0)) {
 				if (val & 0x08) {
-					chans[i].volume++;
+					c[i].volume++;
 				} else {
-					chans[i].volume += 2;
+					c[i].volume += 2;
 				}
 			} else {
-				chans[i].volume = 16 - chans[i].volume;
+				c[i].volume = 16 - c[i].volume;
 			}
 
-			chans[i].volume &= 0x0F;
-			chans[i].env.step = val & 0x07;
+			c[i].volume &= 0x0F;
+			c[i].env.step = val & 0x07;
 		}
 	} break;
 
 	case 0xFF1C:
-		chans[i].volume = chans[i].volume_init = (val >> 5) & 0x03;
+		c[i].volume = c[i].volume_init = (val >> 5) & 0x03;
 		break;
 
 	case 0xFF11:
 	case 0xFF16:
 	case 0xFF20: {
 		const uint8_t duty_lookup[] = { 0x10, 0x30, 0x3C, 0xCF };
-		chans[i].len.load	   = val & 0x3f;
-		chans[i].duty		    = duty_lookup[val >> 6];
+		c[i].len.load	   = val & 0x3f;
+		c[i].duty		    = duty_lookup[val >> 6];
 		break;
 	}
 
 	case 0xFF1B:
-		chans[i].len.load = val;
+		c[i].len.load = val;
 		break;
 
 	case 0xFF13:
 	case 0xFF18:
 	case 0xFF1D:
-		chans[i].freq &= 0xFF00;
-		chans[i].freq |= val;
+		c[i].freq &= 0xFF00;
+		c[i].freq |= val;
 		break;
 
 	case 0xFF1A:
-		chans[i].powered = (val & 0x80) != 0;
-		chan_enable(i, val & 0x80);
+		c[i].powered = (val & 0x80) != 0;
+		chan_enable(ctx, i, val & 0x80);
 		break;
 
 	case 0xFF14:
 	case 0xFF19:
 	case 0xFF1E:
-		chans[i].freq &= 0x00FF;
-		chans[i].freq |= ((val & 0x07) << 8);
+		c[i].freq &= 0x00FF;
+		c[i].freq |= ((val & 0x07) << 8);
 		/* Intentional fall-through. */
 	case 0xFF23:
-		chans[i].len.enabled = val & 0x40 ? 1 : 0;
+		c[i].len.enabled = val & 0x40 ? 1 : 0;
 		if (val & 0x80)
-			chan_trigger(i);
+			chan_trigger(ctx, i);
 
 		break;
 
 	case 0xFF22:
-		chans[3].freq      = val >> 4;
-		chans[3].lfsr_wide = !(val & 0x08);
-		chans[3].lfsr_div  = val & 0x07;
+		c[3].freq      = val >> 4;
+		c[3].lfsr_wide = !(val & 0x08);
+		c[3].lfsr_div  = val & 0x07;
 		break;
 
 	case 0xFF24:
-		vol_l = ((val >> 4) & 0x07) / 7.0f;
-		vol_r = (val & 0x07) / 7.0f;
+		ctx->vol_l = ((val >> 4) & 0x07) / 7.0f;
+		ctx->vol_r = (val & 0x07) / 7.0f;
 		break;
 
 	case 0xFF25:
 		for (uint_fast8_t i = 0; i < 4; ++i) {
-			chans[i].on_left  = (val >> (4 + i)) & 1;
-			chans[i].on_right = (val >> i) & 1;
+			c[i].on_left  = (val >> (4 + i)) & 1;
+			c[i].on_right = (val >> i) & 1;
 		}
 		break;
 	}
 }
 
-void audio_init(void)
+/**
+ * Write audio register.
+ * \param addr	Address of audio register. Must be 0xFF10 <= addr <= 0xFF3F.
+ *				This is not checked in this function.
+ * \param val	Byte to write at address.
+ */
+void minigb_apu_audio_write(struct minigb_apu_ctx *ctx, const uint16_t addr,
+			    const uint8_t val)
+{
+	ctx->cpu_mem[addr - AUDIO_ADDR_COMPENSATION] = val;
+	apply_write(ctx, addr, val);
+}
+
+void minigb_apu_audio_write_at(struct minigb_apu_ctx *ctx,
+			       const uint_fast32_t cycle, const uint16_t addr,
+			       const uint8_t val)
+{
+	struct minigb_apu_write *w;
+
+	/* The CPU sees the new value immediately. */
+	ctx->cpu_mem[addr - AUDIO_ADDR_COMPENSATION] = val;
+
+	/* Lose the timing of the queued writes rather than the writes
+	 * themselves. They are applied in order before this one, so that none
+	 * of them overwrites a later write when the frame is rendered. */
+	if (ctx->queue_len == MINIGB_APU_QUEUE_SIZE) {
+		for (unsigned i = 0; i < ctx->queue_len; i++)
+			apply_write(ctx, ctx->queue[i].addr,
+				    ctx->queue[i].val);
+
+		ctx->queue_len = 0;
+	}
+
+	w = &ctx->queue[ctx->queue_len++];
+	w->cycle = cycle;
+	w->addr = addr;
+	w->val = val;
+}
+
+/**
+ * Returns the number of samples in a frame lasting frame_cycles clock cycles.
+ * A frame too long for MINIGB_APU_MAX_FRAME_SAMPLES is first cut short, by
+ * reducing frame_cycles, so that the fraction of a sample carried over
+ * matches the samples made.
+ */
+static unsigned frame_len(struct minigb_apu_ctx *ctx,
+			  uint_fast32_t *frame_cycles)
+{
+	const uint_fast64_t max_cycles =
+		((MINIGB_APU_MAX_FRAME_SAMPLES + 1) *
+		 (uint_fast64_t)DMG_CLOCK_FREQ - 1 - ctx->sample_frac) /
+		(uint_fast64_t)AUDIO_SAMPLE_RATE;
+	uint_fast64_t total;
+
+	if (*frame_cycles > max_cycles)
+		*frame_cycles = max_cycles;
+
+	/* Carry the fraction of a sample over to the next frame, so that
+	 * exactly AUDIO_SAMPLE_RATE samples are made per second of emulation. */
+	total = ctx->sample_frac +
+		(uint_fast64_t)*frame_cycles * (uint_fast64_t)AUDIO_SAMPLE_RATE;
+	ctx->sample_frac = total % (uint_fast64_t)DMG_CLOCK_FREQ;
+	return total / (uint_fast64_t)DMG_CLOCK_FREQ;
+}
+
+/*
+ * Band-limited path.
+ *
+ * Each channel is stepped at the clock cycle of each of its events, rather
+ * than once for each sample. Whenever the stereo output of a channel changes,
+ * the difference is added to a buffer as a band-limited step, which is a
+ * windowed sinc kernel chosen by the position of the change between two
+ * samples. The samples are the running sum of the buffer.
+ *
+ * Channels are mixed at the same levels as the floating point path, and the
+ * high-pass filter is applied to the mix of all channels.
+ */
+
+static void blip_init(struct minigb_apu_ctx *ctx)
+{
+	const double pi = 3.14159265358979323846;
+	/* Cut-off frequency as a fraction of the Nyquist frequency. */
+	const double cutoff = 0.9;
+	const int half = MINIGB_APU_BLIP_WIDTH / 2;
+
+	for (unsigned p = 0; p < MINIGB_APU_BLIP_PHASES; p++) {
+		float *k = ctx->blip_kernel[p];
+		double sum = 0.0;
+
+		for (int j = 0; j < MINIGB_APU_BLIP_WIDTH; j++) {
+			/* Distance of the sample from the step. */
+			const double x = j - (half - 1) -
+				(double)p / MINIGB_APU_BLIP_PHASES;
+			const double sinc = x == 0.0 ? 1.0 :
+				sin(pi * cutoff * x) / (pi * cutoff * x);
+			const double blackman = 0.42 +
+				0.5 * cos(pi * x / half) +
+				0.08 * cos(2.0 * pi * x / half);
+
+			k[j] = sinc * blackman;
+			sum += k[j];
+		}
+
+		/* Each step must add exactly its height to the output. */
+		for (int j = 0; j < MINIGB_APU_BLIP_WIDTH; j++)
+			k[j] /= sum;
+	}
+}
+
+/**
+ * Add a step of height dl and dr to each side at clock cycle t of the frame.
+ */
+static void blip_add(struct minigb_apu_ctx *ctx, const uint_fast32_t t,
+		     const float dl, const float dr)
+{
+	const uint_fast64_t pos = ctx->blip_frac +
+				  (uint_fast64_t)t * (uint32_t)AUDIO_SAMPLE_RATE;
+	const unsigned phase = pos % (uint32_t)DMG_CLOCK_FREQ *
+			       MINIGB_APU_BLIP_PHASES /
+			       (uint32_t)DMG_CLOCK_FREQ;
+	const unsigned i = MIN(pos / (uint32_t)DMG_CLOCK_FREQ,
+			       MINIGB_APU_MAX_FRAME_SAMPLES);
+	const float *k = ctx->blip_kernel[phase];
+	float *l = ctx->blip_buf[0] + i;
+	float *r = ctx->blip_buf[1] + i;
+
+	for (unsigned j = 0; j < MINIGB_APU_BLIP_WIDTH; j++) {
+		l[j] += dl * k[j];
+		r[j] += dr * k[j];
+	}
+}
+
+/**
+ * Add a step at clock cycle t if the output of channel i has changed.
+ */
+static void blip_update(struct minigb_apu_ctx *ctx, const unsigned i,
+			const uint_fast32_t t)
+{
+	struct chan *c = ctx->chans + i;
+	float out = 0.0f, l, r;
+
+	if (c->enabled && c->powered && !chan_silent(ctx, c)) {
+		if (i != 2) {
+			out = c->val * (c->volume / 15.0f);
+		} else if (c->volume > 0) {
+			const float diff = (float[]){ 7.5f, 3.75f,
+						      1.5f }[c->volume - 1];
+			out = (wave_sample(ctx, c->val, c->volume) - diff) /
+			      7.5f;
+		}
+	}
+
+	l = out * 0.25f * c->on_left * ctx->vol_l;
+	r = out * 0.25f * c->on_right * ctx->vol_r;
+
+	if (l != c->blip.out_l || r != c->blip.out_r) {
+		blip_add(ctx, t, l - c->blip.out_l, r - c->blip.out_r);
+		c->blip.out_l = l;
+		c->blip.out_r = r;
+	}
+}
+
+/**
+ * Returns the clock cycles between steps of the frequency timer of channel i.
+ */
+static uint32_t blip_period(const struct chan *c, const unsigned i)
+{
+	switch (i) {
+	case 2:
+		return (2048 - c->freq) * 2;
+
+	case 3:
+		return (uint32_t)((uint_fast8_t[]){
+			8, 16, 32, 48, 64, 80, 96, 112
+		}[c->lfsr_div]) << c->freq;
+
+	default:
+		/* The sweep may leave the frequency above 2047, but then the
+		 * channel is disabled. */
+		return (2048 - (c->freq & 0x7FF)) * 4;
+	}
+}
+
+static void blip_step(struct chan *c, const unsigned i)
+{
+	switch (i) {
+	case 2:
+		c->val = (c->val + 1) & 31;
+		break;
+
+	case 3: {
+		const unsigned tap = c->lfsr_wide ? 13 : 5;
+
+		c->lfsr_reg = (c->lfsr_reg << 1) | (c->val == 1);
+		c->val = !(((c->lfsr_reg >> (tap + 1)) & 1) ^
+			   ((c->lfsr_reg >> tap) & 1)) ? 1 : -1;
+		break;
+	}
+
+	default:
+		c->duty_counter = (c->duty_counter + 1) & 7;
+		c->val = (c->duty & (1 << c->duty_counter)) ? 1 : -1;
+		break;
+	}
+}
+
+/**
+ * Run channel i from clock cycle t to end of the frame, adding a step to the
+ * buffer at each change in its output.
+ */
+static void blip_run(struct minigb_apu_ctx *ctx, const unsigned i,
+		     uint_fast32_t t, const uint_fast32_t end)
+{
+	struct chan *c = ctx->chans + i;
+
+	if (i == 3 && c->freq >= 14)
+		c->enabled = 0;
+
+	blip_update(ctx, i, t);
+
+	while (t < end && c->enabled && c->powered) {
+		const bool env = i != 2 && c->env.step && c->env.inc != 0;
+		const bool sweep = i == 0 &&
+			(c->sweep.rate || c->blip.sweep_timer == 0);
+		/* A silent channel runs until its next event, and its
+		 * frequency timer is advanced without adding steps. */
+		const bool silent = chan_silent(ctx, c);
+		uint_fast32_t dt, limit = end - t;
+
+		/* A timer of zero is reloaded, as after a trigger. */
+		if (c->blip.timer == 0)
+			c->blip.timer = blip_period(c, i);
+
+		/* Run until the next event of the channel. */
+		if (c->len.enabled)
+			limit = MIN(limit, c->blip.len_timer);
+		if (env)
+			limit = MIN(limit, c->blip.env_timer);
+		if (sweep)
+			limit = MIN(limit, c->blip.sweep_timer);
+		dt = silent ? limit : MIN(limit, c->blip.timer);
+
+		/* Skip the steps of a square channel that do not change its
+		 * output, so that high notes cost no more than low ones. */
+		if (i < 2 && !silent && dt == c->blip.timer) {
+			const uint32_t period = blip_period(c, i);
+
+			while (dt + period <= limit &&
+			       ((c->duty >> ((c->duty_counter + 1) & 7)) & 1) ==
+			       (c->val > 0)) {
+				c->duty_counter = (c->duty_counter + 1) & 7;
+				dt += period;
+			}
+
+			c->blip.timer = dt;
+		}
+
+		t += dt;
+
+		if (!silent) {
+			c->blip.timer -= dt;
+			if (c->blip.timer == 0)
+				blip_step(c, i);
+		} else if (dt >= c->blip.timer) {
+			const uint32_t period = blip_period(c, i);
+			const uint_fast32_t rest = dt - c->blip.timer;
+
+			chan_skip(c, i, 1 + rest / period);
+			c->blip.timer = period - rest % period;
+		} else {
+			c->blip.timer -= dt;
+		}
+
+		if (c->len.enabled) {
+			c->blip.len_timer -= dt;
+			if (c->blip.len_timer == 0) {
+				chan_enable(ctx, i, 0);
+				c->blip.len_timer = BLIP_LEN_CYCLES *
+					((i == 2 ? 256 : 64) - c->len.load);
+			}
+		}
+
+		if (env) {
+			c->blip.env_timer -= dt;
+			if (c->blip.env_timer == 0) {
+				env_step(c);
+				c->blip.env_timer = BLIP_ENV_CYCLES *
+						    c->env.step;
+			}
+		}
+
+		if (sweep) {
+			c->blip.sweep_timer -= dt;
+			if (c->blip.sweep_timer == 0) {
+				sweep_step(c);
+				/* Without a rate, the sweep is only applied
+				 * once after a trigger. */
+				c->blip.sweep_timer = c->sweep.rate ?
+					BLIP_SWEEP_CYCLES * c->sweep.rate :
+					UINT32_MAX;
+			}
+		}
+
+		blip_update(ctx, i, t);
+	}
+}
+
+/**
+ * Sum the buffer into len stereo samples, and keep the steps that extend
+ * past the end of the frame for the next frame.
+ */
+static void blip_read(struct minigb_apu_ctx *ctx, float *restrict samples,
+		      const unsigned len)
+{
+	for (unsigned s = 0; s < 2; s++) {
+		float *buf = ctx->blip_buf[s];
+		float sum = ctx->blip_sum[s];
+#if ENABLE_HIPASS
+		float capacitor = ctx->blip_capacitor[s];
+#endif
+
+		for (unsigned i = 0; i < len; i++) {
+			float out;
+
+			sum += buf[i];
+			out = sum;
+#if ENABLE_HIPASS
+			out = sum - capacitor;
+			capacitor = sum - out * 0.996f;
+#endif
+			samples[i * 2 + s] = out;
+		}
+
+		memmove(buf, buf + len,
+			MINIGB_APU_BLIP_WIDTH * sizeof(*buf));
+		memset(buf + MINIGB_APU_BLIP_WIDTH, 0, len * sizeof(*buf));
+
+		ctx->blip_sum[s] = sum;
+#if ENABLE_HIPASS
+		ctx->blip_capacitor[s] = capacitor;
+#endif
+	}
+}
+
+unsigned minigb_apu_end_frame_blip(struct minigb_apu_ctx *ctx,
+				   uint_fast32_t frame_cycles,
+				   float *restrict samples)
+{
+	uint_fast32_t t = 0;
+	unsigned len;
+
+	ctx->blip_frac = ctx->sample_frac;
+	len = frame_len(ctx, &frame_cycles);
+
+	for (unsigned q = 0; q < ctx->queue_len; q++) {
+		const struct minigb_apu_write *w = &ctx->queue[q];
+		const uint_fast32_t at = MIN(w->cycle, frame_cycles);
+
+		if (at > t) {
+			for (unsigned i = 0; i < 4; i++)
+				blip_run(ctx, i, t, at);
+			t = at;
+		}
+
+		apply_write(ctx, w->addr, w->val);
+
+		for (unsigned i = 0; i < 4; i++)
+			blip_update(ctx, i, t);
+	}
+
+	for (unsigned i = 0; i < 4; i++)
+		blip_run(ctx, i, t, frame_cycles);
+
+	blip_read(ctx, samples, len);
+	ctx->queue_len = 0;
+	return len;
+}
+
+/**
+ * Render a frame using the given render function, applying queued writes.
+ */
+static unsigned end_frame(struct minigb_apu_ctx *ctx,
+			  uint_fast32_t frame_cycles, void *samples,
+			  void (*render_fn)(struct minigb_apu_ctx *, void *,
+					    unsigned, unsigned))
+{
+	const unsigned len = frame_len(ctx, &frame_cycles);
+	unsigned pos = 0;
+
+	for (unsigned i = 0; i < ctx->queue_len; i++) {
+		const struct minigb_apu_write *w = &ctx->queue[i];
+		unsigned at = len;
+
+		if (w->cycle < frame_cycles)
+			at = (uint_fast64_t)w->cycle * len / frame_cycles;
+
+		/* Render up to the sample at which the write happened. */
+		if (at > pos) {
+			render_fn(ctx, samples, pos, at);
+			pos = at;
+		}
+
+		apply_write(ctx, w->addr, w->val);
+	}
+
+	render_fn(ctx, samples, pos, len);
+	ctx->queue_len = 0;
+	return len;
+}
+
+unsigned minigb_apu_end_frame(struct minigb_apu_ctx *ctx,
+			      const uint_fast32_t frame_cycles,
+			      float *restrict samples)
+{
+	memset(samples, 0,
+	       MINIGB_APU_MAX_FRAME_SAMPLES * 2 * sizeof(*samples));
+	return end_frame(ctx, frame_cycles, samples, render);
+}
+
+unsigned minigb_apu_end_frame_s16(struct minigb_apu_ctx *ctx,
+				  const uint_fast32_t frame_cycles,
+				  int16_t *restrict samples)
+{
+	return end_frame(ctx, frame_cycles, samples, render_fixed);
+}
+
+void minigb_apu_set_synthesis(struct minigb_apu_ctx *ctx, const bool enable)
+{
+	ctx->synthesis_off = !enable;
+}
+
+/*
+ * Polyphase resampler.
+ *
+ * Each output sample is the sum of MINIGB_APU_RESAMPLE_TAPS input samples
+ * around its position, weighted by a windowed sinc kernel chosen by the
+ * fraction of an input sample that the position falls at. The position is
+ * kept as an input sample plus a fraction in units of 1 / out_rate, so no
+ * error builds up however long it runs.
+ */
+
+void minigb_apu_resampler_init(struct minigb_apu_resampler *r,
+			       const unsigned in_rate, const unsigned out_rate)
+{
+	const double pi = 3.14159265358979323846;
+	const int half = MINIGB_APU_RESAMPLE_TAPS / 2;
+	/* Cut-off frequency as a fraction of the Nyquist frequency of the
+	 * input, below the Nyquist frequency of the output. */
+	const double cutoff = 0.9 * (out_rate < in_rate ?
+				     (double)out_rate / in_rate : 1.0);
+
+	memset(r, 0, sizeof(*r));
+	r->in_rate = in_rate;
+	r->out_rate = out_rate;
+
+	/* Start with silence before the first input sample, so that the
+	 * output is delayed by half of the kernel. */
+	r->len = MINIGB_APU_RESAMPLE_TAPS - 1;
+	r->pos = half - 1;
+
+	for (unsigned p = 0; p < MINIGB_APU_RESAMPLE_PHASES; p++) {
+		float *k = r->kernel[p];
+		double sum = 0.0;
+
+		for (int j = 0; j < MINIGB_APU_RESAMPLE_TAPS; j++) {
+			/* Distance of the input sample from the output. */
+			const double x = j - (half - 1) -
+				(double)p / MINIGB_APU_RESAMPLE_PHASES;
+			const double sinc = x == 0.0 ? 1.0 :
+				sin(pi * cutoff * x) / (pi * cutoff * x);
+			const double blackman = 0.42 +
+				0.5 * cos(pi * x / half) +
+				0.08 * cos(2.0 * pi * x / half);
+
+			k[j] = sinc * blackman;
+			sum += k[j];
+		}
+
+		/* Keep the gain at 0 Hz at exactly one. */
+		for (int j = 0; j < MINIGB_APU_RESAMPLE_TAPS; j++)
+			k[j] /= sum;
+	}
+}
+
+/**
+ * Returns the sum of MINIGB_APU_RESAMPLE_TAPS input samples x multiplied by
+ * the kernel k.
+ */
+static float resample_dot(const float *restrict x, const float *restrict k)
+{
+#if defined(MIX_SSE2)
+	__m128 sum = _mm_mul_ps(_mm_loadu_ps(x), _mm_loadu_ps(k));
+
+	for (unsigned j = 4; j < MINIGB_APU_RESAMPLE_TAPS; j += 4)
+		sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(x + j),
+						 _mm_loadu_ps(k + j)));
+
+	sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+	sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+	return _mm_cvtss_f32(sum);
+#elif defined(MIX_NEON)
+	float32x4_t sum = vmulq_f32(vld1q_f32(x), vld1q_f32(k));
+	float32x2_t half;
+
+	for (unsigned j = 4; j < MINIGB_APU_RESAMPLE_TAPS; j += 4)
+		sum = vmlaq_f32(sum, vld1q_f32(x + j), vld1q_f32(k + j));
+
+	half = vadd_f32(vget_low_f32(sum), vget_high_f32(sum));
+	return vget_lane_f32(vpadd_f32(half, half), 0);
+#else
+	float sum = 0.0f;
+
+	for (unsigned j = 0; j < MINIGB_APU_RESAMPLE_TAPS; j++)
+		sum += x[j] * k[j];
+
+	return sum;
+#endif
+}
+
+unsigned minigb_apu_resample(struct minigb_apu_resampler *r,
+			     const float *restrict in, const unsigned len,
+			     float *restrict out)
+{
+	const unsigned half = MINIGB_APU_RESAMPLE_TAPS / 2;
+	unsigned n = 0, start;
+
+	/* Store each side separately, so that the kernel is applied to
+	 * consecutive samples. */
+	for (unsigned i = 0; i < len; i++) {
+		r->buf[0][r->len + i] = in[i * 2 + 0];
+		r->buf[1][r->len + i] = in[i * 2 + 1];
+	}
+	r->len += len;
+
+	/* Make each output sample that has all of its input. */
+	while (r->pos + half < r->len) {
+		const float *k = r->kernel[(uint_fast64_t)r->frac *
+					   MINIGB_APU_RESAMPLE_PHASES /
+					   r->out_rate];
+		const unsigned first = r->pos - (half - 1);
+
+		out[n * 2 + 0] = resample_dot(r->buf[0] + first, k);
+		out[n * 2 + 1] = resample_dot(r->buf[1] + first, k);
+		n++;
+
+		r->frac += r->in_rate;
+		while (r->frac >= r->out_rate) {
+			r->frac -= r->out_rate;
+			r->pos++;
+		}
+	}
+
+	/* Keep the input still needed for later output samples. */
+	start = r->pos - (half - 1);
+	r->len -= start;
+	r->pos -= start;
+	memmove(r->buf[0], r->buf[0] + start, r->len * sizeof(float));
+	memmove(r->buf[1], r->buf[1] + start, r->len * sizeof(float));
+
+	return n;
+}
+
+void minigb_apu_audio_init(struct minigb_apu_ctx *ctx)
 {
 	/* Initialise channels and samples. */
-	memset(chans, 0, sizeof(chans));
-	chans[0].val = chans[1].val = -1;
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->chans[0].val = ctx->chans[1].val = -1;
+	blip_init(ctx);
 
 	/* Initialise IO registers. */
 	{
@@ -544,7 +1594,7 @@ void audio_init(void)
 					      0x77, 0xF3, 0xF1 };
 
 		for(uint_fast8_t i = 0; i < sizeof(regs_init); ++i)
-			audio_write(0xFF10 + i, regs_init[i]);
+			minigb_apu_audio_write(ctx, 0xFF10 + i, regs_init[i]);
 	}
 
 	/* Initialise Wave Pattern RAM. */
@@ -555,6 +1605,6 @@ void audio_init(void)
 					      0xac, 0xdd, 0xda, 0x48 };
 
 		for(uint_fast8_t i = 0; i < sizeof(wave_init); ++i)
-			audio_write(0xFF30 + i, wave_init[i]);
+			minigb_apu_audio_write(ctx, 0xFF30 + i, wave_init[i]);
 	}
 }
@@ -7,8 +7,11 @@
 
 #pragma once
 
+#include <stdbool.h>
 #include <stdint.h>
 
+/* Rate at which samples are made. minigb_apu_resample() converts them to
+ * other rates. */
 #define AUDIO_SAMPLE_RATE	48000.0
 
 #define DMG_CLOCK_FREQ		4194304.0
@@ -17,23 +20,293 @@
 
 #define AUDIO_SAMPLES		((unsigned)(AUDIO_SAMPLE_RATE / VERTICAL_SYNC))
 
+#define AUDIO_MEM_SIZE		(0xFF3F - 0xFF10 + 1)
+
+/* Number of register writes that may be queued in a frame. */
+#define MINIGB_APU_QUEUE_SIZE	4096
+
+/* Maximum number of stereo samples made by minigb_apu_end_frame(). This is
+ * enough for frames of up to 89478 clock cycles. */
+#define MINIGB_APU_MAX_FRAME_SAMPLES	1024
+
+/* Number of samples and phases of the kernel of the band-limited path. */
+#define MINIGB_APU_BLIP_WIDTH	24
+#define MINIGB_APU_BLIP_PHASES	32
+
+/* Number of input samples and phases of the kernel of the resampler. */
+#define MINIGB_APU_RESAMPLE_TAPS	16
+#define MINIGB_APU_RESAMPLE_PHASES	256
+
+#ifndef ENABLE_HIPASS
+#	define ENABLE_HIPASS 1
+#endif
+
+/* Mix channels of the fixed-point path with NEON, and resample with SSE2 or
+ * NEON, when available. */
+#ifndef MINIGB_APU_SIMD
+#	define MINIGB_APU_SIMD 1
+#endif
+
+struct chan_len_ctr {
+	unsigned load : 6;
+	unsigned enabled : 1;
+	float counter;
+	float inc;
+};
+
+struct chan_vol_env {
+	unsigned step : 3;
+	unsigned up : 1;
+	float counter;
+	float inc;
+};
+
+struct chan_freq_sweep {
+	uint_fast16_t freq;
+	unsigned rate : 3;
+	unsigned up : 1;
+	unsigned shift : 3;
+	float counter;
+	float inc;
+};
+
+struct chan {
+	unsigned enabled : 1;
+	unsigned powered : 1;
+	unsigned on_left : 1;
+	unsigned on_right : 1;
+	unsigned muted : 1;
+
+	unsigned volume : 4;
+	unsigned volume_init : 4;
+
+	uint16_t freq;
+	float    freq_counter;
+	float    freq_inc;
+
+	int val;
+
+	struct chan_len_ctr    len;
+	struct chan_vol_env    env;
+	struct chan_freq_sweep sweep;
+
+	// square
+	uint8_t duty;
+	uint8_t duty_counter;
+
+	// noise
+	uint16_t lfsr_reg;
+	bool     lfsr_wide;
+	int      lfsr_div;
+
+	// wave
+	uint8_t sample;
+
+#if ENABLE_HIPASS
+	float capacitor;
+#endif
+
+	/* Counters used by the fixed-point path instead of the floating point
+	 * counters above. Frequency steps are timed in 1/65536 of a sample,
+	 * and the other counters reach 1 << 31 when they fire. */
+	struct {
+		uint32_t clocks;
+		uint32_t period, period_rem, period_err;
+		uint32_t freq_counter;
+		uint32_t env_inc, env_counter;
+		uint32_t len_inc, len_counter;
+		uint32_t sweep_inc, sweep_counter;
+		int32_t capacitor;
+	} fixed;
+
+	/* Timers used by the band-limited path, in clock cycles, and the
+	 * stereo output of the channel when last changed. */
+	struct {
+		uint32_t timer;
+		uint32_t len_timer;
+		uint32_t env_timer;
+		uint32_t sweep_timer;
+		float out_l, out_r;
+	} blip;
+};
+
+/**
+ * A register write that is applied when the frame is rendered.
+ */
+struct minigb_apu_write {
+	/* Clock cycles since the start of the frame. */
+	uint32_t cycle;
+	uint16_t addr;
+	uint8_t val;
+};
+
+/**
+ * State of one APU. Each emulated Game Boy must have its own context, which
+ * is passed to every function below.
+ */
+struct minigb_apu_ctx {
+	struct chan chans[4];
+	float vol_l, vol_r;
+
+	/**
+	 * Memory holding audio registers between 0xFF10 and 0xFF3F inclusive,
+	 * as used for synthesis.
+	 */
+	uint8_t audio_mem[AUDIO_MEM_SIZE];
+
+	/**
+	 * Audio registers as seen by the CPU, including writes that are
+	 * queued but not yet rendered.
+	 */
+	uint8_t cpu_mem[AUDIO_MEM_SIZE];
+
+	/* Writes made during the current frame, in order. */
+	struct minigb_apu_write queue[MINIGB_APU_QUEUE_SIZE];
+	unsigned queue_len;
+
+	/* Fraction of a sample left over from previous frames, in units of
+	 * 1 / DMG_CLOCK_FREQ samples. */
+	uint_fast64_t sample_frac;
+
+	/* Band-limited steps added by the band-limited path, for each side.
+	 * The output is the running sum of the buffer. */
+	float blip_buf[2][MINIGB_APU_MAX_FRAME_SAMPLES + MINIGB_APU_BLIP_WIDTH];
+	float blip_sum[2];
+	float blip_capacitor[2];
+	/* Value of sample_frac at the start of the frame being rendered. */
+	uint_fast64_t blip_frac;
+	/* Windowed sinc kernel at each phase between two samples. */
+	float blip_kernel[MINIGB_APU_BLIP_PHASES][MINIGB_APU_BLIP_WIDTH];
+
+	/* Set by minigb_apu_set_synthesis() to skip synthesis. */
+	bool synthesis_off;
+};
+
 /**
  * Fill allocated buffer "data" with "len" number of 32-bit floating point
- * samples (native endian order) in stereo interleaved format.
+ * samples (native endian order) in stereo interleaved format. "ctx" is the
+ * APU context, so that this may be used directly as an SDL2 audio callback.
+ * This does not apply queued writes, so should only be used with
+ * minigb_apu_audio_write().
  */
-void audio_callback(void *ptr, uint8_t *data, int len);
+void minigb_apu_audio_callback(void *ctx, uint8_t *data, int len);
 
 /**
  * Read audio register at given address "addr".
+ *
+ * When writes are queued with minigb_apu_audio_write_at(), the channel status
+ * bits of NR52 are those at the end of the last rendered frame, so may be up
+ * to a frame late.
  */
-uint8_t audio_read(const uint16_t addr);
+uint8_t minigb_apu_audio_read(struct minigb_apu_ctx *ctx, const uint16_t addr);
 
 /**
  * Write "val" to audio register at given address "addr".
  */
-void audio_write(const uint16_t addr, const uint8_t val);
+void minigb_apu_audio_write(struct minigb_apu_ctx *ctx, const uint16_t addr,
+			    const uint8_t val);
+
+/**
+ * Queue a write of "val" to audio register "addr", made "cycle" clock cycles
+ * after the start of the current frame. The CPU reads the new value
+ * immediately, but the write only affects the audio when the frame is
+ * rendered by minigb_apu_end_frame().
+ */
+void minigb_apu_audio_write_at(struct minigb_apu_ctx *ctx,
+			       const uint_fast32_t cycle, const uint16_t addr,
+			       const uint8_t val);
+
+/**
+ * Render a frame lasting "frame_cycles" clock cycles in one pass, applying
+ * queued writes at the samples matching their cycles. Fills "samples" with
+ * 32-bit floating point stereo interleaved samples, which must have space for
+ * MINIGB_APU_MAX_FRAME_SAMPLES * 2 values.
+ *
+ * \return	number of stereo samples made.
+ */
+unsigned minigb_apu_end_frame(struct minigb_apu_ctx *ctx,
+			      const uint_fast32_t frame_cycles,
+			      float *samples);
+
+/**
+ * Same as minigb_apu_end_frame(), but renders using integer arithmetic only
+ * and fills "samples" with signed 16-bit stereo interleaved samples. This is
+ * for processors without an FPU. Register writes still update the floating
+ * point state as well, so a few floating point operations are made for each
+ * write, but none for each sample. A context must be rendered using only one
+ * of the minigb_apu_end_frame functions.
+ *
+ * \return	number of stereo samples made.
+ */
+unsigned minigb_apu_end_frame_s16(struct minigb_apu_ctx *ctx,
+				  const uint_fast32_t frame_cycles,
+				  int16_t *samples);
+
+/**
+ * Same as minigb_apu_end_frame(), but synthesises the frame by adding a
+ * band-limited step to a buffer at the clock cycle of each change in the
+ * output of a channel, which is then summed to make the samples. The cost
+ * depends on the number of changes rather than the number of samples, and
+ * there is less aliasing of high notes. Writes are applied at their exact
+ * clock cycle. The output is delayed by MINIGB_APU_BLIP_WIDTH / 2 samples.
+ *
+ * A context must be rendered using only one of the minigb_apu_end_frame
+ * functions.
+ *
+ * \return	number of stereo samples made.
+ */
+unsigned minigb_apu_end_frame_blip(struct minigb_apu_ctx *ctx,
+				   const uint_fast32_t frame_cycles,
+				   float *samples);
+
+/**
+ * Polyphase resampler converting the output of minigb_apu from
+ * AUDIO_SAMPLE_RATE to any other rate chosen at runtime.
+ */
+struct minigb_apu_resampler {
+	unsigned in_rate, out_rate;
+
+	/* Position of the next output sample, as an index into buf plus a
+	 * fraction of frac / out_rate. */
+	unsigned pos;
+	uint32_t frac;
+
+	/* Input samples of each side not yet fully used. */
+	unsigned len;
+	float buf[2][MINIGB_APU_RESAMPLE_TAPS + MINIGB_APU_MAX_FRAME_SAMPLES];
+
+	/* Windowed sinc kernel at each phase between two input samples. */
+	float kernel[MINIGB_APU_RESAMPLE_PHASES][MINIGB_APU_RESAMPLE_TAPS];
+};
+
+/**
+ * Initialise resampler "r" to convert from "in_rate" to "out_rate" samples
+ * per second. Usually "in_rate" is AUDIO_SAMPLE_RATE.
+ */
+void minigb_apu_resampler_init(struct minigb_apu_resampler *r,
+			       const unsigned in_rate, const unsigned out_rate);
+
+/**
+ * Resample "len" stereo interleaved samples from "in", which must be at most
+ * MINIGB_APU_MAX_FRAME_SAMPLES, to "out". The fraction of an output sample
+ * left over is carried to the next call. "out" must have space for
+ * len * out_rate / in_rate + 1 stereo samples. The output is delayed by
+ * MINIGB_APU_RESAMPLE_TAPS / 2 input samples.
+ *
+ * \return	number of stereo samples made.
+ */
+unsigned minigb_apu_resample(struct minigb_apu_resampler *r,
+			     const float *in, const unsigned len, float *out);
+
+/**
+ * Enable or disable synthesis at runtime. While disabled, the audio registers
+ * behave as normal, including the status bits of NR52 as lengths expire, but
+ * the channels are not synthesised and silence is rendered. This is for
+ * sessions that discard their audio. Enabled by minigb_apu_audio_init().
+ */
+void minigb_apu_set_synthesis(struct minigb_apu_ctx *ctx, const bool enable);
 
 /**
  * Initialise audio driver.
  */
-void audio_init(void);
+void minigb_apu_audio_init(struct minigb_apu_ctx *ctx);
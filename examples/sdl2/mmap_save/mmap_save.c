@@ -0,0 +1,215 @@
+/**
+ * MIT License
+ * Copyright (c) 2018 Mahyar Koshkouei
+ *
+ * Battery save backend that maps the save file directly into memory. See
+ * mmap_save.h for details.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mmap_save.h"
+
+/**
+ * Synchronise the pages set in the given mask with the save file.
+ */
+static int flush_pages(struct mmap_save *s, uint32_t pages)
+{
+	const size_t sys_page = (size_t)sysconf(_SC_PAGESIZE);
+	int ret = 0;
+
+	while(pages)
+	{
+		const unsigned page = __builtin_ctz(pages);
+		size_t start = (size_t)page * MMAP_SAVE_PAGE_SIZE;
+		size_t end = start + MMAP_SAVE_PAGE_SIZE;
+
+		pages &= pages - 1;
+
+		if(end > s->len)
+			end = s->len;
+
+		/* msync() requires an address aligned to the system page size,
+		 * which may be larger than the size of pages tracked. */
+		start -= start % sys_page;
+
+		if(msync(s->data + start, end - start, MS_SYNC) != 0)
+			ret = -1;
+	}
+
+	return ret;
+}
+
+void mmap_save_mark(struct mmap_save *s, size_t addr, size_t len)
+{
+	uint32_t pages = 0;
+
+	if(len == 0)
+		return;
+
+	for(size_t page = addr / MMAP_SAVE_PAGE_SIZE;
+			page <= (addr + len - 1) / MMAP_SAVE_PAGE_SIZE; page++)
+		pages |= (uint32_t)1 << page;
+
+	__atomic_store_n(&s->writes, s->writes + 1, __ATOMIC_RELAXED);
+	__atomic_fetch_or(&s->dirty, pages, __ATOMIC_RELEASE);
+}
+
+int mmap_save_flush(struct mmap_save *s)
+{
+	const uint32_t pages = __atomic_exchange_n(&s->dirty, 0,
+						   __ATOMIC_ACQUIRE);
+	return flush_pages(s, pages);
+}
+
+/**
+ * Flush dirty pages once no writes were made for a whole flush period.
+ */
+static void *flush_thread(void *arg)
+{
+	struct mmap_save *s = arg;
+	uint32_t last_writes = __atomic_load_n(&s->writes, __ATOMIC_RELAXED);
+
+	pthread_mutex_lock(&s->lock);
+
+	while(s->running)
+	{
+		struct timespec ts;
+		uint32_t writes;
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += s->flush_delay_ms / 1000;
+		ts.tv_nsec += (long)(s->flush_delay_ms % 1000) * 1000000L;
+
+		if(ts.tv_nsec >= 1000000000L)
+		{
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+
+		pthread_cond_timedwait(&s->cond, &s->lock, &ts);
+
+		writes = __atomic_load_n(&s->writes, __ATOMIC_RELAXED);
+
+		/* The game is still writing to cart RAM. */
+		if(writes != last_writes)
+		{
+			last_writes = writes;
+			continue;
+		}
+
+		if(__atomic_load_n(&s->dirty, __ATOMIC_RELAXED) == 0)
+			continue;
+
+		pthread_mutex_unlock(&s->lock);
+		mmap_save_flush(s);
+		pthread_mutex_lock(&s->lock);
+	}
+
+	pthread_mutex_unlock(&s->lock);
+	return NULL;
+}
+
+int mmap_save_open(struct mmap_save *s, const char *save_file_name,
+		   size_t len, unsigned flush_delay_ms)
+{
+	struct stat st;
+	size_t old_len;
+	int err;
+
+	memset(s, 0, sizeof(*s));
+	s->fd = -1;
+
+	if(len == 0 || len > MMAP_SAVE_MAX_SIZE)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	if((s->fd = open(save_file_name, O_RDWR | O_CREAT, 0644)) < 0)
+		return -1;
+
+	if(fstat(s->fd, &st) != 0)
+		goto err;
+
+	old_len = (size_t)st.st_size;
+
+	/* Extend a new or short save file. The extended part of the file reads
+	 * as zero, and is set to 0xFF below. */
+	if(old_len < len && ftruncate(s->fd, (off_t)len) != 0)
+		goto err;
+
+	s->data = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, s->fd, 0);
+
+	if(s->data == MAP_FAILED)
+	{
+		s->data = NULL;
+		goto err;
+	}
+
+	s->len = len;
+	s->flush_delay_ms = flush_delay_ms;
+
+	if(old_len < len)
+	{
+		memset(s->data + old_len, 0xFF, len - old_len);
+
+		if(msync(s->data, len, MS_SYNC) != 0)
+			goto err;
+	}
+
+	s->running = 1;
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->cond, NULL);
+
+	if((err = pthread_create(&s->thread, NULL, flush_thread, s)) != 0)
+	{
+		pthread_cond_destroy(&s->cond);
+		pthread_mutex_destroy(&s->lock);
+		errno = err;
+		goto err;
+	}
+
+	return 0;
+
+err:
+	err = errno;
+
+	if(s->data != NULL)
+		munmap(s->data, len);
+
+	close(s->fd);
+	memset(s, 0, sizeof(*s));
+	s->fd = -1;
+	errno = err;
+	return -1;
+}
+
+void mmap_save_close(struct mmap_save *s)
+{
+	if(s->data == NULL)
+		return;
+
+	pthread_mutex_lock(&s->lock);
+	s->running = 0;
+	pthread_cond_signal(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+	pthread_join(s->thread, NULL);
+
+	pthread_cond_destroy(&s->cond);
+	pthread_mutex_destroy(&s->lock);
+
+	mmap_save_flush(s);
+	munmap(s->data, s->len);
+	close(s->fd);
+	s->data = NULL;
+	s->fd = -1;
+}
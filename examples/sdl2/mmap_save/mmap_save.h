@@ -0,0 +1,94 @@
+/**
+ * MIT License
+ * Copyright (c) 2018 Mahyar Koshkouei
+ *
+ * Battery save backend that maps the save file directly into memory, so that
+ * it may be used as cart RAM. Pages written to by the game are tracked, and
+ * only those pages are flushed to storage by a background thread once the
+ * game has stopped writing to cart RAM for a short while.
+ *
+ * This requires a POSIX system with mmap() and pthreads.
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Dirty pages are tracked in units of this size. A Game Boy save is at most
+ * 128 KiB, so 32 pages are tracked in a single 32-bit word. */
+#define MMAP_SAVE_PAGE_SIZE	4096
+#define MMAP_SAVE_MAX_SIZE	(32 * MMAP_SAVE_PAGE_SIZE)
+
+/* Default time in milliseconds that writes must stop for before dirty pages
+ * are flushed. */
+#define MMAP_SAVE_FLUSH_DELAY_MS	250
+
+struct mmap_save
+{
+	/* Save file mapped into memory. May be used as cart RAM directly. */
+	uint8_t *data;
+	size_t len;
+
+	/* Bit n is set if page n was written to since it was last flushed. */
+	uint32_t dirty;
+	/* Incremented on every write. Used to detect when writes stop. */
+	uint32_t writes;
+
+	/* Private. */
+	int fd;
+	unsigned flush_delay_ms;
+	unsigned running;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+/**
+ * Map the file save_file_name as a save of len bytes. The file is created and
+ * filled with 0xFF if it does not exist, and extended if it is too short.
+ *
+ * \param flush_delay_ms	time writes must stop for before dirty pages
+ *				are flushed.
+ * \return	0 on success, or -1 on error with errno set.
+ */
+int mmap_save_open(struct mmap_save *s, const char *save_file_name,
+		   size_t len, unsigned flush_delay_ms);
+
+/**
+ * Write a byte of cart RAM and mark its page as dirty. Must only be called by
+ * the thread running the emulator.
+ */
+static inline void mmap_save_write(struct mmap_save *s, const size_t addr,
+				   const uint8_t val)
+{
+	const uint32_t page = (uint32_t)1 << (addr / MMAP_SAVE_PAGE_SIZE);
+
+	s->data[addr] = val;
+	__atomic_store_n(&s->writes, s->writes + 1, __ATOMIC_RELAXED);
+
+	/* Avoid the locked instruction when the page is already dirty. */
+	if((__atomic_load_n(&s->dirty, __ATOMIC_RELAXED) & page) == 0)
+		__atomic_fetch_or(&s->dirty, page, __ATOMIC_RELEASE);
+}
+
+/**
+ * Mark len bytes of cart RAM from addr as dirty, after they were changed
+ * directly rather than with mmap_save_write(), such as when restoring a saved
+ * state. They are flushed once writes stop, as with mmap_save_write(). Must
+ * only be called by the thread running the emulator.
+ */
+void mmap_save_mark(struct mmap_save *s, size_t addr, size_t len);
+
+/**
+ * Flush all dirty pages to storage immediately.
+ *
+ * \return	0 on success, or -1 on error with errno set.
+ */
+int mmap_save_flush(struct mmap_save *s);
+
+/**
+ * Stop the flush thread, flush all dirty pages and unmap the save file.
+ */
+void mmap_save_close(struct mmap_save *s);
@@ -21,6 +21,22 @@
 #	include "minigb_apu/minigb_apu.h"
 #endif
 
+#if ENABLE_SOUND
+#	include "audio_ring/audio_ring.h"
+#endif
+
+#if ENABLE_MMAP_SAVE
+#	include "mmap_save/mmap_save.h"
+#endif
+
+#if ENABLE_STATE_STORE
+#	include "state_store/state_store.h"
+#endif
+
+#if ENABLE_CHROME_TRACE
+#	include "chrome_trace/chrome_trace.h"
+#endif
+
 #include "../../peanut_gb.h"
 #include "nativefiledialog/src/include/nfd.h"
 
@@ -28,8 +44,39 @@ struct priv_t
 {
 	/* Pointer to allocated memory holding GB file. */
 	uint8_t *rom;
+	/* Size of the GB file in bytes. */
+	size_t rom_size;
 	/* Pointer to allocated memory holding save file. */
 	uint8_t *cart_ram;
+#if ENABLE_MMAP_SAVE
+	/* Save file mapped into memory. cart_ram points to its data. */
+	struct mmap_save save;
+#endif
+#ifdef ENABLE_SOUND_MINIGB
+	/* Audio processing unit of this emulator. */
+	struct minigb_apu_ctx apu;
+	/* Set when the user muted the audio. */
+	unsigned audio_muted;
+	/* Converts the audio to the rate of the audio device. */
+	struct minigb_apu_resampler resampler;
+#endif
+#if ENABLE_SOUND
+	/* Audio waiting to be played by the audio callback. */
+	struct audio_ring ring;
+#endif
+#if ENABLE_STATE_STORE
+	/* Save state store. Opened when a state is first saved or loaded. */
+	struct state_store *states;
+	/* Set when the game polled the joypad. */
+	unsigned warm_start_polled;
+#endif
+#if ENABLE_CHROME_TRACE
+	/* Set when events are being recorded. */
+	unsigned tracing;
+	/* Events of the main thread, and of the audio callback. */
+	struct chrome_trace trace;
+	struct chrome_trace audio_trace;
+#endif
 
 	/* Colour palette for each BG, OBJ0, and OBJ1. */
 	uint16_t selected_palette[3][4];
@@ -60,14 +107,236 @@ uint8_t gb_cart_ram_read(struct gb_s *gb, const uint_fast32_t addr)
 void gb_cart_ram_write(struct gb_s *gb, const uint_fast32_t addr,
 		       const uint8_t val)
 {
+#if ENABLE_MMAP_SAVE
+	struct priv_t * const p = gb->direct.priv;
+	mmap_save_write(&p->save, addr, val);
+#else
 	const struct priv_t * const p = gb->direct.priv;
 	p->cart_ram[addr] = val;
+#endif
+}
+
+#if ENABLE_SOUND
+/* Rate requested from the audio device. The rate of the device is used
+ * instead if it differs, up to AUDIO_MAX_RATE. */
+#define AUDIO_RATE	48000
+#define AUDIO_MAX_RATE	192000
+
+/* Audio kept waiting to be played, in milliseconds. Emulation is paced to
+ * keep this much in the audio ring. */
+#ifndef AUDIO_LATENCY_MS
+#	define AUDIO_LATENCY_MS	30
+#endif
+
+/* Stereo samples requested by each call of the audio callback. */
+#define AUDIO_CALLBACK_SAMPLES	512
+
+/**
+ * Reads an audio register of the APU belonging to this context.
+ */
+uint8_t audio_read(struct gb_s *gb, const uint16_t addr)
+{
+#ifdef ENABLE_SOUND_MINIGB
+	struct priv_t * const p = gb->direct.priv;
+	return minigb_apu_audio_read(&p->apu, addr);
+#else
+	/* The blargg audio library has a single APU. */
+	return blargg_audio_read(gb_get_frame_cycles(gb), addr);
+#endif
+}
+
+/**
+ * Writes an audio register of the APU belonging to this context.
+ */
+void audio_write(struct gb_s *gb, const uint16_t addr, const uint8_t val)
+{
+#ifdef ENABLE_SOUND_MINIGB
+	struct priv_t * const p = gb->direct.priv;
+	minigb_apu_audio_write_at(&p->apu, gb_get_frame_cycles(gb), addr, val);
+#else
+	blargg_audio_write(gb_get_frame_cycles(gb), addr, val);
+#endif
+}
+#endif
+
+#if ENABLE_CHROME_TRACE
+/* Events initially allocated for each trace buffer. */
+#define TRACE_INITIAL_EVENTS	(1 << 16)
+
+/* Events allocated for the audio callback, which must not allocate memory, so
+ * drops events once this is full. Two events are recorded for each call, so
+ * this is over 20 minutes of calls of 512 samples at 48 kHz. */
+#define TRACE_AUDIO_EVENTS	(1 << 18)
+
+/* Tracks of the timeline. Each must only be written by one thread. */
+enum trace_track
+{
+	TRACK_FRAME = 1,
+	TRACK_VBLANK,
+	TRACK_HALT,
+	TRACK_PRESENT,
+	TRACK_AUDIO
+};
+
+/**
+ * Returns the host time in nanoseconds.
+ */
+static uint64_t trace_ns(void)
+{
+	static uint64_t freq = 0;
+	const uint64_t t = SDL_GetPerformanceCounter();
+
+	if(freq == 0)
+		freq = SDL_GetPerformanceFrequency();
+
+	/* Split to avoid overflow of t * 1e9. */
+	return t / freq * 1000000000 + t % freq * 1000000000 / freq;
+}
+
+static const char *const trace_event_names[GB_EVENT_MAX] = {
+	"Frame", "VBLANK", "Draw line", "HALT", "Bank switch", "APU write"
+};
+
+/**
+ * Returns the track each event is shown on. VBLANK and HALT periods overlap
+ * frames, so are shown on their own tracks.
+ */
+static uint32_t trace_event_track(const enum gb_event_e event)
+{
+	switch(event)
+	{
+	case GB_EVENT_VBLANK:
+		return TRACK_VBLANK;
+
+	case GB_EVENT_HALT:
+		return TRACK_HALT;
+
+	default:
+		return TRACK_FRAME;
+	}
+}
+
+void gb_event_begin(struct gb_s *gb, const enum gb_event_e event,
+		const uint16_t arg)
+{
+	struct priv_t * const p = gb->direct.priv;
+
+	if(!p->tracing)
+		return;
+
+	chrome_trace_add(&p->trace, trace_ns(), 'B', trace_event_track(event),
+			 trace_event_names[event],
+			 event == GB_EVENT_DRAW_LINE ? "line" : NULL, arg,
+			 NULL, 0);
+}
+
+void gb_event_end(struct gb_s *gb, const enum gb_event_e event)
+{
+	struct priv_t * const p = gb->direct.priv;
+
+	if(!p->tracing)
+		return;
+
+	chrome_trace_add(&p->trace, trace_ns(), 'E', trace_event_track(event),
+			 trace_event_names[event], NULL, 0, NULL, 0);
+}
+
+void gb_event_instant(struct gb_s *gb, const enum gb_event_e event,
+		const uint16_t addr, const uint8_t val)
+{
+	struct priv_t * const p = gb->direct.priv;
+
+	if(!p->tracing)
+		return;
+
+	chrome_trace_add(&p->trace, trace_ns(), 'i', trace_event_track(event),
+			 trace_event_names[event], "addr", addr, "val", val);
+}
+
+#if ENABLE_SOUND
+/**
+ * Records the time taken by each call of the audio callback.
+ */
+void traced_audio_callback(void *userdata, uint8_t *data, int len)
+{
+	struct priv_t * const p = userdata;
+
+	if(p->tracing)
+		chrome_trace_add(&p->audio_trace, trace_ns(), 'B', TRACK_AUDIO,
+				 "Audio callback", "bytes", len, NULL, 0);
+
+	audio_ring_callback(&p->ring, data, len);
+
+	if(p->tracing)
+		chrome_trace_add(&p->audio_trace, trace_ns(), 'E', TRACK_AUDIO,
+				 "Audio callback", NULL, 0, NULL, 0);
+}
+#endif
+
+/**
+ * Start recording events if the PEANUT_TRACE environment variable gives a
+ * file to write them to.
+ */
+void trace_start(struct priv_t *p)
+{
+	if(getenv("PEANUT_TRACE") == NULL)
+		return;
+
+	if(chrome_trace_init(&p->trace, TRACE_INITIAL_EVENTS) != 0 ||
+			chrome_trace_init_fixed(&p->audio_trace,
+						TRACE_AUDIO_EVENTS) != 0)
+	{
+		puts("Unable to allocate trace buffer");
+		chrome_trace_free(&p->trace);
+		return;
+	}
+
+	chrome_trace_name_track(&p->trace, TRACK_FRAME, "Emulation");
+	chrome_trace_name_track(&p->trace, TRACK_VBLANK, "VBLANK");
+	chrome_trace_name_track(&p->trace, TRACK_HALT, "HALT");
+	chrome_trace_name_track(&p->trace, TRACK_PRESENT, "Present");
+	chrome_trace_name_track(&p->audio_trace, TRACK_AUDIO, "Audio");
+	p->tracing = 1;
+}
+
+/**
+ * Stop recording events, and write them to the file given by PEANUT_TRACE.
+ * Must be called after the audio device is closed.
+ */
+void trace_stop(struct priv_t *p)
+{
+	const struct chrome_trace *const traces[] = {
+		&p->trace, &p->audio_trace
+	};
+	const char *path = getenv("PEANUT_TRACE");
+	FILE *f;
+
+	if(!p->tracing)
+		return;
+
+	p->tracing = 0;
+
+	if((f = fopen(path, "w")) == NULL ||
+			chrome_trace_write(f, traces, 2) != 0)
+		printf("%s: %s\n", path, strerror(errno));
+	else
+		printf("Trace written to %s: %lu events, %lu dropped\n", path,
+		       (unsigned long)(p->trace.len + p->audio_trace.len),
+		       (unsigned long)(p->trace.dropped +
+				       p->audio_trace.dropped));
+
+	if(f != NULL)
+		fclose(f);
+
+	chrome_trace_free(&p->trace);
+	chrome_trace_free(&p->audio_trace);
 }
+#endif
 
 /**
  * Returns a pointer to the allocated space containing the ROM. Must be freed.
  */
-uint8_t *read_rom_to_ram(const char *file_name)
+uint8_t *read_rom_to_ram(const char *file_name, size_t *size)
 {
 	FILE *rom_file = fopen(file_name, "rb");
 	size_t rom_size;
@@ -89,6 +358,7 @@ uint8_t *read_rom_to_ram(const char *file_name)
 	}
 
 	fclose(rom_file);
+	*size = rom_size;
 	return rom;
 }
 
@@ -179,12 +449,17 @@ void gb_error(struct gb_s *gb, const enum gb_error_e gb_err, const uint16_t val)
 
 	if(getchar() == 'q')
 	{
+#if ENABLE_MMAP_SAVE
+		/* The save file is already up to date once it is flushed. */
+		mmap_save_close(&priv->save);
+#else
 		/* Record save file. */
 		write_cart_ram_file("recovery.sav", &priv->cart_ram,
 				    gb_get_save_size(gb));
 
-		free(priv->rom);
 		free(priv->cart_ram);
+#endif
+		free(priv->rom);
 		exit(EXIT_FAILURE);
 	}
 
@@ -595,6 +870,157 @@ void save_lcd_bmp(struct gb_s* gb, uint16_t fb[LCD_HEIGHT][LCD_WIDTH])
 	fflush(stdout);
 }
 
+#if ENABLE_STATE_STORE
+/* Maximum number of frames to wait for the game to poll the joypad before
+ * giving up on taking a warm start snapshot. */
+#define WARM_START_MAX_FRAMES	(60 * 60)
+
+/**
+ * Name the save state of the running ROM with its title and global checksum,
+ * so that ROMs sharing a store do not load each other's states.
+ */
+void state_key(struct gb_s *gb, char key[static STATE_STORE_KEY_MAX + 1])
+{
+	char title_str[17];
+	const uint16_t checksum = gb->gb_rom_read(gb, 0x014E) << 8 |
+				  gb->gb_rom_read(gb, 0x014F);
+
+	gb_get_rom_name(gb, title_str);
+
+	for(char *c = title_str; *c != '\0'; c++)
+	{
+		/* Titles only use upper case characters. */
+		if(!(*c >= '0' && *c <= '9') && !(*c >= 'A' && *c <= 'Z') &&
+				*c != '-' && *c != '.')
+			*c = '_';
+	}
+
+	snprintf(key, STATE_STORE_KEY_MAX + 1, "%s-%04X",
+		 title_str[0] != '\0' ? title_str : "UNTITLED", checksum);
+}
+
+/**
+ * Open the save state store within the directory given by the
+ * PEANUT_STATE_STORE environment variable, or "states" by default.
+ */
+int state_store_ready(struct priv_t *priv)
+{
+	const char *dir;
+
+	if(priv->states != NULL)
+		return 0;
+
+	if((dir = getenv("PEANUT_STATE_STORE")) == NULL)
+		dir = "states";
+
+	if((priv->states = state_store_open(dir)) == NULL)
+	{
+		printf("Unable to open state store %s: %s\n", dir,
+		       strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Save the emulator context and cart RAM to the state store under key.
+ */
+int save_state(struct gb_s *gb, const char *key)
+{
+	struct priv_t *priv = gb->direct.priv;
+	long written;
+
+	if(state_store_ready(priv) != 0)
+		return -1;
+
+	written = state_store_put(priv->states, key, gb, sizeof(*gb),
+				  priv->cart_ram, gb_get_save_size(gb));
+
+	if(written < 0)
+	{
+		printf("Unable to save state %s: %s\n", key, strerror(errno));
+		return -1;
+	}
+
+	printf("Saved state %s (%ld new bytes)\n", key, written);
+	return 0;
+}
+
+/**
+ * Load the emulator context and cart RAM from the state store. Callbacks and
+ * values set directly by the front-end are kept.
+ */
+int load_state(struct gb_s *gb, const char *key)
+{
+	struct priv_t *priv = gb->direct.priv;
+	struct gb_s loaded;
+
+	if(state_store_ready(priv) != 0)
+		return -1;
+
+	if(state_store_get(priv->states, key, &loaded, sizeof(loaded),
+			   priv->cart_ram, gb_get_save_size(gb)) != 0)
+	{
+		if(errno == ENOENT)
+			printf("No saved state %s\n", key);
+		else
+			printf("Unable to load state %s: %s\n", key,
+			       strerror(errno));
+
+		return -1;
+	}
+
+#if ENABLE_MMAP_SAVE
+	/* The restored cart RAM was copied into the mapped save file without
+	 * marking its pages, so would otherwise not be flushed. */
+	mmap_save_mark(&priv->save, 0, gb_get_save_size(gb));
+#endif
+
+	loaded.gb_rom_read = gb->gb_rom_read;
+	loaded.gb_cart_ram_read = gb->gb_cart_ram_read;
+	loaded.gb_cart_ram_write = gb->gb_cart_ram_write;
+	loaded.gb_error = gb->gb_error;
+	loaded.gb_serial_tx = gb->gb_serial_tx;
+	loaded.gb_serial_rx = gb->gb_serial_rx;
+	loaded.gb_joypad_poll = gb->gb_joypad_poll;
+	loaded.display.lcd_draw_line = gb->display.lcd_draw_line;
+	loaded.direct = gb->direct;
+	*gb = loaded;
+	printf("Loaded state %s\n", key);
+	return 0;
+}
+
+/**
+ * Name the warm start snapshot of the running ROM. The snapshot depends on
+ * the ROM, the contents of the save file when the game started, and when the
+ * snapshot was taken.
+ */
+void warm_start_key(struct gb_s *gb, const char *trigger,
+		    char key[static STATE_STORE_KEY_MAX + 1])
+{
+	const struct priv_t *priv = gb->direct.priv;
+
+	snprintf(key, STATE_STORE_KEY_MAX + 1, "warm-%016llX-%016llX-%016llX-%s",
+		 (unsigned long long)state_store_hash(priv->rom + 0x0134,
+						      0x014E - 0x0134),
+		 (unsigned long long)state_store_hash(priv->rom, priv->rom_size),
+		 (unsigned long long)state_store_hash(priv->cart_ram,
+						      gb_get_save_size(gb)),
+		 trigger);
+}
+
+/**
+ * Called when the game first polls the joypad while a warm start snapshot is
+ * pending.
+ */
+void warm_start_poll(struct gb_s *gb)
+{
+	struct priv_t *priv = gb->direct.priv;
+	priv->warm_start_polled = 1;
+}
+#endif
+
 int main(int argc, char **argv)
 {
 	struct gb_s gb;
@@ -615,12 +1041,21 @@ int main(int argc, char **argv)
 	enum gb_init_error_e gb_ret;
 	unsigned int fast_mode = 1;
 	unsigned int fast_mode_timer = 1;
+#if !ENABLE_MMAP_SAVE
 	/* Record save file every 60 seconds. */
 	int save_timer = 60;
+#endif
 	/* Must be freed */
 	char *rom_file_name = NULL;
 	char *save_file_name = NULL;
 	int ret = EXIT_SUCCESS;
+#if ENABLE_STATE_STORE
+	char state_name[STATE_STORE_KEY_MAX + 1];
+	char warm_start_name[STATE_STORE_KEY_MAX + 1];
+	/* Frames remaining until the warm start snapshot is taken. Zero if no
+	 * snapshot is pending. */
+	unsigned long warm_start_frames = 0;
+#endif
 
 	switch(argc)
 	{
@@ -672,7 +1107,8 @@ int main(int argc, char **argv)
 	}
 
 	/* Copy input ROM file to allocated memory. */
-	if((priv.rom = read_rom_to_ram(rom_file_name)) == NULL)
+	if((priv.rom = read_rom_to_ram(rom_file_name,
+					  &priv.rom_size)) == NULL)
 	{
 		printf("%d: %s\n", __LINE__, strerror(errno));
 		ret = EXIT_FAILURE;
@@ -741,7 +1177,50 @@ int main(int argc, char **argv)
 	}
 
 	/* Load Save File. */
+#if ENABLE_MMAP_SAVE
+	if(gb_get_save_size(&gb) != 0)
+	{
+		if(mmap_save_open(&priv.save, save_file_name,
+				  gb_get_save_size(&gb),
+				  MMAP_SAVE_FLUSH_DELAY_MS) != 0)
+		{
+			printf("%d: %s\n", __LINE__, strerror(errno));
+			ret = EXIT_FAILURE;
+			goto out;
+		}
+
+		priv.cart_ram = priv.save.data;
+	}
+#else
 	read_cart_ram_file(save_file_name, &priv.cart_ram, gb_get_save_size(&gb));
+#endif
+
+#if ENABLE_STATE_STORE
+	/* Skip the boot sequence of the game by restoring a snapshot taken
+	 * after a number of frames, or after the game first polled the joypad.
+	 * The snapshot is taken on the first run. */
+	if(getenv("PEANUT_WARM_START") != NULL)
+	{
+		const char *trigger = getenv("PEANUT_WARM_START");
+
+		if(strcmp(trigger, "poll") == 0)
+		{
+			warm_start_frames = WARM_START_MAX_FRAMES;
+			gb_init_joypad(&gb, &warm_start_poll);
+		}
+		else
+			warm_start_frames = strtoul(trigger, NULL, 0);
+
+		warm_start_key(&gb, trigger, warm_start_name);
+
+		if(warm_start_frames != 0 &&
+				load_state(&gb, warm_start_name) == 0)
+		{
+			warm_start_frames = 0;
+			gb_init_joypad(&gb, NULL);
+		}
+	}
+#endif
 
 	/* Set the RTC of the game cartridge. Only used by games that support it. */
 	{
@@ -785,33 +1264,65 @@ int main(int argc, char **argv)
 		goto out;
 	}
 
+#if ENABLE_CHROME_TRACE
+	trace_start(&priv);
+#endif
+
 #if ENABLE_SOUND
 	SDL_AudioDeviceID dev;
+	int audio_rate;
 #endif
 
-#ifdef ENABLE_SOUND_BLARGG
-	audio_init(&dev);
-#elif defined ENABLE_SOUND_MINIGB
+#if ENABLE_SOUND
 	{
 		SDL_AudioSpec want, have;
 
-		want.freq = AUDIO_SAMPLE_RATE;
+		want.freq = AUDIO_RATE;
 		want.format   = AUDIO_F32SYS,
 		want.channels = 2;
-		want.samples = AUDIO_SAMPLES;
-		want.callback = audio_callback;
-		want.userdata = NULL;
+		want.samples = AUDIO_CALLBACK_SAMPLES;
+		/* The audio of each frame is written to the ring, and read
+		 * from it on the audio thread without locking. */
+#if ENABLE_CHROME_TRACE
+		want.callback = traced_audio_callback;
+		want.userdata = &priv;
+#else
+		want.callback = audio_ring_callback;
+		want.userdata = &priv.ring;
+#endif
 
 		printf("Audio driver: %s\n", SDL_GetAudioDeviceName(0, 0));
 
-		if((dev = SDL_OpenAudioDevice(NULL, 0, &want, &have, 0)) == 0)
+		/* Use the rate of the device where possible, so that SDL
+		 * does not have to convert the audio again. */
+		dev = SDL_OpenAudioDevice(NULL, 0, &want, &have,
+					  SDL_AUDIO_ALLOW_FREQUENCY_CHANGE);
+
+		if(dev != 0 && have.freq > AUDIO_MAX_RATE)
+		{
+			SDL_CloseAudioDevice(dev);
+			dev = SDL_OpenAudioDevice(NULL, 0, &want, &have, 0);
+		}
+
+		if(dev == 0)
 		{
 			printf("SDL could not open audio device: %s\n", SDL_GetError());
 			exit(EXIT_FAILURE);
 		}
 
-		audio_init();
-		SDL_PauseAudioDevice(dev, 0);
+		audio_rate = have.freq;
+		printf("Audio sample rate: %d Hz\n", audio_rate);
+
+#ifdef ENABLE_SOUND_BLARGG
+		audio_init(audio_rate);
+#else
+		minigb_apu_audio_init(&priv.apu);
+		minigb_apu_resampler_init(&priv.resampler, AUDIO_SAMPLE_RATE,
+					  audio_rate);
+#endif
+		/* Playback starts once the ring reaches its target. */
+		audio_ring_init(&priv.ring,
+				audio_rate * AUDIO_LATENCY_MS / 1000);
 	}
 #endif
 
@@ -1035,6 +1546,18 @@ int main(int argc, char **argv)
 				case SDLK_r:
 					gb_reset(&gb);
 					break;
+#if ENABLE_STATE_STORE
+
+				case SDLK_F5:
+					state_key(&gb, state_name);
+					save_state(&gb, state_name);
+					break;
+
+				case SDLK_F7:
+					state_key(&gb, state_name);
+					load_state(&gb, state_name);
+					break;
+#endif
 #if ENABLE_LCD
 
 				case SDLK_i:
@@ -1056,6 +1579,16 @@ int main(int argc, char **argv)
 					break;
 #endif
 
+#ifdef ENABLE_SOUND_MINIGB
+				case SDLK_m:
+					/* Registers are still emulated while
+					 * muted, but nothing is synthesised. */
+					priv.audio_muted = !priv.audio_muted;
+					minigb_apu_set_synthesis(&priv.apu,
+							!priv.audio_muted);
+					break;
+#endif
+
 				case SDLK_p:
 					if(event.key.keysym.mod == KMOD_LSHIFT)
 					{
@@ -1151,6 +1684,74 @@ int main(int argc, char **argv)
 		/* Execute CPU cycles until the screen has to be redrawn. */
 		gb_run_frame(&gb);
 
+#ifdef ENABLE_SOUND_MINIGB
+		/* Render the audio of the frame with band-limited steps, so
+		 * that high notes do not alias. Audio is dropped in fast
+		 * mode. */
+		{
+			static float samples[MINIGB_APU_MAX_FRAME_SAMPLES * 2];
+			static float out[(MINIGB_APU_MAX_FRAME_SAMPLES *
+					  AUDIO_MAX_RATE / AUDIO_RATE + 1) * 2];
+			unsigned len = minigb_apu_end_frame_blip(&priv.apu,
+					LCD_VERT_LINES * LCD_LINE_CYCLES, samples);
+
+			if(audio_rate == AUDIO_SAMPLE_RATE)
+			{
+				if(fast_mode == 1)
+					audio_ring_write(&priv.ring, samples,
+							 len);
+			}
+			else
+			{
+				/* Resample even in fast mode, so that the
+				 * resampler keeps its position. */
+				len = minigb_apu_resample(&priv.resampler,
+							  samples, len, out);
+
+				if(fast_mode == 1)
+					audio_ring_write(&priv.ring, out, len);
+			}
+		}
+#elif defined ENABLE_SOUND_BLARGG
+		{
+			static float samples[1024 * 2];
+			unsigned len;
+
+			/* Writes were timed within the frame, so that
+			 * Blip_Buffer synthesises the whole frame at once. */
+			audio_frame(gb_get_frame_cycles(&gb));
+
+			while((len = audio_read_samples(samples, 1024)) != 0)
+			{
+				if(fast_mode == 1)
+					audio_ring_write(&priv.ring, samples,
+							 len);
+			}
+		}
+#endif
+
+#if ENABLE_SOUND
+		if(SDL_GetAudioDeviceStatus(dev) == SDL_AUDIO_PAUSED &&
+				audio_ring_occupancy(&priv.ring) >=
+				priv.ring.target)
+			SDL_PauseAudioDevice(dev, 0);
+#endif
+
+#if ENABLE_STATE_STORE
+		if(warm_start_frames != 0 &&
+				(priv.warm_start_polled || --warm_start_frames == 0))
+		{
+			/* Give up if the game never polled the joypad. */
+			if(gb.gb_joypad_poll != NULL && !priv.warm_start_polled)
+				puts("No warm start snapshot taken");
+			else
+				save_state(&gb, warm_start_name);
+
+			warm_start_frames = 0;
+			gb_init_joypad(&gb, NULL);
+		}
+#endif
+
 		/* Tick the internal RTC when 1 second has passed. */
 		rtc_timer += target_speed_ms / fast_mode;
 
@@ -1171,39 +1772,71 @@ int main(int argc, char **argv)
 
 		fast_mode_timer = fast_mode;
 
-#if ENABLE_SOUND_BLARGG
-		/* Process audio. */
-		audio_frame();
-#endif
-
 #if ENABLE_LCD
 		/* Copy frame buffer to SDL screen. */
 		SDL_UpdateTexture(texture, NULL, &priv.fb, LCD_WIDTH * sizeof(uint16_t));
 		SDL_RenderClear(renderer);
 		SDL_RenderCopy(renderer, texture, NULL, NULL);
+#if ENABLE_CHROME_TRACE
+		if(priv.tracing)
+			chrome_trace_add(&priv.trace, trace_ns(), 'B',
+					 TRACK_PRESENT, "Present",
+					 NULL, 0, NULL, 0);
+#endif
 		SDL_RenderPresent(renderer);
+#if ENABLE_CHROME_TRACE
+		if(priv.tracing)
+			chrome_trace_add(&priv.trace, trace_ns(), 'E',
+					 TRACK_PRESENT, "Present",
+					 NULL, 0, NULL, 0);
+#endif
 
 		if(dump_bmp)
 			save_lcd_bmp(&gb, priv.fb);
 
 #endif
 
-		/* Use a delay that will draw the screen at a rate of 59.7275 Hz. */
-		new_ticks = SDL_GetTicks();
-
-		/* Since we can only delay for a maximum resolution of 1ms, we
-		 * can accumulate the error and compensate for the delay
-		 * accuracy when the delay compensation surpasses 1ms. */
-		speed_compensation += target_speed_ms - (new_ticks - old_ticks);
+#if ENABLE_SOUND
+		/* Pace emulation by the audio waiting to be played, so that it
+		 * follows the clock of the audio device instead of drifting
+		 * from it. Delay until the ring has drained to its target.
+		 * Audio is dropped in fast mode, so it is paced by the timer
+		 * instead. */
+		if(fast_mode == 1)
+		{
+			const unsigned occupancy =
+				audio_ring_occupancy(&priv.ring);
 
-		/* We cast the delay compensation value to an integer, since it
-		 * is the type used by SDL_Delay. This is where delay accuracy
-		 * is lost. */
-		delay = (int)(speed_compensation);
+			delay = 0;
+			if(occupancy > priv.ring.target)
+				delay = (occupancy - priv.ring.target) * 1000 /
+					audio_rate;
 
-		/* We then subtract the actual delay value by the requested
-		 * delay value. */
-		speed_compensation -= delay;
+			speed_compensation = 0.0;
+		}
+		else
+#endif
+		{
+			/* Use a delay that will draw the screen at a rate of
+			 * 59.7275 Hz. */
+			new_ticks = SDL_GetTicks();
+
+			/* Since we can only delay for a maximum resolution of
+			 * 1ms, we can accumulate the error and compensate for
+			 * the delay accuracy when the delay compensation
+			 * surpasses 1ms. */
+			speed_compensation += target_speed_ms -
+					      (new_ticks - old_ticks);
+
+			/* We cast the delay compensation value to an integer,
+			 * since it is the type used by SDL_Delay. This is
+			 * where delay accuracy is lost. */
+			delay = (int)(speed_compensation);
+
+			/* We then subtract the actual delay value by the
+			 * requested delay value. */
+			speed_compensation -= delay;
+		}
 
 		/* Only run delay logic if required. */
 		if(delay > 0)
@@ -1219,6 +1852,7 @@ int main(int argc, char **argv)
 				rtc_timer -= 1000;
 				gb_tick_rtc(&gb);
 
+#if !ENABLE_MMAP_SAVE
 				/* If 60 seconds has passed, record save file.
 				 * We do this because the external audio library
 				 * used contains asserts that will abort the
@@ -1231,19 +1865,12 @@ int main(int argc, char **argv)
 
 				if(!save_timer)
 				{
-#if ENABLE_SOUND_BLARGG
-					/* Locking the audio thread to reduce
-					 * possibility of abort during save. */
-					SDL_LockAudioDevice(dev);
-#endif
 					write_cart_ram_file(save_file_name,
 							    &priv.cart_ram,
 							    gb_get_save_size(&gb));
-#if ENABLE_SOUND_BLARGG
-					SDL_UnlockAudioDevice(dev);
-#endif
 					save_timer = 60;
 				}
+#endif
 			}
 
 			/* This will delay for at least the number of
@@ -1261,17 +1888,39 @@ int main(int argc, char **argv)
 	SDL_DestroyWindow(window);
 	SDL_DestroyTexture(texture);
 	SDL_GameControllerClose(controller);
+#if ENABLE_SOUND
+	SDL_CloseAudioDevice(dev);
+	printf("Audio underruns: %u, lowest occupancy: %u samples, "
+	       "dropped: %u samples\n",
+	       priv.ring.underruns, priv.ring.min_occupancy,
+	       priv.ring.overruns);
+#endif
 	SDL_Quit();
 #ifdef ENABLE_SOUND_BLARGG
 	audio_cleanup();
 #endif
+#if ENABLE_CHROME_TRACE
+	/* The audio device is closed, so the audio callback is no longer
+	 * writing to its trace. */
+	trace_stop(&priv);
+#endif
 
+#if !ENABLE_MMAP_SAVE
 	/* Record save file. */
 	write_cart_ram_file(save_file_name, &priv.cart_ram, gb_get_save_size(&gb));
+#endif
 
 out:
 	free(priv.rom);
+#if ENABLE_MMAP_SAVE
+	/* Flush remaining dirty pages to the save file. */
+	mmap_save_close(&priv.save);
+#else
 	free(priv.cart_ram);
+#endif
+#if ENABLE_STATE_STORE
+	state_store_close(priv.states);
+#endif
 
 	/* If the save file name was automatically generated (which required memory
 	 * allocated on the help), then free it here. */
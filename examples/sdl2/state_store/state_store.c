@@ -0,0 +1,974 @@
+/**
+ * MIT License
+ * Copyright (c) 2018 Mahyar Koshkouei
+ *
+ * Content addressed save state store. See state_store.h for details.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "state_store.h"
+
+#define INDEX_MAGIC		0x31584449u	/* "IDX1" */
+#define MANIFEST_MAGIC		0x31544E4Du	/* "MNT1" */
+#define INDEX_INITIAL_CAPACITY	1024
+
+struct chunk_hash
+{
+	uint64_t h[2];
+};
+
+struct index_header
+{
+	uint32_t magic;
+	/* Number of entries. Always a power of two. */
+	uint32_t capacity;
+	uint32_t count;
+	uint32_t reserved;
+};
+
+/* An entry is unused while its hash is zero. */
+struct index_entry
+{
+	struct chunk_hash hash;
+	uint64_t offset;
+	/* Stored length. Equal to raw_len if the chunk is not compressed. */
+	uint32_t len;
+	uint32_t raw_len;
+};
+
+struct manifest_header
+{
+	uint32_t magic;
+	uint32_t state_len;
+	uint32_t ram_len;
+	uint32_t chunks;
+};
+
+struct state_store
+{
+	char *dir;
+	int pack_fd;
+	int index_fd;
+
+	/* Index file mapped into memory. */
+	struct index_header *index;
+	size_t index_len;
+	ino_t index_ino;
+};
+
+/* Hash primes taken from xxHash64. */
+#define PRIME_1	0x9E3779B185EBCA87ULL
+#define PRIME_2	0xC2B2AE3D27D4EB4FULL
+#define PRIME_3	0x165667B19E3779F9ULL
+
+static uint64_t rotl64(const uint64_t x, const unsigned r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t hash64(const uint8_t *p, const size_t len, uint64_t h)
+{
+	size_t i;
+
+	for(i = 0; i + 8 <= len; i += 8)
+	{
+		uint64_t w;
+		memcpy(&w, p + i, sizeof(w));
+		h ^= rotl64(w * PRIME_2, 31) * PRIME_1;
+		h = rotl64(h, 27) * PRIME_1 + PRIME_3;
+	}
+
+	for(; i < len; i++)
+		h = rotl64(h ^ (p[i] * PRIME_1), 11) * PRIME_2;
+
+	h ^= len;
+	h ^= h >> 33;
+	h *= PRIME_2;
+	h ^= h >> 29;
+	h *= PRIME_3;
+	h ^= h >> 32;
+	return h;
+}
+
+static struct chunk_hash hash_chunk(const uint8_t *p, const size_t len)
+{
+	struct chunk_hash ch =
+	{
+		{ hash64(p, len, PRIME_1), hash64(p, len, PRIME_3) }
+	};
+
+	/* A zero hash marks an unused index entry. */
+	if(ch.h[0] == 0 && ch.h[1] == 0)
+		ch.h[0] = 1;
+
+	return ch;
+}
+
+/**
+ * Compress len bytes of src into dst using a byte oriented LZ77 format
+ * similar to LZ4. Each sequence is a token byte holding the number of
+ * literals in the high nibble and the match length minus 4 in the low nibble,
+ * followed by literals, a 16-bit match offset, and extra length bytes when a
+ * nibble is 15. The final sequence only has literals.
+ *
+ * \return	compressed length, or 0 if the data does not fit in cap bytes.
+ */
+static size_t lz_compress(const uint8_t *src, const size_t len,
+			  uint8_t *dst, const size_t cap)
+{
+#define LZ_HASH_BITS	12
+	uint16_t table[1 << LZ_HASH_BITS];
+	size_t ip = 0, anchor = 0, op = 0;
+
+	/* Positions are stored as 16-bit values. */
+	if(len > UINT16_MAX)
+		return 0;
+
+	memset(table, 0xFF, sizeof(table));
+
+	while(ip + 4 + 8 <= len)
+	{
+		uint32_t seq, ref_seq;
+		size_t ref, match, lit;
+		unsigned h;
+
+		memcpy(&seq, src + ip, 4);
+		h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+		ref = table[h];
+		table[h] = (uint16_t)ip;
+
+		if(ref == 0xFFFF)
+		{
+			ip++;
+			continue;
+		}
+
+		memcpy(&ref_seq, src + ref, 4);
+
+		if(ref_seq != seq)
+		{
+			ip++;
+			continue;
+		}
+
+		/* Extend match, leaving the last bytes as literals. */
+		match = 4;
+
+		while(ip + match + 8 <= len && src[ref + match] == src[ip + match])
+			match++;
+
+		lit = ip - anchor;
+
+		/* Worst case size of this sequence. */
+		if(op + 1 + lit / 255 + 1 + lit + 2 + match / 255 + 1 > cap)
+			return 0;
+
+		{
+			uint8_t *token = dst + op++;
+			size_t n;
+
+			*token = (uint8_t)((lit < 15 ? lit : 15) << 4);
+
+			if(lit >= 15)
+			{
+				for(n = lit - 15; n >= 255; n -= 255)
+					dst[op++] = 255;
+
+				dst[op++] = (uint8_t)n;
+			}
+
+			memcpy(dst + op, src + anchor, lit);
+			op += lit;
+
+			dst[op++] = (uint8_t)(ip - ref);
+			dst[op++] = (uint8_t)((ip - ref) >> 8);
+
+			*token |= (uint8_t)(match - 4 < 15 ? match - 4 : 15);
+
+			if(match - 4 >= 15)
+			{
+				for(n = match - 4 - 15; n >= 255; n -= 255)
+					dst[op++] = 255;
+
+				dst[op++] = (uint8_t)n;
+			}
+		}
+
+		ip += match;
+		anchor = ip;
+	}
+
+	/* Final literals. */
+	{
+		const size_t lit = len - anchor;
+		size_t n;
+
+		if(op + 1 + lit / 255 + 1 + lit > cap)
+			return 0;
+
+		dst[op++] = (uint8_t)((lit < 15 ? lit : 15) << 4);
+
+		if(lit >= 15)
+		{
+			for(n = lit - 15; n >= 255; n -= 255)
+				dst[op++] = 255;
+
+			dst[op++] = (uint8_t)n;
+		}
+
+		memcpy(dst + op, src + anchor, lit);
+		op += lit;
+	}
+
+	return op;
+#undef LZ_HASH_BITS
+}
+
+/**
+ * Read an extended length following a nibble of 15.
+ */
+static int lz_read_len(const uint8_t *src, size_t *ip, const size_t len,
+		       size_t *n)
+{
+	uint8_t b;
+
+	do
+	{
+		if(*ip >= len)
+			return -1;
+
+		b = src[(*ip)++];
+		*n += b;
+	}
+	while(b == 255);
+
+	return 0;
+}
+
+/**
+ * Decompress data compressed by lz_compress(). The output must be exactly
+ * out_len bytes long.
+ *
+ * \return	0 on success, or -1 if the data is corrupt.
+ */
+static int lz_decompress(const uint8_t *src, const size_t len,
+			 uint8_t *dst, const size_t out_len)
+{
+	size_t ip = 0, op = 0;
+
+	while(ip < len)
+	{
+		const uint8_t token = src[ip++];
+		size_t lit = token >> 4;
+		size_t match = token & 0x0F;
+		size_t offset;
+
+		if(lit == 15 && lz_read_len(src, &ip, len, &lit) != 0)
+			return -1;
+
+		if(lit > len - ip || lit > out_len - op)
+			return -1;
+
+		memcpy(dst + op, src + ip, lit);
+		ip += lit;
+		op += lit;
+
+		/* End of the final sequence. */
+		if(ip == len)
+			break;
+
+		if(len - ip < 2)
+			return -1;
+
+		offset = src[ip] | (size_t)src[ip + 1] << 8;
+		ip += 2;
+
+		if(match == 15 && lz_read_len(src, &ip, len, &match) != 0)
+			return -1;
+
+		match += 4;
+
+		if(offset == 0 || offset > op || match > out_len - op)
+			return -1;
+
+		/* Byte by byte as the match may overlap the output. */
+		for(size_t i = 0; i < match; i++, op++)
+			dst[op] = dst[op - offset];
+	}
+
+	return op == out_len ? 0 : -1;
+}
+
+static char *path_join(const char *dir, const char *name)
+{
+	const size_t len = strlen(dir) + 1 + strlen(name) + 1;
+	char *path = malloc(len);
+
+	if(path != NULL)
+		snprintf(path, len, "%s/%s", dir, name);
+
+	return path;
+}
+
+static int write_all(const int fd, const void *buf, size_t len, off_t offset)
+{
+	const uint8_t *p = buf;
+
+	while(len > 0)
+	{
+		const ssize_t n = pwrite(fd, p, len, offset);
+
+		if(n < 0)
+		{
+			if(errno == EINTR)
+				continue;
+
+			return -1;
+		}
+
+		p += n;
+		len -= (size_t)n;
+		offset += n;
+	}
+
+	return 0;
+}
+
+static int read_all(const int fd, void *buf, size_t len, off_t offset)
+{
+	uint8_t *p = buf;
+
+	while(len > 0)
+	{
+		const ssize_t n = pread(fd, p, len, offset);
+
+		if(n < 0)
+		{
+			if(errno == EINTR)
+				continue;
+
+			return -1;
+		}
+
+		if(n == 0)
+		{
+			errno = EIO;
+			return -1;
+		}
+
+		p += n;
+		len -= (size_t)n;
+		offset += n;
+	}
+
+	return 0;
+}
+
+static struct index_entry *index_entries(const struct state_store *st)
+{
+	return (struct index_entry *)(st->index + 1);
+}
+
+static void index_unmap(struct state_store *st)
+{
+	if(st->index != NULL)
+		munmap(st->index, st->index_len);
+
+	if(st->index_fd >= 0)
+		close(st->index_fd);
+
+	st->index = NULL;
+	st->index_fd = -1;
+}
+
+/**
+ * Map the index file, creating an empty index if it does not exist.
+ */
+static int index_map(struct state_store *st)
+{
+	char *path = path_join(st->dir, "index");
+	struct stat s;
+	int fd;
+
+	if(path == NULL)
+		return -1;
+
+	fd = open(path, O_RDWR | O_CREAT, 0644);
+	free(path);
+
+	if(fd < 0)
+		return -1;
+
+	if(fstat(fd, &s) != 0)
+		goto err;
+
+	if(s.st_size == 0)
+	{
+		const struct index_header hdr =
+		{
+			INDEX_MAGIC, INDEX_INITIAL_CAPACITY, 0, 0
+		};
+
+		s.st_size = sizeof(hdr) +
+			    INDEX_INITIAL_CAPACITY * sizeof(struct index_entry);
+
+		if(ftruncate(fd, s.st_size) != 0 ||
+				write_all(fd, &hdr, sizeof(hdr), 0) != 0)
+			goto err;
+	}
+
+	st->index = mmap(NULL, (size_t)s.st_size, PROT_READ | PROT_WRITE,
+			 MAP_SHARED, fd, 0);
+
+	if(st->index == MAP_FAILED)
+	{
+		st->index = NULL;
+		goto err;
+	}
+
+	st->index_fd = fd;
+	st->index_len = (size_t)s.st_size;
+	st->index_ino = s.st_ino;
+
+	if(st->index->magic != INDEX_MAGIC ||
+			st->index_len != sizeof(struct index_header) +
+			(size_t)st->index->capacity * sizeof(struct index_entry))
+	{
+		index_unmap(st);
+		errno = EINVAL;
+		return -1;
+	}
+
+	return 0;
+
+err:
+	close(fd);
+	return -1;
+}
+
+/**
+ * Map the index again if it was replaced by another process.
+ */
+static int index_refresh(struct state_store *st)
+{
+	char *path = path_join(st->dir, "index");
+	struct stat s;
+	int ret;
+
+	if(path == NULL)
+		return -1;
+
+	ret = stat(path, &s);
+	free(path);
+
+	if(ret == 0 && s.st_ino == st->index_ino)
+		return 0;
+
+	index_unmap(st);
+	return index_map(st);
+}
+
+static struct index_entry *index_find(struct state_store *st,
+				      const struct chunk_hash *ch)
+{
+	struct index_entry *e = index_entries(st);
+	const uint32_t mask = st->index->capacity - 1;
+
+	for(uint32_t i = (uint32_t)ch->h[0] & mask;; i = (i + 1) & mask)
+	{
+		if(e[i].hash.h[0] == 0 && e[i].hash.h[1] == 0)
+			return NULL;
+
+		if(e[i].hash.h[0] == ch->h[0] && e[i].hash.h[1] == ch->h[1])
+			return &e[i];
+	}
+}
+
+static void index_insert(struct index_entry *e, const uint32_t capacity,
+			 const struct index_entry *entry)
+{
+	const uint32_t mask = capacity - 1;
+	uint32_t i = (uint32_t)entry->hash.h[0] & mask;
+
+	while(e[i].hash.h[0] != 0 || e[i].hash.h[1] != 0)
+		i = (i + 1) & mask;
+
+	e[i].offset = entry->offset;
+	e[i].len = entry->len;
+	e[i].raw_len = entry->raw_len;
+	/* Publish the hash last, so that readers never see a used entry
+	 * with a missing location. */
+	__atomic_store(&e[i].hash.h[1], &entry->hash.h[1], __ATOMIC_RELEASE);
+	__atomic_store(&e[i].hash.h[0], &entry->hash.h[0], __ATOMIC_RELEASE);
+}
+
+/**
+ * Replace the index with one of twice the capacity. Must be called with the
+ * pack lock held.
+ */
+static int index_grow(struct state_store *st)
+{
+	const uint32_t capacity = st->index->capacity * 2;
+	const size_t len = sizeof(struct index_header) +
+			   (size_t)capacity * sizeof(struct index_entry);
+	char *tmp_path = path_join(st->dir, "index.tmp");
+	char *path = path_join(st->dir, "index");
+	struct index_header *hdr = MAP_FAILED;
+	int fd = -1;
+	int ret = -1;
+
+	if(tmp_path == NULL || path == NULL)
+		goto out;
+
+	if((fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0)
+		goto out;
+
+	if(ftruncate(fd, (off_t)len) != 0)
+		goto out;
+
+	hdr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+	if(hdr == MAP_FAILED)
+		goto out;
+
+	hdr->magic = INDEX_MAGIC;
+	hdr->capacity = capacity;
+	hdr->count = st->index->count;
+
+	for(uint32_t i = 0; i < st->index->capacity; i++)
+	{
+		const struct index_entry *e = &index_entries(st)[i];
+
+		if(e->hash.h[0] != 0 || e->hash.h[1] != 0)
+			index_insert((struct index_entry *)(hdr + 1), capacity, e);
+	}
+
+	if(msync(hdr, len, MS_SYNC) != 0 || rename(tmp_path, path) != 0)
+		goto out;
+
+	ret = 0;
+
+out:
+	if(hdr != MAP_FAILED)
+		munmap(hdr, len);
+
+	if(fd >= 0)
+		close(fd);
+
+	free(tmp_path);
+	free(path);
+
+	if(ret == 0)
+		ret = index_refresh(st);
+
+	return ret;
+}
+
+/**
+ * Store a chunk if it is not already in the pack. Must be called with the
+ * pack lock held.
+ *
+ * \return	bytes appended to the pack, or -1 on error.
+ */
+static long put_chunk(struct state_store *st, const uint8_t *data,
+		      const size_t len, struct chunk_hash *ch)
+{
+	uint8_t packed[STATE_STORE_CHUNK_SIZE];
+	struct index_entry entry;
+	size_t packed_len;
+	off_t end;
+
+	*ch = hash_chunk(data, len);
+
+	if(index_find(st, ch) != NULL)
+		return 0;
+
+	/* Keep the table at most three quarters full. */
+	if((st->index->count + 1) * 4 > st->index->capacity * 3 &&
+			index_grow(st) != 0)
+		return -1;
+
+	packed_len = lz_compress(data, len, packed, len - 1);
+
+	if((end = lseek(st->pack_fd, 0, SEEK_END)) < 0)
+		return -1;
+
+	entry.hash = *ch;
+	entry.offset = (uint64_t)end;
+	entry.raw_len = (uint32_t)len;
+
+	/* Store incompressible chunks as they are. */
+	if(packed_len == 0)
+	{
+		entry.len = (uint32_t)len;
+
+		if(write_all(st->pack_fd, data, len, end) != 0)
+			return -1;
+	}
+	else
+	{
+		entry.len = (uint32_t)packed_len;
+
+		if(write_all(st->pack_fd, packed, packed_len, end) != 0)
+			return -1;
+	}
+
+	/* The chunk must be on storage before the index refers to it. */
+	if(fdatasync(st->pack_fd) != 0)
+		return -1;
+
+	index_insert(index_entries(st), st->index->capacity, &entry);
+	st->index->count++;
+	return (long)entry.len;
+}
+
+static int get_chunk(struct state_store *st, const struct chunk_hash *ch,
+		     uint8_t *data, const size_t len)
+{
+	uint8_t packed[STATE_STORE_CHUNK_SIZE];
+	const struct index_entry *e = index_find(st, ch);
+
+	/* The chunk may have been added after the index was grown by another
+	 * process. */
+	if(e == NULL)
+	{
+		if(index_refresh(st) != 0)
+			return -1;
+
+		e = index_find(st, ch);
+	}
+
+	if(e == NULL || e->raw_len != len || e->len > len)
+	{
+		errno = EIO;
+		return -1;
+	}
+
+	if(e->len == len)
+		return read_all(st->pack_fd, data, len, (off_t)e->offset);
+
+	if(read_all(st->pack_fd, packed, e->len, (off_t)e->offset) != 0)
+		return -1;
+
+	if(lz_decompress(packed, e->len, data, len) != 0)
+	{
+		errno = EIO;
+		return -1;
+	}
+
+	return 0;
+}
+
+static size_t chunk_count(const size_t len)
+{
+	return (len + STATE_STORE_CHUNK_SIZE - 1) / STATE_STORE_CHUNK_SIZE;
+}
+
+uint64_t state_store_hash(const void *data, size_t len)
+{
+	return hash64(data, len, PRIME_1);
+}
+
+int state_store_key_valid(const char *key)
+{
+	size_t len = 0;
+
+	if(key[0] == '\0' || key[0] == '.')
+		return 0;
+
+	for(; key[len] != '\0'; len++)
+	{
+		const char c = key[len];
+
+		if(!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+				(c >= '0' && c <= '9') ||
+				c == '-' || c == '_' || c == '.'))
+			return 0;
+	}
+
+	return len <= STATE_STORE_KEY_MAX;
+}
+
+struct state_store *state_store_open(const char *dir)
+{
+	struct state_store *st = calloc(1, sizeof(*st));
+	char *path;
+
+	if(st == NULL)
+		return NULL;
+
+	st->pack_fd = -1;
+	st->index_fd = -1;
+
+	if((st->dir = strdup(dir)) == NULL)
+		goto err;
+
+	if(mkdir(dir, 0755) != 0 && errno != EEXIST)
+		goto err;
+
+	if((path = path_join(dir, "states")) == NULL)
+		goto err;
+
+	if(mkdir(path, 0755) != 0 && errno != EEXIST)
+	{
+		free(path);
+		goto err;
+	}
+
+	free(path);
+
+	if((path = path_join(dir, "pack")) == NULL)
+		goto err;
+
+	st->pack_fd = open(path, O_RDWR | O_CREAT, 0644);
+	free(path);
+
+	if(st->pack_fd < 0)
+		goto err;
+
+	/* Creating the index is serialised with other writers. */
+	if(flock(st->pack_fd, LOCK_EX) != 0)
+		goto err;
+
+	if(index_map(st) != 0)
+	{
+		flock(st->pack_fd, LOCK_UN);
+		goto err;
+	}
+
+	flock(st->pack_fd, LOCK_UN);
+	return st;
+
+err:
+	{
+		const int err = errno;
+		state_store_close(st);
+		errno = err;
+	}
+
+	return NULL;
+}
+
+void state_store_close(struct state_store *st)
+{
+	if(st == NULL)
+		return;
+
+	index_unmap(st);
+
+	if(st->pack_fd >= 0)
+		close(st->pack_fd);
+
+	free(st->dir);
+	free(st);
+}
+
+long state_store_put(struct state_store *st, const char *key,
+		     const void *state, size_t state_len,
+		     const void *ram, size_t ram_len)
+{
+	const size_t chunks = chunk_count(state_len) + chunk_count(ram_len);
+	const struct
+	{
+		const uint8_t *data;
+		size_t len;
+	} parts[2] = { { state, state_len }, { ram, ram_len } };
+	struct manifest_header hdr =
+	{
+		MANIFEST_MAGIC, (uint32_t)state_len, (uint32_t)ram_len,
+		(uint32_t)chunks
+	};
+	struct chunk_hash *hashes;
+	char name[sizeof("states/.tmp") + STATE_STORE_KEY_MAX];
+	char *path = NULL, *tmp_path = NULL;
+	long written = 0;
+	size_t n = 0;
+	int fd = -1;
+
+	if(!state_store_key_valid(key) || state_len > UINT32_MAX ||
+			ram_len > UINT32_MAX)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	if((hashes = malloc(chunks * sizeof(*hashes) + 1)) == NULL)
+		return -1;
+
+	if(flock(st->pack_fd, LOCK_EX) != 0)
+		goto err;
+
+	if(index_refresh(st) != 0)
+		goto err_unlock;
+
+	for(unsigned p = 0; p < 2; p++)
+	{
+		for(size_t off = 0; off < parts[p].len;
+				off += STATE_STORE_CHUNK_SIZE)
+		{
+			size_t len = parts[p].len - off;
+			long ret;
+
+			if(len > STATE_STORE_CHUNK_SIZE)
+				len = STATE_STORE_CHUNK_SIZE;
+
+			ret = put_chunk(st, parts[p].data + off, len,
+					&hashes[n++]);
+
+			if(ret < 0)
+				goto err_unlock;
+
+			written += ret;
+		}
+	}
+
+	flock(st->pack_fd, LOCK_UN);
+
+	/* Write the manifest to a temporary file first, so that a state is
+	 * either replaced completely or not at all. */
+	snprintf(name, sizeof(name), "states/%s", key);
+	path = path_join(st->dir, name);
+	snprintf(name, sizeof(name), "states/%s.tmp", key);
+	tmp_path = path_join(st->dir, name);
+
+	if(path == NULL || tmp_path == NULL)
+		goto err;
+
+	if((fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+		goto err;
+
+	if(write_all(fd, &hdr, sizeof(hdr), 0) != 0 ||
+			write_all(fd, hashes, chunks * sizeof(*hashes),
+				  sizeof(hdr)) != 0 ||
+			fdatasync(fd) != 0)
+		goto err;
+
+	close(fd);
+	fd = -1;
+
+	if(rename(tmp_path, path) != 0)
+		goto err;
+
+	free(hashes);
+	free(path);
+	free(tmp_path);
+	return written;
+
+err_unlock:
+	flock(st->pack_fd, LOCK_UN);
+err:
+	{
+		const int err = errno;
+
+		if(fd >= 0)
+		{
+			close(fd);
+			unlink(tmp_path);
+		}
+
+		free(hashes);
+		free(path);
+		free(tmp_path);
+		errno = err;
+	}
+
+	return -1;
+}
+
+int state_store_get(struct state_store *st, const char *key,
+		    void *state, size_t state_len,
+		    void *ram, size_t ram_len)
+{
+	const struct
+	{
+		uint8_t *data;
+		size_t len;
+	} parts[2] = { { state, state_len }, { ram, ram_len } };
+	struct manifest_header hdr;
+	struct chunk_hash *hashes = NULL;
+	char name[sizeof("states/") + STATE_STORE_KEY_MAX];
+	char *path;
+	size_t n = 0;
+	int fd;
+
+	if(!state_store_key_valid(key))
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	snprintf(name, sizeof(name), "states/%s", key);
+
+	if((path = path_join(st->dir, name)) == NULL)
+		return -1;
+
+	fd = open(path, O_RDONLY);
+	free(path);
+
+	if(fd < 0)
+		return -1;
+
+	if(read_all(fd, &hdr, sizeof(hdr), 0) != 0)
+		goto err;
+
+	if(hdr.magic != MANIFEST_MAGIC || hdr.state_len != state_len ||
+			hdr.ram_len != ram_len ||
+			hdr.chunks != chunk_count(state_len) + chunk_count(ram_len))
+	{
+		errno = EINVAL;
+		goto err;
+	}
+
+	if((hashes = malloc(hdr.chunks * sizeof(*hashes) + 1)) == NULL)
+		goto err;
+
+	if(read_all(fd, hashes, hdr.chunks * sizeof(*hashes), sizeof(hdr)) != 0)
+		goto err;
+
+	close(fd);
+	fd = -1;
+
+	for(unsigned p = 0; p < 2; p++)
+	{
+		for(size_t off = 0; off < parts[p].len;
+				off += STATE_STORE_CHUNK_SIZE)
+		{
+			size_t len = parts[p].len - off;
+
+			if(len > STATE_STORE_CHUNK_SIZE)
+				len = STATE_STORE_CHUNK_SIZE;
+
+			if(get_chunk(st, &hashes[n++], parts[p].data + off,
+					len) != 0)
+				goto err;
+		}
+	}
+
+	free(hashes);
+	return 0;
+
+err:
+	{
+		const int err = errno;
+
+		if(fd >= 0)
+			close(fd);
+
+		free(hashes);
+		errno = err;
+	}
+
+	return -1;
+}
@@ -0,0 +1,89 @@
+/**
+ * MIT License
+ * Copyright (c) 2018 Mahyar Koshkouei
+ *
+ * Content addressed save state store.
+ *
+ * A save state is split into fixed size chunks. Each chunk is identified by a
+ * 128-bit hash of its contents, and is compressed and stored once in an
+ * append-only pack file no matter how many states contain it. A hash table
+ * that is memory mapped from an index file locates chunks in the pack. Each
+ * state is a small manifest listing the hashes of its chunks.
+ *
+ * Store directory layout:
+ *   pack		compressed chunks.
+ *   index		hash table of chunk locations within the pack.
+ *   states/KEY		manifest of the state named KEY.
+ *
+ * Files are in host byte order, so a store should only be shared between
+ * hosts of the same architecture. This is already the case for save states
+ * that are a copy of struct gb_s.
+ *
+ * Many processes may read and write to the same store. Writers are serialised
+ * with a lock on the pack file. Chunks are never removed.
+ *
+ * This requires a POSIX system with mmap().
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Size of each chunk before compression. */
+#define STATE_STORE_CHUNK_SIZE	4096
+
+/* Maximum length of a state key, excluding the null terminator. */
+#define STATE_STORE_KEY_MAX	128
+
+struct state_store;
+
+/**
+ * Open the store within directory dir, creating it if it does not exist.
+ *
+ * \return	store handle, or NULL on error with errno set.
+ */
+struct state_store *state_store_open(const char *dir);
+
+/**
+ * Close a store opened with state_store_open().
+ */
+void state_store_close(struct state_store *st);
+
+/**
+ * Returns non-zero if key may be used to name a state. Keys may contain
+ * letters, digits, '-', '_' and '.', and must not start with '.'.
+ */
+int state_store_key_valid(const char *key);
+
+/**
+ * Returns a 64-bit hash of len bytes of data. This is the hash used to
+ * identify chunks, and may be used to build keys from data such as the ROM.
+ */
+uint64_t state_store_hash(const void *data, size_t len);
+
+/**
+ * Store a state consisting of the emulator state followed by cart RAM under
+ * the name key, replacing any state previously stored under that name. Each
+ * part is chunked separately, so that cart RAM is deduplicated even if the
+ * size of the emulator state changes.
+ *
+ * \param ram		cart RAM. May be NULL if ram_len is 0.
+ * \return		number of bytes appended to the pack file, or -1 on
+ *			error with errno set.
+ */
+long state_store_put(struct state_store *st, const char *key,
+		     const void *state, size_t state_len,
+		     const void *ram, size_t ram_len);
+
+/**
+ * Load the state stored under the name key. The length of each part must
+ * match the lengths given when the state was stored.
+ *
+ * \return	0 on success, or -1 on error with errno set. errno is ENOENT if
+ *		no state exists with that name, and EINVAL if the lengths do not
+ *		match.
+ */
+int state_store_get(struct state_store *st, const char *key,
+		    void *state, size_t state_len,
+		    void *ram, size_t ram_len);
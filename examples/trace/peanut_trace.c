@@ -0,0 +1,452 @@
+/**
+ * MIT License
+ * Copyright (c) 2018 Mahyar Koshkouei
+ *
+ * Runs a ROM for a number of frames without video or audio output, writing
+ * the registers before every instruction to a binary trace file. The trace is
+ * converted to text by trace-decode.
+ *
+ * Tracing is compiled in when ENABLE_TRACE is 1, as by default. When it is 0,
+ * the ROM is only run and timed, which gives the overhead of tracing when
+ * compared with a traced run.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#ifndef ENABLE_TRACE
+#	define ENABLE_TRACE 1
+#endif
+
+#define ENABLE_SOUND 0
+#define ENABLE_LCD 0
+#define ENABLE_STATS ENABLE_TRACE
+#define ENABLE_OPCODE_HOOKS ENABLE_TRACE
+#define ENABLE_EVENT_HOOKS ENABLE_TRACE
+
+#include "../../peanut_gb.h"
+
+#include "trace_ring.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+struct priv_t
+{
+	/* Pointer to allocated memory holding GB file. */
+	uint8_t *rom;
+	/* Size of the GB file in bytes. */
+	size_t rom_size;
+	/* Pointer to allocated memory holding save file. */
+	uint8_t *cart_ram;
+
+#if ENABLE_TRACE
+	/* Cycles of the frames run before the current one. */
+	uint64_t cycles_done;
+	/* Set when the next instruction must be preceded by a TRACE_SYNC
+	 * record, as a bank register was written or the CPU was halted. */
+	int sync;
+	/* BC, DE, HL and SP before the last instruction, from the lowest
+	 * bits. */
+	uint64_t regs;
+	/* Bytes at each address as known to the decoder from TRACE_MEM
+	 * records, with room for an instruction at 0xFFFF. */
+	uint8_t *shadow;
+	struct trace_ring ring;
+#endif
+};
+
+/**
+ * Returns a byte from the ROM file at the given address.
+ */
+uint8_t gb_rom_read(struct gb_s *gb, const uint_fast32_t addr)
+{
+	const struct priv_t * const p = gb->direct.priv;
+	return p->rom[addr];
+}
+
+/**
+ * Returns a byte from the cartridge RAM at the given address.
+ */
+uint8_t gb_cart_ram_read(struct gb_s *gb, const uint_fast32_t addr)
+{
+	const struct priv_t * const p = gb->direct.priv;
+	return p->cart_ram[addr];
+}
+
+/**
+ * Writes a given byte to the cartridge RAM at the given address.
+ */
+void gb_cart_ram_write(struct gb_s *gb, const uint_fast32_t addr,
+		       const uint8_t val)
+{
+	const struct priv_t * const p = gb->direct.priv;
+	p->cart_ram[addr] = val;
+}
+
+/**
+ * Ignore all errors, so that the trace shows what led up to them.
+ */
+void gb_error(struct gb_s *gb, const enum gb_error_e gb_err, const uint16_t val)
+{
+	(void)gb;
+	(void)gb_err;
+	(void)val;
+}
+
+#if ENABLE_TRACE
+/* The hook is run for every instruction, so is inlined into the emulator
+ * where the compiler allows it, leaving the rarely run parts out of line. */
+#if defined(__GNUC__)
+#	define ALWAYS_INLINE	__attribute__((always_inline)) inline
+#	define NOINLINE		__attribute__((noinline))
+#else
+#	define ALWAYS_INLINE
+#	define NOINLINE
+#endif
+
+/**
+ * Give the whole cycle count and the ROM bank, from which the next records
+ * are given.
+ */
+static NOINLINE void trace_sync(struct gb_s *gb, struct priv_t *p)
+{
+	const uint64_t cycles = p->cycles_done + gb->stats.cycles;
+	struct trace_record *rec = trace_ring_next(&p->ring);
+
+	rec->u.cycles = (uint32_t)cycles;
+	/* Bank mapping as done by __gb_read(). */
+	rec->pc = gb->mbc == 1 && gb->cart_mode_select ?
+		  gb->selected_rom_bank & 0x1F : gb->selected_rom_bank;
+	rec->cycles = (uint8_t)(cycles >> 32);
+	rec->type = TRACE_TYPE(TRACE_SYNC, 0);
+	trace_ring_commit(&p->ring);
+
+	p->sync = 0;
+}
+
+/**
+ * Give each register that changed, when more than one did.
+ */
+static NOINLINE void trace_regs(struct priv_t *p, const uint64_t regs,
+		       const uint64_t changed)
+{
+	for(unsigned i = TRACE_REG_BC; i < TRACE_REGS; i++)
+	{
+		struct trace_record *rec;
+
+		if(((changed >> i * 16) & 0xFFFF) == 0)
+			continue;
+
+		rec = trace_ring_next(&p->ring);
+		rec->u.instr.reg = (uint16_t)(regs >> i * 16);
+		rec->type = TRACE_TYPE(TRACE_REG, i);
+		trace_ring_commit(&p->ring);
+	}
+}
+
+/**
+ * Give the bytes at pc, for an instruction that is not run from ROM.
+ */
+static NOINLINE void trace_mem(struct priv_t *p, const uint16_t pc,
+		       const uint8_t mem[4])
+{
+	struct trace_record *rec;
+
+	memcpy(&p->shadow[pc], mem, 4);
+	rec = trace_ring_next(&p->ring);
+	memcpy(rec->u.mem, mem, 4);
+	rec->pc = pc;
+	rec->type = TRACE_TYPE(TRACE_MEM, 0);
+	trace_ring_commit(&p->ring);
+}
+
+/**
+ * Read the bytes at pc from memory other than WRAM and HRAM.
+ */
+static NOINLINE void read_code(struct gb_s *gb, const uint16_t pc,
+		       uint8_t mem[4])
+{
+	for(unsigned i = 0; i < 4; i++)
+		mem[i] = __gb_read(gb, pc + i);
+}
+
+/**
+ * Give the bytes at pc, for an instruction that is not run from ROM, unless
+ * the decoder already has them. Code in WRAM and HRAM is read directly, since
+ * it is where games and test ROMs run most of the code not in ROM.
+ */
+static ALWAYS_INLINE void trace_code(struct gb_s *gb, struct priv_t *p,
+		       const uint16_t pc)
+{
+	uint8_t mem[4];
+
+	if(pc >= WRAM_0_ADDR && pc <= ECHO_ADDR - 4)
+		memcpy(mem, &gb->wram[pc - WRAM_0_ADDR], 4);
+	else if(pc >= HRAM_ADDR && pc <= INTR_EN_ADDR - 4)
+		memcpy(mem, &gb->hram[pc - HRAM_ADDR], 4);
+	else
+		read_code(gb, pc, mem);
+
+	if(memcmp(&p->shadow[pc], mem, 4) != 0)
+		trace_mem(p, pc, mem);
+}
+
+/**
+ * Returns the lowest register with a bit set in changed, or TRACE_REG_SP if
+ * none changed.
+ */
+static inline unsigned changed_reg(uint64_t changed)
+{
+#if defined(__GNUC__)
+	return (unsigned)__builtin_ctzll(changed | 1ULL << 63) / 16;
+#else
+	unsigned reg = TRACE_REG_BC;
+
+	for(; reg < TRACE_REG_SP && (changed & 0xFFFF) == 0; reg++)
+		changed >>= 16;
+
+	return reg;
+#endif
+}
+
+ALWAYS_INLINE void gb_opcode_hook(struct gb_s *gb, const uint16_t pc,
+		const uint8_t opcode)
+{
+	struct priv_t * const p = gb->direct.priv;
+	const uint64_t regs = gb->cpu_reg.bc |
+			      (uint64_t)gb->cpu_reg.de << 16 |
+			      (uint64_t)gb->cpu_reg.hl << 32 |
+			      (uint64_t)gb->cpu_reg.sp << 48;
+	const uint64_t changed = regs ^ p->regs;
+	const unsigned reg = changed_reg(changed);
+	struct trace_record *rec;
+
+	/* The opcode is found by the decoder at pc. */
+	(void)opcode;
+
+	if(p->sync)
+		trace_sync(gb, p);
+
+	if(pc > VRAM_ADDR - 4)
+		trace_code(gb, p, pc);
+
+	/* Instructions mostly change one register, if any, which is given
+	 * with the instruction. SP is given again if none changed. */
+	if(changed >> reg * 16 >> 16)
+		trace_regs(p, regs, changed);
+
+	p->regs = regs;
+
+	rec = trace_ring_next(&p->ring);
+	rec->u.instr.a = gb->cpu_reg.a;
+	rec->u.instr.f = gb->cpu_reg.f;
+	rec->u.instr.reg = (uint16_t)(regs >> reg * 16);
+	rec->pc = pc;
+	rec->cycles = (uint8_t)(p->cycles_done + gb->stats.cycles);
+	rec->type = TRACE_TYPE(TRACE_INSTR, reg);
+	trace_ring_commit(&p->ring);
+}
+
+void gb_cb_opcode_hook(struct gb_s *gb, const uint8_t cbop)
+{
+	(void)gb;
+	(void)cbop;
+}
+
+/**
+ * Only the low 8 bits of the clock cycle count are given with each
+ * instruction, which is enough unless the CPU was halted. The ROM bank is
+ * only given when it may have changed.
+ */
+void gb_event_end(struct gb_s *gb, const enum gb_event_e event)
+{
+	struct priv_t * const p = gb->direct.priv;
+
+	if(event == GB_EVENT_HALT)
+		p->sync = 1;
+}
+
+void gb_event_instant(struct gb_s *gb, const enum gb_event_e event,
+		const uint16_t addr, const uint8_t val)
+{
+	struct priv_t * const p = gb->direct.priv;
+
+	(void)addr;
+	(void)val;
+
+	if(event == GB_EVENT_BANK_SWITCH)
+		p->sync = 1;
+}
+
+void gb_event_begin(struct gb_s *gb, const enum gb_event_e event,
+		const uint16_t arg)
+{
+	(void)gb;
+	(void)event;
+	(void)arg;
+}
+#endif
+
+/**
+ * Returns a pointer to the allocated space containing the ROM. Must be freed.
+ */
+uint8_t *read_rom_to_ram(const char *file_name, size_t *size)
+{
+	FILE *rom_file = fopen(file_name, "rb");
+	size_t rom_size;
+	uint8_t *rom = NULL;
+
+	if(rom_file == NULL)
+		return NULL;
+
+	fseek(rom_file, 0, SEEK_END);
+	rom_size = ftell(rom_file);
+	rewind(rom_file);
+	rom = malloc(rom_size);
+
+	if(fread(rom, sizeof(uint8_t), rom_size, rom_file) != rom_size)
+	{
+		free(rom);
+		fclose(rom_file);
+		return NULL;
+	}
+
+	fclose(rom_file);
+	*size = rom_size;
+	return rom;
+}
+
+/**
+ * Returns a monotonic time in seconds.
+ */
+double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [-n FRAMES] [-o TRACE] ROM\n"
+		"  -n FRAMES	Number of frames to run. Default 600.\n"
+		"  -o TRACE	Trace file to write. Default trace.bin.\n",
+		name);
+}
+
+int main(int argc, char **argv)
+{
+	static struct gb_s gb;
+	struct priv_t priv = { 0 };
+	const char *trace_path = "trace.bin";
+	unsigned long frames = 600;
+	enum gb_init_error_e gb_ret;
+	int ret = EXIT_FAILURE;
+	double start, elapsed;
+	int opt;
+
+	while((opt = getopt(argc, argv, "n:o:")) != -1)
+	{
+		switch(opt)
+		{
+		case 'n':
+			frames = strtoul(optarg, NULL, 0);
+			break;
+
+		case 'o':
+			trace_path = optarg;
+			break;
+
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if(optind != argc - 1)
+	{
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if((priv.rom = read_rom_to_ram(argv[optind],
+					  &priv.rom_size)) == NULL)
+	{
+		fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno));
+		goto out;
+	}
+
+	gb_ret = gb_init(&gb, &gb_rom_read, &gb_cart_ram_read,
+			 &gb_cart_ram_write, &gb_error, &priv);
+
+	if(gb_ret != GB_INIT_NO_ERROR)
+	{
+		fprintf(stderr, "Error: %d\n", gb_ret);
+		goto out;
+	}
+
+	if((priv.cart_ram = malloc(gb_get_save_size(&gb) + 1)) == NULL)
+		goto out;
+
+	memset(priv.cart_ram, 0xFF, gb_get_save_size(&gb));
+
+#if ENABLE_TRACE
+	if((priv.shadow = calloc(0x10000 + 3, 1)) == NULL)
+		goto out;
+
+	/* The first instruction is preceded by a TRACE_SYNC record. */
+	priv.sync = 1;
+
+	if(trace_ring_open(&priv.ring, trace_path, priv.rom,
+			   priv.rom_size) != 0)
+	{
+		fprintf(stderr, "%s: %s\n", trace_path, strerror(errno));
+		goto out;
+	}
+#else
+	(void)trace_path;
+#endif
+
+	start = now();
+
+	for(unsigned long i = 0; i < frames; i++)
+	{
+		gb_run_frame(&gb);
+#if ENABLE_TRACE
+		priv.cycles_done += gb.stats.cycles;
+#endif
+	}
+
+#if ENABLE_TRACE
+	if(trace_ring_close(&priv.ring) != 0)
+	{
+		fprintf(stderr, "%s: write failed\n", trace_path);
+		goto out;
+	}
+
+	elapsed = now() - start;
+	printf("%lu frames in %.3f s, %.0f FPS, %u records, %llu stalls\n",
+	       frames, elapsed, frames / elapsed, (unsigned)priv.ring.written,
+	       (unsigned long long)priv.ring.stalls);
+#else
+	elapsed = now() - start;
+	printf("%lu frames in %.3f s, %.0f FPS\n",
+	       frames, elapsed, frames / elapsed);
+#endif
+
+	ret = EXIT_SUCCESS;
+
+out:
+#if ENABLE_TRACE
+	free(priv.shadow);
+#endif
+	free(priv.cart_ram);
+	free(priv.rom);
+	return ret;
+}
@@ -0,0 +1,219 @@
+/**
+ * MIT License
+ * Copyright (c) 2018 Mahyar Koshkouei
+ *
+ * Converts a binary trace written by peanut-trace to the text format of
+ * gameboy-doctor, with one line of registers per instruction. Instructions
+ * may be limited to a range of addresses, and to a ROM bank.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "trace_ring.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Records read from the trace at once. */
+#define READ_RECORDS	4096
+
+void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [-r START-END] [-b BANK] [-c] TRACE\n"
+		"  -r START-END	Only print instructions at addresses from\n"
+		"		START to END inclusive, in hexadecimal.\n"
+		"  -b BANK	Only print instructions from 0x4000-0x7FFF\n"
+		"		that were run from ROM bank BANK.\n"
+		"  -c		Add the clock cycle of each instruction.\n",
+		name);
+}
+
+/**
+ * Returns the byte of the ROM at addr with the given bank mapped, as read by
+ * __gb_read(), or 0xFF past the end of the ROM.
+ */
+static uint8_t rom_byte(const uint8_t *rom, const uint32_t rom_size,
+			const uint_fast16_t addr, const uint_fast16_t bank)
+{
+	const uint_fast32_t off = addr < 0x4000 ?
+				  addr : addr + (bank - 1) * 0x4000UL;
+
+	return off < rom_size ? rom[off] : 0xFF;
+}
+
+int main(int argc, char **argv)
+{
+	static struct trace_record recs[READ_RECORDS];
+	static char outbuf[1 << 16];
+	struct trace_file_header hdr;
+	unsigned long start = 0x0000, end = 0xFFFF;
+	long bank = -1;
+	int show_cycles = 0;
+	uint8_t *rom = NULL;
+	/* Clock cycles before the last instruction, and ROM bank given by the
+	 * last TRACE_SYNC record. */
+	uint64_t cycles = 0;
+	uint_fast16_t sync_bank = 1;
+	/* BC, DE, HL and SP, in the order of enum trace_reg. */
+	uint16_t regs[TRACE_REGS] = { 0 };
+	/* Bytes outside of ROM, given by TRACE_MEM records. */
+	static uint8_t ram[0x10000 + 3];
+	uint8_t mem[4];
+	FILE *f;
+	size_t n;
+	int opt;
+
+	while((opt = getopt(argc, argv, "r:b:c")) != -1)
+	{
+		switch(opt)
+		{
+		case 'r':
+			if(sscanf(optarg, "%lx-%lx", &start, &end) != 2 ||
+					start > end || end > 0xFFFF)
+			{
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+
+			break;
+
+		case 'b':
+			bank = strtol(optarg, NULL, 0);
+			break;
+
+		case 'c':
+			show_cycles = 1;
+			break;
+
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if(optind != argc - 1)
+	{
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if((f = fopen(argv[optind], "rb")) == NULL)
+	{
+		fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	if(fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+			memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) != 0 ||
+			hdr.version != TRACE_VERSION ||
+			hdr.record_size != sizeof(struct trace_record))
+	{
+		fprintf(stderr, "%s: not a trace of this version or byte order\n",
+			argv[optind]);
+		fclose(f);
+		return EXIT_FAILURE;
+	}
+
+	if((rom = malloc(hdr.rom_size)) == NULL ||
+			fread(rom, 1, hdr.rom_size, f) != hdr.rom_size ||
+			fseek(f, hdr.records_offset, SEEK_SET) != 0)
+	{
+		fprintf(stderr, "%s: unable to read ROM\n", argv[optind]);
+		free(rom);
+		fclose(f);
+		return EXIT_FAILURE;
+	}
+
+	setvbuf(stdout, outbuf, _IOFBF, sizeof(outbuf));
+
+	while((n = fread(recs, sizeof(*recs), READ_RECORDS, f)) > 0)
+	{
+		for(size_t i = 0; i < n; i++)
+		{
+			const struct trace_record *r = &recs[i];
+
+			const unsigned reg = r->type >> 2;
+
+			switch(r->type & 3)
+			{
+			case TRACE_SYNC:
+				cycles = r->u.cycles |
+					 (uint64_t)r->cycles << 32;
+				sync_bank = r->pc;
+				continue;
+
+			case TRACE_MEM:
+				memcpy(&ram[r->pc], r->u.mem, sizeof(r->u.mem));
+				continue;
+
+			case TRACE_REG:
+				if(reg < TRACE_REGS)
+					regs[reg] = r->u.instr.reg;
+
+				continue;
+
+			case TRACE_INSTR:
+				break;
+			}
+
+			if(reg < TRACE_REGS)
+				regs[reg] = r->u.instr.reg;
+
+			/* Each instruction is given the low 8 bits of its cycle
+			 * count, which is less than 0x100 after the last. */
+			cycles += (uint8_t)(r->cycles - (uint8_t)cycles);
+
+			if(r->pc < start || r->pc > end)
+				continue;
+
+			if(bank >= 0 && (r->pc < 0x4000 || r->pc > 0x7FFF ||
+					sync_bank != (unsigned long)bank))
+				continue;
+
+			for(unsigned j = 0; j < 4; j++)
+			{
+				const unsigned long addr = r->pc + j;
+
+				mem[j] = addr < 0x8000 ?
+					 rom_byte(rom, hdr.rom_size, addr,
+						  sync_bank) :
+					 ram[addr];
+			}
+
+			printf("A:%02X F:%02X B:%02X C:%02X D:%02X E:%02X "
+			       "H:%02X L:%02X SP:%04X PC:%04X "
+			       "PCMEM:%02X,%02X,%02X,%02X",
+			       r->u.instr.a, r->u.instr.f,
+			       regs[TRACE_REG_BC] >> 8,
+			       regs[TRACE_REG_BC] & 0xFF,
+			       regs[TRACE_REG_DE] >> 8,
+			       regs[TRACE_REG_DE] & 0xFF,
+			       regs[TRACE_REG_HL] >> 8,
+			       regs[TRACE_REG_HL] & 0xFF,
+			       regs[TRACE_REG_SP], r->pc,
+			       mem[0], mem[1], mem[2], mem[3]);
+
+			if(show_cycles)
+				printf(" CY:%llu", (unsigned long long)cycles);
+
+			putchar('\n');
+		}
+	}
+
+	if(ferror(f))
+	{
+		fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno));
+		free(rom);
+		fclose(f);
+		return EXIT_FAILURE;
+	}
+
+	free(rom);
+	fclose(f);
+	return fflush(stdout) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,232 @@
+/**
+ * MIT License
+ * Copyright (c) 2018 Mahyar Koshkouei
+ *
+ * Binary execution trace ring. See trace_ring.h for details.
+ */
+
+/* For O_DIRECT, where available. */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trace_ring.h"
+
+#define RING_MASK	(TRACE_RING_SIZE - 1)
+
+/**
+ * Write all of buf to fd, continuing after partial writes.
+ */
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	while(len > 0)
+	{
+		ssize_t n = write(fd, p, len);
+
+		if(n < 0)
+		{
+			if(errno == EINTR)
+				continue;
+
+			return -1;
+		}
+
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static void *writer_run(void *arg)
+{
+	struct trace_ring *r = arg;
+
+	pthread_mutex_lock(&r->lock);
+
+	for(;;)
+	{
+		uint32_t start, n;
+		int error;
+
+		while(r->written == r->read && !r->closing)
+			pthread_cond_wait(&r->ready, &r->lock);
+
+		if((n = r->written - r->read) == 0)
+			break;
+
+		/* Records after the end of the buffer are written next time. */
+		start = r->read & RING_MASK;
+		if(n > TRACE_RING_SIZE - start)
+			n = TRACE_RING_SIZE - start;
+
+		error = r->error;
+		pthread_mutex_unlock(&r->lock);
+
+#ifdef O_DIRECT
+		/* Only whole blocks may be written without the page cache. The
+		 * last records, written on closing, may not be one. */
+		if(n & (TRACE_BLOCK_SIZE - 1))
+			fcntl(r->fd, F_SETFL,
+			      fcntl(r->fd, F_GETFL) & ~O_DIRECT);
+#endif
+
+		if(!error)
+			error = write_all(r->fd, &r->buf[start],
+					  n * sizeof(*r->buf));
+
+		pthread_mutex_lock(&r->lock);
+		r->error = error != 0;
+		r->read += n;
+		pthread_cond_signal(&r->done);
+	}
+
+	pthread_mutex_unlock(&r->lock);
+	return NULL;
+}
+
+/**
+ * Create the file at path, writing it without the page cache if the system
+ * and file system allow it, as the trace is too large to be read back from it.
+ */
+static int create_file(const char *path)
+{
+	int fd;
+
+#ifdef O_DIRECT
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0666);
+	if(fd >= 0 || errno != EINVAL)
+		return fd;
+#endif
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	return fd;
+}
+
+int trace_ring_open(struct trace_ring *r, const char *path,
+		    const uint8_t *rom, uint32_t rom_size)
+{
+	struct trace_file_header hdr;
+	/* Header and ROM, padded to the first record. */
+	uint8_t *prefix = NULL;
+	void *buf;
+	int err;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+	hdr.version = TRACE_VERSION;
+	hdr.record_size = sizeof(struct trace_record);
+	hdr.rom_size = rom_size;
+	hdr.records_offset = (sizeof(hdr) + rom_size + TRACE_FILE_ALIGN - 1) &
+			     ~(uint32_t)(TRACE_FILE_ALIGN - 1);
+
+	r->stalls = 0;
+	r->written = 0;
+	r->read = 0;
+	r->closing = 0;
+	r->error = 0;
+
+	if((err = posix_memalign(&buf, TRACE_FILE_ALIGN,
+				 TRACE_RING_SIZE * sizeof(*r->buf))) != 0)
+	{
+		errno = err;
+		return -1;
+	}
+
+	r->buf = buf;
+	r->next = r->buf;
+	r->end = r->buf + TRACE_BLOCK_SIZE;
+
+	if((err = posix_memalign(&buf, TRACE_FILE_ALIGN,
+				 hdr.records_offset)) != 0)
+	{
+		free(r->buf);
+		errno = err;
+		return -1;
+	}
+
+	prefix = buf;
+	memset(prefix, 0, hdr.records_offset);
+	memcpy(prefix, &hdr, sizeof(hdr));
+	memcpy(prefix + sizeof(hdr), rom, rom_size);
+
+	if((r->fd = create_file(path)) < 0)
+		goto err_file;
+
+	if(write_all(r->fd, prefix, hdr.records_offset) != 0)
+		goto err;
+
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->ready, NULL);
+	pthread_cond_init(&r->done, NULL);
+
+	if((err = pthread_create(&r->thread, NULL, writer_run, r)) != 0)
+	{
+		pthread_cond_destroy(&r->done);
+		pthread_cond_destroy(&r->ready);
+		pthread_mutex_destroy(&r->lock);
+		errno = err;
+		goto err;
+	}
+
+	free(prefix);
+	return 0;
+
+err:
+	err = errno;
+	close(r->fd);
+	errno = err;
+err_file:
+	err = errno;
+	free(prefix);
+	free(r->buf);
+	errno = err;
+	return -1;
+}
+
+void trace_ring_hand(struct trace_ring *r)
+{
+	pthread_mutex_lock(&r->lock);
+	r->written += TRACE_BLOCK_SIZE;
+	pthread_cond_signal(&r->ready);
+
+	if(r->written - r->read == TRACE_RING_SIZE)
+	{
+		r->stalls++;
+
+		do
+			pthread_cond_wait(&r->done, &r->lock);
+		while(r->written - r->read == TRACE_RING_SIZE);
+	}
+
+	r->next = &r->buf[r->written & RING_MASK];
+	r->end = r->next + TRACE_BLOCK_SIZE;
+	pthread_mutex_unlock(&r->lock);
+}
+
+int trace_ring_close(struct trace_ring *r)
+{
+	pthread_mutex_lock(&r->lock);
+	r->written += r->next - &r->buf[r->written & RING_MASK];
+	r->closing = 1;
+	pthread_cond_signal(&r->ready);
+	pthread_mutex_unlock(&r->lock);
+
+	pthread_join(r->thread, NULL);
+
+	if(close(r->fd) != 0)
+		r->error = 1;
+
+	pthread_cond_destroy(&r->done);
+	pthread_cond_destroy(&r->ready);
+	pthread_mutex_destroy(&r->lock);
+	free(r->buf);
+
+	return r->error ? -1 : 0;
+}
@@ -0,0 +1,188 @@
+/**
+ * MIT License
+ * Copyright (c) 2018 Mahyar Koshkouei
+ *
+ * Binary execution trace, written through a ring to a file by its own thread,
+ * so that the thread running the emulator only copies a small record for each
+ * instruction, without locking. There must be a single thread writing records.
+ *
+ * A trace file starts with a trace_file_header and a copy of the ROM, followed
+ * from records_offset by trace_records in the byte order of the machine that
+ * wrote them. Records are kept small, as writing them is most of the cost of
+ * tracing, so each gives only what changed since the one before: usually a
+ * single register besides A and F. The bytes at pc are found in the copy of
+ * the ROM, the ROM bank and whole clock cycle count are only given when they
+ * change or can't be worked out, and instructions outside of ROM are preceded
+ * by a record of the bytes they were run from if those changed.
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stdint.h>
+
+#define TRACE_MAGIC		"PGBTRACE"
+#define TRACE_VERSION		2
+
+/* Capacity of the ring in records. Must be a power of two. */
+#define TRACE_RING_SIZE		(1 << 18)
+
+/* Records handed to the writer thread, and written to the file, at once. Must
+ * divide TRACE_RING_SIZE, and be a multiple of TRACE_FILE_ALIGN in bytes.
+ * Blocks are made large, as writing without the page cache costs much the
+ * same for each block whatever its size. */
+#define TRACE_BLOCK_SIZE	(1 << 16)
+
+/* Alignment in bytes of the first record in the file, and of the buffer of the
+ * ring, so that the file may be written without copying through the page
+ * cache where the system allows it. */
+#define TRACE_FILE_ALIGN	4096
+
+enum trace_record_type
+{
+	/* State before an instruction, with the lowest register that changed
+	 * since the last instruction, or SP if none did. The opcode and
+	 * following bytes are those at pc, in the ROM or as given by
+	 * TRACE_MEM. */
+	TRACE_INSTR,
+	/* New value of a register, before the next TRACE_INSTR record. Given
+	 * for each register when more than one changed since the last
+	 * instruction. */
+	TRACE_REG,
+	/* Clock cycles run, and the ROM bank mapped at 0x4000-0x7FFF, from the
+	 * next instruction record. Given first, after a bank register of the
+	 * MBC is written, and after the CPU was halted, as the cycles since
+	 * the last instruction record may then not fit in its 8 bits. */
+	TRACE_SYNC,
+	/* Bytes at pc, from pc to pc + 3 without wrapping around, that are
+	 * not in ROM. Given before the instruction that is run from them,
+	 * when they differ from the last given for those addresses. */
+	TRACE_MEM
+};
+
+/* Register given by TRACE_INSTR and TRACE_REG records, in the order they are
+ * kept in struct cpu_registers_s. */
+enum trace_reg
+{
+	TRACE_REG_BC,
+	TRACE_REG_DE,
+	TRACE_REG_HL,
+	TRACE_REG_SP,
+	/* Number of registers. */
+	TRACE_REGS
+};
+
+/* Type byte of a record, from the record type and the register given. */
+#define TRACE_TYPE(type, reg)	((type) | (reg) << 2)
+
+struct trace_file_header
+{
+	char magic[8];
+	uint32_t version;
+	/* Size of each record, so that a decoder may reject a file of another
+	 * version or byte order. */
+	uint32_t record_size;
+	/* Size of the copy of the ROM following the header. */
+	uint32_t rom_size;
+	/* Offset in the file of the first record. */
+	uint32_t records_offset;
+};
+
+struct trace_record
+{
+	union
+	{
+		/* TRACE_INSTR, TRACE_REG. */
+		struct
+		{
+			uint8_t a, f;
+			/* Value of the register given in type. */
+			uint16_t reg;
+		} instr;
+		/* TRACE_SYNC: low 32 bits of the clock cycles. */
+		uint32_t cycles;
+		/* TRACE_MEM: the opcode and the three bytes following it. */
+		uint8_t mem[4];
+	} u;
+	/* TRACE_SYNC: ROM bank. Otherwise pc. */
+	uint16_t pc;
+	/* TRACE_INSTR: low 8 bits of the clock cycles run before the
+	 * instruction. TRACE_SYNC: bits 32 to 39 of the clock cycles. */
+	uint8_t cycles;
+	/* TRACE_TYPE() of the enum trace_record_type, and of the enum trace_reg
+	 * for TRACE_INSTR and TRACE_REG records. */
+	uint8_t type;
+};
+
+struct trace_ring
+{
+	/* Next record to fill in, and the end of the block it is in. Only used
+	 * by the emulator thread. */
+	struct trace_record *next;
+	struct trace_record *end;
+	/* Number of times the emulator waited for space in the ring. Only
+	 * changed by the emulator thread. */
+	uint64_t stalls;
+	struct trace_record *buf;
+
+	/* The following are only accessed with lock held. */
+	pthread_mutex_t lock;
+	/* Signalled when records are handed to the writer thread, and when the
+	 * writer thread has written them. */
+	pthread_cond_t ready;
+	pthread_cond_t done;
+	/* Records handed to and written by the writer thread. Both wrap
+	 * around. */
+	uint32_t written;
+	uint32_t read;
+	/* Set by trace_ring_close() once the last record is handed over. */
+	int closing;
+	/* Set by the writer thread if writing the file failed. */
+	int error;
+
+	int fd;
+	pthread_t thread;
+};
+
+/**
+ * Create the trace file at path with a copy of the ROM, and start the thread
+ * writing to it.
+ *
+ * \return	0 on success, or -1 with errno set.
+ */
+int trace_ring_open(struct trace_ring *r, const char *path,
+		    const uint8_t *rom, uint32_t rom_size);
+
+/**
+ * Hand the block just filled in to the writer thread, and wait until the next
+ * is free. Called by trace_ring_commit().
+ */
+void trace_ring_hand(struct trace_ring *r);
+
+/**
+ * Returns the next record to fill in. The record is not written until
+ * trace_ring_commit() is called.
+ */
+static inline struct trace_record *trace_ring_next(struct trace_ring *r)
+{
+	return r->next;
+}
+
+/**
+ * Commit the record returned by trace_ring_next(). Records are handed to the
+ * writer thread a block at a time, so that nothing is shared with it for each
+ * record.
+ */
+static inline void trace_ring_commit(struct trace_ring *r)
+{
+	if(++r->next == r->end)
+		trace_ring_hand(r);
+}
+
+/**
+ * Write the remaining records, stop the writer thread and close the file.
+ * The number of records written is then given by written.
+ *
+ * \return	0 on success, or -1 if any write failed.
+ */
+int trace_ring_close(struct trace_ring *r);
@@ -37,7 +37,9 @@
 /**
  * Sound support must be provided by an external library. When audio_read() and
  * audio_write() functions are provided, define ENABLE_SOUND to a non-zero value
- * before including peanut_gb.h in order for these functions to be used.
+ * before including peanut_gb.h in order for these functions to be used. These
+ * functions are given the emulator context, so that each context may have its
+ * own audio state; see the prototypes following struct gb_s.
  */
 #ifndef ENABLE_SOUND
 #	define ENABLE_SOUND 0
@@ -48,6 +50,65 @@
 #	define ENABLE_LCD 1
 #endif
 
+/**
+ * Track memory modified by the emulated CPU so that
+ * gb_state_hash_incremental() only has to rehash the regions that changed.
+ * Off by default as it adds a small cost to every memory write.
+ */
+#ifndef ENABLE_STATE_HASH
+#	define ENABLE_STATE_HASH 0
+#endif
+
+/**
+ * Call gb_phase_begin() and gb_phase_end() on entering and leaving each part
+ * of the emulator listed in enum gb_phase_e, so that a profiler may attribute
+ * time and hardware events to them. These functions must be provided by the
+ * front-end when this is set. Off by default, in which case the calls are not
+ * compiled at all.
+ */
+#ifndef ENABLE_PHASE_HOOKS
+#	define ENABLE_PHASE_HOOKS 0
+#endif
+
+/**
+ * Count the work done in each call of gb_run_frame() in struct gb_stats_s, so
+ * that the front-end may find out why a game runs slower than others. Off by
+ * default; when on, the cost is a few increments per instruction.
+ */
+#ifndef ENABLE_STATS
+#	define ENABLE_STATS 0
+#endif
+
+/**
+ * Call gb_opcode_hook() before each instruction is executed, and
+ * gb_cb_opcode_hook() before each CB prefixed instruction, so that the
+ * front-end may count the instructions run by a game. These functions must be
+ * provided by the front-end when this is set. Off by default.
+ */
+#ifndef ENABLE_OPCODE_HOOKS
+#	define ENABLE_OPCODE_HOOKS 0
+#endif
+
+/**
+ * Call gb_call_hook() after each call, and gb_ret_hook() after each return,
+ * so that the front-end may keep a shadow call stack of the game. These
+ * functions must be provided by the front-end when this is set. Off by
+ * default.
+ */
+#ifndef ENABLE_CALL_HOOKS
+#	define ENABLE_CALL_HOOKS 0
+#endif
+
+/**
+ * Call gb_event_begin(), gb_event_end() and gb_event_instant() on the events
+ * listed in enum gb_event_e, so that the front-end may record a timeline of
+ * each frame. These functions must be provided by the front-end when this is
+ * set. Off by default.
+ */
+#ifndef ENABLE_EVENT_HOOKS
+#	define ENABLE_EVENT_HOOKS 0
+#endif
+
 /* Interrupt masks */
 #define VBLANK_INTR	0x01
 #define LCDC_INTR	0x02
@@ -152,6 +213,11 @@
 
 #define ROM_HEADER_CHECKSUM_LOC	0x014D
 
+/* State hashing. Memory is hashed in blocks of this size so that unmodified
+ * blocks may be reused by gb_state_hash_incremental(). */
+#define STATE_HASH_BLOCK_SIZE	0x0100
+#define STATE_HASH_CART_BLOCKS	(0x20000 / STATE_HASH_BLOCK_SIZE)
+
 #ifndef MIN
 	#define MIN(a, b)   ((a) < (b) ? (a) : (b))
 #endif
@@ -318,6 +384,90 @@ enum gb_serial_rx_ret_e
 	GB_SERIAL_RX_NO_CONNECTION = 1
 };
 
+/**
+ * Parts of the emulator given to gb_phase_begin() and gb_phase_end() when
+ * ENABLE_PHASE_HOOKS is set. Phases nest; memory accesses are made within
+ * opcode dispatch, and front-end callbacks within most other phases.
+ */
+enum gb_phase_e
+{
+	/* Interrupt handling, and the fetch and execution of instructions. */
+	GB_PHASE_DISPATCH,
+	/* __gb_read() and __gb_write(). */
+	GB_PHASE_MEMORY,
+	/* DIV, serial and TIMA updates after each instruction. */
+	GB_PHASE_TIMERS,
+	/* LCD mode and line updates after each instruction. */
+	GB_PHASE_LCD,
+	/* __gb_draw_line(). */
+	GB_PHASE_DRAW_LINE,
+	/* ROM, cart RAM, audio, serial and LCD callbacks of the front-end. */
+	GB_PHASE_FRONTEND,
+
+	GB_PHASE_MAX
+};
+
+/**
+ * Events given to the event hooks when ENABLE_EVENT_HOOKS is set. Events with
+ * a duration are given to gb_event_begin() and gb_event_end(), and events
+ * without to gb_event_instant(). A VBLANK period starts at the end of a frame
+ * and ends during the next, so does not nest within GB_EVENT_FRAME.
+ */
+enum gb_event_e
+{
+	/* A call of gb_run_frame(). */
+	GB_EVENT_FRAME,
+	/* From LY reaching LCD_HEIGHT until it returns to 0. */
+	GB_EVENT_VBLANK,
+	/* __gb_draw_line(), given the line drawn. */
+	GB_EVENT_DRAW_LINE,
+	/* From a HALT instruction until an interrupt wakes the CPU. */
+	GB_EVENT_HALT,
+	/* A write to a ROM or RAM bank register, or to the banking mode
+	 * register, of the MBC. */
+	GB_EVENT_BANK_SWITCH,
+	/* A write to an audio register. */
+	GB_EVENT_APU_WRITE,
+
+	GB_EVENT_MAX
+};
+
+#if ENABLE_STATS
+/**
+ * Work done by the emulator in the last call of gb_run_frame(), when
+ * ENABLE_STATS is set.
+ */
+struct gb_stats_s
+{
+	/* Instructions executed, not counting steps spent halted. */
+	uint32_t instructions;
+	/* Clock cycles run, including those spent halted. */
+	uint32_t cycles;
+	uint32_t halt_cycles;
+
+	/* Lines given to lcd_draw_line(), and lines not drawn because of frame
+	 * skip or interlace. */
+	uint32_t lines_drawn;
+	uint32_t lines_skipped;
+
+	/* Calls to the front-end. */
+	uint32_t rom_reads;
+	uint32_t cart_ram_reads;
+	uint32_t cart_ram_writes;
+
+	/* Writes to audio registers, whether or not ENABLE_SOUND is set. */
+	uint32_t apu_writes;
+	/* Writes to the ROM or RAM bank registers of the MBC. */
+	uint32_t bank_switches;
+};
+
+#	define __GB_STAT(gb, field) ((gb)->stats.field++)
+#	define __GB_STAT_ADD(gb, field, n) ((gb)->stats.field += (n))
+#else
+#	define __GB_STAT(gb, field)
+#	define __GB_STAT_ADD(gb, field, n)
+#endif
+
 /**
  * Emulator context.
  *
@@ -367,6 +517,15 @@ struct gb_s
 	void (*gb_serial_tx)(struct gb_s*, const uint8_t tx);
 	enum gb_serial_rx_ret_e (*gb_serial_rx)(struct gb_s*, uint8_t* rx);
 
+	/**
+	 * Notify front-end that the game is polling the joypad. Called when
+	 * the joypad register is written, before the state of the buttons is
+	 * read from direct.joypad.
+	 *
+	 * \param gb_s	emulator context
+	 */
+	void (*gb_joypad_poll)(struct gb_s*);
+
 	struct
 	{
 		unsigned gb_halt	: 1;
@@ -420,6 +579,27 @@ struct gb_s
 	uint8_t hram[HRAM_SIZE];
 	uint8_t oam[OAM_SIZE];
 
+#if ENABLE_STATE_HASH
+	/* Blocks written to since the last state hash, and the cached hash of
+	 * each block. One bit per STATE_HASH_BLOCK_SIZE bytes. */
+	struct
+	{
+		uint32_t wram_dirty;
+		uint32_t vram_dirty;
+		uint32_t cart_ram_dirty[STATE_HASH_CART_BLOCKS / 32];
+		uint8_t oam_dirty;
+		uint8_t hram_dirty;
+		/* Cleared when the cached hashes cannot be trusted. */
+		uint8_t valid;
+
+		uint64_t wram[WRAM_SIZE / STATE_HASH_BLOCK_SIZE];
+		uint64_t vram[VRAM_SIZE / STATE_HASH_BLOCK_SIZE];
+		uint64_t cart_ram[STATE_HASH_CART_BLOCKS];
+		uint64_t oam;
+		uint64_t hram;
+	} hash;
+#endif
+
 	struct
 	{
 		/**
@@ -491,8 +671,163 @@ struct gb_s
 		/* Implementation defined data. Set to NULL if not required. */
 		void *priv;
 	} direct;
+
+#if ENABLE_STATS
+	/* Filled by gb_run_frame(). May be read by the front-end. */
+	struct gb_stats_s stats;
+#endif
 };
 
+#if ENABLE_SOUND
+/**
+ * Read audio register. Must be provided by the front-end.
+ *
+ * \param gb	emulator context. direct.priv may be used to find the audio
+ *		state of this context.
+ * \param addr	address of audio register, between 0xFF10 and 0xFF3F.
+ * \return	byte at address.
+ */
+uint8_t audio_read(struct gb_s *gb, const uint16_t addr);
+
+/**
+ * Write audio register. Must be provided by the front-end.
+ *
+ * \param gb	emulator context.
+ * \param addr	address of audio register, between 0xFF10 and 0xFF3F.
+ * \param val	byte to write to address.
+ */
+void audio_write(struct gb_s *gb, const uint16_t addr, const uint8_t val);
+#endif
+
+#if ENABLE_PHASE_HOOKS
+/**
+ * Called on entering a phase of emulation. Must be provided by the front-end.
+ * Calls are nested, so that each call is matched by a call to gb_phase_end()
+ * with the same phase, before that of the enclosing phase.
+ *
+ * \param gb	emulator context.
+ * \param phase	phase being entered.
+ */
+void gb_phase_begin(struct gb_s *gb, const enum gb_phase_e phase);
+
+/**
+ * Called on leaving a phase of emulation. Must be provided by the front-end.
+ *
+ * \param gb	emulator context.
+ * \param phase	phase being left.
+ */
+void gb_phase_end(struct gb_s *gb, const enum gb_phase_e phase);
+
+/**
+ * Returns val after leaving phase. Used by __GB_PHASE_CALL() to leave a phase
+ * after the function it calls returns.
+ */
+static uint8_t __gb_phase_end_ret(struct gb_s *gb,
+		const enum gb_phase_e phase, const uint8_t val)
+{
+	gb_phase_end(gb, phase);
+	return val;
+}
+
+#	define __GB_PHASE_BEGIN(gb, phase) gb_phase_begin(gb, phase)
+#	define __GB_PHASE_END(gb, phase) gb_phase_end(gb, phase)
+/* Evaluates call, which returns a byte, within the front-end phase. */
+#	define __GB_PHASE_CALL(gb, call) \
+	(gb_phase_begin(gb, GB_PHASE_FRONTEND), \
+	 __gb_phase_end_ret(gb, GB_PHASE_FRONTEND, (call)))
+#else
+#	define __GB_PHASE_BEGIN(gb, phase)
+#	define __GB_PHASE_END(gb, phase)
+#	define __GB_PHASE_CALL(gb, call) (call)
+#endif
+
+#if ENABLE_OPCODE_HOOKS
+/**
+ * Called before an instruction is executed. Not called while the CPU is
+ * halted, nor for interrupt calls. Must be provided by the front-end.
+ *
+ * \param gb	emulator context.
+ * \param pc	address the opcode was read from. Addresses 0x4000 to
+ *		0x7FFF are in ROM bank gb->selected_rom_bank.
+ * \param opcode	opcode of the instruction. For 0xCB, gb_cb_opcode_hook()
+ *		is then called with the second byte.
+ */
+void gb_opcode_hook(struct gb_s *gb, const uint16_t pc, const uint8_t opcode);
+
+/**
+ * Called before a CB prefixed instruction is executed, after
+ * gb_opcode_hook() was called with the prefix. Must be provided by the
+ * front-end.
+ *
+ * \param gb	emulator context.
+ * \param cbop	byte following the CB prefix.
+ */
+void gb_cb_opcode_hook(struct gb_s *gb, const uint8_t cbop);
+#endif
+
+#if ENABLE_CALL_HOOKS
+/**
+ * Called after a taken CALL, an RST or an interrupt pushed the return address
+ * and jumped. The target is in gb->cpu_reg.pc, and the stack pointer after the
+ * push in gb->cpu_reg.sp. Must be provided by the front-end.
+ *
+ * \param gb	emulator context.
+ */
+void gb_call_hook(struct gb_s *gb);
+
+/**
+ * Called after a taken RET or a RETI popped the return address and jumped.
+ * Must be provided by the front-end.
+ *
+ * \param gb	emulator context.
+ */
+void gb_ret_hook(struct gb_s *gb);
+#endif
+
+#if ENABLE_EVENT_HOOKS
+/**
+ * Called at the start of an event with a duration. Must be provided by the
+ * front-end.
+ *
+ * \param gb	emulator context.
+ * \param event	event starting.
+ * \param arg	line drawn for GB_EVENT_DRAW_LINE, otherwise 0.
+ */
+void gb_event_begin(struct gb_s *gb, const enum gb_event_e event,
+		const uint16_t arg);
+
+/**
+ * Called at the end of an event started by gb_event_begin(). Must be provided
+ * by the front-end.
+ *
+ * \param gb	emulator context.
+ * \param event	event ending.
+ */
+void gb_event_end(struct gb_s *gb, const enum gb_event_e event);
+
+/**
+ * Called on a write that is an event without a duration. Must be provided by
+ * the front-end.
+ *
+ * \param gb	emulator context.
+ * \param event	event that occurred.
+ * \param addr	address written to.
+ * \param val	byte written.
+ */
+void gb_event_instant(struct gb_s *gb, const enum gb_event_e event,
+		const uint16_t addr, const uint8_t val);
+
+#	define __GB_EVENT_BEGIN(gb, event, arg) gb_event_begin(gb, event, arg)
+#	define __GB_EVENT_END(gb, event) gb_event_end(gb, event)
+#	define __GB_EVENT_INSTANT(gb, event, addr, val) \
+	gb_event_instant(gb, event, addr, val)
+#else
+/* Expand to a statement, so that they may be the body of an if. */
+#	define __GB_EVENT_BEGIN(gb, event, arg) ((void)0)
+#	define __GB_EVENT_END(gb, event) ((void)0)
+#	define __GB_EVENT_INSTANT(gb, event, addr, val) ((void)0)
+#endif
+
 /**
  * Tick the internal RTC by one second.
  * This was taken from SameBoy, which is released under MIT Licence.
@@ -545,7 +880,23 @@ void gb_set_rtc(struct gb_s *gb, const struct tm * const time)
 /**
  * Internal function used to read bytes.
  */
+#if ENABLE_PHASE_HOOKS
+static uint8_t __gb_read_phase(struct gb_s *gb, const uint_fast16_t addr);
+
+uint8_t __gb_read(struct gb_s *gb, const uint_fast16_t addr)
+{
+	uint8_t val;
+
+	__GB_PHASE_BEGIN(gb, GB_PHASE_MEMORY);
+	val = __gb_read_phase(gb, addr);
+	__GB_PHASE_END(gb, GB_PHASE_MEMORY);
+	return val;
+}
+
+static uint8_t __gb_read_phase(struct gb_s *gb, const uint_fast16_t addr)
+#else
 uint8_t __gb_read(struct gb_s *gb, const uint_fast16_t addr)
+#endif
 {
 	switch(addr >> 12)
 	{
@@ -555,17 +906,21 @@ uint8_t __gb_read(struct gb_s *gb, const uint_fast16_t addr)
 	case 0x1:
 	case 0x2:
 	case 0x3:
-		return gb->gb_rom_read(gb, addr);
+		__GB_STAT(gb, rom_reads);
+		return __GB_PHASE_CALL(gb, gb->gb_rom_read(gb, addr));
 
 	case 0x4:
 	case 0x5:
 	case 0x6:
 	case 0x7:
+		__GB_STAT(gb, rom_reads);
+
 		if(gb->mbc == 1 && gb->cart_mode_select)
-			return gb->gb_rom_read(gb,
-					       addr + ((gb->selected_rom_bank & 0x1F) - 1) * ROM_BANK_SIZE);
+			return __GB_PHASE_CALL(gb, gb->gb_rom_read(gb,
+					       addr + ((gb->selected_rom_bank & 0x1F) - 1) * ROM_BANK_SIZE));
 		else
-			return gb->gb_rom_read(gb, addr + (gb->selected_rom_bank - 1) * ROM_BANK_SIZE);
+			return __GB_PHASE_CALL(gb, gb->gb_rom_read(gb,
+					       addr + (gb->selected_rom_bank - 1) * ROM_BANK_SIZE));
 
 	case 0x8:
 	case 0x9:
@@ -580,11 +935,17 @@ uint8_t __gb_read(struct gb_s *gb, const uint_fast16_t addr)
 			else if((gb->cart_mode_select || gb->mbc != 1) &&
 					gb->cart_ram_bank < gb->num_ram_banks)
 			{
-				return gb->gb_cart_ram_read(gb, addr - CART_RAM_ADDR +
-							    (gb->cart_ram_bank * CRAM_BANK_SIZE));
+				__GB_STAT(gb, cart_ram_reads);
+				return __GB_PHASE_CALL(gb,
+					gb->gb_cart_ram_read(gb, addr - CART_RAM_ADDR +
+							     (gb->cart_ram_bank * CRAM_BANK_SIZE)));
 			}
 			else
-				return gb->gb_cart_ram_read(gb, addr - CART_RAM_ADDR);
+			{
+				__GB_STAT(gb, cart_ram_reads);
+				return __GB_PHASE_CALL(gb,
+					gb->gb_cart_ram_read(gb, addr - CART_RAM_ADDR));
+			}
 		}
 
 		return 0;
@@ -616,7 +977,7 @@ uint8_t __gb_read(struct gb_s *gb, const uint_fast16_t addr)
 		if((addr >= 0xFF10) && (addr <= 0xFF3F))
 		{
 #if ENABLE_SOUND
-			return audio_read(addr);
+			return __GB_PHASE_CALL(gb, audio_read(gb, addr));
 #else
 			return 1;
 #endif
@@ -707,10 +1068,37 @@ uint8_t __gb_read(struct gb_s *gb, const uint_fast16_t addr)
 	return 0xFF;
 }
 
+#if ENABLE_STATE_HASH
+#	define __GB_HASH_DIRTY(map, offset) \
+	((map) |= (uint32_t)1 << ((offset) / STATE_HASH_BLOCK_SIZE))
+#	define __GB_HASH_CART_DIRTY(gb, offset) \
+	((gb)->hash.cart_ram_dirty[((offset) / STATE_HASH_BLOCK_SIZE / 32) \
+		% (STATE_HASH_CART_BLOCKS / 32)] |= \
+		(uint32_t)1 << (((offset) / STATE_HASH_BLOCK_SIZE) & 31))
+#else
+#	define __GB_HASH_DIRTY(map, offset)
+#	define __GB_HASH_CART_DIRTY(gb, offset)
+#endif
+
 /**
  * Internal function used to write bytes.
  */
+#if ENABLE_PHASE_HOOKS
+static void __gb_write_phase(struct gb_s *gb, const uint_fast16_t addr,
+		const uint8_t val);
+
 void __gb_write(struct gb_s *gb, const uint_fast16_t addr, const uint8_t val)
+{
+	__GB_PHASE_BEGIN(gb, GB_PHASE_MEMORY);
+	__gb_write_phase(gb, addr, val);
+	__GB_PHASE_END(gb, GB_PHASE_MEMORY);
+}
+
+static void __gb_write_phase(struct gb_s *gb, const uint_fast16_t addr,
+		const uint8_t val)
+#else
+void __gb_write(struct gb_s *gb, const uint_fast16_t addr, const uint8_t val)
+#endif
 {
 	switch(addr >> 12)
 	{
@@ -726,6 +1114,8 @@ void __gb_write(struct gb_s *gb, const uint_fast16_t addr, const uint8_t val)
 	case 0x2:
 		if(gb->mbc == 5)
 		{
+			__GB_STAT(gb, bank_switches);
+			__GB_EVENT_INSTANT(gb, GB_EVENT_BANK_SWITCH, addr, val);
 			gb->selected_rom_bank = (gb->selected_rom_bank & 0x100) | val;
 			gb->selected_rom_bank =
 				gb->selected_rom_bank % gb->num_rom_banks;
@@ -735,6 +1125,13 @@ void __gb_write(struct gb_s *gb, const uint_fast16_t addr, const uint8_t val)
 	/* Intentional fall through. */
 
 	case 0x3:
+		/* Cartridges without an MBC ignore these writes. */
+		if(gb->mbc > 0)
+		{
+			__GB_STAT(gb, bank_switches);
+			__GB_EVENT_INSTANT(gb, GB_EVENT_BANK_SWITCH, addr, val);
+		}
+
 		if(gb->mbc == 1)
 		{
 			//selected_rom_bank = val & 0x7;
@@ -765,6 +1162,12 @@ void __gb_write(struct gb_s *gb, const uint_fast16_t addr, const uint8_t val)
 
 	case 0x4:
 	case 0x5:
+		if(gb->mbc > 0)
+		{
+			__GB_STAT(gb, bank_switches);
+			__GB_EVENT_INSTANT(gb, GB_EVENT_BANK_SWITCH, addr, val);
+		}
+
 		if(gb->mbc == 1)
 		{
 			gb->cart_ram_bank = (val & 3);
@@ -780,12 +1183,16 @@ void __gb_write(struct gb_s *gb, const uint_fast16_t addr, const uint8_t val)
 
 	case 0x6:
 	case 0x7:
+		if(gb->mbc > 0)
+			__GB_EVENT_INSTANT(gb, GB_EVENT_BANK_SWITCH, addr, val);
+
 		gb->cart_mode_select = (val & 1);
 		return;
 
 	case 0x8:
 	case 0x9:
 		gb->vram[addr - VRAM_ADDR] = val;
+		__GB_HASH_DIRTY(gb->hash.vram_dirty, addr - VRAM_ADDR);
 		return;
 
 	case 0xA:
@@ -797,37 +1204,56 @@ void __gb_write(struct gb_s *gb, const uint_fast16_t addr, const uint8_t val)
 			else if(gb->cart_mode_select &&
 					gb->cart_ram_bank < gb->num_ram_banks)
 			{
-				gb->gb_cart_ram_write(gb,
-						      addr - CART_RAM_ADDR + (gb->cart_ram_bank * CRAM_BANK_SIZE), val);
+				const uint_fast32_t ram_addr = addr - CART_RAM_ADDR +
+					(gb->cart_ram_bank * CRAM_BANK_SIZE);
+				__GB_STAT(gb, cart_ram_writes);
+				__GB_PHASE_BEGIN(gb, GB_PHASE_FRONTEND);
+				gb->gb_cart_ram_write(gb, ram_addr, val);
+				__GB_PHASE_END(gb, GB_PHASE_FRONTEND);
+				__GB_HASH_CART_DIRTY(gb, ram_addr);
 			}
 			else if(gb->num_ram_banks)
+			{
+				__GB_STAT(gb, cart_ram_writes);
+				__GB_PHASE_BEGIN(gb, GB_PHASE_FRONTEND);
 				gb->gb_cart_ram_write(gb, addr - CART_RAM_ADDR, val);
+				__GB_PHASE_END(gb, GB_PHASE_FRONTEND);
+				__GB_HASH_CART_DIRTY(gb, addr - CART_RAM_ADDR);
+			}
 		}
 
 		return;
 
 	case 0xC:
 		gb->wram[addr - WRAM_0_ADDR] = val;
+		__GB_HASH_DIRTY(gb->hash.wram_dirty, addr - WRAM_0_ADDR);
 		return;
 
 	case 0xD:
 		gb->wram[addr - WRAM_1_ADDR + WRAM_BANK_SIZE] = val;
+		__GB_HASH_DIRTY(gb->hash.wram_dirty,
+				addr - WRAM_1_ADDR + WRAM_BANK_SIZE);
 		return;
 
 	case 0xE:
 		gb->wram[addr - ECHO_ADDR] = val;
+		__GB_HASH_DIRTY(gb->hash.wram_dirty, addr - ECHO_ADDR);
 		return;
 
 	case 0xF:
 		if(addr < OAM_ADDR)
 		{
 			gb->wram[addr - ECHO_ADDR] = val;
+			__GB_HASH_DIRTY(gb->hash.wram_dirty, addr - ECHO_ADDR);
 			return;
 		}
 
 		if(addr < UNUSED_ADDR)
 		{
 			gb->oam[addr - OAM_ADDR] = val;
+#if ENABLE_STATE_HASH
+			gb->hash.oam_dirty = 1;
+#endif
 			return;
 		}
 
@@ -838,13 +1264,20 @@ void __gb_write(struct gb_s *gb, const uint_fast16_t addr, const uint8_t val)
 		if(HRAM_ADDR <= addr && addr < INTR_EN_ADDR)
 		{
 			gb->hram[addr - HRAM_ADDR] = val;
+#if ENABLE_STATE_HASH
+			gb->hash.hram_dirty = 1;
+#endif
 			return;
 		}
 
 		if((addr >= 0xFF10) && (addr <= 0xFF3F))
 		{
+			__GB_STAT(gb, apu_writes);
+			__GB_EVENT_INSTANT(gb, GB_EVENT_APU_WRITE, addr, val);
 #if ENABLE_SOUND
-			audio_write(addr, val);
+			__GB_PHASE_BEGIN(gb, GB_PHASE_FRONTEND);
+			audio_write(gb, addr, val);
+			__GB_PHASE_END(gb, GB_PHASE_FRONTEND);
 #endif
 			return;
 		}
@@ -859,6 +1292,9 @@ void __gb_write(struct gb_s *gb, const uint_fast16_t addr, const uint8_t val)
 			 * significant bits are unused. */
 			gb->gb_reg.P1 = val;
 
+			if(gb->gb_joypad_poll != NULL)
+				gb->gb_joypad_poll(gb);
+
 			/* Direction keys selected */
 			if((gb->gb_reg.P1 & 0b010000) == 0)
 				gb->gb_reg.P1 |= (gb->direct.joypad >> 4);
@@ -901,6 +1337,9 @@ void __gb_write(struct gb_s *gb, const uint_fast16_t addr, const uint8_t val)
 
 		/* LCD Registers */
 		case 0x40:
+		{
+			const uint8_t prev_lcdc = gb->gb_reg.LCDC;
+
 			gb->gb_reg.LCDC = val;
 
 			/* LY fixed to 0 when LCD turned off. */
@@ -914,12 +1353,18 @@ void __gb_write(struct gb_s *gb, const uint_fast16_t addr, const uint8_t val)
 					return;
 				}
 
+				/* VBLANK ends here, as LY does not wrap to 0
+				 * while the LCD is off. */
+				if(prev_lcdc & LCDC_ENABLE)
+					__GB_EVENT_END(gb, GB_EVENT_VBLANK);
+
 				gb->gb_reg.STAT = (gb->gb_reg.STAT & ~0x03) | LCD_VBLANK;
 				gb->gb_reg.LY = 0;
 				gb->counter.lcd_count = 0;
 			}
 
 			return;
+		}
 
 		case 0x41:
 			gb->gb_reg.STAT = (val & 0b01111000);
@@ -945,6 +1390,9 @@ void __gb_write(struct gb_s *gb, const uint_fast16_t addr, const uint8_t val)
 			for(uint8_t i = 0; i < OAM_SIZE; i++)
 				gb->oam[i] = __gb_read(gb, (gb->gb_reg.DMA << 8) + i);
 
+#if ENABLE_STATE_HASH
+			gb->hash.oam_dirty = 1;
+#endif
 			return;
 
 		/* DMG Palette Registers */
@@ -1006,6 +1454,10 @@ uint8_t __gb_execute_cb(struct gb_s *gb)
 	uint8_t val;
 	uint8_t writeback = 1;
 
+#if ENABLE_OPCODE_HOOKS
+	gb_cb_opcode_hook(gb, cbop);
+#endif
+
 	inst_cycles = 8;
 	/* Add an additional 8 cycles to these sets of instructions. */
 	switch(cbop & 0xC7)
@@ -1201,7 +1653,10 @@ void __gb_draw_line(struct gb_s *gb)
 		return;
 
 	if(gb->direct.frame_skip && !gb->display.frame_skip_count)
+	{
+		__GB_STAT(gb, lines_skipped);
 		return;
+	}
 
 	/* If interlaced mode is activated, check if we need to draw the current
 	 * line. */
@@ -1218,6 +1673,7 @@ void __gb_draw_line(struct gb_s *gb)
 					&& gb->gb_reg.WX <= 166)
 				gb->display.window_clear++;
 
+			__GB_STAT(gb, lines_skipped);
 			return;
 		}
 	}
@@ -1457,7 +1913,10 @@ void __gb_draw_line(struct gb_s *gb)
 		}
 	}
 
+	__GB_STAT(gb, lines_drawn);
+	__GB_PHASE_BEGIN(gb, GB_PHASE_FRONTEND);
 	gb->display.lcd_draw_line(gb, pixels, gb->gb_reg.LY);
+	__GB_PHASE_END(gb, GB_PHASE_FRONTEND);
 }
 #endif
 
@@ -1490,10 +1949,15 @@ void __gb_step_cpu(struct gb_s *gb)
 		/* *INDENT-ON* */
 	};
 
+	__GB_PHASE_BEGIN(gb, GB_PHASE_DISPATCH);
+
 	/* Handle interrupts */
 	if((gb->gb_ime || gb->gb_halt) &&
 			(gb->gb_reg.IF & gb->gb_reg.IE & ANY_INTR))
 	{
+		if(gb->gb_halt)
+			__GB_EVENT_END(gb, GB_EVENT_HALT);
+
 		gb->gb_halt = 0;
 
 		if(gb->gb_ime)
@@ -1531,6 +1995,10 @@ void __gb_step_cpu(struct gb_s *gb)
 				gb->cpu_reg.pc = CONTROL_INTR_ADDR;
 				gb->gb_reg.IF ^= CONTROL_INTR;
 			}
+
+#if ENABLE_CALL_HOOKS
+			gb_call_hook(gb);
+#endif
 		}
 	}
 
@@ -1538,6 +2006,18 @@ void __gb_step_cpu(struct gb_s *gb)
 	opcode = (gb->gb_halt ? 0x00 : __gb_read(gb, gb->cpu_reg.pc++));
 	inst_cycles = op_cycles[opcode];
 
+#if ENABLE_STATS
+	if(gb->gb_halt)
+		gb->stats.halt_cycles += inst_cycles;
+	else
+		gb->stats.instructions++;
+#endif
+
+#if ENABLE_OPCODE_HOOKS
+	if(!gb->gb_halt)
+		gb_opcode_hook(gb, gb->cpu_reg.pc - 1, opcode);
+#endif
+
 	/* Execute opcode */
 	switch(opcode)
 	{
@@ -2191,6 +2671,7 @@ void __gb_step_cpu(struct gb_s *gb)
 	case 0x76: /* HALT */
 		/* TODO: Emulate HALT bug? */
 		gb->gb_halt = 1;
+		__GB_EVENT_BEGIN(gb, GB_EVENT_HALT, 0);
 		break;
 
 	case 0x77: /* LD (HL), A */
@@ -3345,6 +3826,51 @@ void __gb_step_cpu(struct gb_s *gb)
 		(gb->gb_error)(gb, GB_INVALID_OPCODE, opcode);
 	}
 
+#if ENABLE_CALL_HOOKS
+	/* Conditional calls and returns take longer when taken. */
+	switch(opcode)
+	{
+	case 0xC4:
+	case 0xCC:
+	case 0xD4:
+	case 0xDC:
+		if(inst_cycles == op_cycles[opcode])
+			break;
+
+	/* Intentional fall through. */
+
+	case 0xCD:
+	case 0xC7:
+	case 0xCF:
+	case 0xD7:
+	case 0xDF:
+	case 0xE7:
+	case 0xEF:
+	case 0xF7:
+	case 0xFF:
+		gb_call_hook(gb);
+		break;
+
+	case 0xC0:
+	case 0xC8:
+	case 0xD0:
+	case 0xD8:
+		if(inst_cycles == op_cycles[opcode])
+			break;
+
+	/* Intentional fall through. */
+
+	case 0xC9:
+	case 0xD9:
+		gb_ret_hook(gb);
+		break;
+	}
+#endif
+
+	__GB_PHASE_END(gb, GB_PHASE_DISPATCH);
+	__GB_PHASE_BEGIN(gb, GB_PHASE_TIMERS);
+	__GB_STAT_ADD(gb, cycles, inst_cycles);
+
 	/* DIV register timing */
 	gb->counter.div_count += inst_cycles;
 
@@ -3359,7 +3885,11 @@ void __gb_step_cpu(struct gb_s *gb)
 	{
 		/* If new transfer, call TX function. */
 		if(gb->counter.serial_count == 0 && gb->gb_serial_tx != NULL)
+		{
+			__GB_PHASE_BEGIN(gb, GB_PHASE_FRONTEND);
 			(gb->gb_serial_tx)(gb, gb->gb_reg.SB);
+			__GB_PHASE_END(gb, GB_PHASE_FRONTEND);
+		}
 
 		gb->counter.serial_count += inst_cycles;
 
@@ -3372,7 +3902,7 @@ void __gb_step_cpu(struct gb_s *gb)
 			uint8_t rx;
 
 			if(gb->gb_serial_rx != NULL &&
-				(gb->gb_serial_rx(gb, &rx) ==
+				(__GB_PHASE_CALL(gb, gb->gb_serial_rx(gb, &rx)) ==
 					 GB_SERIAL_RX_SUCCESS))
 			{
 				gb->gb_reg.SB = rx;
@@ -3424,11 +3954,15 @@ void __gb_step_cpu(struct gb_s *gb)
 		}
 	}
 
+	__GB_PHASE_END(gb, GB_PHASE_TIMERS);
+
 	/* TODO Check behaviour of LCD during LCD power off state. */
 	/* If LCD is off, don't update LCD state. */
 	if((gb->gb_reg.LCDC & LCDC_ENABLE) == 0)
 		return;
 
+	__GB_PHASE_BEGIN(gb, GB_PHASE_LCD);
+
 	/* LCD Timing */
 	gb->counter.lcd_count += inst_cycles;
 
@@ -3454,6 +3988,7 @@ void __gb_step_cpu(struct gb_s *gb)
 		/* VBLANK Start */
 		if(gb->gb_reg.LY == LCD_HEIGHT)
 		{
+			__GB_EVENT_BEGIN(gb, GB_EVENT_VBLANK, 0);
 			gb->lcd_mode = LCD_VBLANK;
 			gb->gb_frame = 1;
 			gb->gb_reg.IF |= VBLANK_INTR;
@@ -3489,6 +4024,8 @@ void __gb_step_cpu(struct gb_s *gb)
 		{
 			if(gb->gb_reg.LY == 0)
 			{
+				__GB_EVENT_END(gb, GB_EVENT_VBLANK);
+
 				/* Clear Screen */
 				gb->display.WY = gb->gb_reg.WY;
 				gb->display.window_clear = 0;
@@ -3515,17 +4052,45 @@ void __gb_step_cpu(struct gb_s *gb)
 	{
 		gb->lcd_mode = LCD_TRANSFER;
 #if ENABLE_LCD
+		__GB_PHASE_BEGIN(gb, GB_PHASE_DRAW_LINE);
+		__GB_EVENT_BEGIN(gb, GB_EVENT_DRAW_LINE, gb->gb_reg.LY);
 		__gb_draw_line(gb);
+		__GB_EVENT_END(gb, GB_EVENT_DRAW_LINE);
+		__GB_PHASE_END(gb, GB_PHASE_DRAW_LINE);
 #endif
 	}
+
+	__GB_PHASE_END(gb, GB_PHASE_LCD);
 }
 
 void gb_run_frame(struct gb_s *gb)
 {
+	__GB_EVENT_BEGIN(gb, GB_EVENT_FRAME, 0);
 	gb->gb_frame = 0;
+#if ENABLE_STATS
+	gb->stats = (struct gb_stats_s){ 0 };
+#endif
 
 	while(!gb->gb_frame)
 		__gb_step_cpu(gb);
+
+	__GB_EVENT_END(gb, GB_EVENT_FRAME);
+}
+
+/**
+ * Returns the number of clock cycles since the start of the current frame.
+ * A frame starts when the LCD enters VBLANK, which is when gb_run_frame()
+ * returns, and lasts for LCD_VERT_LINES * LCD_LINE_CYCLES clock cycles.
+ *
+ * This is calculated from the position of the LCD, so costs nothing while
+ * unused. It may be called from audio_write() to timestamp writes to audio
+ * registers. The value does not change while the LCD is off.
+ */
+uint_fast32_t gb_get_frame_cycles(struct gb_s *gb)
+{
+	const uint_fast16_t line = (gb->gb_reg.LY + LCD_VERT_LINES -
+				    LCD_HEIGHT) % LCD_VERT_LINES;
+	return line * LCD_LINE_CYCLES + gb->counter.lcd_count;
 }
 
 /**
@@ -3557,6 +4122,17 @@ void gb_init_serial(struct gb_s *gb,
 	gb->gb_serial_rx = gb_serial_rx;
 }
 
+/**
+ * Initialise the joypad poll callback. The callback is called each time the
+ * game selects the buttons or directions to read, and may be used to update
+ * direct.joypad with the latest input or to detect that the game is ready for
+ * input. Set to NULL to disable.
+ */
+void gb_init_joypad(struct gb_s *gb, void (*gb_joypad_poll)(struct gb_s*))
+{
+	gb->gb_joypad_poll = gb_joypad_poll;
+}
+
 uint8_t gb_colour_hash(struct gb_s *gb)
 {
 #define ROM_TITLE_START_ADDR	0x0134
@@ -3626,6 +4202,11 @@ void gb_reset(struct gb_s *gb)
 
 	gb->direct.joypad = 0xFF;
 	gb->gb_reg.P1 = 0xCF;
+
+#if ENABLE_STATE_HASH
+	/* Memory is not cleared on reset, but cached hashes are discarded. */
+	gb->hash.valid = 0;
+#endif
 }
 
 /**
@@ -3684,6 +4265,7 @@ enum gb_init_error_e gb_init(struct gb_s *gb,
 	 * automatically. */
 	gb->gb_serial_tx = NULL;
 	gb->gb_serial_rx = NULL;
+	gb->gb_joypad_poll = NULL;
 
 	/* Check valid ROM using checksum value. */
 	{
@@ -3747,6 +4329,274 @@ const char* gb_get_rom_name(struct gb_s* gb, char title_str[static 16])
 	return title_start;
 }
 
+/* Constants used by the state hash. These are the xxHash64 primes. */
+#define STATE_HASH_PRIME_1	0x9E3779B185EBCA87ULL
+#define STATE_HASH_PRIME_2	0xC2B2AE3D27D4EB4FULL
+#define STATE_HASH_PRIME_3	0x165667B19E3779F9ULL
+#define STATE_HASH_PRIME_4	0x85EBCA77C2B2AE63ULL
+#define STATE_HASH_PRIME_5	0x27D4EB2F165667C5ULL
+
+uint64_t __gb_hash_rotl(const uint64_t x, const unsigned r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+/**
+ * Read a little-endian 64-bit word. Compilers reduce this to a single load on
+ * little-endian hosts, and it keeps the hash identical on big-endian hosts.
+ */
+uint64_t __gb_hash_read64(const uint8_t *p)
+{
+	return (uint64_t)p[0] | (uint64_t)p[1] << 8 |
+	       (uint64_t)p[2] << 16 | (uint64_t)p[3] << 24 |
+	       (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 |
+	       (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+}
+
+uint64_t __gb_hash_round(uint64_t acc, const uint64_t input)
+{
+	acc += input * STATE_HASH_PRIME_2;
+	acc = __gb_hash_rotl(acc, 31);
+	return acc * STATE_HASH_PRIME_1;
+}
+
+uint64_t __gb_hash_merge(uint64_t acc, const uint64_t val)
+{
+	acc ^= __gb_hash_round(0, val);
+	return acc * STATE_HASH_PRIME_1 + STATE_HASH_PRIME_4;
+}
+
+/**
+ * Hash a block of up to STATE_HASH_BLOCK_SIZE bytes.
+ * The block is consumed in 32 byte stripes by four independent lanes, so the
+ * loop has no dependency between lanes and may be vectorised.
+ */
+uint64_t __gb_hash_block(const uint8_t *data, const uint_fast16_t len,
+			 const uint64_t seed)
+{
+	uint64_t v[4] =
+	{
+		seed + STATE_HASH_PRIME_1 + STATE_HASH_PRIME_2,
+		seed + STATE_HASH_PRIME_2,
+		seed,
+		seed - STATE_HASH_PRIME_1
+	};
+	uint_fast16_t i;
+	uint64_t h;
+
+	for(i = 0; i + 32 <= len; i += 32)
+	{
+		for(uint_fast8_t lane = 0; lane < 4; lane++)
+			v[lane] = __gb_hash_round(v[lane],
+					__gb_hash_read64(data + i + lane * 8));
+	}
+
+	/* Zero pad the remaining bytes to a full stripe. */
+	if(i < len)
+	{
+		uint8_t tail[32] = { 0 };
+
+		for(uint_fast8_t j = 0; i + j < len; j++)
+			tail[j] = data[i + j];
+
+		for(uint_fast8_t lane = 0; lane < 4; lane++)
+			v[lane] = __gb_hash_round(v[lane],
+					__gb_hash_read64(tail + lane * 8));
+	}
+
+	h = __gb_hash_rotl(v[0], 1) + __gb_hash_rotl(v[1], 7) +
+	    __gb_hash_rotl(v[2], 12) + __gb_hash_rotl(v[3], 18);
+
+	for(uint_fast8_t lane = 0; lane < 4; lane++)
+		h = __gb_hash_merge(h, v[lane]);
+
+	return h + len;
+}
+
+/**
+ * Hash a memory region block by block, and merge each block hash into acc.
+ *
+ * \param mem	memory to hash, or NULL to read cart RAM through
+ *		gb_cart_ram_read().
+ * \param cache	if not NULL, the hash of each block is stored here.
+ * \param dirty	if not NULL, blocks whose bit is clear are not read, and
+ *		their hash is taken from cache instead.
+ */
+uint64_t __gb_hash_region(struct gb_s *gb, uint64_t acc,
+			  const uint8_t *mem, const uint_fast32_t len,
+			  const uint64_t seed, uint64_t *cache,
+			  const uint32_t *dirty)
+{
+	for(uint_fast16_t blk = 0; blk * STATE_HASH_BLOCK_SIZE < len; blk++)
+	{
+		const uint_fast32_t off = blk * STATE_HASH_BLOCK_SIZE;
+		const uint_fast16_t n = MIN(STATE_HASH_BLOCK_SIZE, len - off);
+		uint64_t bh;
+
+		if(cache != NULL && dirty != NULL &&
+				((dirty[blk / 32] >> (blk % 32)) & 1) == 0)
+			bh = cache[blk];
+		else if(mem != NULL)
+			bh = __gb_hash_block(mem + off, n, seed);
+		else
+		{
+			uint8_t buf[STATE_HASH_BLOCK_SIZE];
+
+			for(uint_fast16_t i = 0; i < n; i++)
+				buf[i] = gb->gb_cart_ram_read(gb, off + i);
+
+			bh = __gb_hash_block(buf, n, seed);
+		}
+
+		if(cache != NULL)
+			cache[blk] = bh;
+
+		acc = __gb_hash_merge(acc, bh);
+	}
+
+	return acc;
+}
+
+/**
+ * Internal function computing the state hash. If incremental is set and the
+ * cached block hashes are valid, only blocks written to since the last call
+ * are hashed again.
+ */
+uint64_t __gb_state_hash(struct gb_s *gb, const uint_fast8_t incremental)
+{
+	/* Registers and MBC state are serialised in a fixed order so that
+	 * the layout of struct gb_s on the host does not matter. */
+	const uint8_t hdr[] =
+	{
+		gb->cpu_reg.a, gb->cpu_reg.f, gb->cpu_reg.b, gb->cpu_reg.c,
+		gb->cpu_reg.d, gb->cpu_reg.e, gb->cpu_reg.h, gb->cpu_reg.l,
+		gb->cpu_reg.sp & 0xFF, gb->cpu_reg.sp >> 8,
+		gb->cpu_reg.pc & 0xFF, gb->cpu_reg.pc >> 8,
+		gb->gb_halt, gb->gb_ime, gb->gb_bios_enable, gb->lcd_mode,
+
+		gb->mbc, gb->cart_ram,
+		gb->num_rom_banks & 0xFF, gb->num_rom_banks >> 8,
+		gb->num_ram_banks,
+		gb->selected_rom_bank & 0xFF, gb->selected_rom_bank >> 8,
+		gb->cart_ram_bank, gb->enable_cart_ram, gb->cart_mode_select,
+		gb->cart_rtc[0], gb->cart_rtc[1], gb->cart_rtc[2],
+		gb->cart_rtc[3], gb->cart_rtc[4],
+
+		gb->gb_reg.TIMA, gb->gb_reg.TMA, gb->gb_reg.DIV, gb->gb_reg.TAC,
+		gb->gb_reg.LCDC, gb->gb_reg.STAT, gb->gb_reg.SCY,
+		gb->gb_reg.SCX, gb->gb_reg.LY, gb->gb_reg.LYC, gb->gb_reg.DMA,
+		gb->gb_reg.BGP, gb->gb_reg.OBP0, gb->gb_reg.OBP1,
+		gb->gb_reg.WY, gb->gb_reg.WX, gb->gb_reg.P1, gb->gb_reg.SB,
+		gb->gb_reg.SC, gb->gb_reg.IF, gb->gb_reg.IE,
+
+		gb->counter.lcd_count & 0xFF, gb->counter.lcd_count >> 8,
+		gb->counter.div_count & 0xFF, gb->counter.div_count >> 8,
+		gb->counter.tima_count & 0xFF, gb->counter.tima_count >> 8,
+		gb->counter.serial_count & 0xFF,
+		gb->counter.serial_count >> 8,
+
+		gb->display.window_clear, gb->display.WY,
+		gb->display.frame_skip_count, gb->display.interlace_count,
+		gb->direct.joypad
+	};
+	const uint_fast32_t cart_ram_len =
+		gb->cart_ram && gb->num_ram_banks ? gb_get_save_size(gb) : 0;
+	uint64_t *wram_cache = NULL, *vram_cache = NULL, *cart_cache = NULL;
+	uint64_t *oam_cache = NULL, *hram_cache = NULL;
+	const uint32_t *wram_dirty = NULL, *vram_dirty = NULL;
+	const uint32_t *cart_dirty = NULL;
+	const uint32_t *oam_dirty = NULL, *hram_dirty = NULL;
+	uint64_t h;
+
+#if ENABLE_STATE_HASH
+	const uint32_t oam_bits = gb->hash.oam_dirty;
+	const uint32_t hram_bits = gb->hash.hram_dirty;
+
+	wram_cache = gb->hash.wram;
+	vram_cache = gb->hash.vram;
+	cart_cache = gb->hash.cart_ram;
+	oam_cache = &gb->hash.oam;
+	hram_cache = &gb->hash.hram;
+
+	if(incremental && gb->hash.valid)
+	{
+		wram_dirty = &gb->hash.wram_dirty;
+		vram_dirty = &gb->hash.vram_dirty;
+		cart_dirty = gb->hash.cart_ram_dirty;
+		oam_dirty = &oam_bits;
+		hram_dirty = &hram_bits;
+	}
+#else
+	(void) incremental;
+#endif
+
+	h = __gb_hash_block(hdr, sizeof(hdr), 0);
+	h = __gb_hash_region(gb, h, gb->wram, WRAM_SIZE, 1,
+			     wram_cache, wram_dirty);
+	h = __gb_hash_region(gb, h, gb->vram, VRAM_SIZE, 2,
+			     vram_cache, vram_dirty);
+	h = __gb_hash_region(gb, h, gb->oam, OAM_SIZE, 3,
+			     oam_cache, oam_dirty);
+	/* Only 0xFF80 to 0xFFFE is backed by HRAM. */
+	h = __gb_hash_region(gb, h, gb->hram, INTR_EN_ADDR - HRAM_ADDR, 4,
+			     hram_cache, hram_dirty);
+	h = __gb_hash_region(gb, h, NULL, cart_ram_len, 5,
+			     cart_cache, cart_dirty);
+
+#if ENABLE_STATE_HASH
+	gb->hash.wram_dirty = 0;
+	gb->hash.vram_dirty = 0;
+	gb->hash.oam_dirty = 0;
+	gb->hash.hram_dirty = 0;
+
+	for(uint_fast8_t i = 0; i < STATE_HASH_CART_BLOCKS / 32; i++)
+		gb->hash.cart_ram_dirty[i] = 0;
+
+	gb->hash.valid = 1;
+#endif
+
+	/* Final avalanche. */
+	h ^= h >> 33;
+	h *= STATE_HASH_PRIME_2;
+	h ^= h >> 29;
+	h *= STATE_HASH_PRIME_3;
+	h ^= h >> 32;
+	return h;
+}
+
+/**
+ * Returns a 64-bit hash of the emulated state: CPU registers, IO registers,
+ * WRAM, VRAM, OAM, HRAM, cart RAM, and MBC and RTC state. The result is the
+ * same on all hosts, so it may be used to check that two runs are
+ * deterministic across builds and machines.
+ *
+ * Front-end configuration, such as callbacks and palettes, is not hashed.
+ * WRAM and VRAM are not cleared by gb_init(), so the context should be zeroed
+ * by the front-end before initialisation if hashes are to be compared between
+ * runs.
+ *
+ * Cart RAM is read through gb_cart_ram_read(). When ENABLE_STATE_HASH is set,
+ * this also refreshes the hashes used by gb_state_hash_incremental(), and so
+ * should be called after the front-end modifies memory directly, such as when
+ * loading a save state.
+ */
+uint64_t gb_state_hash(struct gb_s *gb)
+{
+	return __gb_state_hash(gb, 0);
+}
+
+#if ENABLE_STATE_HASH
+/**
+ * Returns the same value as gb_state_hash(), but only hashes memory that was
+ * written by the emulated CPU since the last call to either function. This is
+ * cheap enough to be called after every frame.
+ */
+uint64_t gb_state_hash_incremental(struct gb_s *gb)
+{
+	return __gb_state_hash(gb, 1);
+}
+#endif
+
 #if ENABLE_LCD
 void gb_init_lcd(struct gb_s *gb,
 		void (*lcd_draw_line)(struct gb_s*,
@@ -56,6 +56,9 @@ struct priv_t
 	/* Colour palette for each BG, OBJ0, and OBJ1. */
 	uint16_t selected_palette[3][4];
 	uint16_t fb[LCD_HEIGHT][LCD_WIDTH];
+
+	/* Audio processing unit of this emulator instance. */
+	struct minigb_apu_ctx apu;
 };
 
 /**
@@ -86,6 +89,26 @@ void gb_cart_ram_write(struct gb_s *gb, const uint_fast32_t addr,
 	p->cart_ram[addr] = val;
 }
 
+/**
+ * Reads an audio register of the APU belonging to this context.
+ */
+uint8_t audio_read(struct gb_s *gb, const uint16_t addr)
+{
+	struct priv_t * const p = gb->direct.priv;
+	return minigb_apu_audio_read(&p->apu, addr);
+}
+
+/**
+ * Writes an audio register of the APU belonging to this context. The samples
+ * are rendered directly by the audio callback, so the write is applied
+ * immediately instead of being queued.
+ */
+void audio_write(struct gb_s *gb, const uint16_t addr, const uint8_t val)
+{
+	struct priv_t * const p = gb->direct.priv;
+	minigb_apu_audio_write(&p->apu, addr, val);
+}
+
 /**
  * Returns a pointer to the allocated space containing the ROM. Must be freed.
  */
@@ -748,8 +771,8 @@ start:
 		want.format   = AUDIO_F32SYS,
 		want.channels = 2;
 		want.samples = AUDIO_SAMPLES;
-		want.callback = audio_callback;
-		want.userdata = NULL;
+		want.callback = minigb_apu_audio_callback;
+		want.userdata = &priv.apu;
 
 		printf("Audio driver: %s\n", SDL_GetAudioDeviceName(0, 0));
 
@@ -759,7 +782,7 @@ start:
 			exit(EXIT_FAILURE);
 		}
 
-		audio_init();
+		minigb_apu_audio_init(&priv.apu);
 		SDL_PauseAudioDevice(dev, 0);
 	}
 
@@ -1,137 +1,467 @@
+/**
+ * Runs test ROMs headless, in parallel across cores, and reports whether each
+ * passed, with the wall time and emulated clock cycles taken to report it.
+ *
+ * The Blargg cpu_instrs and instr_timing ROMs are built in. ROM files, or
+ * directories of them, given as arguments are run as well. A ROM passes when
+ * it prints "Passed" to the serial port, or when it reports success in cart
+ * RAM at 0xA000 as later Blargg ROMs do. It fails when it prints "Failed",
+ * reports an error in cart RAM, or runs for longer than the time limit.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
 #include "minctest.h"
 
 #define ENABLE_SOUND 0
 #define ENABLE_LCD 0
+#define ENABLE_STATS 1
 #include "../peanut_gb.h"
 
-#include <assert.h>
-#include <string.h>
+#include "cpu_instrs.h"
+#include "instr_timing.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <unistd.h>
+
+/* Serial output kept for each ROM. */
+#define SERIAL_MAX	4096
+
+/* Largest cart RAM of the supported MBCs. */
+#define CART_RAM_MAX	0x20000
+
+/* Default limit of emulated time for each ROM, in seconds. */
+#define DEFAULT_LIMIT_S	300
+
+enum result
+{
+	RESULT_TIMEOUT,
+	RESULT_PASS,
+	RESULT_FAIL,
+	RESULT_ERROR
+};
+
+struct test_rom
+{
+	char name[256];
+	const uint8_t *data;
+	size_t len;
+	/* Set if data was read from a file, and must be freed. */
+	uint8_t *owned;
+
+	enum result result;
+	/* Emulated clock cycles until the result was reported. */
+	uint64_t cycles;
+	double wall_s;
+	char serial[SERIAL_MAX + 1];
+	size_t serial_len;
+};
+
+struct runner
+{
+	struct test_rom *rom;
+	uint8_t cart_ram[CART_RAM_MAX];
+	/* Cycles of the frames run before the current one. */
+	uint64_t cycles_done;
+};
 
-struct priv
+struct pool
 {
-	char str[1024];
-	unsigned int count;
+	struct test_rom *roms;
+	size_t count;
+	/* Index of the next ROM to run. Shared by all workers. */
+	size_t next;
+	unsigned long max_frames;
 };
 
 /**
- * Return byte from blarrg test ROM.
+ * Returns a byte from the ROM, or 0xFF past its end.
  */
-uint8_t gb_rom_read_cpu_instrs(struct gb_t *gb, const uint32_t addr)
+uint8_t gb_rom_read(struct gb_s *gb, const uint_fast32_t addr)
 {
-#include "cpu_instrs.h"
-	assert(addr < cpu_instrs_gb_len);
-	return cpu_instrs_gb[addr];
+	const struct runner *r = gb->direct.priv;
+	return addr < r->rom->len ? r->rom->data[addr] : 0xFF;
+}
+
+uint8_t gb_cart_ram_read(struct gb_s *gb, const uint_fast32_t addr)
+{
+	const struct runner *r = gb->direct.priv;
+	return addr < CART_RAM_MAX ? r->cart_ram[addr] : 0xFF;
+}
+
+void gb_cart_ram_write(struct gb_s *gb, const uint_fast32_t addr,
+		       const uint8_t val)
+{
+	struct runner *r = gb->direct.priv;
+
+	if(addr < CART_RAM_MAX)
+		r->cart_ram[addr] = val;
 }
 
 /**
- * Return byte from blarrg test ROM.
+ * Ignore all errors; a ROM that goes astray fails by timing out.
  */
-uint8_t gb_rom_read_instr_timing(struct gb_t *gb, const uint32_t addr)
+void gb_error(struct gb_s *gb, const enum gb_error_e gb_err,
+	      const uint16_t val)
 {
-#include "instr_timing.h"
-	assert(addr < instr_timing_gb_len);
-	return instr_timing_gb[addr];
+	(void)gb;
+	(void)gb_err;
+	(void)val;
+}
+
+/**
+ * Keep serial output, and finish the test once it gives a result.
+ */
+void gb_serial_tx(struct gb_s *gb, const uint8_t tx)
+{
+	struct runner *r = gb->direct.priv;
+	struct test_rom *rom = r->rom;
+
+	if(rom->serial_len == SERIAL_MAX || rom->result != RESULT_TIMEOUT)
+		return;
+
+	rom->serial[rom->serial_len++] = tx;
+	rom->serial[rom->serial_len] = '\0';
+
+	if(strstr(rom->serial, "Passed") != NULL)
+		rom->result = RESULT_PASS;
+	else if(strstr(rom->serial, "Failed") != NULL)
+		rom->result = RESULT_FAIL;
+	else
+		return;
+
+	rom->cycles = r->cycles_done + gb->stats.cycles;
 }
 
 /**
- * Ignore cart RAM writes, since the test doesn't require it.
+ * No second Game Boy is connected.
  */
-void gb_cart_ram_write(struct gb_t *gb, const uint32_t addr, const uint8_t val)
+enum gb_serial_rx_ret_e gb_serial_rx(struct gb_s *gb, uint8_t *rx)
 {
-	return;
+	(void)gb;
+	(void)rx;
+	return GB_SERIAL_RX_NO_CONNECTION;
 }
 
 /**
- * Ignore cart RAM reads, since the test doesn't require it.
+ * Check the result written to cart RAM by ROMs that have no serial output.
+ * The signature DE B0 61 at 0xA001 is followed by text, and 0xA000 holds 0x80
+ * while the test runs, then 0 if it passed.
  */
-uint8_t gb_cart_ram_read(struct gb_t *gb, const uint32_t addr)
+static void check_cart_ram(struct runner *r)
 {
-	return 0xFF;
+	const uint8_t *ram = r->cart_ram;
+
+	if(ram[1] != 0xDE || ram[2] != 0xB0 || ram[3] != 0x61 ||
+			ram[0] == 0x80)
+		return;
+
+	r->rom->result = ram[0] == 0 ? RESULT_PASS : RESULT_FAIL;
+	r->rom->cycles = r->cycles_done;
+	snprintf(r->rom->serial, sizeof(r->rom->serial), "%.*s",
+		 (int)strnlen((const char *)&ram[4], SERIAL_MAX),
+		 (const char *)&ram[4]);
+	r->rom->serial_len = strlen(r->rom->serial);
 }
 
 /**
- * Ignore all errors.
+ * Returns a monotonic time in seconds.
  */
-void gb_error(struct gb_t *gb, const enum gb_error_e gb_err, const uint16_t val)
+static double now(void)
 {
-	return;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
-uint8_t gb_serial_transfer(struct gb_t *gb, const uint8_t tx)
+static void run_rom(struct test_rom *rom, const unsigned long max_frames)
 {
-	struct priv *p = gb->priv;
+	const double start = now();
+	struct runner *r = calloc(1, sizeof(*r));
+	struct gb_s *gb = malloc(sizeof(*gb));
+
+	if(r == NULL || gb == NULL)
+	{
+		rom->result = RESULT_ERROR;
+		goto out;
+	}
+
+	r->rom = rom;
 
-	/* Filter newlines to make test output cleaner. */
-	if(tx < 32)
-		return 0xFF;
+	if(gb_init(gb, &gb_rom_read, &gb_cart_ram_read, &gb_cart_ram_write,
+			&gb_error, r) != GB_INIT_NO_ERROR)
+	{
+		rom->result = RESULT_ERROR;
+		goto out;
+	}
 
-	printf("%c", tx);
-	p->str[p->count++] = tx;
+	gb_init_serial(gb, &gb_serial_tx, &gb_serial_rx);
 
-	if(p->count == 1024)
-		abort();
+	for(unsigned long f = 0;
+			f < max_frames && rom->result == RESULT_TIMEOUT; f++)
+	{
+		gb_run_frame(gb);
+		r->cycles_done += gb->stats.cycles;
 
-	/* No 2nd player connected. */
-	return 0xFF;
+		if(rom->result == RESULT_TIMEOUT)
+			check_cart_ram(r);
+	}
+
+	if(rom->result == RESULT_TIMEOUT)
+		rom->cycles = r->cycles_done;
+
+out:
+	rom->wall_s = now() - start;
+	free(gb);
+	free(r);
 }
 
-void test_cpu_inst(void)
+static void *worker_run(void *arg)
 {
-	struct gb_t gb;
-	const unsigned short pc_end = 0x06F1; /* Test ends when PC is this value. */
-	struct priv p = { .count = 0 };
+	struct pool *p = arg;
+	size_t i;
 
-	/* Run ROM test. */
-	gb_init(&gb, &gb_rom_read_cpu_instrs, &gb_cart_ram_read,
-			&gb_cart_ram_write, &gb_error, &p);
+	while((i = __atomic_fetch_add(&p->next, 1, __ATOMIC_RELAXED)) <
+			p->count)
+		run_rom(&p->roms[i], p->max_frames);
 
-	gb_init_serial(&gb, &gb_serial_transfer);
+	return NULL;
+}
 
-	printf("Serial: ");
+/**
+ * Read a ROM file into a new entry at the end of roms.
+ */
+static int add_rom_file(struct test_rom **roms, size_t *count,
+			const char *path)
+{
+	struct test_rom *rom, *grown;
+	FILE *f;
+	long len;
 
-	/* Step CPU until test is complete. */
-	while(gb.cpu_reg.pc != pc_end)
-		__gb_step_cpu(&gb);
+	if((grown = realloc(*roms, (*count + 1) * sizeof(**roms))) == NULL)
+		return -1;
 
-	p.str[p.count++] = '\0';
+	*roms = grown;
+	rom = &grown[*count];
+	memset(rom, 0, sizeof(*rom));
+	snprintf(rom->name, sizeof(rom->name), "%s", path);
 
-	/* Check test results. */
-	lok(strstr(p.str, "Passed all tests") != NULL);
+	if((f = fopen(path, "rb")) == NULL)
+		return -1;
+
+	if(fseek(f, 0, SEEK_END) != 0 || (len = ftell(f)) < 0x150 ||
+			(rom->owned = malloc(len)) == NULL)
+	{
+		fclose(f);
+		errno = errno ? errno : EINVAL;
+		return -1;
+	}
+
+	rewind(f);
+
+	if(fread(rom->owned, 1, len, f) != (size_t)len)
+	{
+		free(rom->owned);
+		fclose(f);
+		return -1;
+	}
+
+	fclose(f);
+	rom->data = rom->owned;
+	rom->len = len;
+	(*count)++;
+	return 0;
+}
 
-	return;
+static int name_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
 }
 
-void test_instr_timing(void)
+/**
+ * Add each .gb and .gbc file of a directory, in order of name.
+ */
+static int add_rom_dir(struct test_rom **roms, size_t *count,
+		       const char *dir_path, DIR *dir)
 {
-	struct gb_t gb;
-	const unsigned short pc_end = 0xC8B0; /* Test ends when PC is this value. */
-	struct priv p = { .count = 0 };
+	char **names = NULL;
+	size_t n = 0;
+	struct dirent *de;
+	int ret = 0;
+
+	while((de = readdir(dir)) != NULL)
+	{
+		const char *ext = strrchr(de->d_name, '.');
+		char **grown;
+
+		if(ext == NULL ||
+				(strcmp(ext, ".gb") != 0 && strcmp(ext, ".gbc") != 0))
+			continue;
+
+		if((grown = realloc(names, (n + 1) * sizeof(*names))) == NULL)
+		{
+			ret = -1;
+			break;
+		}
 
-	/* Run ROM test. */
-	gb_init(&gb, &gb_rom_read_instr_timing, &gb_cart_ram_read,
-			&gb_cart_ram_write, &gb_error, &p);
+		names = grown;
 
-	gb_init_serial(&gb, &gb_serial_transfer);
+		if((names[n] = malloc(strlen(dir_path) +
+				      strlen(de->d_name) + 2)) == NULL)
+		{
+			ret = -1;
+			break;
+		}
 
-	printf("Serial: ");
+		sprintf(names[n++], "%s/%s", dir_path, de->d_name);
+	}
 
-	/* Step CPU until test is complete. */
-	while(gb.cpu_reg.pc != pc_end)
-		__gb_step_cpu(&gb);
+	qsort(names, n, sizeof(*names), name_cmp);
 
-	p.str[p.count++] = '\0';
+	for(size_t i = 0; i < n; i++)
+	{
+		if(ret == 0 && add_rom_file(roms, count, names[i]) != 0)
+		{
+			fprintf(stderr, "%s: %s\n", names[i], strerror(errno));
+			ret = -1;
+		}
 
-	/* Check test results. */
-	lok(strstr(p.str, "Passed") != NULL);
+		free(names[i]);
+	}
 
-	return;
+	free(names);
+	return ret;
 }
 
-int main(void)
+static void usage(const char *name)
 {
-	lrun("cpu_inst blarrg tests", test_cpu_inst);
-	lrun("instr_timing blarrg tests", test_instr_timing);
+	fprintf(stderr,
+		"Usage: %s [-j JOBS] [-t SECONDS] [ROM|DIR...]\n"
+		"  -j JOBS	Number of ROMs run at once. Default is the\n"
+		"		number of processors.\n"
+		"  -t SECONDS	Emulated time after which a ROM fails.\n"
+		"		Default %d.\n"
+		"The built in Blargg cpu_instrs and instr_timing ROMs are run,\n"
+		"with the given ROMs and the .gb and .gbc files of the given\n"
+		"directories.\n",
+		name, DEFAULT_LIMIT_S);
+}
+
+int main(int argc, char **argv)
+{
+	static const char *const result_names[] = {
+		"TIMEOUT", "PASS", "FAIL", "ERROR"
+	};
+	struct pool p = { 0 };
+	long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned long limit_s = DEFAULT_LIMIT_S;
+	pthread_t *threads;
+	double start, wall;
+	int opt;
+
+	while((opt = getopt(argc, argv, "j:t:")) != -1)
+	{
+		switch(opt)
+		{
+		case 'j':
+			jobs = strtol(optarg, NULL, 0);
+			break;
+
+		case 't':
+			limit_s = strtoul(optarg, NULL, 0);
+			break;
+
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if((p.roms = calloc(2, sizeof(*p.roms))) == NULL)
+		return EXIT_FAILURE;
+
+	snprintf(p.roms[0].name, sizeof(p.roms[0].name), "cpu_instrs");
+	p.roms[0].data = cpu_instrs_gb;
+	p.roms[0].len = cpu_instrs_gb_len;
+	snprintf(p.roms[1].name, sizeof(p.roms[1].name), "instr_timing");
+	p.roms[1].data = instr_timing_gb;
+	p.roms[1].len = instr_timing_gb_len;
+	p.count = 2;
+
+	for(int a = optind; a < argc; a++)
+	{
+		DIR *dir = opendir(argv[a]);
+		int ret;
+
+		if(dir != NULL)
+		{
+			ret = add_rom_dir(&p.roms, &p.count, argv[a], dir);
+			closedir(dir);
+		}
+		else if((ret = add_rom_file(&p.roms, &p.count, argv[a])) != 0)
+			fprintf(stderr, "%s: %s\n", argv[a], strerror(errno));
+
+		if(ret != 0)
+			return EXIT_FAILURE;
+	}
+
+	if(jobs < 1)
+		jobs = 1;
+
+	if((size_t)jobs > p.count)
+		jobs = p.count;
+
+	p.max_frames = (unsigned long)(limit_s * VERTICAL_SYNC);
+
+	if((threads = malloc(jobs * sizeof(*threads))) == NULL)
+		return EXIT_FAILURE;
+
+	start = now();
+
+	for(long t = 0; t < jobs; t++)
+		pthread_create(&threads[t], NULL, worker_run, &p);
+
+	for(long t = 0; t < jobs; t++)
+		pthread_join(threads[t], NULL);
+
+	wall = now() - start;
+
+	printf("%-40s %-7s %14s %10s %10s\n", "ROM", "Result", "Cycles",
+	       "Emulated s", "Wall s");
+
+	for(size_t i = 0; i < p.count; i++)
+	{
+		const struct test_rom *rom = &p.roms[i];
+		const char *name = rom->name;
+
+		/* Keep the end of long paths, which names the ROM. */
+		if(strlen(name) > 40)
+			name += strlen(name) - 40;
+
+		lok(rom->result == RESULT_PASS);
+		printf("%-40s %-7s %14llu %10.2f %10.3f\n", name,
+		       result_names[rom->result],
+		       (unsigned long long)rom->cycles,
+		       (double)rom->cycles / (LCD_VERT_LINES * LCD_LINE_CYCLES *
+					      VERTICAL_SYNC),
+		       rom->wall_s);
+
+		if(rom->result != RESULT_PASS && rom->serial_len > 0)
+			printf("\t%s\n", rom->serial);
+	}
+
+	printf("%zu ROMs in %.3f s with %ld jobs\n", p.count, wall, jobs);
+	lresults();
+
+	for(size_t i = 0; i < p.count; i++)
+		free(p.roms[i].owned);
+
+	free(p.roms);
+	free(threads);
 	return lfails != 0;
 }